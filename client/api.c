@@ -31,8 +31,10 @@
 
 #include <client/internal.h>
 #include <client/remctl.h>
+#include <util/compress.h>
 #include <util/macros.h>
 #include <util/network.h>
+#include <util/tokens.h>
 
 
 /*
@@ -298,20 +300,67 @@ remctl_set_source_ip(struct remctl *r, const char *source)
 /*
  * Set the network timeout in seconds, which may be 0 to not use any timeout
  * (the default).  Returns true on success, false on an invalid timeout, such
- * as a negative value.
+ * as a negative value or one too large to represent in milliseconds.
  */
 int
 remctl_set_timeout(struct remctl *r, time_t timeout)
 {
-    if (timeout < 0) {
+    if (timeout < 0 || timeout > LONG_MAX / 1000) {
         internal_set_error(r, "invalid timeout %ld", (long) timeout);
         return 0;
     }
+    r->timeout = timeout * 1000;
+    return 1;
+}
+
+
+/*
+ * Set the network timeout in milliseconds, which may be 0 to not use any
+ * timeout (the default).  Returns true on success, false on an invalid
+ * timeout, such as a negative value.
+ */
+int
+remctl_set_timeout_ms(struct remctl *r, long timeout)
+{
+    if (timeout < 0) {
+        internal_set_error(r, "invalid timeout %ld ms", timeout);
+        return 0;
+    }
     r->timeout = timeout;
     return 1;
 }
 
 
+/*
+ * Set whether the server may send output without encrypting it for commands
+ * configured to allow that.  This only changes how later commands are sent,
+ * so it can be called at any time.
+ */
+int
+remctl_set_integrity_only(struct remctl *r, int allow)
+{
+    r->integrity_only = allow ? true : false;
+    return 1;
+}
+
+
+/*
+ * Set whether the server may compress the output of commands configured to
+ * allow that.  Fails if the library was built without any compression
+ * support, so that the caller can tell that it will have no effect.
+ */
+int
+remctl_set_compression(struct remctl *r, int allow)
+{
+    if (allow && compress_methods() == 0) {
+        internal_set_error(r, "compression not supported");
+        return 0;
+    }
+    r->compress = allow ? true : false;
+    return 1;
+}
+
+
 static void
 internal_reset(struct remctl *r)
 {
@@ -320,6 +369,11 @@ internal_reset(struct remctl *r)
             internal_v2_quit(r);
         socket_close(r->fd);
     }
+    token_buffer_free(r->input);
+    r->input = NULL;
+    r->options = 0;
+    r->options_sent = 0;
+    r->old_server = false;
     free(r->error);
     r->error = NULL;
     if (r->output != NULL) {
@@ -481,6 +535,7 @@ remctl_close(struct remctl *r)
 #endif
 
     /* Free remaining resources. */
+    token_buffer_free(r->input);
     free(r->source);
     free(r->ccache);
     free(r->error);
@@ -569,8 +624,9 @@ remctl_commandv(struct remctl *r, const struct iovec *command, size_t count)
         return 0;
     if (r->protocol == 1)
         return internal_v1_commandv(r, command, count);
-    else
-        return internal_v2_commandv(r, command, count);
+    if (!internal_v3_options(r))
+        return 0;
+    return internal_v2_commandv(r, command, count);
 }
 
 
@@ -22,6 +22,7 @@
 
 #include <client/internal.h>
 #include <client/remctl.h>
+#include <util/compress.h>
 #include <util/gss-tokens.h>
 #include <util/protocol.h>
 
@@ -44,7 +45,7 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
                      size_t count)
 {
     size_t length, iov, offset, sent, left, delta;
-    gss_buffer_desc token;
+    struct iovec token;
     char *p;
     OM_uint32 data, major, minor;
     int status;
@@ -78,19 +79,19 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
     sent = 0;
     while (sent < length) {
         if (length - sent > TOKEN_MAX_DATA - 4)
-            token.length = TOKEN_MAX_DATA;
+            token.iov_len = TOKEN_MAX_DATA;
         else
-            token.length = length - sent + 4;
-        token.value = malloc(token.length);
-        if (token.value == NULL) {
+            token.iov_len = length - sent + 4;
+        token.iov_base = malloc(token.iov_len);
+        if (token.iov_base == NULL) {
             internal_set_error(r, "cannot allocate memory: %s",
                                strerror(errno));
             return false;
         }
-        left = token.length - 4;
+        left = token.iov_len - 4;
 
         /* Each token begins with the protocol version and message type. */
-        p = token.value;
+        p = token.iov_base;
         p[0] = 2;
         p[1] = MESSAGE_COMMAND;
         p += 2;
@@ -100,7 +101,7 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
         p++;
 
         /* Continue status. */
-        if (token.length == length - sent + 4)
+        if (token.iov_len == length - sent + 4)
             *p = (sent == 0) ? 0 : 3;
         else
             *p = (sent == 0) ? 1 : 2;
@@ -146,17 +147,20 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
             offset = 0;
         }
 
-        /* Send the result. */
-        token.length -= left;
-        status = token_send_priv(r->fd, r->context,
-                                 TOKEN_DATA | TOKEN_PROTOCOL, &token,
-                                 r->timeout, &major, &minor);
+        /*
+         * Send the result.  The token is our own copy of the data, so it can
+         * be encrypted in place and sent without any further copies.
+         */
+        token.iov_len -= left;
+        status = token_send_priv_iov(r->fd, r->context,
+                                     TOKEN_DATA | TOKEN_PROTOCOL, true,
+                                     &token, 1, r->timeout, &major, &minor);
         if (status != TOKEN_OK) {
             internal_token_error(r, "sending token", status, major, minor);
-            free(token.value);
+            free(token.iov_base);
             return false;
         }
-        free(token.value);
+        free(token.iov_base);
     }
     r->ready = true;
     return true;
@@ -189,23 +193,40 @@ internal_v2_quit(struct remctl *r)
 
 /*
  * Read a token from the server connection and store it in the provided
- * buffer.  Return true on success and false on any failure.
+ * buffer.  Return true on success and false on any failure.  Only output
+ * tokens may be unencrypted, and only if we told the server that was okay.
  */
 static bool
 internal_v2_read_token(struct remctl *r, gss_buffer_t token)
 {
     int status, flags;
     OM_uint32 major, minor;
+    bool conf;
     char *p;
 
-    status = token_recv_priv(r->fd, r->context, &flags, token,
-                             TOKEN_MAX_LENGTH, r->timeout, &major, &minor);
+    /*
+     * Read all tokens from the server through a buffer, since the server
+     * often sends several at once.
+     */
+    if (r->input == NULL) {
+        r->input = token_buffer_new();
+        if (r->input == NULL) {
+            internal_set_error(r, "cannot allocate memory: %s",
+                               strerror(errno));
+            return false;
+        }
+    }
+    status = token_recv_integ_buffer(r->fd, r->input, r->context, &flags,
+                                     token, &conf, TOKEN_MAX_LENGTH,
+                                     r->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         internal_token_error(r, "receiving token", status, major, minor);
         if (status == TOKEN_FAIL_EOF || status == TOKEN_FAIL_TIMEOUT) {
             gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
             socket_close(r->fd);
             r->fd = INVALID_SOCKET;
+            token_buffer_free(r->input);
+            r->input = NULL;
         }
         return false;
     }
@@ -222,6 +243,13 @@ internal_v2_read_token(struct remctl *r, gss_buffer_t token)
         internal_set_error(r, "unexpected protocol %d from server", p[0]);
         goto fail;
     }
+    if (!conf
+        && !((r->options & OPTION_INTEGRITY)
+             && (p[1] == MESSAGE_OUTPUT
+                 || p[1] == MESSAGE_OUTPUT_COMPRESSED))) {
+        internal_set_error(r, "unencrypted token from server");
+        goto fail;
+    }
     return true;
 
 fail:
@@ -261,6 +289,43 @@ internal_v2_read_string(struct remctl *r, gss_buffer_t token, size_t offset)
 }
 
 
+/*
+ * Read the compressed output from a MESSAGE_OUTPUT_COMPRESSED token,
+ * decompress it, and store it in newly allocated memory in the remctl struct.
+ * Returns true on success and false on any failure (also setting the error).
+ */
+static bool
+internal_v2_read_compressed(struct remctl *r, gss_buffer_t token)
+{
+    size_t size;
+    OM_uint32 data;
+    const char *p;
+    enum compress_method method;
+
+    p = (const char *) token->value + 3;
+    method = (unsigned char) p[0];
+    memcpy(&data, p + 1, 4);
+    p += 5;
+    size = ntohl(data);
+    if (size > TOKEN_MAX_OUTPUT) {
+        internal_set_error(r, "malformed result token from server");
+        return false;
+    }
+    r->output->data = malloc(size > 0 ? size : 1);
+    if (r->output->data == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    if (!compress_expand(method, p, token->length - (1 + 1 + 1 + 1 + 4),
+                         r->output->data, size)) {
+        internal_set_error(r, "cannot decompress output from server");
+        return false;
+    }
+    r->output->length = size;
+    return true;
+}
+
+
 /*
  * Retrieve the output from the server using protocol v2 and return it.  This
  * function may be called any number of times; if the last packet we got from
@@ -316,6 +381,25 @@ internal_v2_output(struct remctl *r)
             goto fail;
         break;
 
+    case MESSAGE_OUTPUT_COMPRESSED:
+        if (!(r->options & (OPTION_ZLIB | OPTION_ZSTD))) {
+            internal_set_error(r, "unexpected compressed output from server");
+            goto fail;
+        }
+        if (token.length < 2 + 6) {
+            internal_set_error(r, "malformed result token from server");
+            goto fail;
+        }
+        r->output->type = REMCTL_OUT_OUTPUT;
+        if (p[2] != 1 && p[2] != 2) {
+            internal_set_error(r, "unexpected stream %d from server", p[2]);
+            goto fail;
+        }
+        r->output->stream = p[2];
+        if (!internal_v2_read_compressed(r, &token))
+            goto fail;
+        break;
+
     case MESSAGE_STATUS:
         if (token.length != 2 + 1) {
             internal_set_error(r, "malformed result token from server");
@@ -339,6 +423,16 @@ internal_v2_output(struct remctl *r)
         r->ready = 0;
         break;
 
+    case MESSAGE_VERSION:
+        if (token.length != 2 + 1) {
+            internal_set_error(r, "malformed result token from server");
+            goto fail;
+        }
+        internal_set_error(r, "server only supports protocol version %d",
+                           p[2]);
+        r->ready = 0;
+        goto fail;
+
     default:
         internal_set_error(r, "unknown message type %d from server", type);
         goto fail;
@@ -393,3 +487,75 @@ internal_noop(struct remctl *r)
     /* Everything looks good. */
     return true;
 }
+
+
+/*
+ * Ask the server for the output options the caller wants with a protocol v3
+ * MESSAGE_OPTIONS message and record the ones the server agrees to.  This
+ * is only done if the options wanted have changed since we last asked, so
+ * nothing extra is sent unless the caller asks for an option.  A server that
+ * doesn't know the message replies with an unknown message error (or with
+ * MESSAGE_VERSION if it only supports protocol v2) and keeps the connection
+ * open, so in that case just send output as usual for the rest of the
+ * connection.  Returns true on success, false on failure.
+ */
+bool
+internal_v3_options(struct remctl *r)
+{
+    gss_buffer_desc token;
+    char buffer[3] = { 3, MESSAGE_OPTIONS, 0 };
+    OM_uint32 data, major, minor;
+    int status, options;
+    char *p;
+
+    /* Figure out what options we want and whether we need to ask. */
+    options = 0;
+    if (r->integrity_only)
+        options |= OPTION_INTEGRITY;
+    if (r->compress)
+        options |= compress_methods();
+    if (r->old_server || options == r->options_sent)
+        return true;
+
+    /* Send the options token. */
+    buffer[2] = options;
+    token.length = 1 + 1 + 1;
+    token.value = buffer;
+    status = token_send_priv(r->fd, r->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                             &token, r->timeout, &major, &minor);
+    if (status != TOKEN_OK) {
+        internal_token_error(r, "sending options token", status, major,
+                             minor);
+        return false;
+    }
+
+    /* Read the reply, which says which of the options the server will use. */
+    token.length = 0;
+    token.value = GSS_C_NO_BUFFER;
+    if (!internal_v2_read_token(r, &token))
+        return false;
+    p = token.value;
+    if (p[1] == MESSAGE_OPTIONS && token.length == 1 + 1 + 1)
+        r->options = p[2] & options;
+    else if (p[1] == MESSAGE_VERSION && token.length == 1 + 1 + 1) {
+        r->old_server = true;
+        r->options = 0;
+    } else if (p[1] == MESSAGE_ERROR && token.length >= 2 + 8) {
+        memcpy(&data, p + 2, 4);
+        if (ntohl(data) != ERROR_UNKNOWN_MESSAGE) {
+            internal_set_error(r, "error %lu from server setting options",
+                               (unsigned long) ntohl(data));
+            gss_release_buffer(&minor, &token);
+            return false;
+        }
+        r->old_server = true;
+        r->options = 0;
+    } else {
+        internal_set_error(r, "unexpected message type %d from server", p[1]);
+        gss_release_buffer(&minor, &token);
+        return false;
+    }
+    r->options_sent = options;
+    gss_release_buffer(&minor, &token);
+    return true;
+}
@@ -22,8 +22,9 @@
 #include <portable/stdbool.h>
 #include <sys/types.h>
 
-/* Forward declaration to avoid unnecessary includes. */
+/* Forward declarations to avoid unnecessary includes. */
 struct iovec;
+struct token_buffer;
 
 /* Private structure that holds the details of an open remctl connection. */
 struct remctl {
@@ -32,7 +33,7 @@ struct remctl {
     const char *principal;      /*   connection for each command.        */
     int protocol;               /* Protocol version. */
     char *source;               /* Source address for connection. */
-    time_t timeout;
+    time_t timeout;             /* Network timeout in milliseconds. */
     char *ccache;               /* Path to client ticket cache. */
     socket_type fd;
     gss_ctx_id_t context;
@@ -40,6 +41,14 @@ struct remctl {
     struct remctl_output *output;
     int status;
     bool ready;                 /* If true, we are expecting server output. */
+    bool integrity_only;        /* Accept output without encryption. */
+    bool compress;              /* Accept compressed output. */
+    struct token_buffer *input; /* Data read but not yet parsed (v2). */
+
+    /* Output options negotiated with MESSAGE_OPTIONS (v3). */
+    int options;                /* Options the server agreed to use. */
+    int options_sent;           /* Options we last asked the server for. */
+    bool old_server;            /* Server doesn't understand the options. */
 
     /* Used to hold state for remctl_set_ccache. */
 #ifdef HAVE_KRB5
@@ -85,6 +94,9 @@ struct remctl_output *internal_v1_output(struct remctl *);
 bool internal_v2_commandv(struct remctl *, const struct iovec *command,
                           size_t count);
 
+/* Ask for output options with protocol v3 MESSAGE_OPTIONS if they changed. */
+bool internal_v3_options(struct remctl *);
+
 /* Send a protocol v3 NOOP command. */
 bool internal_noop(struct remctl *);
 
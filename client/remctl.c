@@ -22,6 +22,7 @@
 
 #include <client/remctl.h>
 #include <util/messages.h>
+#include <util/protocol.h>
 #include <util/xmalloc.h>
 
 /* Usage message. */
@@ -32,9 +33,11 @@ Options:\n\
     -b <source>   Source IP used for outgoing connections\n\
     -d            Debugging level of output\n\
     -h            Display this help\n\
+    -i            Accept unencrypted output if the server allows it\n\
     -p <port>     remctld port (default: 4373 falling back to 4444)\n\
     -s <service>  remctld service principal (default: host/<host>)\n\
-    -v            Display the version of remctl\n";
+    -v            Display the version of remctl\n\
+    -z            Accept compressed output if the server allows it\n";
 
 
 /*
@@ -91,6 +94,8 @@ process_response(struct remctl *r, int *errorcode)
             *errorcode = 255;
             fwrite_checked(out->data, out->length, 1, stderr);
             fputc('\n', stderr);
+            if (out->error == ERROR_BUSY)
+                warn("server is busy, try again later");
             return true;
         case REMCTL_OUT_STATUS:
             *errorcode = out->status;
@@ -123,6 +128,8 @@ main(int argc, char *argv[])
     unsigned short port = 0;
     struct remctl *r;
     int errorcode = 0;
+    bool integrity_only = false;
+    bool compress = false;
 
     /* Set up logging and identity. */
     message_program_name = "remctl";
@@ -136,7 +143,7 @@ main(int argc, char *argv[])
      * Non-GNU getopt will treat the + as a supported option, which is handled
      * below.
      */
-    while ((option = getopt(argc, argv, "+b:dhp:s:v")) != EOF) {
+    while ((option = getopt(argc, argv, "+b:dhip:s:vz")) != EOF) {
         switch (option) {
         case 'b':
             source = optarg;
@@ -147,6 +154,9 @@ main(int argc, char *argv[])
         case 'h':
             usage(0);
             break;
+        case 'i':
+            integrity_only = true;
+            break;
         case 'p':
             port = atoi(optarg);
             break;
@@ -157,6 +167,9 @@ main(int argc, char *argv[])
             printf("%s\n", PACKAGE_STRING);
             exit(0);
             break;
+        case 'z':
+            compress = true;
+            break;
         case '+':
             fprintf(stderr, "%s: invalid option -- +\n", argv[0]);
         default:
@@ -217,6 +230,11 @@ main(int argc, char *argv[])
     if (source != NULL)
         if (!remctl_set_source_ip(r, source))
             die("%s", remctl_error(r));
+    if (integrity_only)
+        remctl_set_integrity_only(r, true);
+    if (compress)
+        if (!remctl_set_compression(r, true))
+            die("%s", remctl_error(r));
     if (!remctl_open(r, server_host, port, service_name))
         die("%s", remctl_error(r));
 
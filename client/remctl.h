@@ -187,6 +187,30 @@ int remctl_set_source_ip(struct remctl *, const char *);
  */
 int remctl_set_timeout(struct remctl *, time_t);
 
+/*
+ * The same, but with the timeout in milliseconds, allowing timeouts of less
+ * than a second.
+ */
+int remctl_set_timeout_ms(struct remctl *, long);
+
+/*
+ * Allow the server to send command output with integrity protection only,
+ * without encrypting it, for commands that it is configured to handle that
+ * way.  This avoids the cost of encryption for large outputs that aren't
+ * secret.  The next command asks the server for this with an options message,
+ * which older servers ignore.  Has no effect with protocol version one.
+ * Returns true.
+ */
+int remctl_set_integrity_only(struct remctl *, int allow);
+
+/*
+ * Allow the server to compress command output, for commands that it is
+ * configured to handle that way.  As with remctl_set_integrity_only, the next
+ * command asks the server for this first.  Returns false and sets the error
+ * if the library was built without support for any compression method.
+ */
+int remctl_set_compression(struct remctl *, int allow);
+
 /*
  * Send a complete remote command.  Returns true on success, false on failure.
  * On failure, use remctl_error to get the error.  There are two forms of this
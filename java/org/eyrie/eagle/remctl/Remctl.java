@@ -86,6 +86,9 @@ public class Remctl {
 	public static final int ERROR_ACCESS =           6;
 	public static final int ERROR_TOOMANY_ARGS =     7;
 	public static final int ERROR_TOOMUCH_DATA =     8;
+	public static final int ERROR_UNEXPECTED_MESSAGE = 9;
+	public static final int ERROR_NO_HELP =          10;
+	public static final int ERROR_BUSY =             11;
 
 	protected ByteBuffer responseBytes;
 	protected GSSContext context;
@@ -0,0 +1,58 @@
+dnl Find the compiler and linker flags for Zstandard.
+dnl
+dnl Finds the compiler and linker flags for linking with the Zstandard library.
+dnl Provides the --with-zstd, --with-zstd-lib, and --with-zstd-include
+dnl configure options to specify non-standard paths to the Zstandard library or
+dnl header files.
+dnl
+dnl Provides the macro RRA_LIB_ZSTD_OPTIONAL and sets the substitution
+dnl variables ZSTD_CPPFLAGS, ZSTD_LDFLAGS, and ZSTD_LIBS.  Also provides
+dnl RRA_LIB_ZSTD_SWITCH to set CPPFLAGS, LDFLAGS, and LIBS to include the
+dnl Zstandard library, saving the current values first, and
+dnl RRA_LIB_ZSTD_RESTORE to restore those settings to before the last
+dnl RRA_LIB_ZSTD_SWITCH.  Defines HAVE_ZSTD and sets rra_use_ZSTD to true if
+dnl Zstandard is found.  If it isn't found, the substitution variables will be
+dnl empty.
+dnl
+dnl Depends on the lib-helper.m4 framework.
+dnl
+dnl Written by Russ Allbery <eagle@eyrie.org>
+dnl Copyright 2026 Russ Allbery <eagle@eyrie.org>
+dnl
+dnl This file is free software; the authors give unlimited permission to copy
+dnl and/or distribute it, with or without modifications, as long as this
+dnl notice is preserved.
+
+dnl Save the current CPPFLAGS, LDFLAGS, and LIBS settings and switch to
+dnl versions that include the Zstandard flags.  Used as a wrapper, with
+dnl RRA_LIB_ZSTD_RESTORE, around tests.
+AC_DEFUN([RRA_LIB_ZSTD_SWITCH], [RRA_LIB_HELPER_SWITCH([ZSTD])])
+
+dnl Restore CPPFLAGS, LDFLAGS, and LIBS to their previous values before
+dnl RRA_LIB_ZSTD_SWITCH was called.
+AC_DEFUN([RRA_LIB_ZSTD_RESTORE], [RRA_LIB_HELPER_RESTORE([ZSTD])])
+
+dnl Checks if Zstandard is present.  The single argument, if "true", says to
+dnl fail if the Zstandard library could not be found.
+AC_DEFUN([_RRA_LIB_ZSTD_INTERNAL],
+[RRA_LIB_HELPER_PATHS([ZSTD])
+ RRA_LIB_ZSTD_SWITCH
+ AC_CHECK_HEADER([zstd.h],
+    [AC_CHECK_LIB([zstd], [ZSTD_compress], [ZSTD_LIBS="-lzstd"],
+        [AS_IF([test x"$1" = xtrue],
+            [AC_MSG_ERROR([cannot find usable Zstandard library])])])],
+    [AS_IF([test x"$1" = xtrue],
+        [AC_MSG_ERROR([cannot find usable Zstandard library])])])
+ RRA_LIB_ZSTD_RESTORE])
+
+dnl The main macro for packages with optional Zstandard support.
+AC_DEFUN([RRA_LIB_ZSTD_OPTIONAL],
+[RRA_LIB_HELPER_VAR_INIT([ZSTD])
+ RRA_LIB_HELPER_WITH_OPTIONAL([zstd], [Zstandard], [ZSTD])
+ AS_IF([test x"$rra_use_ZSTD" != xfalse],
+    [AS_IF([test x"$rra_use_ZSTD" = xtrue],
+        [_RRA_LIB_ZSTD_INTERNAL([true])],
+        [_RRA_LIB_ZSTD_INTERNAL([false])])])
+ AS_IF([test x"$ZSTD_LIBS" != x],
+    [rra_use_ZSTD=true
+     AC_DEFINE([HAVE_ZSTD], 1, [Define if Zstandard is available.])])])
@@ -73,6 +73,11 @@ typedef void (*event_callback_fn)(evutil_socket_t, short, void *);
 # define bufferevent_get_input(bev) EVBUFFER_INPUT(bev)
 #endif
 
+/* Introduced in 2.0.1-alpha. */
+#ifndef HAVE_BUFFEREVENT_GET_OUTPUT
+# define bufferevent_get_output(bev) EVBUFFER_OUTPUT(bev)
+#endif
+
 /* Introduced in 2.0.1-alpha. */
 #ifndef HAVE_BUFFEREVENT_READ_BUFFER
 int bufferevent_read_buffer(struct bufferevent *, struct evbuffer *);
@@ -0,0 +1,514 @@
+/*
+ * Thread pool for establishing GSS-API contexts.
+ *
+ * Accepting a GSS-API context is the most expensive part of a new
+ * connection: it decrypts the ticket with the keytab and, with MIT Kerberos,
+ * writes to the replay cache.  A pool worker handling many connections with
+ * the event engine would otherwise do that work for every new connection one
+ * at a time.  With the auth-threads tunable, the engine instead hands each
+ * context token to a pool of threads, which call server_client_accept for it
+ * (and so send any reply token) and put the result on a completion queue.
+ * A byte written to a pipe tells the engine that results are waiting, and
+ * the engine picks them up in its own event loop and only then starts
+ * reading commands from the connection.  While a connection is with the
+ * threads, the engine doesn't touch it.
+ *
+ * The threads only ever call server_client_accept on a client that no other
+ * thread is using, but that still reaches code shared with the main thread.
+ * The GSS-API library is safe to use from several threads with separate
+ * contexts.  The shared replay cache (replay.c) locks itself against other
+ * threads as well as other processes.  The logging functions in
+ * util/messages.c only read the handlers, which are set before any threads
+ * start.  Hostname lookups are started when the connection is accepted and
+ * collected when a command runs, both in the main thread.
+ *
+ * The main thread also forks, to run commands that can't use posix_spawn and
+ * for other helpers, and a forked child gets only the thread that forked, so
+ * any lock another thread held at the time would stay locked in the child
+ * forever.  To prevent that, fork handlers stop the threads from starting
+ * new tokens and wait for the ones they're handling to finish before any
+ * fork, so that no thread is inside the GSS-API library, malloc, or stdio at
+ * that point.  The threads block all signals so that signals are still
+ * handled by the main thread.
+ *
+ * The pool keeps statistics on how long each handshake waited in the queue
+ * and how long it took, along with the queue depth, and logs them regularly
+ * so that the number of threads can be sized to the load.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* How often, in seconds, to log the statistics of the pool. */
+#define AUTH_REPORT_INTERVAL 60
+
+/* A context token waiting for or done with a thread. */
+struct auth_job {
+    struct auth_job *next;      /* Next job in the same queue. */
+    struct client *client;      /* The client to accept a token for. */
+    void *data;                 /* Data for the caller. */
+    enum accept_status status;  /* Result of server_client_accept. */
+    uint64_t queued;            /* When the job was queued (microseconds). */
+};
+
+/* A queue of jobs. */
+struct auth_queue {
+    struct auth_job *head;
+    struct auth_job *tail;
+    size_t count;
+};
+
+/* Statistics for the pool since the last report. */
+struct auth_stats {
+    unsigned long jobs;         /* Jobs finished. */
+    uint64_t wait;              /* Total time jobs waited for a thread. */
+    uint64_t wait_max;          /* Longest time a job waited. */
+    uint64_t run;               /* Total time spent in the threads. */
+    size_t depth_max;           /* Most jobs waiting for a thread. */
+};
+
+/* The pool. */
+struct auth_pool {
+    gss_cred_id_t creds;        /* Credentials for accepting contexts. */
+#ifdef HAVE_PTHREAD
+    pthread_t *threads;         /* The threads. */
+    pthread_mutex_t lock;       /* Protects everything below. */
+    pthread_cond_t wakeup;      /* Signaled when a job is queued. */
+    pthread_cond_t idle;        /* Signaled when a thread finishes a job. */
+#endif
+    size_t nthreads;            /* Number of threads. */
+    struct auth_queue pending;  /* Jobs waiting for a thread. */
+    struct auth_queue done;     /* Finished jobs. */
+    size_t running;             /* Jobs being handled by a thread. */
+    bool stopping;              /* Set to tell the threads to exit. */
+    bool holding;               /* Set while forking, no new jobs start. */
+    int notify[2];              /* Pipe written to when a job finishes. */
+    struct auth_stats stats;    /* Statistics since the last report. */
+    time_t reported;            /* When the statistics were last logged. */
+};
+
+
+#ifdef HAVE_PTHREAD
+/* The pool whose threads must be held while forking, and its registration. */
+static struct auth_pool *forking = NULL;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+#endif
+
+
+/*
+ * Return the current time in microseconds.  Use a monotonic clock if
+ * available so that changes to the system time don't affect the statistics.
+ */
+static uint64_t
+auth_now(void)
+{
+    struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+#endif
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
+
+
+/*
+ * Add a job to the end of a queue.
+ */
+static void
+queue_push(struct auth_queue *queue, struct auth_job *job)
+{
+    job->next = NULL;
+    if (queue->tail == NULL)
+        queue->head = job;
+    else
+        queue->tail->next = job;
+    queue->tail = job;
+    queue->count++;
+}
+
+
+/*
+ * Remove the job at the front of a queue and return it, or NULL if the queue
+ * is empty.
+ */
+static struct auth_job *
+queue_pop(struct auth_queue *queue)
+{
+    struct auth_job *job = queue->head;
+
+    if (job == NULL)
+        return NULL;
+    queue->head = job->next;
+    if (queue->head == NULL)
+        queue->tail = NULL;
+    queue->count--;
+    return job;
+}
+
+
+/*
+ * Lock and unlock the pool.  Without threads, these do nothing.
+ */
+static void
+pool_lock(struct auth_pool *pool UNUSED)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&pool->lock);
+#endif
+}
+
+static void
+pool_unlock(struct auth_pool *pool UNUSED)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+
+/*
+ * Accept the context token for a job and put it on the completion queue,
+ * updating the statistics and waking up the engine.  The caller must not
+ * hold the lock.
+ */
+static void
+run_job(struct auth_pool *pool, struct auth_job *job)
+{
+    uint64_t start, end;
+    ssize_t status;
+    const char byte = 0;
+
+    start = auth_now();
+    job->status = server_client_accept(job->client, pool->creds);
+    end = auth_now();
+    pool_lock(pool);
+    pool->stats.jobs++;
+    pool->stats.wait += start - job->queued;
+    if (start - job->queued > pool->stats.wait_max)
+        pool->stats.wait_max = start - job->queued;
+    pool->stats.run += end - start;
+    pool->running--;
+    queue_push(&pool->done, job);
+#ifdef HAVE_PTHREAD
+    pthread_cond_signal(&pool->idle);
+#endif
+    pool_unlock(pool);
+    do {
+        status = write(pool->notify[1], &byte, 1);
+    } while (status < 0 && errno == EINTR);
+}
+
+
+#ifdef HAVE_PTHREAD
+/*
+ * The main loop of a thread, which runs jobs until told to stop and there
+ * are no more jobs waiting.
+ */
+static void *
+auth_thread(void *data)
+{
+    struct auth_pool *pool = data;
+    struct auth_job *job;
+    sigset_t signals;
+
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        job = pool->holding ? NULL : queue_pop(&pool->pending);
+        if (job == NULL) {
+            if (pool->stopping)
+                break;
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+            continue;
+        }
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+        run_job(pool, job);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+/*
+ * Called before any fork.  Stop the threads from starting new jobs and wait
+ * for the ones they're running to finish, and then hold the lock across the
+ * fork so that no thread can start one.
+ */
+static void
+fork_prepare(void)
+{
+    struct auth_pool *pool = forking;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->holding = true;
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+}
+
+
+/*
+ * Called in the parent after a fork.  Let the threads carry on.
+ */
+static void
+fork_parent(void)
+{
+    struct auth_pool *pool = forking;
+
+    if (pool == NULL)
+        return;
+    pool->holding = false;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Called in the child after a fork.  The threads don't exist in the child,
+ * so just release the lock and forget the pool.
+ */
+static void
+fork_child(void)
+{
+    struct auth_pool *pool = forking;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_unlock(&pool->lock);
+    forking = NULL;
+}
+
+
+/*
+ * Register the fork handlers.  This is only done once per process, since
+ * they can't be removed, and they do nothing while there is no pool.
+ */
+static void
+register_atfork(void)
+{
+    int status;
+
+    status = pthread_atfork(fork_prepare, fork_parent, fork_child);
+    if (status != 0)
+        die("cannot register fork handlers: %s", strerror(status));
+}
+#endif
+
+
+/*
+ * Create a pool of the given number of threads that accept contexts with the
+ * given credentials.  If threads aren't supported, or threads is 0, jobs are
+ * instead run as soon as they're submitted.
+ */
+struct auth_pool *
+server_auth_new(gss_cred_id_t creds, size_t threads)
+{
+    struct auth_pool *pool;
+#ifdef HAVE_PTHREAD
+    size_t i;
+    int status;
+#endif
+
+    pool = xcalloc(1, sizeof(struct auth_pool));
+    pool->creds = creds;
+    pool->reported = time(NULL);
+    if (pipe(pool->notify) < 0)
+        sysdie("cannot create pipe for authentication threads");
+    fdflag_nonblocking(pool->notify[0], true);
+    fdflag_close_exec(pool->notify[0], true);
+    fdflag_close_exec(pool->notify[1], true);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pthread_once(&atfork_once, register_atfork);
+    pool->threads = xcalloc(threads, sizeof(pthread_t));
+    for (i = 0; i < threads; i++) {
+        status = pthread_create(&pool->threads[i], NULL, auth_thread, pool);
+        if (status != 0) {
+            warn("cannot create authentication thread: %s", strerror(status));
+            break;
+        }
+    }
+    pool->nthreads = i;
+    if (pool->nthreads > 0)
+        forking = pool;
+#else
+    if (threads > 0)
+        warn("threads not supported, accepting contexts without them");
+#endif
+    return pool;
+}
+
+
+/*
+ * Return the file descriptor that becomes readable when finished jobs are
+ * waiting to be collected with server_auth_result.
+ */
+socket_type
+server_auth_fd(const struct auth_pool *pool)
+{
+    return pool->notify[0];
+}
+
+
+/*
+ * Queue the next context token from a client for a thread.  The client must
+ * have a complete token in its input buffer, and the caller must not touch
+ * the client until it comes back from server_auth_result.  data is returned
+ * with it.
+ */
+void
+server_auth_submit(struct auth_pool *pool, struct client *client, void *data)
+{
+    struct auth_job *job;
+
+    job = xcalloc(1, sizeof(struct auth_job));
+    job->client = client;
+    job->data = data;
+    job->queued = auth_now();
+    if (pool->nthreads == 0) {
+        pool->running++;
+        run_job(pool, job);
+        return;
+    }
+    pool_lock(pool);
+    queue_push(&pool->pending, job);
+    if (pool->pending.count > pool->stats.depth_max)
+        pool->stats.depth_max = pool->pending.count;
+#ifdef HAVE_PTHREAD
+    pthread_cond_signal(&pool->wakeup);
+#endif
+    pool_unlock(pool);
+}
+
+
+/*
+ * Collect a finished job.  Returns false if there are none.  Otherwise,
+ * stores the data given to server_auth_submit in data and the result of
+ * server_client_accept in status and returns true.
+ */
+bool
+server_auth_result(struct auth_pool *pool, void **data,
+                   enum accept_status *status)
+{
+    struct auth_job *job;
+    char buffer[64];
+
+    while (read(pool->notify[0], buffer, sizeof(buffer)) > 0)
+        ;
+    pool_lock(pool);
+    job = queue_pop(&pool->done);
+    pool_unlock(pool);
+    if (job == NULL)
+        return false;
+    *data = job->data;
+    *status = job->status;
+    free(job);
+    return true;
+}
+
+
+/*
+ * Log the statistics of the pool and reset them, if there is anything to
+ * report and either force is true or it's been long enough since the last
+ * report.  Called regularly by the engine.
+ */
+void
+server_auth_report(struct auth_pool *pool, bool force)
+{
+    struct auth_stats stats;
+    size_t depth, running;
+    time_t now;
+
+    now = time(NULL);
+    if (!force && now - pool->reported < AUTH_REPORT_INTERVAL)
+        return;
+    pool_lock(pool);
+    stats = pool->stats;
+    depth = pool->pending.count;
+    running = pool->running;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->stats.depth_max = depth;
+    pool_unlock(pool);
+    pool->reported = now;
+    if (stats.jobs == 0)
+        return;
+    notice("authentication: %lu tokens, queue depth %lu (max %lu), %lu"
+           " running, wait %lu ms mean %lu ms max, handshake %lu ms mean",
+           stats.jobs, (unsigned long) depth, (unsigned long) stats.depth_max,
+           (unsigned long) running,
+           (unsigned long) (stats.wait / stats.jobs / 1000),
+           (unsigned long) (stats.wait_max / 1000),
+           (unsigned long) (stats.run / stats.jobs / 1000));
+}
+
+
+/*
+ * Stop the threads once they finish all queued jobs and free the pool,
+ * discarding any results that weren't collected.  The caller is responsible
+ * for the clients.
+ */
+void
+server_auth_free(struct auth_pool *pool)
+{
+    struct auth_job *job;
+#ifdef HAVE_PTHREAD
+    size_t i;
+#endif
+
+    if (pool == NULL)
+        return;
+#ifdef HAVE_PTHREAD
+    if (forking == pool)
+        forking = NULL;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+#endif
+    server_auth_report(pool, true);
+#ifdef HAVE_PTHREAD
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    while ((job = queue_pop(&pool->pending)) != NULL)
+        free(job);
+    while ((job = queue_pop(&pool->done)) != NULL)
+        free(job);
+    close(pool->notify[0]);
+    close(pool->notify[1]);
+    free(pool);
+}
@@ -0,0 +1,725 @@
+/*
+ * Persistent backend processes for the stand-alone server.
+ *
+ * Commands whose rules set the backend option can be handled by a pool of
+ * long-running copies of the program instead of running the program anew
+ * for each command.  The stand-alone parent starts the pools when it loads
+ * its configuration.  Each backend process gets its own listening UNIX domain
+ * socket, passed to it as standard input in the style of FastCGI, and handles
+ * one request at a time on connections to that socket.
+ *
+ * The command is still run in a child process forked by the server, so that
+ * all of the normal handling of output and exit status applies, but rather
+ * than executing the program, that child relays the command to a backend
+ * process and relays the backend's output and exit status back.  The request
+ * and reply are sent as records of the types defined in util/protocol.h.
+ *
+ * Which backend processes are available is tracked in anonymous shared
+ * memory created by the parent.  A relaying child claims a backend process
+ * with an fcntl lock on the byte of an unlinked temporary file corresponding
+ * to that process, so each backend process only handles one request at a
+ * time and the size of the pool limits how many commands can run at once.
+ * The lock is released automatically if the child dies.  If no backend
+ * process can be reached, the child runs the program normally instead.
+ *
+ * The parent restarts backend processes that exit and, when asked to check
+ * the health of the backends, forks a checker process that sends a ping to
+ * each idle one and kills any that don't answer in time, so that a hung
+ * backend doesn't hold up the parent.  The child that completes the last
+ * request a backend process is allowed to handle tells it to exit.
+ *
+ * When remctld is not running in stand-alone mode, there are no pools, and
+ * all commands are run normally.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/network.h>
+#include <util/protocol.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/* Some systems only provide the older name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* How long to wait, in milliseconds, for a backend to answer a ping. */
+#define BACKEND_TIMEOUT (10 * 1000)
+
+/*
+ * A backend process that exits within this many seconds of being started is
+ * assumed to be failing and is not restarted until the next health check.
+ */
+#define BACKEND_MIN_LIFETIME 2
+
+/* The environment variables passed to backends with each request. */
+static const char *const backend_env[] = {
+    "REMUSER", "REMOTE_USER", "REMOTE_ADDR", "REMOTE_HOST", "REMCTL_COMMAND",
+    "REMOTE_EXPIRES", NULL
+};
+
+/* States of a backend process. */
+enum slot_state {
+    SLOT_EMPTY = 0,             /* No process, should be started. */
+    SLOT_FAILED,                /* No process, wait for a health check. */
+    SLOT_READY,                 /* Running and accepting requests. */
+    SLOT_RETIRING               /* Told to exit, will be restarted. */
+};
+
+/* A backend process, kept in shared memory. */
+struct slot {
+    pid_t pid;                  /* Process ID of the backend. */
+    volatile sig_atomic_t state; /* The enum slot_state of the process. */
+    unsigned long served;       /* Requests handled by this process. */
+    time_t started;             /* When the process was started. */
+};
+
+/* A pool of backend processes for one configuration rule. */
+struct backend_pool {
+    struct rule *rule;          /* The rule whose program is run. */
+    size_t count;               /* Number of processes in the pool. */
+    size_t base;                /* Offset of the pool's bytes in lockfile. */
+    struct slot *slots;         /* Process states, in shared memory. */
+    socket_type *fds;           /* Listening socket for each process. */
+    char **paths;               /* Path to the socket for each process. */
+};
+
+/* All of the pools, the directory holding their sockets, and the lock file. */
+static struct backend_pool **pools = NULL;
+static size_t npools = 0;
+static char *socket_dir = NULL;
+static FILE *lockfile = NULL;
+
+/* The process checking the health of the backends, if one is running. */
+static pid_t checker = 0;
+
+
+/*
+ * Lock or unlock the given backend process.  type is F_WRLCK or F_UNLCK.  If
+ * wait is false and someone else holds the lock, return false without
+ * reporting an error.  Otherwise, wait for the lock.  Returns true on success
+ * and false on failure, after reporting an error.
+ */
+static bool
+lock_slot(struct backend_pool *pool, size_t n, short type, bool wait)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = (off_t) (pool->base + n);
+    lock.l_len = 1;
+    while (fcntl(fileno(lockfile), wait ? F_SETLKW : F_SETLK, &lock) < 0) {
+        if (!wait && (errno == EACCES || errno == EAGAIN))
+            return false;
+        if (errno != EINTR) {
+            syswarn("cannot lock backend process");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Start the backend process in the given slot of a pool.  The process gets
+ * its listening socket as standard input, /dev/null as standard output, and
+ * REMCTL_BACKEND set in its environment so that it knows to serve requests
+ * from the socket.
+ */
+static void
+spawn(struct backend_pool *pool, size_t n)
+{
+    struct slot *slot = &pool->slots[n];
+    struct rule *rule = pool->rule;
+    struct sigaction sa;
+    const char *program;
+    pid_t child;
+    int fd;
+
+    fflush(stdout);
+    child = fork();
+    if (child < 0) {
+        syswarn("cannot fork backend for %s", rule->program);
+        slot->state = SLOT_FAILED;
+        return;
+    } else if (child == 0) {
+        if (dup2(pool->fds[n], 0) < 0)
+            sysdie("cannot set up backend socket");
+        fd = open("/dev/null", O_WRONLY);
+        if (fd > 1) {
+            dup2(fd, 1);
+            close(fd);
+        }
+        for (fd = 3; fd < 16; fd++)
+            close(fd);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        if (sigaction(SIGPIPE, &sa, NULL) < 0)
+            sysdie("cannot clear SIGPIPE handler");
+        if (setenv("REMCTL_BACKEND", "1", 1) < 0)
+            sysdie("cannot set REMCTL_BACKEND in environment");
+        server_replay_restore();
+        server_process_drop_privileges(rule);
+        program = strrchr(rule->program, '/');
+        program = (program == NULL) ? rule->program : program + 1;
+        execl(rule->program, program, (char *) 0);
+        sysdie("cannot execute backend %s", rule->program);
+    }
+    slot->pid = child;
+    slot->served = 0;
+    slot->started = time(NULL);
+    slot->state = SLOT_READY;
+    debug("backend %lu started for %s", (unsigned long) child, rule->program);
+}
+
+
+/*
+ * Create a pool of backend processes for a rule and start them.  Returns the
+ * new pool.
+ */
+static struct backend_pool *
+pool_new(struct rule *rule, size_t index, size_t base)
+{
+    struct backend_pool *pool;
+    struct sockaddr_un addr;
+    size_t i;
+
+    pool = xcalloc(1, sizeof(struct backend_pool));
+    pool->rule = rule;
+    pool->count = (size_t) rule->backend;
+    pool->base = base;
+    pool->slots = mmap(NULL, pool->count * sizeof(struct slot),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                       0);
+    if (pool->slots == MAP_FAILED)
+        sysdie("cannot allocate backend scoreboard");
+    pool->fds = xcalloc(pool->count, sizeof(socket_type));
+    pool->paths = xcalloc(pool->count, sizeof(char *));
+    for (i = 0; i < pool->count; i++) {
+        xasprintf(&pool->paths[i], "%s/%lu.%lu", socket_dir,
+                  (unsigned long) index, (unsigned long) i);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(pool->paths[i]) >= sizeof(addr.sun_path))
+            die("backend socket path %s too long", pool->paths[i]);
+        memcpy(addr.sun_path, pool->paths[i], strlen(pool->paths[i]));
+        pool->fds[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (pool->fds[i] == INVALID_SOCKET)
+            sysdie("cannot create backend socket");
+        if (bind(pool->fds[i], (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            sysdie("cannot bind backend socket %s", pool->paths[i]);
+        if (listen(pool->fds[i], 16) < 0)
+            sysdie("cannot listen on backend socket %s", pool->paths[i]);
+        fdflag_close_exec(pool->fds[i], true);
+        spawn(pool, i);
+    }
+    return pool;
+}
+
+
+/*
+ * Start pools of backend processes for every rule in the configuration that
+ * uses them.  Must be called by the parent before forking any children that
+ * may run commands, and only when there are no pools already.
+ */
+void
+server_backend_start(struct config *config)
+{
+    struct rule *rule;
+    const char *tmpdir;
+    size_t i, base;
+
+    for (i = 0; i < config->count; i++)
+        if (config->rules[i]->backend > 0)
+            npools++;
+    if (npools == 0)
+        return;
+
+    /* Create the directory for the sockets and the lock file. */
+    tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL || tmpdir[0] == '\0')
+        tmpdir = "/tmp";
+    xasprintf(&socket_dir, "%s/remctld-XXXXXX", tmpdir);
+    if (mkdtemp(socket_dir) == NULL)
+        sysdie("cannot create backend socket directory %s", socket_dir);
+    lockfile = tmpfile();
+    if (lockfile == NULL)
+        sysdie("cannot create backend lock file");
+    fdflag_close_exec(fileno(lockfile), true);
+
+    /* Start the pools. */
+    pools = xcalloc(npools, sizeof(struct backend_pool *));
+    npools = 0;
+    base = 0;
+    for (i = 0; i < config->count; i++) {
+        if (config->rules[i]->backend <= 0)
+            continue;
+        rule = config->rules[i];
+        if (rule->sudo_user != NULL) {
+            warn("%s:%d: backend cannot be used with sudo, ignoring",
+                 rule->file, rule->lineno);
+            continue;
+        }
+        pools[npools] = pool_new(rule, npools, base);
+        rule->pool = pools[npools];
+        base += pools[npools]->count;
+        npools++;
+    }
+}
+
+
+/*
+ * Stop all backend processes and free the pools.  The rules that used them
+ * must be freed or no longer used afterwards.  Only called by the parent.
+ */
+void
+server_backend_stop(void)
+{
+    struct backend_pool *pool;
+    size_t i, j;
+
+    for (i = 0; i < npools; i++) {
+        pool = pools[i];
+        for (j = 0; j < pool->count; j++) {
+            if (pool->slots[j].pid > 0)
+                if (kill(pool->slots[j].pid, SIGTERM) < 0 && errno != ESRCH)
+                    syswarn("cannot signal backend %lu",
+                            (unsigned long) pool->slots[j].pid);
+            close(pool->fds[j]);
+            if (unlink(pool->paths[j]) < 0 && errno != ENOENT)
+                syswarn("cannot remove %s", pool->paths[j]);
+            free(pool->paths[j]);
+        }
+        pool->rule->pool = NULL;
+        munmap(pool->slots, pool->count * sizeof(struct slot));
+        free(pool->fds);
+        free(pool->paths);
+        free(pool);
+    }
+    free(pools);
+    pools = NULL;
+    npools = 0;
+    if (checker > 0) {
+        if (kill(checker, SIGTERM) < 0 && errno != ESRCH)
+            syswarn("cannot signal backend checker %lu",
+                    (unsigned long) checker);
+        checker = 0;
+    }
+    if (socket_dir != NULL) {
+        if (rmdir(socket_dir) < 0)
+            syswarn("cannot remove %s", socket_dir);
+        free(socket_dir);
+        socket_dir = NULL;
+    }
+    if (lockfile != NULL) {
+        fclose(lockfile);
+        lockfile = NULL;
+    }
+}
+
+
+/*
+ * Called by the parent when a child exits, with its PID and wait status.  If
+ * it was a backend process, log its exit unless it was told to exit, mark its
+ * slot so that it will be restarted, and return true.  Otherwise, return
+ * false.
+ */
+bool
+server_backend_reap(pid_t pid, int status)
+{
+    struct slot *slot;
+    const char *program;
+    size_t i, j;
+
+    if (checker > 0 && pid == checker) {
+        checker = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            warn("backend checker %lu failed", (unsigned long) pid);
+        return true;
+    }
+    for (i = 0; i < npools; i++)
+        for (j = 0; j < pools[i]->count; j++) {
+            slot = &pools[i]->slots[j];
+            if (slot->pid != pid || slot->state == SLOT_EMPTY)
+                continue;
+            program = pools[i]->rule->program;
+            slot->pid = 0;
+            if (slot->state == SLOT_RETIRING) {
+                debug("backend %lu for %s done", (unsigned long) pid, program);
+                slot->state = SLOT_EMPTY;
+                return true;
+            }
+            if (WIFEXITED(status))
+                warn("backend %lu for %s exited with %d", (unsigned long) pid,
+                     program, WEXITSTATUS(status));
+            else
+                warn("backend %lu for %s died", (unsigned long) pid, program);
+            if (time(NULL) - slot->started < BACKEND_MIN_LIFETIME)
+                slot->state = SLOT_FAILED;
+            else
+                slot->state = SLOT_EMPTY;
+            return true;
+        }
+    return false;
+}
+
+
+/*
+ * Open a connection to the given backend process.  Returns the socket, or
+ * INVALID_SOCKET on failure after reporting an error.
+ */
+static socket_type
+connect_slot(struct backend_pool *pool, size_t n)
+{
+    struct sockaddr_un addr;
+    socket_type fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, pool->paths[n], strlen(pool->paths[n]));
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET) {
+        syswarn("cannot create socket for backend");
+        return INVALID_SOCKET;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        syswarn("cannot connect to backend %s", pool->paths[n]);
+        close(fd);
+        return INVALID_SOCKET;
+    }
+    fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Send a record to a backend.  Returns true on success and false on failure.
+ */
+static bool
+send_record(socket_type fd, enum backend_records type, const void *data,
+            size_t length)
+{
+    char header[5];
+    uint32_t size;
+
+    header[0] = (char) type;
+    size = htonl((uint32_t) length);
+    memcpy(header + 1, &size, sizeof(size));
+    if (xwrite(fd, header, sizeof(header)) < 0)
+        return false;
+    if (length > 0 && xwrite(fd, data, length) < 0)
+        return false;
+    return true;
+}
+
+
+/*
+ * Read the header of a record from a backend, storing its type and length.
+ * Uses the given timeout in milliseconds, or no timeout if it is 0.  Returns
+ * true on success and false on failure or end of file.
+ */
+static bool
+read_header(socket_type fd, int *type, size_t *length, time_t timeout)
+{
+    unsigned char header[5];
+    uint32_t size;
+
+    if (!network_read(fd, header, sizeof(header), timeout))
+        return false;
+    *type = header[0];
+    memcpy(&size, header + 1, sizeof(size));
+    *length = ntohl(size);
+    return true;
+}
+
+
+/*
+ * Read a status record from a backend, after its header.  Returns true on
+ * success and false on failure.
+ */
+static bool
+read_status(socket_type fd, size_t length, int *status, time_t timeout)
+{
+    uint32_t value;
+
+    if (length != sizeof(value))
+        return false;
+    if (!network_read(fd, &value, sizeof(value), timeout))
+        return false;
+    *status = (int) (int32_t) ntohl(value);
+    return true;
+}
+
+
+/*
+ * Send a ping to an idle backend process and return whether it answered in
+ * time.
+ */
+static bool
+ping(struct backend_pool *pool, size_t n)
+{
+    socket_type fd;
+    size_t length;
+    int type, status;
+    bool okay = false;
+
+    fd = connect_slot(pool, n);
+    if (fd == INVALID_SOCKET)
+        return false;
+    if (send_record(fd, BACKEND_PING, NULL, 0))
+        if (read_header(fd, &type, &length, BACKEND_TIMEOUT))
+            if (type == BACKEND_STATUS)
+                okay = read_status(fd, length, &status, BACKEND_TIMEOUT);
+    close(fd);
+    return okay;
+}
+
+
+/*
+ * Check the health of all of the idle backend processes, pinging each and
+ * killing any that don't answer.  This is run in a separate process, since
+ * each ping can take up to BACKEND_TIMEOUT.  The state of the slots is in
+ * shared memory, so the parent sees any backend marked as retiring.
+ */
+static void
+check_health(void)
+{
+    struct backend_pool *pool;
+    struct slot *slot;
+    size_t i, j;
+
+    for (i = 0; i < npools; i++) {
+        pool = pools[i];
+        for (j = 0; j < pool->count; j++) {
+            slot = &pool->slots[j];
+            if (slot->state != SLOT_READY)
+                continue;
+            if (!lock_slot(pool, j, F_WRLCK, false))
+                continue;
+            if (slot->state == SLOT_READY && !ping(pool, j)) {
+                warn("backend %lu for %s not responding, killing it",
+                     (unsigned long) slot->pid, pool->rule->program);
+                slot->state = SLOT_RETIRING;
+                if (kill(slot->pid, SIGKILL) < 0 && errno != ESRCH)
+                    syswarn("cannot kill backend %lu",
+                            (unsigned long) slot->pid);
+            }
+            lock_slot(pool, j, F_UNLCK, true);
+        }
+    }
+}
+
+
+/*
+ * Called periodically by the parent to keep the pools running.  Restarts any
+ * backend processes that have exited.  If health is true, also restarts
+ * backend processes that were failing and starts a process to ping each idle
+ * backend process, unless the last one is still running.  Backend processes
+ * that don't answer are killed and will be restarted once they have been
+ * reaped.  The checker process is reaped by server_backend_reap.
+ */
+void
+server_backend_check(bool health)
+{
+    struct backend_pool *pool;
+    struct sigaction sa;
+    size_t i, j;
+
+    for (i = 0; i < npools; i++) {
+        pool = pools[i];
+        for (j = 0; j < pool->count; j++)
+            if (pool->slots[j].state == SLOT_EMPTY
+                || (health && pool->slots[j].state == SLOT_FAILED))
+                spawn(pool, j);
+    }
+    if (!health || npools == 0 || checker > 0)
+        return;
+    fflush(stdout);
+    checker = fork();
+    if (checker < 0) {
+        syswarn("cannot fork backend checker");
+        checker = 0;
+    } else if (checker == 0) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+        sigaction(SIGALRM, &sa, NULL);
+        check_health();
+        _exit(0);
+    }
+}
+
+
+/*
+ * Claim a backend process from a pool, trying each in turn without waiting
+ * and then waiting for one if they're all busy.  Returns true and stores the
+ * slot in n on success, and returns false if no backend process is ready.
+ */
+static bool
+acquire(struct backend_pool *pool, size_t *n)
+{
+    size_t i, start;
+
+    start = (size_t) getpid() % pool->count;
+    for (i = 0; i < pool->count; i++) {
+        *n = (start + i) % pool->count;
+        if (!lock_slot(pool, *n, F_WRLCK, false))
+            continue;
+        if (pool->slots[*n].state == SLOT_READY)
+            return true;
+        lock_slot(pool, *n, F_UNLCK, true);
+    }
+    *n = start;
+    if (!lock_slot(pool, *n, F_WRLCK, true))
+        return false;
+    if (pool->slots[*n].state == SLOT_READY)
+        return true;
+    lock_slot(pool, *n, F_UNLCK, true);
+    return false;
+}
+
+
+/*
+ * Copy the data of a record from a backend to the given file descriptor.
+ * Dies on failure, since the command has already been sent.
+ */
+static void
+copy_record(socket_type fd, size_t length, int out)
+{
+    char buffer[BUFSIZ];
+    size_t size;
+
+    while (length > 0) {
+        size = (length > sizeof(buffer)) ? sizeof(buffer) : length;
+        if (!network_read(fd, buffer, size, 0))
+            sysdie("cannot read output from backend");
+        if (xwrite(out, buffer, size) < 0)
+            sysdie("cannot write output from backend");
+        length -= size;
+    }
+}
+
+
+/*
+ * Run a command with a backend process, if the rule has a pool of them.  This
+ * is called in the child process forked to run the command, with the
+ * environment already set up.  argv is the argv of the command, the first
+ * element of which is ignored.  Standard input is read from in until end of
+ * file and sent to the backend, and the output of the backend is written to
+ * out and err.
+ *
+ * Returns the exit status of the command, or -1 if no backend process could
+ * be reached, in which case the caller should run the program itself.  Dies
+ * on any failure after the command was sent.
+ */
+int
+server_backend_relay(struct rule *rule, const char **argv, int in, int out,
+                     int err)
+{
+    struct backend_pool *pool = rule->pool;
+    struct slot *slot;
+    struct sigaction sa;
+    socket_type fd;
+    size_t i, n, length;
+    ssize_t got;
+    const char *value;
+    char *env;
+    char buffer[BUFSIZ];
+    int type;
+    int status = -1;
+
+    if (pool == NULL || lockfile == NULL)
+        return -1;
+    if (!acquire(pool, &n))
+        return -1;
+    slot = &pool->slots[n];
+    fd = connect_slot(pool, n);
+    if (fd == INVALID_SOCKET) {
+        lock_slot(pool, n, F_UNLCK, true);
+        return -1;
+    }
+
+    /* A backend dying shouldn't kill us with SIGPIPE. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) < 0)
+        sysdie("cannot ignore SIGPIPE");
+
+    /* Send the request. */
+    for (i = 1; argv[i] != NULL; i++)
+        if (!send_record(fd, BACKEND_ARGUMENT, argv[i], strlen(argv[i])))
+            sysdie("cannot send command to backend");
+    for (i = 0; backend_env[i] != NULL; i++) {
+        value = getenv(backend_env[i]);
+        if (value == NULL)
+            continue;
+        xasprintf(&env, "%s=%s", backend_env[i], value);
+        if (!send_record(fd, BACKEND_ENV, env, strlen(env)))
+            sysdie("cannot send command to backend");
+        free(env);
+    }
+    do {
+        got = read(in, buffer, sizeof(buffer));
+        if (got < 0 && errno != EINTR)
+            sysdie("cannot read standard input for backend");
+        if (got > 0)
+            if (!send_record(fd, BACKEND_STDIN, buffer, (size_t) got))
+                sysdie("cannot send standard input to backend");
+    } while (got != 0);
+    if (!send_record(fd, BACKEND_END, NULL, 0))
+        sysdie("cannot send command to backend");
+
+    /* Relay the reply. */
+    while (status < 0) {
+        if (!read_header(fd, &type, &length, 0))
+            die("backend for %s exited without a status", rule->program);
+        switch (type) {
+        case BACKEND_STDOUT:
+            copy_record(fd, length, out);
+            break;
+        case BACKEND_STDERR:
+            copy_record(fd, length, err);
+            break;
+        case BACKEND_STATUS:
+            if (!read_status(fd, length, &status, 0) || status < 0)
+                die("invalid status from backend for %s", rule->program);
+            break;
+        default:
+            die("unknown record %d from backend for %s", type, rule->program);
+        }
+    }
+    close(fd);
+
+    /* Retire the backend process if it has handled enough requests. */
+    slot->served++;
+    if (rule->backend_requests > 0
+        && slot->served >= (unsigned long) rule->backend_requests) {
+        slot->state = SLOT_RETIRING;
+        if (kill(slot->pid, SIGTERM) < 0 && errno != ESRCH)
+            syswarn("cannot signal backend %lu", (unsigned long) slot->pid);
+    }
+    lock_slot(pool, n, F_UNLCK, true);
+    return status;
+}
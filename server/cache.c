@@ -0,0 +1,476 @@
+/*
+ * Shared cache of command output for the stand-alone server.
+ *
+ * The output of commands whose rules set the cache option is kept in a cache
+ * in anonymous shared memory, created by the parent before it starts forking,
+ * so that every process handling connections sees the same cache.  The cache
+ * has a fixed number of entries, each with room for a fixed amount of data.
+ * Each key can only be stored in the entry selected by its hash, so storing
+ * a new result replaces whatever was in that entry before.
+ *
+ * Access to each entry is serialized with fcntl locks on the byte of an
+ * unlinked temporary file with the same offset as the entry number.  The
+ * parent creates the file and its children inherit the open descriptor.
+ * Since fcntl locks belong to processes, this works without any shared
+ * locking primitives, and a lock is released automatically if the process
+ * holding it dies.
+ *
+ * The cache is also used to coalesce identical commands running at the same
+ * time.  A second set of lock bytes, following the ones for the entries,
+ * marks a command for that entry as running.  The first process to take that
+ * lock runs the command, records the hash of its key in the entry, and
+ * stores its result, and any other process running the same command waits
+ * for the lock to be released and then uses the stored result.  A process
+ * running a different command that uses the same entry doesn't wait, and
+ * waiting processes give up after a while and run the command themselves.
+ * Each entry has a generation number, incremented whenever it is stored, so
+ * that waiting processes only use results stored after they started
+ * waiting.
+ *
+ * When remctld is not running in stand-alone mode, or the cache is disabled,
+ * there is no cache and all of these functions do nothing.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/time.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+
+/* Some systems only provide the older name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * The header of an entry in the cache.  It is followed by the key and then
+ * the cached data.  An entry with a key length of 0 is empty.
+ */
+struct entry {
+    unsigned long hash;         /* Hash of the key. */
+    size_t keylen;              /* Length of the key. */
+    size_t datalen;             /* Length of the cached data. */
+    int status;                 /* Exit status of the command. */
+    time_t expires;             /* When the entry expires. */
+    unsigned long generation;   /* Incremented each time entry is stored. */
+    unsigned long running;      /* Hash of the key of a running command. */
+};
+
+/* The cache, its geometry, and the file used for locking. */
+static char *cache = NULL;
+static size_t nentries = 0;
+static size_t entry_size = 0;
+static size_t stride = 0;
+static FILE *lockfile = NULL;
+
+/* How long to wait for an identical running command, in milliseconds. */
+static unsigned long coalesce_wait = 10 * 1000;
+
+/* The longest interval between checks of whether a running command is done. */
+#define COALESCE_INTERVAL 100
+
+
+/*
+ * Hash a cache key.  This is the 32-bit FNV-1a hash.
+ */
+static unsigned long
+hash_key(const char *key, size_t length)
+{
+    const unsigned char *p;
+    unsigned long hash = 2166136261UL;
+
+    for (p = (const unsigned char *) key; length > 0; p++, length--) {
+        hash ^= *p;
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+
+/*
+ * Lock or unlock byte n of the lock file, which is either an entry of the
+ * cache or, for n of at least nentries, the running command for an entry.
+ * type is F_RDLCK, F_WRLCK, or F_UNLCK.  If wait is false and someone else
+ * holds a conflicting lock, return false without reporting an error.
+ * Otherwise, wait for the lock.  Returns true on success and false on
+ * failure, after reporting an error.
+ */
+static bool
+lock_byte(size_t n, short type, bool wait)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = (off_t) n;
+    lock.l_len = 1;
+    while (fcntl(fileno(lockfile), wait ? F_SETLKW : F_SETLK, &lock) < 0) {
+        if (!wait && (errno == EACCES || errno == EAGAIN))
+            return false;
+        if (errno != EINTR) {
+            syswarn("cannot lock output cache entry");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Take a lock on byte n of the lock file like lock_byte, but only wait for
+ * up to timeout milliseconds, checking again at increasing intervals.
+ * Returns false if the lock couldn't be taken in that time or on failure,
+ * after reporting an error.
+ */
+static bool
+lock_byte_timed(size_t n, short type, unsigned long timeout)
+{
+    struct flock lock;
+    struct timeval tv;
+    unsigned long waited = 0;
+    unsigned long interval = 1;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = (off_t) n;
+    lock.l_len = 1;
+    while (fcntl(fileno(lockfile), F_SETLK, &lock) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EACCES && errno != EAGAIN) {
+            syswarn("cannot lock output cache entry");
+            return false;
+        }
+        if (waited >= timeout)
+            return false;
+        if (interval > timeout - waited)
+            interval = timeout - waited;
+        tv.tv_sec = (time_t) (interval / 1000);
+        tv.tv_usec = (long) (interval % 1000) * 1000;
+        select(0, NULL, NULL, NULL, &tv);
+        waited += interval;
+        interval *= 2;
+        if (interval > COALESCE_INTERVAL)
+            interval = COALESCE_INTERVAL;
+    }
+    return true;
+}
+
+
+/*
+ * Lock or unlock an entry of the cache, waiting for the lock if needed.
+ */
+static bool
+lock_entry(size_t n, short type)
+{
+    return lock_byte(n, type, true);
+}
+
+
+/*
+ * Return the entry with the given number.
+ */
+static struct entry *
+get_entry(size_t n)
+{
+    return (struct entry *) (void *) (cache + n * stride);
+}
+
+
+/*
+ * Returns true if the given entry, which the caller must have locked, holds
+ * the given key.
+ */
+static bool
+entry_matches(const struct entry *entry, unsigned long hash, const char *key,
+              size_t keylen)
+{
+    const char *data = (const char *) (entry + 1);
+
+    return (entry->keylen == keylen && entry->hash == hash
+            && memcmp(data, key, keylen) == 0);
+}
+
+
+/*
+ * Copy the data and status of an entry, which the caller must have locked,
+ * into an output buffer and status.
+ */
+static void
+entry_copy(const struct entry *entry, struct evbuffer *output, int *status)
+{
+    const char *data = (const char *) (entry + 1);
+
+    if (evbuffer_add(output, data + entry->keylen, entry->datalen) < 0)
+        die("internal error: cannot copy data from output cache");
+    *status = entry->status;
+}
+
+
+/*
+ * Create the cache with the given number of entries, each of which can hold
+ * a key and data of up to size bytes.  Must be called by the parent before
+ * forking any children.  Anonymous mappings start out zeroed, so every entry
+ * starts out empty, and pages are only allocated once entries are used.
+ */
+void
+server_cache_init(size_t entries, size_t size)
+{
+    size_t align = sizeof(struct entry);
+
+    lockfile = tmpfile();
+    if (lockfile == NULL)
+        sysdie("cannot create output cache lock file");
+    fdflag_close_exec(fileno(lockfile), true);
+    nentries = entries;
+    entry_size = size;
+    stride = (sizeof(struct entry) + size + align - 1) / align * align;
+    cache = mmap(NULL, nentries * stride, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED)
+        sysdie("cannot allocate output cache");
+}
+
+
+/*
+ * Empty the cache, such as after re-reading the configuration.
+ */
+void
+server_cache_clear(void)
+{
+    struct entry *entry;
+    size_t i;
+
+    for (i = 0; i < nentries; i++) {
+        if (!lock_entry(i, F_WRLCK))
+            continue;
+        entry = get_entry(i);
+        entry->keylen = 0;
+        lock_entry(i, F_UNLCK);
+    }
+}
+
+
+/*
+ * Set how long, in milliseconds, to wait for an identical command that is
+ * already running before running the command anyway.
+ */
+void
+server_cache_set_wait(unsigned long timeout)
+{
+    coalesce_wait = timeout;
+}
+
+
+/*
+ * Free the cache.  Only called by the parent on exit.
+ */
+void
+server_cache_free(void)
+{
+    if (cache == NULL)
+        return;
+    munmap(cache, nentries * stride);
+    fclose(lockfile);
+    cache = NULL;
+    lockfile = NULL;
+    nentries = 0;
+}
+
+
+/*
+ * Returns whether there is a cache, so that callers can avoid the work of
+ * capturing output that couldn't be stored anyway.
+ */
+bool
+server_cache_enabled(void)
+{
+    return cache != NULL;
+}
+
+
+/*
+ * Returns the most output that can be stored in the cache under a key of the
+ * given length, or 0 if nothing can be stored under it, so that callers can
+ * stop capturing output that won't fit.
+ */
+size_t
+server_cache_room(size_t keylen)
+{
+    if (cache == NULL || keylen == 0 || keylen >= entry_size)
+        return 0;
+    return entry_size - keylen;
+}
+
+
+/*
+ * Look up a key in the cache.  If there is an entry for that key that hasn't
+ * expired, add its data to the output buffer, store its exit status in
+ * status, and return true.  Otherwise, return false.
+ */
+bool
+server_cache_get(const char *key, size_t keylen, struct evbuffer *output,
+                 int *status)
+{
+    struct entry *entry;
+    unsigned long hash;
+    size_t n;
+    bool found = false;
+
+    if (cache == NULL || keylen == 0)
+        return false;
+    hash = hash_key(key, keylen);
+    n = hash % nentries;
+    if (!lock_entry(n, F_RDLCK))
+        return false;
+    entry = get_entry(n);
+    if (entry_matches(entry, hash, key, keylen)
+        && entry->expires > time(NULL)) {
+        entry_copy(entry, output, status);
+        found = true;
+    }
+    lock_entry(n, F_UNLCK);
+    return found;
+}
+
+
+/*
+ * Join an identical command that another process is already running.  If
+ * there is one, wait for it to finish and, if it stored its result in the
+ * cache, add its output to the output buffer, store its exit status in
+ * status, and return true.
+ *
+ * Otherwise, return false, and the caller should run the command itself.  In
+ * that case, leader is set to true if the caller is now the process running
+ * the command, and must then store the result with server_cache_put and call
+ * server_cache_leave when done, even if the command fails.  The caller also
+ * runs the command itself, without being the leader, if a different command
+ * using the same entry is running or the running command doesn't finish in
+ * time.
+ */
+bool
+server_cache_join(const char *key, size_t keylen, struct evbuffer *output,
+                  int *status, bool *leader)
+{
+    struct entry *entry;
+    unsigned long hash, generation, running;
+    size_t n;
+    bool found = false;
+
+    *leader = false;
+    if (cache == NULL || keylen == 0)
+        return false;
+    hash = hash_key(key, keylen);
+    n = hash % nentries;
+    entry = get_entry(n);
+
+    /*
+     * Note the generation before checking for a running command, so that any
+     * result stored after that check is newer.
+     */
+    if (!lock_entry(n, F_RDLCK))
+        return false;
+    generation = entry->generation;
+    lock_entry(n, F_UNLCK);
+    if (lock_byte(nentries + n, F_WRLCK, false)) {
+        *leader = true;
+        if (lock_entry(n, F_WRLCK)) {
+            entry->running = hash;
+            lock_entry(n, F_UNLCK);
+        }
+        return false;
+    }
+
+    /*
+     * Someone else is running a command for this entry.  If it's the same
+     * command, wait a while for them and check the result.
+     */
+    if (!lock_entry(n, F_RDLCK))
+        return false;
+    running = entry->running;
+    lock_entry(n, F_UNLCK);
+    if (running != hash)
+        return false;
+    if (!lock_byte_timed(nentries + n, F_RDLCK, coalesce_wait)) {
+        debug("gave up waiting for running command after %lums",
+              coalesce_wait);
+        return false;
+    }
+    lock_byte(nentries + n, F_UNLCK, true);
+    if (!lock_entry(n, F_RDLCK))
+        return false;
+    if (entry->generation != generation
+        && entry_matches(entry, hash, key, keylen)) {
+        entry_copy(entry, output, status);
+        found = true;
+    }
+    lock_entry(n, F_UNLCK);
+    return found;
+}
+
+
+/*
+ * Mark a command started after server_cache_join set leader as no longer
+ * running, letting any processes waiting for it continue.
+ */
+void
+server_cache_leave(const char *key, size_t keylen)
+{
+    if (cache == NULL || keylen == 0)
+        return;
+    lock_byte(nentries + hash_key(key, keylen) % nentries, F_UNLCK, true);
+}
+
+
+/*
+ * Store data and an exit status in the cache under the given key, to expire
+ * after the given number of seconds.  If the key and data don't fit in an
+ * entry, nothing is stored.  A ttl of 0 stores a result that is only used by
+ * processes waiting in server_cache_join.
+ */
+void
+server_cache_put(const char *key, size_t keylen, const char *data,
+                 size_t length, int status, time_t ttl)
+{
+    struct entry *entry;
+    unsigned long hash;
+    size_t n;
+    char *p;
+
+    if (cache == NULL || keylen == 0 || keylen + length > entry_size)
+        return;
+    hash = hash_key(key, keylen);
+    n = hash % nentries;
+    if (!lock_entry(n, F_WRLCK))
+        return;
+    entry = get_entry(n);
+    p = (char *) (entry + 1);
+    memcpy(p, key, keylen);
+    if (length > 0)
+        memcpy(p + keylen, data, length);
+    entry->hash = hash;
+    entry->keylen = keylen;
+    entry->datalen = length;
+    entry->status = status;
+    entry->expires = time(NULL) + ttl;
+    entry->generation++;
+    lock_entry(n, F_UNLCK);
+}
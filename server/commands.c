@@ -24,6 +24,7 @@
 #include <sys/wait.h>
 
 #include <server/internal.h>
+#include <util/compress.h>
 #include <util/fdflag.h>
 #include <util/macros.h>
 #include <util/messages.h>
@@ -31,52 +32,30 @@
 #include <util/xmalloc.h>
 
 
-/*
- * Given a configuration rule, a command, and a subcommand, return true if
- * that command and subcommand match that configuration rule and false
- * otherwise.  Handles the ALL and NULL special cases.
- *
- * Empty commands are not yet supported by the rest of the code, but this
- * function copes in case that changes later.
- */
-static bool
-line_matches(struct rule *rule, const char *command, const char *subcommand)
-{
-    bool okay = false;
-
-    if (strcmp(rule->command, "ALL") == 0)
-        okay = true;
-    if (command != NULL && strcmp(rule->command, command) == 0)
-        okay = true;
-    if (command == NULL && strcmp(rule->command, "EMPTY") == 0)
-        okay = true;
-    if (okay) {
-        if (strcmp(rule->subcommand, "ALL") == 0)
-            return true;
-        if (subcommand != NULL && strcmp(rule->subcommand, subcommand) == 0)
-            return true;
-        if (subcommand == NULL && strcmp(rule->subcommand, "EMPTY") == 0)
-            return true;
-    }
-    return false;
-}
+/* The maximum number of summary programs to run at the same time. */
+#define SUMMARY_PARALLEL 8
 
+/* The maximum output kept from each summary program. */
+#define SUMMARY_MAX_OUTPUT (1024 * 1024)
 
 /*
- * Look up the matching configuration rule for a command and subcommand.
- * Takes the configuration, a command, and a subcommand to match against
- * Returns the matching config line or NULL if none match.
+ * A command between checking it and sending its exit status.  This is
+ * allocated so that a command started in the background can be finished
+ * after server_run_command returns.
  */
-static struct rule *
-find_config_line(struct config *config, char *command, char *subcommand)
-{
-    size_t i;
-
-    for (i = 0; i < config->count; i++)
-        if (line_matches(config->rules[i], command, subcommand))
-            return config->rules[i];
-    return NULL;
-}
+struct command {
+    struct client *client;      /* Client that sent the command. */
+    struct process process;     /* The process running the command. */
+    char *command;              /* The command as a string. */
+    char *subcommand;           /* The subcommand as a string, if any. */
+    char *helpsubcommand;       /* Subcommand to get help for, if any. */
+    char **argv;                /* argv for running the program. */
+    char *key;                  /* Key for the output in the cache. */
+    size_t keylen;              /* Length of that key. */
+    bool limited;               /* Counted against the command limits. */
+    bool cached;                /* Output and status came from the cache. */
+    bool leader;                /* Identical commands wait for our output. */
+};
 
 
 /*
@@ -85,6 +64,10 @@ find_config_line(struct config *config, char *command, char *subcommand)
  * provide a summary setup that the user can access, then running that
  * line's command with the given summary sub-command.
  *
+ * The summary programs are run in parallel, up to SUMMARY_PARALLEL at a time,
+ * but their output is captured and sent in the order of the configuration
+ * lines.  Output from each program beyond SUMMARY_MAX_OUTPUT is discarded.
+ *
  * Takes a client object, the user requesting access, and the list of all
  * valid configurations.
  */
@@ -96,10 +79,11 @@ server_send_summary(struct client *client, struct config *config)
     const char *subcommand;
     struct rule *rule = NULL;
     size_t i;
+    size_t count = 0;
     const char **req_argv = NULL;
-    bool ok_any = false;
     int status_all = 0;
-    struct process process;
+    struct process *processes, *process;
+    struct process *last = NULL;
     struct evbuffer *output = NULL;
 
     /* Create a buffer to hold all the output for protocol version one. */
@@ -114,15 +98,14 @@ server_send_summary(struct client *client, struct config *config)
      * lines, the user is authorized to run, and which have a summary field
      * given.
      */
+    processes = xcalloc(config->count, sizeof(struct process));
     for (i = 0; i < config->count; i++) {
-        memset(&process, 0, sizeof(process));
-        process.client = client;
+        last = NULL;
         rule = config->rules[i];
         if (!server_config_acl_permit(rule, client))
             continue;
         if (rule->summary == NULL)
             continue;
-        ok_any = true;
 
         /*
          * Get the real program name, and use it as the first argument in
@@ -146,36 +129,68 @@ server_send_summary(struct client *client, struct config *config)
             req_argv[2] = subcommand;
         req_argv[3] = NULL;
 
-        /* Pass the command off to be executed. */
-        process.command = rule->summary;
-        process.argv = req_argv;
-        process.rule = rule;
-        if (server_process_run(&process)) {
-            if (client->protocol == 1)
-                if (evbuffer_add_buffer(output, process.output) < 0)
-                    die("internal error: cannot copy data from output buffer");
-            if (process.status != 0)
-                status_all = process.status;
+        /* Queue the command to be executed. */
+        process = &processes[count];
+        process->client = client;
+        process->command = rule->summary;
+        process->argv = req_argv;
+        process->rule = rule;
+        process->capture = true;
+        process->capture_max = SUMMARY_MAX_OUTPUT;
+        last = process;
+        count++;
+    }
+    if (count == 0) {
+        notice("summary request from user %s, but no defined summaries",
+               client->user);
+        client->error(client, ERROR_UNKNOWN_COMMAND, "Unknown command");
+        goto done;
+    }
+
+    /*
+     * Run all of the commands and then collect or send their output in order.
+     * Stop sending output if sending fails, since the client is gone.
+     */
+    server_process_run_all(processes, count, SUMMARY_PARALLEL);
+    for (i = 0; i < count; i++) {
+        process = &processes[i];
+        if (process->saw_error)
+            continue;
+        if (client->protocol == 1) {
+            if (evbuffer_add_buffer(output, process->output) < 0)
+                die("internal error: cannot copy data from output buffer");
+        } else if (!client->fatal) {
+            server_process_send_output(process);
         }
-        free(req_argv);
+        if (process->status != 0)
+            status_all = process->status;
     }
 
     /*
      * Sets the last process status to 0 if all succeeded, or the last failed
      * exit status if any commands gave non-zero.  Return that we had output
      * successfully if any command gave it.
+     *
+     * What this actually does, and has always done, is use the exit status of
+     * the summary program of the last line of the configuration, or 0 if
+     * that line has no summary or the user can't run it, as long as the last
+     * failing status was a normal exit.  Clients may depend on this, so it is
+     * kept as is.
      */
     if (WIFEXITED(status_all))
-        status_all = (int) WEXITSTATUS(process.status);
+        status_all = (int) WEXITSTATUS(last == NULL ? 0 : last->status);
     else
         status_all = -1;
-    if (ok_any)
+    if (!client->fatal)
         client->finish(client, output, status_all);
-    else {
-        notice("summary request from user %s, but no defined summaries",
-               client->user);
-        client->error(client, ERROR_UNKNOWN_COMMAND, "Unknown command");
+
+done:
+    for (i = 0; i < count; i++) {
+        free(processes[i].argv);
+        if (processes[i].output != NULL)
+            evbuffer_free(processes[i].output);
     }
+    free(processes);
     if (output != NULL)
         evbuffer_free(output);
 }
@@ -294,10 +309,52 @@ create_argv_help(const char *path, const char *command, const char *subcommand)
 
 
 /*
- * Process an incoming command.  Check the configuration files and the ACL
- * file, and if appropriate, forks off the command.  Takes the argument vector
- * and the user principal, and a buffer into which to put the output from the
- * executable or any error message.  Returns the exit status of the command.
+ * Build the key under which the output of a command is cached.  The key
+ * starts with the protocol version, since output is stored differently for
+ * protocol version one, followed by the user unless the cached output is
+ * shared between all users, and then each argument preceded by its length.
+ * Returns the key in newly allocated memory and stores its length in length.
+ */
+static char *
+cache_key(struct client *client, struct rule *rule, struct iovec **argv,
+          size_t *length)
+{
+    struct evbuffer *buf;
+    size_t i, arglen;
+    char *key;
+
+    buf = evbuffer_new();
+    if (buf == NULL)
+        die("internal error: cannot create cache key buffer");
+    if (evbuffer_add(buf, client->protocol > 1 ? "2" : "1", 1) < 0)
+        die("internal error: cannot build cache key");
+    if (!rule->cache_shared)
+        if (evbuffer_add(buf, client->user, strlen(client->user)) < 0)
+            die("internal error: cannot build cache key");
+    if (evbuffer_add(buf, "", 1) < 0)
+        die("internal error: cannot build cache key");
+    for (i = 0; argv[i] != NULL; i++) {
+        arglen = argv[i]->iov_len;
+        if (evbuffer_add(buf, &arglen, sizeof(arglen)) < 0)
+            die("internal error: cannot build cache key");
+        if (evbuffer_add(buf, argv[i]->iov_base, arglen) < 0)
+            die("internal error: cannot build cache key");
+    }
+    *length = evbuffer_get_length(buf);
+    key = xmalloc(*length);
+    if (evbuffer_remove(buf, key, *length) < 0)
+        die("internal error: cannot build cache key");
+    evbuffer_free(buf);
+    return key;
+}
+
+
+/*
+ * Check a command and prepare to run it, filling in the command struct.
+ * Check the configuration files and the ACL file, send any error to the
+ * client, and look for cached output.  Returns true if the command should be
+ * run or its cached output sent, and false if there is nothing more to do,
+ * either because of an error or because it was a summary request.
  *
  * Using the command and the subcommand, the following argument, a lookup in
  * the configuration data structure is done to find the command executable and
@@ -306,25 +363,20 @@ create_argv_help(const char *path, const char *command, const char *subcommand)
  * subcommand.  The first argument is then replaced with the actual program
  * name to be executed.
  */
-int
-server_run_command(struct client *client, struct config *config,
-                   struct iovec **argv)
+static bool
+command_prepare(struct command *cmd, struct config *config,
+                struct iovec **argv)
 {
-    char *command = NULL;
-    char *subcommand = NULL;
-    char *helpsubcommand = NULL;
+    struct client *client = cmd->client;
+    struct process *process = &cmd->process;
     struct rule *rule = NULL;
-    char **req_argv = NULL;
     size_t i;
-    int status = -1;
-    bool ok = false;
     bool help = false;
     const char *user = client->user;
-    struct process process;
 
-    /* Start with an empty process. */
-    memset(&process, 0, sizeof(process));
-    process.client = client;
+    /* Start with encrypted, uncompressed output. */
+    client->integrity_only = false;
+    client->compress = COMPRESS_NONE;
 
     /*
      * We need at least one argument.  This is also rejected earlier when
@@ -333,23 +385,39 @@ server_run_command(struct client *client, struct config *config,
     if (argv[0] == NULL) {
         notice("empty command from user %s", user);
         client->error(client, ERROR_BAD_COMMAND, "Invalid command token");
-        goto done;
+        return false;
     }
 
+    /*
+     * Reject the command right away if the server is too busy to run it.  If
+     * the whole connection was over the limits, also close the connection
+     * after sending the error.
+     */
+    if (client->busy) {
+        client->error(client, ERROR_BUSY, "Too many connections");
+        client->keepalive = false;
+        return false;
+    }
+    if (!server_limits_command_start(user)) {
+        client->error(client, ERROR_BUSY, "Too many running commands");
+        return false;
+    }
+    cmd->limited = true;
+
     /* Neither the command nor the subcommand may ever contain nuls. */
     for (i = 0; argv[i] != NULL && i < 2; i++) {
         if (memchr(argv[i]->iov_base, '\0', argv[i]->iov_len)) {
             notice("%s from user %s contains nul octet",
                    (i == 0) ? "command" : "subcommand", user);
             client->error(client, ERROR_BAD_COMMAND, "Invalid command token");
-            goto done;
+            return false;
         }
     }
 
     /* We need the command and subcommand as nul-terminated strings. */
-    command = xstrndup(argv[0]->iov_base, argv[0]->iov_len);
+    cmd->command = xstrndup(argv[0]->iov_base, argv[0]->iov_len);
     if (argv[1] != NULL)
-        subcommand = xstrndup(argv[1]->iov_base, argv[1]->iov_len);
+        cmd->subcommand = xstrndup(argv[1]->iov_base, argv[1]->iov_len);
 
     /*
      * Find the program path we need to run.  If we find no matching command
@@ -358,8 +426,8 @@ server_run_command(struct client *client, struct config *config,
      * specific help command was listed, check for that in the configuration
      * instead.
      */
-    rule = find_config_line(config, command, subcommand);
-    if (rule == NULL && strcmp(command, "help") == 0) {
+    rule = server_config_find_rule(config, cmd->command, cmd->subcommand);
+    if (rule == NULL && strcmp(cmd->command, "help") == 0) {
 
         /* Error if we have more than a command and possible subcommand. */
         if (argv[1] != NULL && argv[2] != NULL && argv[3] != NULL) {
@@ -369,15 +437,16 @@ server_run_command(struct client *client, struct config *config,
                           "Too many arguments for help command");
         }
 
-        if (subcommand == NULL) {
+        if (cmd->subcommand == NULL) {
             server_send_summary(client, config);
-            goto done;
+            return false;
         } else {
             help = true;
             if (argv[2] != NULL)
-                helpsubcommand = xstrndup(argv[2]->iov_base,
-                                          argv[2]->iov_len);
-            rule = find_config_line(config, subcommand, helpsubcommand);
+                cmd->helpsubcommand = xstrndup(argv[2]->iov_base,
+                                               argv[2]->iov_len);
+            rule = server_config_find_rule(config, cmd->subcommand,
+                                           cmd->helpsubcommand);
         }
     }
 
@@ -396,7 +465,7 @@ server_run_command(struct client *client, struct config *config,
             notice("argument %lu from user %s contains nul octet",
                    (unsigned long) i, user);
             client->error(client, ERROR_BAD_COMMAND, "Invalid command token");
-            goto done;
+            return false;
         }
     }
 
@@ -408,20 +477,34 @@ server_run_command(struct client *client, struct config *config,
      * run this command.
      */
     if (rule == NULL) {
-        notice("unknown command %s%s%s from user %s", command,
-               (subcommand == NULL) ? "" : " ",
-               (subcommand == NULL) ? "" : subcommand, user);
+        notice("unknown command %s%s%s from user %s", cmd->command,
+               (cmd->subcommand == NULL) ? "" : " ",
+               (cmd->subcommand == NULL) ? "" : cmd->subcommand, user);
         client->error(client, ERROR_UNKNOWN_COMMAND, "Unknown command");
-        goto done;
+        return false;
     }
     if (!server_config_acl_permit(rule, client)) {
-        notice("access denied: user %s, command %s%s%s", user, command,
-               (subcommand == NULL) ? "" : " ",
-               (subcommand == NULL) ? "" : subcommand);
+        notice("access denied: user %s, command %s%s%s", user, cmd->command,
+               (cmd->subcommand == NULL) ? "" : " ",
+               (cmd->subcommand == NULL) ? "" : cmd->subcommand);
         client->error(client, ERROR_ACCESS, "Access denied");
-        goto done;
+        return false;
+    }
+
+    /*
+     * Send the output without encrypting it if the rule allows that and the
+     * client said it would accept it.
+     */
+    if (rule->integrity_only && (client->options & OPTION_INTEGRITY)) {
+        debug("sending output of %s with integrity protection only",
+              cmd->command);
+        client->integrity_only = true;
     }
 
+    /* Compress the output if the rule allows that and the client can. */
+    if (rule->compress)
+        client->compress = compress_choose(client->options);
+
     /*
      * Check for a specific command help request with the rule and do error
      * checking and arg massaging.
@@ -429,49 +512,215 @@ server_run_command(struct client *client, struct config *config,
     if (help) {
         if (rule->help == NULL) {
             notice("command %s from user %s has no defined help",
-                   command, user);
+                   cmd->command, user);
             client->error(client, ERROR_NO_HELP,
                           "No help defined for command");
-            goto done;
+            return false;
         } else {
-            free(subcommand);
-            subcommand = xstrdup(rule->help);
+            free(cmd->subcommand);
+            cmd->subcommand = xstrdup(rule->help);
         }
     }
 
     /* Assemble the argv for the command we're about to run. */
     if (help)
-        req_argv = create_argv_help(rule->program, subcommand, helpsubcommand);
+        cmd->argv = create_argv_help(rule->program, cmd->subcommand,
+                                     cmd->helpsubcommand);
     else
-        req_argv = create_argv_command(rule, &process, argv);
+        cmd->argv = create_argv_command(rule, process, argv);
+    process->command = cmd->command;
+    process->argv = (const char **) cmd->argv;
+    process->rule = rule;
+
+    /*
+     * If the output of this command may be cached or shared with identical
+     * commands running at the same time, capture its output so that it can
+     * be stored, and check whether we already have it or can wait for
+     * another process to get it.  If the output turns out to be too large to
+     * store, it's sent to the client as it arrives instead.
+     */
+    if (!help && (rule->cache > 0 || rule->coalesce)
+        && server_cache_enabled()) {
+        cmd->key = cache_key(client, rule, argv, &cmd->keylen);
+        if (server_cache_room(cmd->keylen) == 0) {
+            free(cmd->key);
+            cmd->key = NULL;
+        }
+    }
+    if (cmd->key != NULL) {
+        process->capture = true;
+        process->capture_max = server_cache_room(cmd->keylen);
+        process->capture_stream = true;
+        process->output = evbuffer_new();
+        if (process->output == NULL)
+            die("internal error: cannot create output buffer");
+        if (rule->cache > 0
+            && server_cache_get(cmd->key, cmd->keylen, process->output,
+                                &process->status)) {
+            debug("using cached output for command %s from user %s",
+                  cmd->command, user);
+            cmd->cached = true;
+        } else if (rule->coalesce
+                   && server_cache_join(cmd->key, cmd->keylen,
+                                        process->output, &process->status,
+                                        &cmd->leader)) {
+            debug("using output of running command %s for user %s",
+                  cmd->command, user);
+            cmd->cached = true;
+        } else {
+            evbuffer_free(process->output);
+            process->output = NULL;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Send the output and exit status of a command to the client, either once
+ * its process has finished or when they were found in the cache.
+ */
+static void
+command_send(struct command *cmd)
+{
+    struct client *client = cmd->client;
+    struct process *process = &cmd->process;
+
+    if (process->capture && client->protocol > 1)
+        server_process_send_output(process);
+    client->finish(client, process->output, process->status);
+}
+
+
+/*
+ * Finish a command once its process has been run, successfully if ok is
+ * true.  Store its output in the cache if appropriate and then send its
+ * output and exit status to the client.  Returns the exit status.
+ */
+static int
+command_finish(struct command *cmd, bool ok)
+{
+    struct process *process = &cmd->process;
+    const char *output;
 
-    /* Now actually execute the program. */
-    process.command = command;
-    process.argv = (const char **) req_argv;
-    process.rule = rule;
-    ok = server_process_run(&process);
     if (ok) {
-        if (WIFEXITED(process.status))
-            process.status = (signed int) WEXITSTATUS(process.status);
+        if (WIFEXITED(process->status))
+            process->status = (signed int) WEXITSTATUS(process->status);
         else
-            process.status = -1;
-        client->finish(client, process.output, process.status);
+            process->status = -1;
+        if (process->capture && (cmd->leader || process->status == 0)) {
+            output = (const char *) evbuffer_pullup(process->output, -1);
+            server_cache_put(cmd->key, cmd->keylen, output,
+                             evbuffer_get_length(process->output),
+                             process->status,
+                             process->status == 0 ? process->rule->cache : 0);
+        }
     }
-    status = process.status;
+    if (cmd->leader)
+        server_cache_leave(cmd->key, cmd->keylen);
+    if (ok)
+        command_send(cmd);
+    return process->status;
+}
 
- done:
-    free(command);
-    free(subcommand);
-    free(helpsubcommand);
-    if (req_argv != NULL) {
-        for (i = 0; req_argv[i] != NULL; i++)
-            free(req_argv[i]);
-        free(req_argv);
+
+/*
+ * Free a command struct and everything it holds, and record that the command
+ * is no longer running for the concurrency limits.
+ */
+static void
+command_free(struct command *cmd)
+{
+    size_t i;
+
+    if (cmd->limited)
+        server_limits_command_end();
+    free(cmd->key);
+    free(cmd->command);
+    free(cmd->subcommand);
+    free(cmd->helpsubcommand);
+    if (cmd->argv != NULL) {
+        for (i = 0; cmd->argv[i] != NULL; i++)
+            free(cmd->argv[i]);
+        free(cmd->argv);
     }
-    if (process.input != NULL)
-        evbuffer_free(process.input);
-    if (process.output != NULL)
-        evbuffer_free(process.output);
+    if (cmd->process.input != NULL)
+        evbuffer_free(cmd->process.input);
+    if (cmd->process.output != NULL)
+        evbuffer_free(cmd->process.output);
+    free(cmd);
+}
+
+
+/*
+ * Process an incoming command.  Check the configuration files and the ACL
+ * file, and if appropriate, run the command, sending its output and exit
+ * status to the client.  Takes the client, the configuration, and the
+ * argument vector.  Returns the exit status of the command, or -1 if it
+ * wasn't run.
+ *
+ * If background is set in the client, the process for the command is only
+ * started, in the event loop of the client, and this returns -1 right away.
+ * The command is stored in the client, and the caller must keep running that
+ * event loop until server_command_done returns true and then call
+ * server_command_finish.
+ */
+int
+server_run_command(struct client *client, struct config *config,
+                   struct iovec **argv)
+{
+    struct command *cmd;
+    int status = -1;
+
+    cmd = xcalloc(1, sizeof(struct command));
+    cmd->client = client;
+    cmd->process.client = client;
+    if (command_prepare(cmd, config, argv)) {
+        if (cmd->cached) {
+            command_send(cmd);
+            status = cmd->process.status;
+        } else if (client->background) {
+            server_process_start(&cmd->process, server_client_loop(client));
+            client->command = cmd;
+            return -1;
+        } else {
+            status = command_finish(cmd, server_process_run(&cmd->process));
+        }
+    }
+    command_free(cmd);
+    return status;
+}
+
+
+/*
+ * Returns whether the command the client started in the background has
+ * exited or failed, so that server_command_finish won't wait for it.
+ * Returns false if the client has no such command.
+ */
+bool
+server_command_done(const struct client *client)
+{
+    if (client->command == NULL)
+        return false;
+    return server_process_done(&client->command->process);
+}
+
+
+/*
+ * Finish the command the client started in the background, collecting the
+ * rest of its output and sending its output and exit status to the client,
+ * and then free it.  Must not be called from inside the event loop, since it
+ * runs the loop itself.  Returns the exit status of the command.
+ */
+int
+server_command_finish(struct client *client)
+{
+    struct command *cmd = client->command;
+    int status;
+
+    client->command = NULL;
+    status = command_finish(cmd, server_process_finish(&cmd->process));
+    command_free(cmd);
     return status;
 }
 
@@ -33,6 +33,7 @@
 # include <regex.h>
 #endif
 #include <sys/stat.h>
+#include <time.h>
 
 #include <server/internal.h>
 #include <util/macros.h>
@@ -58,6 +59,22 @@ static char *acl_gput_file = NULL;
 #define REMCTL_KRB5_LOCALNAME_MAX_LEN \
     (sysconf(_SC_LOGIN_NAME_MAX) < 256 ? 256 : sysconf(_SC_LOGIN_NAME_MAX))
 
+/*
+ * The nanoseconds part of the modification and change times from stat
+ * results, if the system provides them.  Otherwise, changes to ACL files
+ * that don't change their size are only noticed after the second changes.
+ */
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+# define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+# define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+# define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+# define ST_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+#else
+# define ST_MTIME_NSEC(st) 0
+# define ST_CTIME_NSEC(st) 0
+#endif
+
 /* Return codes for configuration and ACL parsing. */
 enum config_status {
     CONFIG_SUCCESS = 0,
@@ -87,6 +104,72 @@ struct acl_scheme {
 #define ACL_SCHEME_FILE  0
 #define ACL_SCHEME_PRINC 1
 
+/* Initial value for the FNV-1a hash used for hash tables. */
+#define HASH_INIT 2166136261UL
+
+/* Kinds of entries in a compiled ACL file other than simple principals. */
+enum acl_entry_type {
+    ACL_ENTRY_CHECK,            /* ACL to check, defaulting to princ. */
+    ACL_ENTRY_INCLUDE,          /* Included ACL, defaulting to file. */
+    ACL_ENTRY_TOOLONG,          /* Line that was too long. */
+    ACL_ENTRY_PARSE             /* Line that couldn't be parsed. */
+};
+
+/* An entry in a compiled ACL file other than a simple principal. */
+struct acl_entry {
+    enum acl_entry_type type;
+    int lineno;                 /* Line number for error reporting. */
+    size_t position;            /* Position among all entries in the file. */
+    char *data;                 /* ACL or included file, if any. */
+};
+
+/* A simple principal in the hash set of a compiled ACL file. */
+struct acl_princ {
+    char *name;                 /* The principal, or NULL if slot is empty. */
+    size_t position;            /* Position of its first occurrence. */
+};
+
+/*
+ * A compiled ACL file or the list of files in an ACL directory, along with
+ * the stat information used to tell whether it has changed.  Files that were
+ * read are kept in a cache indexed by path, so that ACL files only have to be
+ * read again when they change.
+ */
+struct acl_cache {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    long mtime_nsec;
+    long ctime_nsec;
+    bool directory;
+
+    /* For files, the entries other than principals and the principals. */
+    struct acl_entry *entries;
+    size_t count;
+    struct acl_princ *princs;   /* Hash set of principals. */
+    size_t princs_size;         /* Size of princs, always a power of two. */
+    size_t princs_count;        /* Number of principals in the hash set. */
+
+    /* For directories, the full paths to the files in the directory. */
+    struct vector *files;
+};
+
+/*
+ * A hash table of pointers to structs keyed by a string, used for caches of
+ * things that are expensive to compute.  The key function returns the key of
+ * a stored struct, and the free function frees one.
+ */
+struct cache_table {
+    void **slots;               /* Open addressing, NULL for empty slots. */
+    size_t size;                /* Always zero or a power of two. */
+    size_t count;
+    const char *(*key)(const void *);
+    void (*free)(void *);
+};
+
 /* Forward declarations. */
 static enum config_status acl_check(const struct client *, const char *entry,
                                     int def_index, const char *file,
@@ -117,14 +200,110 @@ valid_filename(const char *filename)
 
 
 /*
- * Process a request for including a file, either for configuration or for
- * ACLs.  Called by read_conf_file and acl_check_file.
+ * Hash a string, continuing from the given hash value (HASH_INIT to start a
+ * new hash).  This is the 32-bit FNV-1a hash, which is simple and good
+ * enough for our hash tables.
+ */
+static unsigned long
+hash_string(unsigned long hash, const char *string)
+{
+    const unsigned char *p;
+
+    for (p = (const unsigned char *) string; *p != '\0'; p++)
+        hash = ((hash ^ *p) * 16777619UL) & 0xffffffffUL;
+    return hash;
+}
+
+
+/*
+ * Find the slot in a cache table for the given key.  Returns a pointer to the
+ * slot, which will be NULL if the key isn't present.  The table must already
+ * be allocated.
+ */
+static void **
+cache_slot(struct cache_table *table, const char *key)
+{
+    size_t slot, mask;
+
+    mask = table->size - 1;
+    slot = hash_string(HASH_INIT, key) & mask;
+    while (table->slots[slot] != NULL) {
+        if (strcmp(table->key(table->slots[slot]), key) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return &table->slots[slot];
+}
+
+
+/*
+ * Look up a key in a cache table.  Returns the stored struct or NULL if the
+ * key isn't present.
+ */
+static void *
+cache_lookup(struct cache_table *table, const char *key)
+{
+    if (table->slots == NULL)
+        return NULL;
+    return *cache_slot(table, key);
+}
+
+
+/*
+ * Store a struct in a cache table, freeing any previous struct with the same
+ * key.  The table is kept at most half full, growing it as needed.
+ */
+static void
+cache_store(struct cache_table *table, void *data)
+{
+    void **old, **slot;
+    size_t i, size;
+
+    if (table->count + 1 > table->size / 2) {
+        old = table->slots;
+        size = table->size;
+        table->size = (size == 0) ? 64 : size * 2;
+        table->slots = xcalloc(table->size, sizeof(void *));
+        for (i = 0; i < size; i++)
+            if (old[i] != NULL)
+                *cache_slot(table, table->key(old[i])) = old[i];
+        free(old);
+    }
+    slot = cache_slot(table, table->key(data));
+    if (*slot == NULL)
+        table->count++;
+    else
+        table->free(*slot);
+    *slot = data;
+}
+
+
+/*
+ * Free everything stored in a cache table and the table itself.
+ */
+static void
+cache_clear(struct cache_table *table)
+{
+    size_t i;
+
+    for (i = 0; i < table->size; i++)
+        if (table->slots[i] != NULL)
+            table->free(table->slots[i]);
+    free(table->slots);
+    table->slots = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+
+/*
+ * Process a request for including a file for configuration.  Called by
+ * read_conf_file.  ACL files handle includes with acl_check_file, which
+ * follows the same rules but caches what it reads.
  *
  * Takes the file to include, the current file, the line number, the function
  * to call for each included file, and a piece of data to pass to that
- * function.  Handles including either files or directories.  When used for
- * processing ACL files named in the configuration file, the current file and
- * line number will be passed as zero.
+ * function.  Handles including either files or directories.
  *
  * If the function returns a value less than -1, return its return code.  If
  * the file is recursively included or if there is an error in reading a file
@@ -230,6 +409,126 @@ convert_number(const char *string, long *result)
 }
 
 
+/*
+ * Parse the backend configuration option.  Verifies that the value is a
+ * number of processes, stores it in the configuration rule struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_backend(struct rule *rule, char *value, const char *name,
+               size_t lineno)
+{
+    if (!convert_number(value, &rule->backend)) {
+        warn("%s:%lu: invalid backend value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the backend-requests configuration option.  Verifies that the value
+ * is a number of requests, stores it in the configuration rule struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_backend_requests(struct rule *rule, char *value, const char *name,
+                        size_t lineno)
+{
+    if (!convert_number(value, &rule->backend_requests)) {
+        warn("%s:%lu: invalid backend-requests value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the cache configuration option.  Verifies that the value is a number
+ * of seconds, stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_cache(struct rule *rule, char *value, const char *name, size_t lineno)
+{
+    if (!convert_number(value, &rule->cache)) {
+        warn("%s:%lu: invalid cache value %s", name, (unsigned long) lineno,
+             value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the cache-key configuration option.  Verifies that the value is
+ * either "user" or "command", stores whether cached output is shared between
+ * users in the configuration rule struct, and returns CONFIG_SUCCESS on
+ * success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_cache_key(struct rule *rule, char *value, const char *name,
+                 size_t lineno)
+{
+    if (strcmp(value, "user") == 0)
+        rule->cache_shared = false;
+    else if (strcmp(value, "command") == 0)
+        rule->cache_shared = true;
+    else {
+        warn("%s:%lu: invalid cache-key value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the coalesce configuration option.  Verifies that the value is either
+ * "yes" or "no", stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_coalesce(struct rule *rule, char *value, const char *name,
+                size_t lineno)
+{
+    if (strcmp(value, "yes") == 0)
+        rule->coalesce = true;
+    else if (strcmp(value, "no") == 0)
+        rule->coalesce = false;
+    else {
+        warn("%s:%lu: invalid coalesce value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the compress configuration option.  Verifies that the value is either
+ * "yes" or "no", stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_compress(struct rule *rule, char *value, const char *name,
+                size_t lineno)
+{
+    if (strcmp(value, "yes") == 0)
+        rule->compress = true;
+    else if (strcmp(value, "no") == 0)
+        rule->compress = false;
+    else {
+        warn("%s:%lu: invalid compress value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * Parse the logmask configuration option.  Verifies the listed argument
  * numbers, stores them in the configuration rule struct, and returns
@@ -262,6 +561,87 @@ option_logmask(struct rule *rule, char *value, const char *name, size_t lineno)
 }
 
 
+/*
+ * Parse the output-batch configuration option.  Verifies that the value is a
+ * number of bytes, stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_output_batch(struct rule *rule, char *value, const char *name,
+                    size_t lineno)
+{
+    if (!convert_number(value, &rule->output_batch)
+        || rule->output_batch > TOKEN_MAX_OUTPUT) {
+        warn("%s:%lu: invalid output-batch value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the output-delay configuration option.  Verifies that the value is a
+ * number of milliseconds, stores it in the configuration rule struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_output_delay(struct rule *rule, char *value, const char *name,
+                    size_t lineno)
+{
+    if (!convert_number(value, &rule->output_delay)) {
+        warn("%s:%lu: invalid output-delay value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the remote-host configuration option.  Verifies that the value is
+ * either "yes" or "no", stores it in the configuration rule struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_remote_host(struct rule *rule, char *value, const char *name,
+                   size_t lineno)
+{
+    if (strcmp(value, "yes") == 0)
+        rule->no_hostname = false;
+    else if (strcmp(value, "no") == 0)
+        rule->no_hostname = true;
+    else {
+        warn("%s:%lu: invalid remote-host value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the integrity-only configuration option.  Verifies that the value is
+ * either "yes" or "no", stores it in the configuration rule struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_integrity_only(struct rule *rule, char *value, const char *name,
+                      size_t lineno)
+{
+    if (strcmp(value, "yes") == 0)
+        rule->integrity_only = true;
+    else if (strcmp(value, "no") == 0)
+        rule->integrity_only = false;
+    else {
+        warn("%s:%lu: invalid integrity-only value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * Parse the stdin configuration option.  Verifies the argument number or
  * "last" keyword, stores it in the configuration rule struct, and returns
@@ -356,13 +736,23 @@ option_help(struct rule *rule, char *value, const char *name UNUSED,
  * The table relating configuration option names to functions.
  */
 static const struct config_option options[] = {
-    { "help",    option_help    },
-    { "logmask", option_logmask },
-    { "stdin",   option_stdin   },
-    { "sudo",    option_sudo    },
-    { "summary", option_summary },
-    { "user",    option_user    },
-    { NULL,      NULL           }
+    { "backend",          option_backend          },
+    { "backend-requests", option_backend_requests },
+    { "cache",            option_cache            },
+    { "cache-key",        option_cache_key        },
+    { "coalesce",         option_coalesce         },
+    { "compress",         option_compress         },
+    { "help",             option_help             },
+    { "integrity-only",   option_integrity_only   },
+    { "logmask",          option_logmask          },
+    { "output-batch",     option_output_batch     },
+    { "output-delay",     option_output_delay     },
+    { "remote-host",      option_remote_host      },
+    { "stdin",            option_stdin            },
+    { "sudo",             option_sudo             },
+    { "summary",          option_summary          },
+    { "user",             option_user             },
+    { NULL,               NULL                    }
 };
 
 
@@ -582,119 +972,459 @@ fail:
 
 
 /*
- * Check to see if a principal is authorized by a given ACL file.
- *
- * This function is used to handle included ACL files and only does a simple
- * check to prevent infinite recursion, so be careful.  The first argument is
- * the user to check, which is passed in as a void * so that acl_check_file
- * and read_conf_file can share common include-handling code.
- *
- * Returns the result of the first check that returns a result other than
- * CONFIG_NOMATCH, or CONFIG_NOMATCH if no check returns some other value.
- * Also returns CONFIG_ERROR on some sort of failure (such as failure to read
- * a file or a syntax error).
+ * Return the key of a cached ACL file or directory, which is its path.
  */
-static enum config_status
-acl_check_file_internal(void *data, const char *aclfile)
+static const char *
+acl_cache_key(const void *data)
 {
-    const struct client *client = data;
-    FILE *file = NULL;
-    char buffer[BUFSIZ];
-    char *p;
-    int lineno;
-    enum config_status s;
-    size_t length;
-    struct vector *line = NULL;
-
-    file = fopen(aclfile, "r");
-    if (file == NULL) {
-        syswarn("cannot open ACL file %s", aclfile);
-        return CONFIG_ERROR;
-    }
-    lineno = 0;
-    while (fgets(buffer, sizeof(buffer), file) != NULL) {
-        lineno++;
-        length = strlen(buffer);
-        if (length >= sizeof(buffer) - 1) {
-            warn("%s:%d: ACL file line too long", aclfile, lineno);
-            goto fail;
-        }
-
-        /*
-         * Skip blank lines or commented-out lines and remove trailing
-         * whitespace.
-         */
-        p = buffer + length - 1;
-        while (p > buffer && isspace((int) *p))
-            p--;
-        p[1] = '\0';
-        p = buffer;
-        while (isspace((int) *p))
-            p++;
-        if (*p == '\0' || *p == '#')
-            continue;
-
-        /* Parse the line. */
-        if (strchr(p, ' ') == NULL)
-            s = acl_check(client, p, ACL_SCHEME_PRINC, aclfile, lineno);
-        else {
-            line = vector_split_space(buffer, NULL);
-            if (line->count == 2 && strcmp(line->strings[0], "include") == 0) {
-                s = acl_check(data, line->strings[1], ACL_SCHEME_FILE,
-                              aclfile, lineno);
-                vector_free(line);
-                line = NULL;
-            } else {
-                warn("%s:%d: parse error", aclfile, lineno);
-                goto fail;
-            }
-        }
-        if (s != CONFIG_NOMATCH) {
-            fclose(file);
-            return s;
-        }
-    }
-    fclose(file);
-    return CONFIG_NOMATCH;
+    const struct acl_cache *cache = data;
 
-fail:
-    vector_free(line);
-    if (file != NULL)
-        fclose(file);
-    return CONFIG_ERROR;
+    return cache->path;
 }
 
 
 /*
- * The ACL check operation for the file method.  Takes the user to check, the
- * ACL file or directory name, and the referencing file name and line number.
- *
- * Conceptually, this returns CONFIG_SUCCESS if the user is authorized,
- * CONFIG_NOMATCH if they aren't, CONFIG_ERROR on some sort of failure, and
- * CONFIG_DENY for an explicit deny.  What actually happens is the result of
- * the interplay between handle_include and acl_check_file_internal:
- *
- * - For each file, return the first result other than CONFIG_NOMATCH
- *   (indicating no match), or CONFIG_NOMATCH if there is no other result.
- *
- * - Return the first result from any file less than CONFIG_NOMATCH,
- *   indicating a failure or an explicit deny.
- *
- * - If there is no result less than CONFIG_NOMATCH, return the largest
- *   remaining result, which should be CONFIG_SUCCESS or CONFIG_NOMATCH.
+ * Free a cached ACL file or directory.
  */
-static enum config_status
-acl_check_file(const struct client *client, const char *aclfile,
-               const char *file, int lineno)
+static void
+acl_cache_free(void *data)
 {
-    return handle_include(aclfile, file, lineno, acl_check_file_internal,
-                          (void *) client);
+    struct acl_cache *cache = data;
+    size_t i;
+
+    for (i = 0; i < cache->count; i++)
+        free(cache->entries[i].data);
+    free(cache->entries);
+    for (i = 0; i < cache->princs_size; i++)
+        free(cache->princs[i].name);
+    free(cache->princs);
+    if (cache->files != NULL)
+        vector_free(cache->files);
+    free(cache->path);
+    free(cache);
 }
 
 
+/* The cache of compiled ACL files and directories, keyed by path. */
+static struct cache_table acl_files = {
+    NULL, 0, 0, acl_cache_key, acl_cache_free
+};
+
+
 /*
- * The ACL check operation for the princ method.  Takes the user to check, the
- * principal name we are checking against, and the referencing file name and
+ * Look up an ACL file or directory in the cache.  Returns the cached entry
+ * if it is still current, meaning that it is the same type of entry and the
+ * file hasn't changed according to the provided stat results, and NULL
+ * otherwise.
+ */
+static struct acl_cache *
+acl_cache_lookup(const char *path, const struct stat *st, bool directory)
+{
+    struct acl_cache *cache;
+
+    cache = cache_lookup(&acl_files, path);
+    if (cache == NULL || cache->directory != directory)
+        return NULL;
+    if (cache->dev != st->st_dev || cache->ino != st->st_ino)
+        return NULL;
+    if (cache->size != st->st_size || cache->mtime != st->st_mtime)
+        return NULL;
+    if (cache->mtime_nsec != ST_MTIME_NSEC(st))
+        return NULL;
+    if (cache->ctime != st->st_ctime || cache->ctime_nsec != ST_CTIME_NSEC(st))
+        return NULL;
+    return cache;
+}
+
+
+/*
+ * Allocate a new cache entry for the given path and stat results.
+ */
+static struct acl_cache *
+acl_cache_new(const char *path, const struct stat *st, bool directory)
+{
+    struct acl_cache *cache;
+
+    cache = xcalloc(1, sizeof(struct acl_cache));
+    cache->path = xstrdup(path);
+    cache->dev = st->st_dev;
+    cache->ino = st->st_ino;
+    cache->size = st->st_size;
+    cache->mtime = st->st_mtime;
+    cache->ctime = st->st_ctime;
+    cache->mtime_nsec = ST_MTIME_NSEC(st);
+    cache->ctime_nsec = ST_CTIME_NSEC(st);
+    cache->directory = directory;
+    return cache;
+}
+
+
+/*
+ * Add a principal to the hash set of principals in a compiled ACL file,
+ * unless it is already present, in which case only the position of the
+ * first occurrence matters.
+ */
+static void
+acl_princ_add(struct acl_cache *cache, const char *name, size_t position)
+{
+    struct acl_princ *old;
+    size_t i, size, slot, mask;
+
+    if (cache->princs_count + 1 > cache->princs_size / 2) {
+        old = cache->princs;
+        size = cache->princs_size;
+        cache->princs_size = (size == 0) ? 16 : size * 2;
+        cache->princs = xcalloc(cache->princs_size, sizeof(struct acl_princ));
+        cache->princs_count = 0;
+        for (i = 0; i < size; i++)
+            if (old[i].name != NULL) {
+                mask = cache->princs_size - 1;
+                slot = hash_string(HASH_INIT, old[i].name) & mask;
+                while (cache->princs[slot].name != NULL)
+                    slot = (slot + 1) & mask;
+                cache->princs[slot] = old[i];
+                cache->princs_count++;
+            }
+        free(old);
+    }
+    mask = cache->princs_size - 1;
+    slot = hash_string(HASH_INIT, name) & mask;
+    while (cache->princs[slot].name != NULL) {
+        if (strcmp(cache->princs[slot].name, name) == 0)
+            return;
+        slot = (slot + 1) & mask;
+    }
+    cache->princs[slot].name = xstrdup(name);
+    cache->princs[slot].position = position;
+    cache->princs_count++;
+}
+
+
+/*
+ * Look up a principal in the hash set of principals in a compiled ACL file.
+ * Returns the position of its first occurrence in the file, or SIZE_MAX if
+ * it is not present.
+ */
+static size_t
+acl_princ_find(const struct acl_cache *cache, const char *name)
+{
+    size_t slot, mask;
+
+    if (cache->princs_size == 0)
+        return SIZE_MAX;
+    mask = cache->princs_size - 1;
+    slot = hash_string(HASH_INIT, name) & mask;
+    while (cache->princs[slot].name != NULL) {
+        if (strcmp(cache->princs[slot].name, name) == 0)
+            return cache->princs[slot].position;
+        slot = (slot + 1) & mask;
+    }
+    return SIZE_MAX;
+}
+
+
+/*
+ * Add an entry other than a simple principal to a compiled ACL file.
+ */
+static void
+acl_entry_add(struct acl_cache *cache, enum acl_entry_type type, int lineno,
+              size_t position, const char *data)
+{
+    struct acl_entry *entry;
+
+    cache->entries = xreallocarray(cache->entries, cache->count + 1,
+                                   sizeof(struct acl_entry));
+    entry = &cache->entries[cache->count];
+    entry->type = type;
+    entry->lineno = lineno;
+    entry->position = position;
+    entry->data = (data == NULL) ? NULL : xstrdup(data);
+    cache->count++;
+}
+
+
+/*
+ * Return true if an ACL entry is a simple principal, meaning that it would be
+ * checked with a plain string comparison against the user.  These are the
+ * entries that can go into the hash set of principals.  Sets name to the
+ * principal.
+ */
+static bool
+acl_entry_is_princ(const char *entry, const char **name)
+{
+    if (strcmp(entry, "ANYUSER") == 0)
+        return false;
+    if (strncmp(entry, "princ:", strlen("princ:")) == 0) {
+        *name = entry + strlen("princ:");
+        return true;
+    }
+    if (strchr(entry, ':') != NULL)
+        return false;
+    *name = entry;
+    return true;
+}
+
+
+/*
+ * Read and compile an ACL file.  Takes the path and the results of stat on
+ * it.  Returns the new cache entry, or NULL if the file could not be opened.
+ *
+ * Each line of the file becomes an entry with the next position.  Simple
+ * principals go into a hash set and everything else, including includes and
+ * lines with syntax errors, goes into an ordered list of entries.  Since
+ * checking stops at the first line with a syntax error, so does compiling.
+ * The error is only reported when a check reaches that line.
+ */
+static struct acl_cache *
+acl_file_compile(const char *aclfile, const struct stat *st)
+{
+    struct acl_cache *cache;
+    FILE *file;
+    char buffer[BUFSIZ];
+    char *p;
+    const char *name;
+    int lineno;
+    size_t length;
+    size_t position = 0;
+    struct vector *line;
+
+    file = fopen(aclfile, "r");
+    if (file == NULL) {
+        syswarn("cannot open ACL file %s", aclfile);
+        return NULL;
+    }
+    cache = acl_cache_new(aclfile, st, false);
+    lineno = 0;
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        lineno++;
+        length = strlen(buffer);
+        if (length >= sizeof(buffer) - 1) {
+            acl_entry_add(cache, ACL_ENTRY_TOOLONG, lineno, position, NULL);
+            break;
+        }
+
+        /*
+         * Skip blank lines or commented-out lines and remove trailing
+         * whitespace.
+         */
+        p = buffer + length - 1;
+        while (p > buffer && isspace((int) *p))
+            p--;
+        p[1] = '\0';
+        p = buffer;
+        while (isspace((int) *p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        /* Parse the line. */
+        if (strchr(p, ' ') == NULL) {
+            if (acl_entry_is_princ(p, &name))
+                acl_princ_add(cache, name, position);
+            else
+                acl_entry_add(cache, ACL_ENTRY_CHECK, lineno, position, p);
+        } else {
+            line = vector_split_space(buffer, NULL);
+            if (line->count == 2 && strcmp(line->strings[0], "include") == 0)
+                acl_entry_add(cache, ACL_ENTRY_INCLUDE, lineno, position,
+                              line->strings[1]);
+            else
+                acl_entry_add(cache, ACL_ENTRY_PARSE, lineno, position, NULL);
+            vector_free(line);
+            if (cache->entries[cache->count - 1].type == ACL_ENTRY_PARSE)
+                break;
+        }
+        position++;
+    }
+    fclose(file);
+    return cache;
+}
+
+
+/*
+ * Read the list of files in an ACL directory.  Takes the path, the results
+ * of stat on it, and the referencing file name and line number for error
+ * reporting.  Returns the new cache entry, or NULL if the directory could not
+ * be opened.
+ */
+static struct acl_cache *
+acl_dir_compile(const char *dirname, const struct stat *st, const char *file,
+                int lineno)
+{
+    struct acl_cache *cache;
+    DIR *dir;
+    struct dirent *entry;
+    char *path;
+
+    dir = opendir(dirname);
+    if (dir == NULL) {
+        syswarn("%s:%d: included directory %s cannot be opened", file,
+                lineno, dirname);
+        return NULL;
+    }
+    cache = acl_cache_new(dirname, st, true);
+    cache->files = vector_new();
+    while ((entry = readdir(dir)) != NULL) {
+        if (!valid_filename(entry->d_name))
+            continue;
+        xasprintf(&path, "%s/%s", dirname, entry->d_name);
+        vector_add(cache->files, path);
+        free(path);
+    }
+    closedir(dir);
+    return cache;
+}
+
+
+/*
+ * Check to see if a principal is authorized by a given ACL file.  Takes the
+ * client, the ACL file, and the results of stat on the file, or NULL if the
+ * file hasn't been checked with stat yet.
+ *
+ * The compiled version of the file is used if it's cached and the file hasn't
+ * changed since; otherwise, the file is read and compiled again.  Then, the
+ * entries are checked as if the file were checked line by line.  All simple
+ * principal entries before the first one matching the user can't match, so
+ * only the other entries before that point have to be checked.
+ *
+ * Returns the result of the first check that returns a result other than
+ * CONFIG_NOMATCH, or CONFIG_NOMATCH if no check returns some other value.
+ * Also returns CONFIG_ERROR on some sort of failure (such as failure to read
+ * a file or a syntax error).
+ */
+static enum config_status
+acl_check_file_internal(const struct client *client, const char *aclfile,
+                        const struct stat *st)
+{
+    struct acl_cache *cache;
+    struct acl_entry *entry;
+    struct stat sbuf;
+    size_t i, match;
+    enum config_status s;
+
+    /* Find or compile the ACL file. */
+    if (st == NULL) {
+        if (stat(aclfile, &sbuf) < 0) {
+            syswarn("cannot open ACL file %s", aclfile);
+            return CONFIG_ERROR;
+        }
+        st = &sbuf;
+    }
+    cache = acl_cache_lookup(aclfile, st, false);
+    if (cache == NULL) {
+        cache = acl_file_compile(aclfile, st);
+        if (cache == NULL)
+            return CONFIG_ERROR;
+        cache_store(&acl_files, cache);
+    }
+
+    /* Check the entries before the first principal match, if any. */
+    match = acl_princ_find(cache, client->user);
+    for (i = 0; i < cache->count; i++) {
+        entry = &cache->entries[i];
+        if (entry->position > match)
+            break;
+        switch (entry->type) {
+        case ACL_ENTRY_CHECK:
+            s = acl_check(client, entry->data, ACL_SCHEME_PRINC, aclfile,
+                          entry->lineno);
+            break;
+        case ACL_ENTRY_INCLUDE:
+            s = acl_check(client, entry->data, ACL_SCHEME_FILE, aclfile,
+                          entry->lineno);
+            break;
+        case ACL_ENTRY_TOOLONG:
+            warn("%s:%d: ACL file line too long", aclfile, entry->lineno);
+            return CONFIG_ERROR;
+        case ACL_ENTRY_PARSE:
+        default:
+            warn("%s:%d: parse error", aclfile, entry->lineno);
+            return CONFIG_ERROR;
+        }
+        if (s != CONFIG_NOMATCH)
+            return s;
+
+        /*
+         * If this file changed while we were checking an include, the
+         * include may have read it again and freed our copy.  If so, start
+         * over with the new version.
+         */
+        if (cache != acl_cache_lookup(aclfile, st, false))
+            return acl_check_file_internal(client, aclfile, NULL);
+    }
+    return (match == SIZE_MAX) ? CONFIG_NOMATCH : CONFIG_SUCCESS;
+}
+
+
+/*
+ * The ACL check operation for the file method.  Takes the user to check, the
+ * ACL file or directory name, and the referencing file name and line number.
+ *
+ * Conceptually, this returns CONFIG_SUCCESS if the user is authorized,
+ * CONFIG_NOMATCH if they aren't, CONFIG_ERROR on some sort of failure, and
+ * CONFIG_DENY for an explicit deny.  What actually happens follows the same
+ * rules as handle_include:
+ *
+ * - For each file, return the first result other than CONFIG_NOMATCH
+ *   (indicating no match), or CONFIG_NOMATCH if there is no other result.
+ *
+ * - Return the first result from any file less than CONFIG_NOMATCH,
+ *   indicating a failure or an explicit deny.
+ *
+ * - If there is no result less than CONFIG_NOMATCH, return the largest
+ *   remaining result, which should be CONFIG_SUCCESS or CONFIG_NOMATCH.
+ *
+ * The list of files in a directory is cached like the contents of files and
+ * only read again when the directory changes.
+ */
+static enum config_status
+acl_check_file(const struct client *client, const char *aclfile,
+               const char *file, int lineno)
+{
+    struct acl_cache *cache;
+    struct stat st;
+    size_t i;
+    enum config_status s;
+    enum config_status status = CONFIG_NOMATCH;
+
+    /* Sanity checking. */
+    if (strcmp(aclfile, file) == 0) {
+        warn("%s:%d: %s recursively included", file, lineno, file);
+        return CONFIG_ERROR;
+    }
+    if (stat(aclfile, &st) < 0) {
+        syswarn("%s:%d: included file %s not found", file, lineno, aclfile);
+        return CONFIG_ERROR;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return acl_check_file_internal(client, aclfile, &st);
+
+    /* Find or read the directory and then check each file. */
+    cache = acl_cache_lookup(aclfile, &st, true);
+    if (cache == NULL) {
+        cache = acl_dir_compile(aclfile, &st, file, lineno);
+        if (cache == NULL)
+            return CONFIG_ERROR;
+        cache_store(&acl_files, cache);
+    }
+    for (i = 0; i < cache->files->count; i++) {
+        s = acl_check_file_internal(client, cache->files->strings[i], NULL);
+        if (s < CONFIG_NOMATCH)
+            return s;
+        if (s > status)
+            status = s;
+
+        /* As in acl_check_file_internal, start over if we were replaced. */
+        if (cache != acl_cache_lookup(aclfile, &st, true))
+            return acl_check_file(client, aclfile, file, lineno);
+    }
+    return status;
+}
+
+
+/*
+ * The ACL check operation for the princ method.  Takes the user to check, the
+ * principal name we are checking against, and the referencing file name and
  * line number.
  *
  * Returns CONFIG_SUCCESS if the user is authorized, or CONFIG_NOMATCH if they
@@ -855,30 +1585,96 @@ acl_check_gput(const struct client *client, const char *data,
 #endif /* HAVE_GPUT */
 
 
+#ifdef HAVE_PCRE
+
+/* Versions of PCRE older than 8.20 have no JIT compiler. */
+# ifndef PCRE_STUDY_JIT_COMPILE
+#  define PCRE_STUDY_JIT_COMPILE 0
+# endif
+
+/* A compiled PCRE regular expression, keyed by its source. */
+struct acl_pcre {
+    char *pattern;
+    pcre *code;
+    pcre_extra *extra;          /* Study data, including JIT code, or NULL. */
+};
+
+/*
+ * Return the key of a compiled PCRE regular expression.
+ */
+static const char *
+acl_pcre_key(const void *data)
+{
+    const struct acl_pcre *regex = data;
+
+    return regex->pattern;
+}
+
+
+/*
+ * Free a compiled PCRE regular expression.
+ */
+static void
+acl_pcre_free(void *data)
+{
+    struct acl_pcre *regex = data;
+
+    if (regex->extra != NULL) {
+# ifdef PCRE_CONFIG_JIT
+        pcre_free_study(regex->extra);
+# else
+        pcre_free(regex->extra);
+# endif
+    }
+    pcre_free(regex->code);
+    free(regex->pattern);
+    free(regex);
+}
+
+
+/* The cache of compiled PCRE regular expressions. */
+static struct cache_table acl_pcres = {
+    NULL, 0, 0, acl_pcre_key, acl_pcre_free
+};
+
+
 /*
  * The ACL check operation for PCRE matches.  Takes the user to check, the
  * regular expression, and the referencing file name and line number.  This
  * can be used to do things like allow only host principals and deny everyone
  * else.
+ *
+ * Each regular expression is compiled and studied, using the JIT compiler if
+ * PCRE supports it, the first time that it's used and then cached for the
+ * life of the configuration.  Expressions that fail to compile are not
+ * cached, so they are reported each time.
  */
-#ifdef HAVE_PCRE
 static enum config_status
 acl_check_pcre(const struct client *client, const char *data,
                const char *file, int lineno)
 {
-    pcre *regex;
+    struct acl_pcre *regex;
+    pcre *code;
     const char *error;
     const char *user = client->user;
     int offset, status;
 
-    regex = pcre_compile(data, PCRE_NO_AUTO_CAPTURE, &error, &offset, NULL);
+    regex = cache_lookup(&acl_pcres, data);
     if (regex == NULL) {
-        warn("%s:%d: compilation of regex '%s' failed around %d", file,
-             lineno, data, offset);
-        return CONFIG_ERROR;
+        code = pcre_compile(data, PCRE_NO_AUTO_CAPTURE, &error, &offset, NULL);
+        if (code == NULL) {
+            warn("%s:%d: compilation of regex '%s' failed around %d", file,
+                 lineno, data, offset);
+            return CONFIG_ERROR;
+        }
+        regex = xcalloc(1, sizeof(struct acl_pcre));
+        regex->pattern = xstrdup(data);
+        regex->code = code;
+        regex->extra = pcre_study(code, PCRE_STUDY_JIT_COMPILE, &error);
+        cache_store(&acl_pcres, regex);
     }
-    status = pcre_exec(regex, NULL, user, strlen(user), 0, 0, NULL, 0);
-    pcre_free(regex);
+    status = pcre_exec(regex->code, regex->extra, user, strlen(user), 0, 0,
+                       NULL, 0);
     switch (status) {
     case 0:
         return CONFIG_SUCCESS;
@@ -890,94 +1686,297 @@ acl_check_pcre(const struct client *client, const char *data,
         return CONFIG_ERROR;
     }
 }
+
 #endif /* HAVE_PCRE */
 
 
+#ifdef HAVE_REGCOMP
+
+/* A compiled POSIX regular expression, keyed by its source. */
+struct acl_regex {
+    char *pattern;
+    regex_t regex;
+};
+
+/*
+ * Return the key of a compiled POSIX regular expression.
+ */
+static const char *
+acl_regex_key(const void *data)
+{
+    const struct acl_regex *regex = data;
+
+    return regex->pattern;
+}
+
+
+/*
+ * Free a compiled POSIX regular expression.
+ */
+static void
+acl_regex_free(void *data)
+{
+    struct acl_regex *regex = data;
+
+    regfree(&regex->regex);
+    free(regex->pattern);
+    free(regex);
+}
+
+
+/* The cache of compiled POSIX regular expressions. */
+static struct cache_table acl_regexes = {
+    NULL, 0, 0, acl_regex_key, acl_regex_free
+};
+
+
 /*
  * The ACL check operation for POSIX regex matches.  Takes the user to check,
  * the regular expression, and the referencing file name and line number.
  * This can be used to do things like allow only host principals and deny
  * everyone else.
+ *
+ * As with PCRE, each regular expression is compiled the first time that it's
+ * used and then cached.
  */
-#ifdef HAVE_REGCOMP
 static enum config_status
 acl_check_regex(const struct client *client, const char *data,
                 const char *file, int lineno)
 {
-    regex_t regex;
+    struct acl_regex *regex;
     char error[BUFSIZ];
     int status;
-    enum config_status result;
 
-    memset(&regex, 0, sizeof(regex));
-    status = regcomp(&regex, data, REG_EXTENDED | REG_NOSUB);
-    if (status != 0) {
-        regerror(status, &regex, error, sizeof(error));
-        warn("%s:%d: compilation of regex '%s' failed: %s", file, lineno,
-             data, error);
-        return CONFIG_ERROR;
+    regex = cache_lookup(&acl_regexes, data);
+    if (regex == NULL) {
+        regex = xcalloc(1, sizeof(struct acl_regex));
+        status = regcomp(&regex->regex, data, REG_EXTENDED | REG_NOSUB);
+        if (status != 0) {
+            regerror(status, &regex->regex, error, sizeof(error));
+            warn("%s:%d: compilation of regex '%s' failed: %s", file, lineno,
+                 data, error);
+            free(regex);
+            return CONFIG_ERROR;
+        }
+        regex->pattern = xstrdup(data);
+        cache_store(&acl_regexes, regex);
     }
-    status = regexec(&regex, client->user, 0, NULL, 0);
+    status = regexec(&regex->regex, client->user, 0, NULL, 0);
     switch (status) {
     case 0:
-        result = CONFIG_SUCCESS;
-        break;
+        return CONFIG_SUCCESS;
     case REG_NOMATCH:
-        result = CONFIG_NOMATCH;
-        break;
+        return CONFIG_NOMATCH;
     default:
-        regerror(status, &regex, error, sizeof(error));
+        regerror(status, &regex->regex, error, sizeof(error));
         warn("%s:%d: matching with regex '%s' failed: %s", file, lineno,
              data, error);
-        result = CONFIG_ERROR;
-        break;
+        return CONFIG_ERROR;
     }
-    regfree(&regex);
-    return result;
 }
+
 #endif /* HAVE_REGCOMP */
 
 
 #if defined(HAVE_KRB5) && defined(HAVE_GETGRNAM_R)
 
 /*
- * Convert the user (a Kerberos principal name) to a local username for group
- * lookups.  Returns true on success and false on an error other than there
- * being no local equivalent of the Kerberos principal.  Stores the local
- * equivalent username, or NULL if there is none, in the localname parameter.
+ * The number of principals or groups after which the localgroup caches are
+ * emptied and started over, so that a long-running process seeing many
+ * different users doesn't grow without bound.
+ */
+#define LOCALGROUP_CACHE_MAX 4096
+
+/* The cached local account for a principal. */
+struct acl_localname {
+    char *user;                 /* The principal, used as the key. */
+    char *localname;            /* Local username, or NULL if none. */
+    bool found;                 /* Whether the local user exists. */
+    gid_t gid;                  /* Primary group of the local user. */
+    time_t expires;             /* When to look the principal up again. */
+};
+
+/* The cached membership of a local group. */
+struct acl_group {
+    char *name;                 /* The group name, used as the key. */
+    bool found;                 /* Whether the group exists. */
+    gid_t gid;                  /* GID of the group. */
+    struct vector *members;     /* Sorted list of the group members. */
+    time_t expires;             /* When to look the group up again. */
+};
+
+/*
+ * How long to cache successful and unsuccessful localgroup lookups, in
+ * seconds, set with server_config_set_localgroup_ttl.  The default of 0
+ * disables caching.  Lookups that fail with an error are never cached.
+ */
+static time_t localgroup_ttl = 0;
+static time_t localgroup_negative_ttl = 0;
+
+/*
+ * The Kerberos context used to convert principals to local names, created the
+ * first time it's needed and kept until the configuration is freed.
+ */
+static krb5_context localgroup_ctx = NULL;
+
+
+/*
+ * Return the key of a cached local account, which is the principal.
+ */
+static const char *
+acl_localname_key(const void *data)
+{
+    const struct acl_localname *entry = data;
+
+    return entry->user;
+}
+
+
+/*
+ * Free a cached local account.
+ */
+static void
+acl_localname_free(void *data)
+{
+    struct acl_localname *entry = data;
+
+    free(entry->user);
+    free(entry->localname);
+    free(entry);
+}
+
+
+/*
+ * Return the key of a cached local group, which is the group name.
+ */
+static const char *
+acl_group_key(const void *data)
+{
+    const struct acl_group *entry = data;
+
+    return entry->name;
+}
+
+
+/*
+ * Free a cached local group.
+ */
+static void
+acl_group_free(void *data)
+{
+    struct acl_group *entry = data;
+
+    vector_free(entry->members);
+    free(entry->name);
+    free(entry);
+}
+
+
+/* The caches of local accounts for principals and of group memberships. */
+static struct cache_table acl_localnames = {
+    NULL, 0, 0, acl_localname_key, acl_localname_free
+};
+static struct cache_table acl_groups = {
+    NULL, 0, 0, acl_group_key, acl_group_free
+};
+
+
+/*
+ * Compare two strings given pointers to them, for qsort and bsearch.
+ */
+static int
+compare_strings(const void *a, const void *b)
+{
+    const char *const *first = a;
+    const char *const *second = b;
+
+    return strcmp(*first, *second);
+}
+
+
+/*
+ * Cache the result of a localgroup lookup for the given number of seconds.
+ * Returns true if it was cached, in which case the cache now owns it, and
+ * false if the caller is still responsible for freeing it.
  */
 static bool
-user_to_localname(const char *user, char **localname)
+localgroup_store(struct cache_table *table, void *data, time_t ttl)
+{
+    if (ttl <= 0)
+        return false;
+    if (table->count >= LOCALGROUP_CACHE_MAX)
+        cache_clear(table);
+    cache_store(table, data);
+    return true;
+}
+
+
+/*
+ * Free the localgroup caches and the Kerberos context.
+ */
+static void
+localgroup_clear(void)
 {
-    krb5_context ctx = NULL;
+    cache_clear(&acl_localnames);
+    cache_clear(&acl_groups);
+    if (localgroup_ctx != NULL) {
+        krb5_free_context(localgroup_ctx);
+        localgroup_ctx = NULL;
+    }
+}
+
+
+/*
+ * Convert the user (a Kerberos principal name) to a local user for group
+ * lookups.  Returns a struct holding the local username, or NULL if there is
+ * no local equivalent of the Kerberos principal, and the primary group of
+ * that local user if it exists.  Returns NULL on an error other than there
+ * being no local equivalent of the principal or no such local user.  Sets
+ * cached to true if the result is owned by the cache and false if the caller
+ * must free it with acl_localname_free.
+ */
+static struct acl_localname *
+user_to_localname(const char *user, bool *cached)
+{
+    struct acl_localname *entry;
     krb5_error_code code;
     krb5_principal princ = NULL;
+    struct passwd *pw;
     char buffer[BUFSIZ];
+    char *localname = NULL;
+    time_t now, ttl;
+
+    /* Use the cached result if it hasn't expired. */
+    now = time(NULL);
+    entry = cache_lookup(&acl_localnames, user);
+    if (entry != NULL && entry->expires > now) {
+        *cached = true;
+        return entry;
+    }
 
-    /* Initialize the result. */
-    *localname = NULL;
-
-    /*
-     * Unfortunately, we don't keep a Kerberos context around and have to
-     * create a new one with each invocation.
-     */
-    code = krb5_init_context(&ctx);
-    if (code != 0) {
-        warn_krb5(ctx, code, "cannot create Kerberos context");
-        return false;
+    /* Create the Kerberos context if we don't have one already. */
+    if (localgroup_ctx == NULL) {
+        code = krb5_init_context(&localgroup_ctx);
+        if (code != 0) {
+            warn_krb5(localgroup_ctx, code, "cannot create Kerberos context");
+            localgroup_ctx = NULL;
+            return NULL;
+        }
     }
 
     /* Convert the user to a principal and find the local name. */
-    code = krb5_parse_name(ctx, user, &princ);
+    code = krb5_parse_name(localgroup_ctx, user, &princ);
     if (code != 0) {
-        warn_krb5(ctx, code, "cannot parse principal %s", user);
-        goto fail;
+        warn_krb5(localgroup_ctx, code, "cannot parse principal %s", user);
+        return NULL;
     }
-    code = krb5_aname_to_localname(ctx, princ, sizeof(buffer), buffer);
+    code = krb5_aname_to_localname(localgroup_ctx, princ, sizeof(buffer),
+                                   buffer);
+    krb5_free_principal(localgroup_ctx, princ);
 
     /*
      * Distinguish between no result with no error, a result (where we want to
-     * make a copy), and an error.  Then free memory and return.
+     * make a copy), and an error.
      */
     switch (code) {
     case KRB5_LNAME_NOTRANS:
@@ -985,21 +1984,31 @@ user_to_localname(const char *user, char **localname)
         /* No result.  Do nothing. */
         break;
     case 0:
-        *localname = xstrdup(buffer);
+        localname = xstrdup(buffer);
         break;
     default:
-        warn_krb5(ctx, code, "conversion of %s to local name failed", user);
-        goto fail;
+        warn_krb5(localgroup_ctx, code, "conversion of %s to local name failed",
+                  user);
+        return NULL;
     }
-    krb5_free_principal(ctx, princ);
-    krb5_free_context(ctx);
-    return true;
 
-fail:
-    if (princ != NULL)
-        krb5_free_principal(ctx, princ);
-    krb5_free_context(ctx);
-    return false;
+    /* Look up the local user, if any, to get its primary group. */
+    entry = xcalloc(1, sizeof(struct acl_localname));
+    entry->user = xstrdup(user);
+    entry->localname = localname;
+    if (localname != NULL) {
+        pw = getpwnam(localname);
+        if (pw != NULL) {
+            entry->found = true;
+            entry->gid = pw->pw_gid;
+        }
+    }
+
+    /* Cache the result if configured to do so. */
+    ttl = entry->found ? localgroup_ttl : localgroup_negative_ttl;
+    entry->expires = now + ttl;
+    *cached = localgroup_store(&acl_localnames, entry, ttl);
+    return entry;
 }
 
 
@@ -1069,6 +2078,60 @@ fail:
 }
 
 
+/*
+ * Find the GID and members of a group, using the cached result if it hasn't
+ * expired.  Returns CONFIG_SUCCESS or CONFIG_ERROR with errno set, like
+ * acl_getgrnam.  On success, stores the group information in result, with
+ * found set to false if there is no such group, and sets cached to true if
+ * the result is owned by the cache and false if the caller must free it with
+ * acl_group_free.
+ */
+static enum config_status
+acl_lookup_group(const char *group, struct acl_group **result, bool *cached)
+{
+    struct acl_group *entry;
+    struct group *gr;
+    char *buffer;
+    size_t i;
+    enum config_status status;
+    time_t now, ttl;
+
+    /* Use the cached result if it hasn't expired. */
+    now = time(NULL);
+    entry = cache_lookup(&acl_groups, group);
+    if (entry != NULL && entry->expires > now) {
+        *result = entry;
+        *cached = true;
+        return CONFIG_SUCCESS;
+    }
+
+    /* Look up the group and store its sorted members. */
+    status = acl_getgrnam(group, &gr, &buffer);
+    if (status != CONFIG_SUCCESS)
+        return status;
+    entry = xcalloc(1, sizeof(struct acl_group));
+    entry->name = xstrdup(group);
+    entry->members = vector_new();
+    if (gr != NULL) {
+        entry->found = true;
+        entry->gid = gr->gr_gid;
+        for (i = 0; gr->gr_mem[i] != NULL; i++)
+            vector_add(entry->members, gr->gr_mem[i]);
+        qsort(entry->members->strings, entry->members->count,
+              sizeof(char *), compare_strings);
+        free(gr);
+        free(buffer);
+    }
+
+    /* Cache the result if configured to do so. */
+    ttl = entry->found ? localgroup_ttl : localgroup_negative_ttl;
+    entry->expires = now + ttl;
+    *result = entry;
+    *cached = localgroup_store(&acl_groups, entry, ttl);
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * The ACL check operation for UNIX local group membership.  Takes the user to
  * check, the group of which they have to be a member, and the referencing
@@ -1078,67 +2141,86 @@ static enum config_status
 acl_check_localgroup(const struct client *client, const char *group,
                      const char *file, int lineno)
 {
-    struct passwd *pw;
-    struct group *gr = NULL;
-    char *grbuffer = NULL;
-    size_t i;
-    char *localname = NULL;
+    struct acl_group *gr;
+    struct acl_localname *local = NULL;
+    bool gr_cached;
+    bool local_cached = false;
     enum config_status result;
 
     /* Look up the group membership. */
-    result = acl_getgrnam(group, &gr, &grbuffer);
+    result = acl_lookup_group(group, &gr, &gr_cached);
     if (result != CONFIG_SUCCESS) {
         syswarn("%s:%d: retrieving membership of localgroup %s failed", file,
                 lineno, group);
         return result;
     }
-    if (gr == NULL)
-        return CONFIG_NOMATCH;
+    if (!gr->found) {
+        result = CONFIG_NOMATCH;
+        goto done;
+    }
 
     /*
-     * Convert the principal to a local name.  Return no match if it doesn't
-     * convert.
+     * Convert the principal to a local user.  Return no match if it doesn't
+     * convert or if the local user doesn't exist.
      */
-    if (!user_to_localname(client->user, &localname)) {
+    local = user_to_localname(client->user, &local_cached);
+    if (local == NULL) {
         result = CONFIG_ERROR;
         goto done;
     }
-    if (localname == NULL) {
+    if (!local->found) {
         result = CONFIG_NOMATCH;
         goto done;
     }
 
-    /* Look up the local user.  If they don't exist, return no match. */
-    pw = getpwnam(localname);
-    if (pw == NULL) {
-        result = CONFIG_NOMATCH;
-        goto done;
-    }
-
-    /* Check if the user's primary group is the desired group. */
-    if (gr->gr_gid == pw->pw_gid) {
+    /*
+     * Check if the user's primary group is the desired group, and otherwise
+     * if the user is one of the other group members.
+     */
+    if (gr->gid == local->gid)
         result = CONFIG_SUCCESS;
-        goto done;
-    }
-
-    /* Otherwise, check if the user is one of the other group members. */
-    result = CONFIG_NOMATCH;
-    for (i = 0; gr->gr_mem[i] != NULL; i++)
-        if (strcmp(localname, gr->gr_mem[i]) == 0) {
-            result = CONFIG_SUCCESS;
-            break;
-        }
+    else if (bsearch(&local->localname, gr->members->strings,
+                     gr->members->count, sizeof(char *), compare_strings)
+             != NULL)
+        result = CONFIG_SUCCESS;
+    else
+        result = CONFIG_NOMATCH;
 
 done:
-    free(gr);
-    free(grbuffer);
-    free(localname);
+    if (!gr_cached)
+        acl_group_free(gr);
+    if (local != NULL && !local_cached)
+        acl_localname_free(local);
     return result;
 }
 
 #endif /* HAVE_KRB5 && HAVE_GETGRNAM_R */
 
 
+/*
+ * Sets how long to cache the results of localgroup lookups, in seconds, for
+ * lookups that found the user or group and for those that didn't.  0 disables
+ * caching.  Any results already cached are discarded.
+ */
+#if defined(HAVE_KRB5) && defined(HAVE_GETGRNAM_R)
+void
+server_config_set_localgroup_ttl(time_t ttl, time_t negative_ttl)
+{
+    localgroup_ttl = ttl;
+    localgroup_negative_ttl = negative_ttl;
+    cache_clear(&acl_localnames);
+    cache_clear(&acl_groups);
+}
+#else
+void
+server_config_set_localgroup_ttl(time_t ttl UNUSED,
+                                 time_t negative_ttl UNUSED)
+{
+    return;
+}
+#endif
+
+
 /*
  * The table relating ACL scheme names to functions.  The first two ACL
  * schemes must remain in their current slots or the index constants set at
@@ -1221,6 +2303,80 @@ acl_check(const struct client *client, const char *entry, int def_index,
 }
 
 
+/*
+ * Hash a command and subcommand for the rule index.  This is the 32-bit
+ * FNV-1a hash of the command, a nul, and the subcommand.
+ */
+static size_t
+hash_rule_key(const char *command, const char *subcommand)
+{
+    unsigned long hash;
+
+    hash = hash_string(HASH_INIT, command);
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+    return hash_string(hash, subcommand);
+}
+
+
+/*
+ * Build the index used to find the rule for a command.  The index is a hash
+ * table with open addressing, keyed on the literal command and subcommand of
+ * the rule (so ALL and EMPTY are keys like any other), that stores the
+ * position in the rules array plus one of the first rule with that key.
+ * Later rules with the same key can never match first, so they're left out.
+ */
+static void
+index_rules(struct config *config)
+{
+    size_t i, slot, mask;
+    struct rule *rule, *other;
+
+    config->index_size = 16;
+    while (config->index_size < config->count * 2)
+        config->index_size *= 2;
+    config->index = xcalloc(config->index_size, sizeof(size_t));
+    mask = config->index_size - 1;
+    for (i = 0; i < config->count; i++) {
+        rule = config->rules[i];
+        slot = hash_rule_key(rule->command, rule->subcommand) & mask;
+        while (config->index[slot] != 0) {
+            other = config->rules[config->index[slot] - 1];
+            if (strcmp(rule->command, other->command) == 0
+                && strcmp(rule->subcommand, other->subcommand) == 0)
+                break;
+            slot = (slot + 1) & mask;
+        }
+        if (config->index[slot] == 0)
+            config->index[slot] = i + 1;
+    }
+}
+
+
+/*
+ * Look up a literal command and subcommand in the rule index.  Returns the
+ * position in the rules array plus one of the first rule with that command
+ * and subcommand, or 0 if there is none.
+ */
+static size_t
+index_lookup(const struct config *config, const char *command,
+             const char *subcommand)
+{
+    size_t slot, mask;
+    struct rule *rule;
+
+    mask = config->index_size - 1;
+    slot = hash_rule_key(command, subcommand) & mask;
+    while (config->index[slot] != 0) {
+        rule = config->rules[config->index[slot] - 1];
+        if (strcmp(rule->command, command) == 0
+            && strcmp(rule->subcommand, subcommand) == 0)
+            return config->index[slot];
+        slot = (slot + 1) & mask;
+    }
+    return 0;
+}
+
+
 /*
  * Load a configuration file.  Returns a newly allocated config struct if
  * successful or NULL on failure, logging an appropriate error message.
@@ -1236,6 +2392,7 @@ server_config_load(const char *file)
         server_config_free(config);
         return NULL;
     }
+    index_rules(config);
     return config;
 }
 
@@ -1259,7 +2416,56 @@ server_config_free(struct config *config)
         free(rule);
     }
     free(config->rules);
+    free(config->index);
     free(config);
+
+    /*
+     * Clear the caches of compiled ACL files and patterns and of localgroup
+     * lookups.  Freeing a configuration is a natural point at which to start
+     * over, and this lets valgrind see that nothing leaked.
+     */
+    cache_clear(&acl_files);
+#ifdef HAVE_PCRE
+    cache_clear(&acl_pcres);
+#endif
+#ifdef HAVE_REGCOMP
+    cache_clear(&acl_regexes);
+#endif
+#if defined(HAVE_KRB5) && defined(HAVE_GETGRNAM_R)
+    localgroup_clear();
+#endif
+}
+
+
+/*
+ * Look up the matching configuration rule for a command and subcommand.
+ * Either may be NULL if not given.  Returns the first matching rule in the
+ * configuration or NULL if none match.
+ *
+ * A rule matches if its command is ALL, is the same as the command, or is
+ * EMPTY and no command was given, and likewise for the subcommand.  Rather
+ * than checking every rule, look up each combination of keys that could
+ * match in the index and take the earliest rule found.
+ */
+struct rule *
+server_config_find_rule(const struct config *config, const char *command,
+                        const char *subcommand)
+{
+    const char *commands[2], *subcommands[2];
+    size_t i, j, position;
+    size_t best = 0;
+
+    commands[0] = (command == NULL) ? "EMPTY" : command;
+    commands[1] = "ALL";
+    subcommands[0] = (subcommand == NULL) ? "EMPTY" : subcommand;
+    subcommands[1] = "ALL";
+    for (i = 0; i < ARRAY_SIZE(commands); i++)
+        for (j = 0; j < ARRAY_SIZE(subcommands); j++) {
+            position = index_lookup(config, commands[i], subcommands[j]);
+            if (position != 0 && (best == 0 || position < best))
+                best = position;
+        }
+    return (best == 0) ? NULL : config->rules[best - 1];
 }
 
 
@@ -0,0 +1,615 @@
+/*
+ * Event engine for pool workers that handle many connections at once.
+ *
+ * Normally each remctld process handles a single connection at a time,
+ * blocking while it waits for the client to finish establishing the GSS-API
+ * context or to send its next command.  With the worker-connections tunable,
+ * each pool worker instead keeps up to that many connections in one libevent
+ * loop, so a handful of workers, usually one per CPU, can negotiate with many
+ * clients and hold many idle keep-alive connections at once.
+ *
+ * Each worker is a separate process with its own libevent loop, rather than
+ * one of several threads in a single process.  The pool already runs as many
+ * workers as it's told to, so several workers give the same use of multiple
+ * CPUs, and keeping them in separate processes means that the GSS-API
+ * library, the caches, the logging code, and the forking of commands don't
+ * have to be safe to use from several threads at once.
+ *
+ * Data from each client is read into its token buffer as it arrives, and only
+ * once a complete token is buffered is it passed to the protocol code in
+ * generic.c (while establishing the context) or server-v2.c (afterwards), so
+ * none of those steps wait for the client.  Context tokens are handled as
+ * soon as they arrive, but a connection with a complete message is set aside
+ * until the worker calls server_engine_run, since handling a message may run
+ * a command, which can't be done from inside the event loop.
+ *
+ * Commands run in their own processes in the same event loop as the
+ * connections.  server_engine_run only starts the process for a command (see
+ * server_run_command), with its own bufferevents for its output and its own
+ * SIGCHLD event, so any number of connections can have a command running at
+ * once.  The connection isn't watched while its command runs, and once the
+ * command has exited, server_engine_run sends the rest of its output and its
+ * exit status and carries on with the connection.  If command limits are
+ * set, though, each worker runs one command at a time, since its slot in the
+ * scoreboard of the limits only records one, and messages from other
+ * connections wait until that command finishes.  Either way, the other
+ * connections are handled by the loop while commands run.
+ *
+ * If the auth-threads tunable is set, context tokens are instead handed to a
+ * pool of threads (see auth.c) so that several handshakes can run at once on
+ * different CPUs.  The connection isn't watched while a thread has it, and
+ * the engine carries on with it once the result comes back.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/tokens.h>
+#include <util/xmalloc.h>
+
+/* A connection handled by the engine. */
+struct session {
+    struct engine *engine;      /* The engine that owns the connection. */
+    struct client *client;      /* The client, set up before the context. */
+    struct event *event;        /* Event for data from the client. */
+    size_t index;               /* Index of the session in the engine. */
+    bool ready;                 /* Whether the context is established. */
+    bool busy;                  /* Whether a thread is accepting a token. */
+    bool pending;               /* Whether a message is waiting to run. */
+    bool closing;               /* Close once the running command is done. */
+};
+
+/* The state of the engine for a pool worker. */
+struct engine {
+    struct event_base *base;    /* Loop for connections and commands. */
+    struct event *tick;         /* Timer so that each wait returns. */
+    struct config *config;      /* Server configuration. */
+    gss_cred_id_t creds;        /* Credentials for accepting contexts. */
+    struct session **sessions;  /* The open connections. */
+    size_t count;               /* Number of open connections. */
+    size_t max;                 /* Maximum number of open connections. */
+    struct event **listeners;   /* Events for the listening sockets. */
+    unsigned int nlisteners;    /* Number of listening sockets. */
+    bool listening;             /* Whether the listener events are added. */
+    socket_type ready;          /* Listening socket with a new connection. */
+    struct auth_pool *auth;     /* Threads accepting contexts, if any. */
+    struct event *auth_event;   /* Event for results from those threads. */
+};
+
+
+/*
+ * Callback for the timer that makes sure that every wait returns at least
+ * once a second.  Just being run ends the wait, but it's also a convenient
+ * time to log the statistics of the authentication threads.
+ */
+static void
+handle_tick(evutil_socket_t fd UNUSED, short what UNUSED, void *data)
+{
+    struct engine *engine = data;
+
+    if (engine->auth != NULL)
+        server_auth_report(engine->auth, false);
+}
+
+
+/*
+ * Callback for a listening socket with an incoming connection, which records
+ * which socket it was so that server_engine_wait can return it.
+ */
+static void
+handle_listener(evutil_socket_t fd, short what UNUSED, void *data)
+{
+    struct engine *engine = data;
+
+    engine->ready = fd;
+}
+
+
+/* Callback for results from the authentication threads, defined below. */
+static void handle_auth(evutil_socket_t, short, void *);
+
+
+/*
+ * Create a new engine that handles up to max connections for the given
+ * configuration and credentials, accepting contexts in the given number of
+ * threads if it's not 0.
+ */
+struct engine *
+server_engine_new(struct config *config, gss_cred_id_t creds, size_t max,
+                  size_t threads)
+{
+    struct engine *engine;
+    struct timeval tv = { 1, 0 };
+
+    engine = xcalloc(1, sizeof(struct engine));
+    engine->base = event_base_new();
+    if (engine->base == NULL)
+        die("internal error: cannot create event base");
+    engine->tick = event_new(engine->base, -1, EV_PERSIST, handle_tick,
+                             engine);
+    if (engine->tick == NULL || event_add(engine->tick, &tv) < 0)
+        die("internal error: cannot create timer event");
+    engine->config = config;
+    engine->creds = creds;
+    engine->max = (max > 0) ? max : 1;
+    engine->sessions = xcalloc(engine->max, sizeof(struct session *));
+    engine->ready = INVALID_SOCKET;
+    if (threads > 0) {
+        engine->auth = server_auth_new(creds, threads);
+        engine->auth_event = event_new(engine->base,
+                                       server_auth_fd(engine->auth),
+                                       EV_READ | EV_PERSIST, handle_auth,
+                                       engine);
+        if (engine->auth_event == NULL
+            || event_add(engine->auth_event, NULL) < 0)
+            die("internal error: cannot create authentication event");
+    }
+    return engine;
+}
+
+
+/*
+ * Tell the engine which listening sockets to watch for new connections.
+ * Must be called before server_engine_wait if it should ever return a
+ * listening socket.
+ */
+void
+server_engine_listen(struct engine *engine, socket_type *fds,
+                     unsigned int nfds)
+{
+    unsigned int i;
+
+    engine->listeners = xcalloc(nfds, sizeof(struct event *));
+    engine->nlisteners = nfds;
+    for (i = 0; i < nfds; i++) {
+        engine->listeners[i] = event_new(engine->base, fds[i], EV_READ,
+                                         handle_listener, engine);
+        if (engine->listeners[i] == NULL)
+            die("internal error: cannot create listener event");
+    }
+}
+
+
+/*
+ * Start or stop watching the listening sockets.  The events aren't
+ * persistent, since we only want one connection from each wait.
+ */
+static void
+engine_listen(struct engine *engine, bool on)
+{
+    unsigned int i;
+
+    for (i = 0; i < engine->nlisteners; i++)
+        if (on) {
+            if (event_add(engine->listeners[i], NULL) < 0)
+                die("internal error: cannot add listener event");
+        } else {
+            event_del(engine->listeners[i]);
+        }
+    engine->listening = on;
+}
+
+
+/*
+ * Close a connection and free everything associated with it, first finishing
+ * any command still running for it.  The client shares the event loop of the
+ * engine, so it must not be freed with the client.
+ */
+static void
+session_close(struct session *session)
+{
+    struct engine *engine = session->engine;
+    struct session *last;
+
+    if (session->client->command != NULL)
+        server_command_finish(session->client);
+    event_free(session->event);
+    session->client->loop = NULL;
+    server_free_client(session->client);
+    last = engine->sessions[engine->count - 1];
+    engine->sessions[session->index] = last;
+    last->index = session->index;
+    engine->count--;
+    free(session);
+}
+
+
+/*
+ * Watch a connection for data from the client, with the usual timeout.
+ */
+static void
+session_watch(struct session *session)
+{
+    struct timeval tv;
+
+    tv.tv_sec = TIMEOUT / 1000;
+    tv.tv_usec = (TIMEOUT % 1000) * 1000;
+    if (event_add(session->event, &tv) < 0)
+        die("internal error: cannot add connection event");
+}
+
+
+/*
+ * Handle one complete context token from the client.  Returns true if the
+ * connection should stay open and false if it should be closed.
+ *
+ * If there are authentication threads, context tokens are handed to them
+ * instead, and the connection isn't watched until handle_auth gets the
+ * result.
+ */
+static bool
+session_accept(struct session *session)
+{
+    struct engine *engine = session->engine;
+    struct client *client = session->client;
+
+    if (engine->auth != NULL && client->protocol != 0) {
+        event_del(session->event);
+        session->busy = true;
+        server_auth_submit(engine->auth, client, session);
+        return true;
+    }
+    switch (server_client_accept(client, engine->creds)) {
+    case ACCEPT_FAIL:
+        return false;
+    case ACCEPT_CONTINUE:
+        return true;
+    case ACCEPT_DONE:
+        break;
+    }
+    debug("accepted connection from %s (protocol %d)", client->user,
+          client->protocol);
+    session->ready = true;
+    client->keepalive = true;
+    return true;
+}
+
+
+/*
+ * Handle one complete message from the client once the context is
+ * established, using the same code that handles messages for connections
+ * that aren't multiplexed.  Protocol version one only supports a single
+ * command, so the connection is closed after it.  Returns true if the
+ * connection should stay open and false if it should be closed, which for a
+ * message that started a command means once that command is done.
+ *
+ * The concurrency limits track one connection for each process, so the
+ * connection is only counted while handling a message.  The connection
+ * limits can't be used with the engine, but the command limits can.  If the
+ * connection is over the limits anyway, reject it the same way as
+ * serve_client in remctld.c: a protocol v2 client is told right away, and a
+ * protocol v1 client gets the error in reply to its command.
+ */
+static bool
+session_message(struct session *session)
+{
+    struct engine *engine = session->engine;
+    struct client *client = session->client;
+    bool keep = false;
+
+    if (!server_limits_connect(client->user)) {
+        if (client->protocol != 1) {
+            client->error(client, ERROR_BUSY, "Too many connections");
+            return false;
+        }
+        client->busy = true;
+    }
+    if (client->protocol == 1)
+        server_v1_handle_messages(client, engine->config);
+    else
+        keep = server_v2_handle_message(client, engine->config);
+    server_limits_disconnect();
+    return keep;
+}
+
+
+/*
+ * Handle each complete context token buffered for a connection, stopping if
+ * one is handed to the authentication threads.  Once the context is
+ * established, a complete message instead marks the connection as pending
+ * and stops watching it until server_engine_run handles the message.  Closes
+ * the connection and returns false if it should be closed, and otherwise
+ * returns true.
+ */
+static bool
+session_process(struct session *session)
+{
+    struct client *client = session->client;
+
+    while (!session->busy
+           && token_buffer_complete(client->input, TOKEN_MAX_LENGTH)) {
+        if (session->ready) {
+            event_del(session->event);
+            session->pending = true;
+            return true;
+        }
+        if (!session_accept(session)) {
+            session_close(session);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Callback for data from a client or for the client timing out.  Read
+ * whatever is available and then handle each complete token.
+ */
+static void
+handle_session(evutil_socket_t fd, short what, void *data)
+{
+    struct session *session = data;
+    struct client *client = session->client;
+    const char *error;
+    int status;
+
+    if (session->ready)
+        error = "receiving token";
+    else if (client->protocol == 0)
+        error = "receiving initial token";
+    else
+        error = "receiving context token";
+    if (what & EV_TIMEOUT) {
+        warn_token(error, TOKEN_FAIL_TIMEOUT, 0, 0);
+        if (session->ready)
+            client->error(client, ERROR_BAD_TOKEN, "Invalid token");
+        session_close(session);
+        return;
+    }
+    status = token_buffer_read(fd, client->input);
+    if (status != TOKEN_OK) {
+        warn_token(error, status, 0, 0);
+        session_close(session);
+        return;
+    }
+    session_process(session);
+}
+
+
+/*
+ * Callback for results from the authentication threads.  For each connection
+ * that comes back, either close it or go back to watching it, handling any
+ * further tokens that were already buffered.
+ */
+static void
+handle_auth(evutil_socket_t fd UNUSED, short what UNUSED, void *data)
+{
+    struct engine *engine = data;
+    struct session *session;
+    struct client *client;
+    enum accept_status status;
+    void *result;
+
+    while (server_auth_result(engine->auth, &result, &status)) {
+        session = result;
+        client = session->client;
+        session->busy = false;
+        if (status == ACCEPT_FAIL) {
+            session_close(session);
+            continue;
+        }
+        if (status == ACCEPT_DONE) {
+            debug("accepted connection from %s (protocol %d)", client->user,
+                  client->protocol);
+            session->ready = true;
+            client->keepalive = true;
+        }
+        session_watch(session);
+        session_process(session);
+    }
+}
+
+
+/*
+ * Add a newly accepted connection to the engine, which takes over the file
+ * descriptor.  The caller must only do this when there is room for it, which
+ * is always the case when server_engine_wait returned a listening socket.
+ */
+void
+server_engine_add(struct engine *engine, socket_type fd)
+{
+    struct session *session;
+    struct client *client;
+
+    if (engine->count >= engine->max)
+        die("internal error: too many connections for engine");
+    client = server_client_start(fd);
+    if (client == NULL) {
+        close(fd);
+        return;
+    }
+    client->loop = engine->base;
+    client->background = !server_limits_commands();
+    session = xcalloc(1, sizeof(struct session));
+    session->engine = engine;
+    session->client = client;
+    session->event = event_new(engine->base, fd, EV_READ | EV_PERSIST,
+                               handle_session, session);
+    if (session->event == NULL)
+        die("internal error: cannot create connection event");
+    session_watch(session);
+    session->index = engine->count;
+    engine->sessions[engine->count++] = session;
+}
+
+
+/*
+ * Returns the number of connections open in the engine.
+ */
+size_t
+server_engine_count(const struct engine *engine)
+{
+    return engine->count;
+}
+
+
+/*
+ * Returns whether any connection has a message waiting or a command that has
+ * finished, either of which is handled by server_engine_run.
+ */
+bool
+server_engine_pending(const struct engine *engine)
+{
+    struct session *session;
+    size_t i;
+
+    for (i = 0; i < engine->count; i++) {
+        session = engine->sessions[i];
+        if (session->pending || server_command_done(session->client))
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Handle the complete messages buffered for a connection until there are no
+ * more or one of them starts a command, and then go back to watching the
+ * connection or close it.  A connection with a command running isn't watched
+ * until session_finish is called for it.
+ */
+static void
+session_run(struct session *session)
+{
+    struct client *client = session->client;
+    bool keep;
+
+    session->pending = false;
+    while (token_buffer_complete(client->input, TOKEN_MAX_LENGTH)) {
+        keep = session_message(session);
+        if (client->command != NULL) {
+            session->closing = !keep;
+            return;
+        }
+        if (!keep) {
+            session_close(session);
+            return;
+        }
+    }
+    session_watch(session);
+}
+
+
+/*
+ * Finish the command running for a connection once it has exited, sending
+ * the rest of its output and its exit status, and then either close the
+ * connection or carry on with it.
+ */
+static void
+session_finish(struct session *session)
+{
+    struct client *client = session->client;
+
+    server_command_finish(client);
+    if (session->closing || client->fatal) {
+        session_close(session);
+        return;
+    }
+    session_run(session);
+}
+
+
+/*
+ * Handle the messages waiting on each pending connection and finish the
+ * commands that have exited, until there are none of either left.  Messages
+ * may start further commands, which keep running in the event loop after
+ * this returns.  Finishing a command runs the event loop until all of its
+ * output is sent, so the other connections may have new messages by then,
+ * and those are handled in turn.  The listening sockets aren't watched
+ * meanwhile, since only the caller accepts connections.
+ */
+void
+server_engine_run(struct engine *engine)
+{
+    struct session *session;
+    size_t i;
+
+    if (engine->listening)
+        engine_listen(engine, false);
+    i = 0;
+    while (i < engine->count) {
+        session = engine->sessions[i];
+        if (server_command_done(session->client))
+            session_finish(session);
+        else if (session->pending)
+            session_run(session);
+        else {
+            i++;
+            continue;
+        }
+        i = 0;
+    }
+}
+
+
+/*
+ * Run the event loop once, handling whatever the clients have sent and the
+ * output of running commands.  If accepting is true and there is room for
+ * another connection, also watch the listening sockets.  Returns a listening
+ * socket with a new connection if there is one, and otherwise
+ * INVALID_SOCKET.  This always returns within a second so that the caller
+ * can check for signals.  Messages from clients and commands that have
+ * exited are left for server_engine_run.
+ */
+socket_type
+server_engine_wait(struct engine *engine, bool accepting)
+{
+    socket_type fd;
+    bool want;
+
+    want = (accepting && engine->count < engine->max);
+    if (want != engine->listening)
+        engine_listen(engine, want);
+    engine->ready = INVALID_SOCKET;
+    if (event_base_loop(engine->base, EVLOOP_ONCE) < 0)
+        die("internal error: engine event loop failed");
+
+    /*
+     * The listener that fired is no longer pending, so start over with all
+     * of them next time.
+     */
+    fd = engine->ready;
+    if (engine->listening)
+        if (fd != INVALID_SOCKET || engine->count >= engine->max)
+            engine_listen(engine, false);
+    return fd;
+}
+
+
+/*
+ * Free the engine, closing any connections still open.  Any authentication
+ * threads are stopped first, after they finish the tokens they were given.
+ */
+void
+server_engine_free(struct engine *engine)
+{
+    unsigned int i;
+
+    if (engine == NULL)
+        return;
+    if (engine->auth != NULL) {
+        event_free(engine->auth_event);
+        server_auth_free(engine->auth);
+    }
+    while (engine->count > 0)
+        session_close(engine->sessions[engine->count - 1]);
+    for (i = 0; i < engine->nlisteners; i++)
+        event_free(engine->listeners[i]);
+    free(engine->listeners);
+    free(engine->sessions);
+    event_free(engine->tick);
+    event_base_free(engine->base);
+    free(engine);
+}
@@ -17,8 +17,16 @@
 #include <portable/socket.h>
 
 #include <server/internal.h>
+#include <util/macros.h>
 #include <util/messages.h>
 
+/* The states of server_event_wait. */
+enum wait_state {
+    WAIT_PENDING,
+    WAIT_READABLE,
+    WAIT_TIMEOUT
+};
+
 
 /*
  * The logging callback for libevent.  We hook this into our message system so
@@ -53,3 +61,72 @@ server_event_fatal_callback(int err)
 {
     die("fatal libevent error (%d)", err);
 }
+
+
+/*
+ * Return the event loop for a client connection, creating it if this is the
+ * first time it's needed.  The same loop is used for everything done on that
+ * connection, including running all of its commands, rather than creating
+ * and tearing down a new one for each command.
+ */
+struct event_base *
+server_client_loop(struct client *client)
+{
+    if (client->loop == NULL) {
+        client->loop = event_base_new();
+        if (client->loop == NULL)
+            die("internal error: cannot create event base");
+    }
+    return client->loop;
+}
+
+
+/*
+ * Free the event loop for a client connection, if any.  Called when freeing
+ * the client.
+ */
+void
+server_client_loop_free(struct client *client)
+{
+    if (client->loop != NULL) {
+        event_base_free(client->loop);
+        client->loop = NULL;
+    }
+}
+
+
+/*
+ * Callback for server_event_wait, which records why the wait finished.
+ */
+static void
+handle_wait(evutil_socket_t fd UNUSED, short what, void *data)
+{
+    enum wait_state *state = data;
+
+    *state = (what & EV_READ) ? WAIT_READABLE : WAIT_TIMEOUT;
+}
+
+
+/*
+ * Run an event loop until the given file descriptor is readable or until
+ * timeout milliseconds have passed, processing any other events in the loop
+ * in the meantime.  A timeout of 0 waits forever.  Returns true if the file
+ * descriptor is readable and false on timeout.
+ */
+bool
+server_event_wait(struct event_base *loop, socket_type fd, time_t timeout)
+{
+    struct timeval tv;
+    enum wait_state state = WAIT_PENDING;
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (event_base_once(loop, fd, EV_READ, handle_wait, &state,
+                        (timeout > 0) ? &tv : NULL)
+        < 0)
+        die("internal error: cannot create event to wait for input");
+    while (state == WAIT_PENDING)
+        if (event_base_loop(loop, EVLOOP_ONCE) < 0)
+            die("internal error: event loop failed");
+    return state == WAIT_READABLE;
+}
@@ -31,35 +31,31 @@
 
 
 /*
- * Create a new client struct from a file descriptor and establish a GSS-API
- * context as a specified service with an incoming client and fills out the
- * client struct.  Returns a new client struct on success and NULL on failure,
- * logging an appropriate error message.
+ * Create a new client struct from a file descriptor and fill in the address
+ * of the client, but don't read anything from it yet.  The GSS-API context is
+ * then established by calling server_client_accept for each token from the
+ * client.  Returns NULL on failure, logging an appropriate error message,
+ * but doesn't close the file descriptor.
  */
 struct client *
-server_new_client(int fd, gss_cred_id_t creds)
+server_client_start(int fd)
 {
     struct client *client;
     struct sockaddr_storage ss;
     socklen_t socklen;
     size_t length;
     char *buffer;
-    gss_buffer_desc send_tok, recv_tok, name_buf;
-    gss_name_t name = GSS_C_NO_NAME;
-    gss_OID doid;
-    OM_uint32 major = 0;
-    OM_uint32 minor = 0;
-    OM_uint32 acc_minor, time_rec;
-    int flags, status;
-    static const OM_uint32 req_gss_flags
-        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+    int status;
 
     /* Create and initialize a new client struct. */
     client = xcalloc(1, sizeof(struct client));
     client->fd = fd;
     client->context = GSS_C_NO_CONTEXT;
+    client->input = token_buffer_new();
+    if (client->input == NULL)
+        sysdie("cannot allocate memory");
 
-    /* Fill in hostname and IP address. */
+    /* Fill in the IP address. */
     socklen = sizeof(ss);
     if (getpeername(fd, (struct sockaddr *) &ss, &socklen) != 0) {
         syswarn("cannot get peer address");
@@ -75,88 +71,25 @@ server_new_client(int fd, gss_cred_id_t creds)
                 gai_strerror(status));
         goto fail;
     }
-    length = NI_MAXHOST;
-    buffer = xmalloc(length);
-    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, length,
-                         NULL, 0, NI_NAMEREQD);
-    if (status == 0)
-        client->hostname = buffer;
-    else
-        free(buffer);
-
-    /* Accept the initial (worthless) token. */
-    status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                        TIMEOUT);
-    if (status != TOKEN_OK) {
-        warn_token("receiving initial token", status, major, minor);
-        goto fail;
-    }
-    free(recv_tok.value);
-    if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
-        client->protocol = 2;
-    else if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT))
-        client->protocol = 1;
-    else {
-        warn("bad token flags %d in initial token", flags);
-        goto fail;
-    }
 
-    /* Now, do the real work of negotiating the context. */
-    do {
-        status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                            TIMEOUT);
-        if (status != TOKEN_OK) {
-            warn_token("receiving context token", status, major, minor);
-            goto fail;
-        }
-        if (flags == TOKEN_CONTEXT)
-            client->protocol = 1;
-        else if (flags != (TOKEN_CONTEXT | TOKEN_PROTOCOL)) {
-            warn("bad token flags %d in context token", flags);
-            free(recv_tok.value);
-            goto fail;
-        }
-        debug("received context token (size=%lu)",
-              (unsigned long) recv_tok.length);
-        major = gss_accept_sec_context(&acc_minor, &client->context, creds,
-                    &recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &name, &doid,
-                    &send_tok, &client->flags, &time_rec, NULL);
-        free(recv_tok.value);
-
-        /* Send back a token if we need to. */
-        if (send_tok.length != 0) {
-            debug("sending context token (size=%lu)",
-                  (unsigned long) send_tok.length);
-            flags = TOKEN_CONTEXT;
-            if (client->protocol > 1)
-                flags |= TOKEN_PROTOCOL;
-            status = token_send(client->fd, flags, &send_tok, TIMEOUT);
-            if (status != TOKEN_OK) {
-                warn_token("sending context token", status, major, minor);
-                gss_release_buffer(&minor, &send_tok);
-                goto fail;
-            }
-            gss_release_buffer(&minor, &send_tok);
-        }
+    /* Look up the hostname while the client authenticates. */
+    server_resolve_start(client, (struct sockaddr *) &ss, socklen);
+    return client;
 
-        /* Bail out if we lose. */
-        if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED) {
-            warn_gssapi("while accepting context", major, acc_minor);
-            goto fail;
-        }
-        if (major == GSS_S_CONTINUE_NEEDED)
-            debug("continue needed while accepting context");
-    } while (major == GSS_S_CONTINUE_NEEDED);
+fail:
+    client->fd = -1;
+    server_free_client(client);
+    return NULL;
+}
 
-    /* Make sure that the appropriate context flags are set. */
-    if (client->protocol > 1) {
-        if ((client->flags & req_gss_flags) != req_gss_flags) {
-            warn("client did not negotiate appropriate GSS-API flags");
-            goto fail;
-        }
-    }
 
-    /* Based on the protocol, set up the callbacks. */
+/*
+ * Set up the callbacks used by the generic server code for a client, based on
+ * its protocol version.
+ */
+void
+server_client_setup(struct client *client)
+{
     if (client->protocol == 1) {
         client->setup = server_v1_command_setup;
         client->finish = server_v1_send_output;
@@ -165,31 +98,187 @@ server_new_client(int fd, gss_cred_id_t creds)
         client->setup = server_v2_command_setup;
         client->finish = server_v2_command_finish;
         client->error = server_v2_send_error;
+        client->output = server_v2_send_output;
+    }
+}
+
+
+/*
+ * Finish setting up a client once the GSS-API context is established, given
+ * the name of the client and the lifetime of the context.  Returns false on
+ * failure, logging an appropriate error message.
+ */
+static bool
+server_client_ready(struct client *client, gss_name_t name,
+                    OM_uint32 time_rec)
+{
+    gss_buffer_desc name_buf;
+    gss_OID doid;
+    OM_uint32 major, minor;
+    static const OM_uint32 req_gss_flags
+        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+
+    /* Make sure that the appropriate context flags are set. */
+    if (client->protocol > 1) {
+        if ((client->flags & req_gss_flags) != req_gss_flags) {
+            warn("client did not negotiate appropriate GSS-API flags");
+            return false;
+        }
     }
 
+    /* Based on the protocol, set up the callbacks. */
+    server_client_setup(client);
+
     /* Get the display version of the client name and store it. */
     major = gss_display_name(&minor, name, &name_buf, &doid);
     if (major != GSS_S_COMPLETE) {
         warn_gssapi("while displaying client name", major, minor);
-        goto fail;
+        return false;
     }
-    gss_release_name(&minor, &name);
     if (gss_oid_equal(doid, GSS_C_NT_ANONYMOUS))
         client->anonymous = true;
     client->user = xstrndup(name_buf.value, name_buf.length);
     client->expires = time(NULL) + time_rec;
     gss_release_buffer(&minor, &name_buf);
-    return client;
+    return true;
+}
 
-fail:
-    if (client->context != GSS_C_NO_CONTEXT)
-        gss_delete_sec_context(&minor, &client->context, GSS_C_NO_BUFFER);
+
+/*
+ * Read the next token from the client while establishing the GSS-API
+ * context and process it, sending back a context token if needed.  The
+ * first token is the initial (worthless) token that says which protocol the
+ * client speaks, and the rest are context tokens.  All tokens from the client
+ * are read through the input buffer, which usually gets the initial token
+ * and the first context token with a single read.
+ *
+ * This waits for the token if it hasn't been read yet, but callers that wait
+ * for data themselves can call it once token_buffer_complete is true for the
+ * input buffer of the client and it won't block on reading.  Returns
+ * ACCEPT_CONTINUE if more tokens are needed, ACCEPT_DONE once the context is
+ * established and the client struct is filled out, and ACCEPT_FAIL on
+ * failure, logging an appropriate error message.
+ */
+enum accept_status
+server_client_accept(struct client *client, gss_cred_id_t creds)
+{
+    gss_buffer_desc send_tok, recv_tok;
+    gss_name_t name = GSS_C_NO_NAME;
+    gss_OID doid;
+    OM_uint32 major = 0;
+    OM_uint32 minor = 0;
+    OM_uint32 acc_minor, time_rec;
+    enum accept_status result = ACCEPT_FAIL;
+    struct replay_tag tag;
+    int flags, status;
+
+    /* Accept the initial token, if we haven't seen it yet. */
+    if (client->protocol == 0) {
+        status = token_recv_buffer(client->fd, client->input, &flags,
+                                   &recv_tok, TOKEN_MAX_LENGTH, TIMEOUT);
+        if (status != TOKEN_OK) {
+            warn_token("receiving initial token", status, major, minor);
+            return ACCEPT_FAIL;
+        }
+        if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
+            client->protocol = 2;
+        else if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT))
+            client->protocol = 1;
+        else {
+            warn("bad token flags %d in initial token", flags);
+            return ACCEPT_FAIL;
+        }
+        return ACCEPT_CONTINUE;
+    }
+
+    /* Now, do the real work of negotiating the context. */
+    status = token_recv_buffer(client->fd, client->input, &flags, &recv_tok,
+                               TOKEN_MAX_LENGTH, TIMEOUT);
+    if (status != TOKEN_OK) {
+        warn_token("receiving context token", status, major, minor);
+        return ACCEPT_FAIL;
+    }
+    if (flags == TOKEN_CONTEXT)
+        client->protocol = 1;
+    else if (flags != (TOKEN_CONTEXT | TOKEN_PROTOCOL)) {
+        warn("bad token flags %d in context token", flags);
+        return ACCEPT_FAIL;
+    }
+    debug("received context token (size=%lu)",
+          (unsigned long) recv_tok.length);
+
+    /*
+     * If the shared replay cache is in use, the Kerberos one isn't, so check
+     * the first context token for a replayed authenticator ourselves.  Forget
+     * it again if it doesn't establish a context so that invalid tokens can't
+     * fill the cache.
+     */
+    memset(&tag, 0, sizeof(tag));
+    if (client->context == GSS_C_NO_CONTEXT
+        && !server_replay_check(&recv_tok, &tag))
+        return ACCEPT_FAIL;
+    major = gss_accept_sec_context(&acc_minor, &client->context, creds,
+                &recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &name, &doid,
+                &send_tok, &client->flags, &time_rec, NULL);
+    if (GSS_ERROR(major))
+        server_replay_forget(&tag);
+
+    /* Send back a token if we need to. */
+    if (send_tok.length != 0) {
+        debug("sending context token (size=%lu)",
+              (unsigned long) send_tok.length);
+        flags = TOKEN_CONTEXT;
+        if (client->protocol > 1)
+            flags |= TOKEN_PROTOCOL;
+        status = token_send(client->fd, flags, &send_tok, TIMEOUT);
+        if (status != TOKEN_OK) {
+            warn_token("sending context token", status, major, minor);
+            gss_release_buffer(&minor, &send_tok);
+            goto done;
+        }
+        gss_release_buffer(&minor, &send_tok);
+    }
+
+    /* Bail out if we lose, and otherwise see if we're done. */
+    if (major == GSS_S_CONTINUE_NEEDED) {
+        debug("continue needed while accepting context");
+        result = ACCEPT_CONTINUE;
+    } else if (major != GSS_S_COMPLETE)
+        warn_gssapi("while accepting context", major, acc_minor);
+    else if (server_client_ready(client, name, time_rec))
+        result = ACCEPT_DONE;
+
+done:
     if (name != GSS_C_NO_NAME)
         gss_release_name(&minor, &name);
-    free(client->ipaddress);
-    free(client->hostname);
-    free(client);
-    return NULL;
+    return result;
+}
+
+
+/*
+ * Create a new client struct from a file descriptor and establish a GSS-API
+ * context as a specified service with an incoming client and fills out the
+ * client struct.  Returns a new client struct on success and NULL on failure,
+ * logging an appropriate error message.
+ */
+struct client *
+server_new_client(int fd, gss_cred_id_t creds)
+{
+    struct client *client;
+    enum accept_status status;
+
+    client = server_client_start(fd);
+    if (client == NULL)
+        return NULL;
+    do {
+        status = server_client_accept(client, creds);
+    } while (status == ACCEPT_CONTINUE);
+    if (status == ACCEPT_FAIL) {
+        client->fd = -1;
+        server_free_client(client);
+        return NULL;
+    }
+    return client;
 }
 
 
@@ -203,11 +292,16 @@ server_free_client(struct client *client)
 
     if (client == NULL)
         return;
+    server_resolve_cancel(client);
     if (client->context != GSS_C_NO_CONTEXT) {
         major = gss_delete_sec_context(&minor, &client->context, NULL);
         if (major != GSS_S_COMPLETE)
             warn_gssapi("while deleting context", major, minor);
     }
+    if (client->queue != NULL)
+        bufferevent_free(client->queue);
+    server_client_loop_free(client);
+    token_buffer_free(client->input);
     if (client->fd >= 0)
         close(client->fd);
     free(client->user);
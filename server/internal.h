@@ -24,12 +24,18 @@
 #include <util/protocol.h>
 
 /* Forward declarations to avoid extra includes. */
+struct auth_pool;
+struct backend_pool;
 struct bufferevent;
+struct command;
+struct engine;
 struct evbuffer;
 struct event;
 struct event_base;
 struct iovec;
+struct parked;
 struct process;
+struct token_buffer;
 
 /*
  * The maximum size of argc passed to the server (4K arguments), and the
@@ -41,10 +47,10 @@ struct process;
 #define COMMAND_MAX_DATA (100UL * 1024 * 1024)
 
 /*
- * The timeout.  We won't wait for longer than this number of seconds for more
- * data from the client.  This needs to be configurable.
+ * The timeout.  We won't wait for longer than this number of milliseconds for
+ * more data from the client.  This needs to be configurable.
  */
-#define TIMEOUT (60 * 60)
+#define TIMEOUT (60 * 60 * 1000)
 
 /*
  * Normally set by the build system, but don't fail to compile if it's not
@@ -54,13 +60,20 @@ struct process;
 # define PATH_SUDO "sudo"
 #endif
 
+/* Result of processing a token while establishing a GSS-API context. */
+enum accept_status {
+    ACCEPT_FAIL = 0,            /* Failed, and the connection should close. */
+    ACCEPT_CONTINUE,            /* More tokens are needed from the client. */
+    ACCEPT_DONE                 /* The context is established. */
+};
+
 /* Holds the information about a client connection. */
 struct client {
     int fd;                     /* File descriptor of client connection. */
     int stderr_fd;              /* stderr file descriptor for remctl-shell. */
     char *hostname;             /* Hostname of client (if available). */
     char *ipaddress;            /* IP address of client as a string. */
-    int protocol;               /* Protocol version number. */
+    int protocol;               /* Protocol version number, 0 if unknown. */
     gss_ctx_id_t context;       /* GSS-API context. */
     char *user;                 /* Name of the client as a string. */
     bool anonymous;             /* Whether the client is anonymous. */
@@ -76,6 +89,53 @@ struct client {
     void (*setup)(struct process *);
     bool (*finish)(struct client *, struct evbuffer *, int);
     bool (*error)(struct client *, enum error_codes, const char *);
+
+    /* Set if the connection was over the concurrency limits. */
+    bool busy;                  /* Reject all commands with ERROR_BUSY. */
+
+    /*
+     * Send a block of output for the given stream to the client.  Used to
+     * send output captured from a process after the fact.  NULL for protocol
+     * version one, which returns all output with the exit status.
+     */
+    bool (*output)(struct client *, int stream, struct evbuffer *);
+
+    /*
+     * Event loop for the connection, created when first needed and kept
+     * until the client is freed so that all commands share it.
+     */
+    struct event_base *loop;
+
+    /*
+     * Queue of output tokens waiting to be sent to the client while a
+     * command is running, if the protocol uses one.
+     */
+    struct bufferevent *queue;
+
+    /* Data read from the client and not yet parsed into tokens. */
+    struct token_buffer *input;
+
+    /* Lookup of the client hostname, if one is running. */
+    bool resolving;             /* Whether a lookup is running. */
+    pid_t resolver;             /* Helper we started for it, or 0. */
+    int resolver_fd;            /* Pipe to which the hostname is written. */
+
+    /*
+     * Set by the event engine so that server_run_command only starts the
+     * process for a command, storing the command here for the engine to
+     * finish later, and so the engine can run several at once.
+     */
+    bool background;            /* Start commands without waiting. */
+    struct command *command;    /* Command started in the background. */
+
+    /*
+     * Output options the client asked for with MESSAGE_OPTIONS, which last
+     * for the rest of the connection, and the protection and compression of
+     * the output of the current command that result from them.
+     */
+    int options;                /* Options accepted for the connection. */
+    bool integrity_only;        /* Send output without encrypting it. */
+    enum compress_method compress; /* How to compress output, if at all. */
 };
 
 /* Holds the configuration for a single command. */
@@ -95,13 +155,50 @@ struct rule {
     char *summary;              /* Argument that gives a command summary. */
     char *help;                 /* Argument that gives help for a command. */
     char **acls;                /* Full file names of ACL files. */
+    long cache;                 /* Seconds to cache output, 0 for none. */
+    bool cache_shared;          /* Share cached output between users. */
+    bool coalesce;              /* Coalesce identical running commands. */
+    long backend;               /* Persistent backend processes, 0 for none. */
+    long backend_requests;      /* Requests per backend process, 0 for any. */
+    struct backend_pool *pool;  /* Running backend processes, if any. */
+    long output_batch;          /* Output batch size, 0 for the default. */
+    long output_delay;          /* Output batch delay in ms, 0 for default. */
+    bool no_hostname;           /* Don't set REMOTE_HOST for the command. */
+    bool integrity_only;        /* Output need not be encrypted. */
+    bool compress;              /* Output may be compressed. */
 };
 
-/* Holds the complete parsed configuration for remctld. */
+/*
+ * Holds the complete parsed configuration for remctld.  The index is a hash
+ * table used by server_config_find_rule to find the rule for a command
+ * without scanning all of the rules.
+ */
 struct config {
     struct rule **rules;
     size_t count;
     size_t allocated;
+    size_t *index;              /* Rule position plus one, or 0 if empty. */
+    size_t index_size;          /* Size of index, always a power of two. */
+};
+
+/*
+ * Concurrency limits for the stand-alone server.  Zero means no limit.  The
+ * connection limits count authenticated connections and the command limits
+ * count connections that are currently running a command.
+ */
+struct limits {
+    unsigned long connections;      /* Total connections. */
+    unsigned long user_connections; /* Connections per user. */
+    unsigned long commands;         /* Total running commands. */
+    unsigned long user_commands;    /* Running commands per user. */
+};
+
+/*
+ * The tag identifying a Kerberos authenticator in the shared replay cache,
+ * all zero if nothing was recorded.
+ */
+struct replay_tag {
+    uint64_t hash[2];
 };
 
 /*
@@ -118,10 +215,14 @@ struct process {
     const char **argv;          /* argv for running the command. */
     struct rule *rule;          /* Configuration rule for the command. */
     struct evbuffer *input;     /* Buffer of input to process. */
+    bool capture;               /* Capture output rather than sending it. */
+    size_t capture_max;         /* If not 0, discard capture beyond this. */
+    bool capture_stream;        /* Send output instead past capture_max. */
 
     /* Command output. */
     struct evbuffer *output;    /* Buffer of output from process. */
     int status;                 /* Exit status. */
+    bool truncated;             /* Captured output was cut off. */
 
     /* Everything below this point is used internally by the process loop. */
 
@@ -140,6 +241,8 @@ struct process {
     bool reaped;                /* Whether we've reaped the process. */
     bool saw_error;             /* Whether we encountered some error. */
     bool saw_output;            /* Whether we saw process output. */
+    bool paused;                /* Reading output paused for the client. */
+    struct event *flush;        /* Timer to send held-back output. */
 };
 
 BEGIN_DECLS
@@ -153,21 +256,129 @@ void server_log_command(struct iovec **, struct rule *, const char *user);
 struct config *server_config_load(const char *file);
 void server_config_free(struct config *);
 bool server_config_acl_permit(const struct rule *, const struct client *);
+struct rule *server_config_find_rule(const struct config *,
+                                     const char *command,
+                                     const char *subcommand);
 void server_config_set_gput_file(char *file);
+void server_config_set_localgroup_ttl(time_t ttl, time_t negative_ttl);
+
+/* Persistent backend processes. */
+void server_backend_start(struct config *);
+void server_backend_stop(void);
+bool server_backend_reap(pid_t, int status);
+void server_backend_check(bool health);
+int server_backend_relay(struct rule *, const char **argv, int in, int out,
+                         int err);
+
+/* Shared cache of command output. */
+void server_cache_init(size_t entries, size_t size);
+void server_cache_clear(void);
+void server_cache_free(void);
+void server_cache_set_wait(unsigned long timeout);
+bool server_cache_enabled(void);
+size_t server_cache_room(size_t keylen);
+bool server_cache_get(const char *key, size_t keylen, struct evbuffer *,
+                      int *status);
+bool server_cache_join(const char *key, size_t keylen, struct evbuffer *,
+                       int *status, bool *leader);
+void server_cache_leave(const char *key, size_t keylen);
+void server_cache_put(const char *key, size_t keylen, const char *data,
+                      size_t length, int status, time_t ttl);
+
+/* Shared replay cache for Kerberos authenticators. */
+void server_replay_init(size_t entries, time_t ttl);
+time_t server_replay_min_ttl(void);
+void server_replay_free(void);
+void server_replay_restore(void);
+bool server_replay_environment(const char **value);
+bool server_replay_check(const gss_buffer_t, struct replay_tag *);
+void server_replay_forget(const struct replay_tag *);
+
+/* Asynchronous lookup of client hostnames. */
+void server_resolve_init(size_t entries, time_t ttl, time_t failed_ttl);
+void server_resolve_free(void);
+void server_resolve_configure(const struct config *);
+void server_resolve_skip(const char *address);
+void server_resolve_start(struct client *, const struct sockaddr *,
+                          socklen_t);
+void server_resolve_collect(struct client *, bool ready);
+bool server_resolve_wait(struct client *, struct event_base *,
+                         void (*)(socket_type, short, void *), void *);
+void server_resolve_finish(struct client *);
+void server_resolve_cancel(struct client *);
+
+/* Concurrency limits. */
+void server_limits_init(const struct limits *, size_t slots);
+void server_limits_free(void);
+long server_limits_reserve(void);
+void server_limits_claim(long slot);
+void server_limits_assign(long slot, pid_t);
+void server_limits_reap(pid_t);
+void server_limits_enter(long slot);
+bool server_limits_connect(const char *user);
+void server_limits_disconnect(void);
+bool server_limits_command_start(const char *user);
+void server_limits_command_end(void);
+bool server_limits_commands(void);
 
 /* Running commands. */
 int server_run_command(struct client *, struct config *, struct iovec **);
+bool server_command_done(const struct client *);
+int server_command_finish(struct client *);
 
 /* Freeing the command structure. */
 void server_free_command(struct iovec **);
 
 /* Running processes. */
 bool server_process_run(struct process *process);
+bool server_process_run_all(struct process *, size_t count, size_t parallel);
+void server_process_start(struct process *, struct event_base *);
+bool server_process_done(const struct process *);
+bool server_process_finish(struct process *);
+bool server_process_send_output(struct process *);
+void server_process_drop_privileges(const struct rule *);
+void server_process_set_spawn(bool);
 void server_handle_io_event(struct bufferevent *, short, void *);
 void server_handle_input_end(struct bufferevent *, void *);
 
+/* Threads for accepting GSS-API contexts in the event engine. */
+struct auth_pool *server_auth_new(gss_cred_id_t, size_t threads);
+socket_type server_auth_fd(const struct auth_pool *);
+void server_auth_submit(struct auth_pool *, struct client *, void *data);
+bool server_auth_result(struct auth_pool *, void **data,
+                        enum accept_status *);
+void server_auth_report(struct auth_pool *, bool force);
+void server_auth_free(struct auth_pool *);
+
+/* Event engine for pool workers that multiplex connections. */
+struct engine *server_engine_new(struct config *, gss_cred_id_t, size_t max,
+                                 size_t threads);
+void server_engine_listen(struct engine *, socket_type *, unsigned int);
+void server_engine_add(struct engine *, socket_type);
+size_t server_engine_count(const struct engine *);
+bool server_engine_pending(const struct engine *);
+void server_engine_run(struct engine *);
+socket_type server_engine_wait(struct engine *, bool accepting);
+void server_engine_free(struct engine *);
+
+/* Parking idle connections in the stand-alone server. */
+void server_park_start(unsigned long delay);
+void server_park_stop(void);
+void server_park_child(void);
+bool server_park_idle(struct client *);
+void server_park_expire(void);
+socket_type *server_park_watch(socket_type *, unsigned int, unsigned int *);
+bool server_park_owns(socket_type);
+struct parked *server_park_ready(socket_type);
+socket_type server_park_fd(const struct parked *);
+void server_park_free(struct parked *);
+struct client *server_park_resume(struct parked *);
+
 /* Generic GSS-API protocol functions. */
 struct client *server_new_client(int fd, gss_cred_id_t creds);
+struct client *server_client_start(int fd);
+void server_client_setup(struct client *);
+enum accept_status server_client_accept(struct client *, gss_cred_id_t);
 void server_free_client(struct client *);
 struct iovec **server_parse_command(struct client *, const char *, size_t);
 
@@ -179,8 +390,12 @@ void server_v1_handle_messages(struct client *, struct config *);
 
 /* Protocol v2 functions. */
 void server_v2_command_setup(struct process *);
+void server_v2_set_output_batch(size_t size, unsigned long delay);
+void server_v2_set_compress_min(size_t size);
 bool server_v2_command_finish(struct client *, struct evbuffer *, int status);
+bool server_v2_send_output(struct client *, int stream, struct evbuffer *);
 bool server_v2_send_error(struct client *, enum error_codes, const char *);
+bool server_v2_handle_message(struct client *, struct config *);
 void server_v2_handle_messages(struct client *, struct config *);
 
 /* ssh protocol functions. */
@@ -191,6 +406,9 @@ struct iovec **server_ssh_parse_command(const char *);
 /* libevent utility functions. */
 void server_event_log_callback(int, const char *);
 void server_event_fatal_callback(int);
+struct event_base *server_client_loop(struct client *);
+bool server_event_wait(struct event_base *, socket_type fd, time_t timeout);
+void server_client_loop_free(struct client *);
 
 END_DECLS
 
@@ -0,0 +1,336 @@
+/*
+ * Concurrency limits for the stand-alone server.
+ *
+ * Every process handling a connection in stand-alone mode is assigned a slot
+ * in a scoreboard kept in anonymous shared memory, created by the parent
+ * before it starts forking.  A process records in its own slot the
+ * authenticated user of its current connection, when that connection
+ * started, and whether it is currently running a command.  To decide whether
+ * a new connection or command is allowed, a process first marks its own slot
+ * and then counts the matching slots of every process.
+ *
+ * The parent only reserves slots, records the PID of the child that owns
+ * each one, and frees them when the child exits.  Everything else in a slot
+ * is written only by the child that owns it, so the parent never overwrites
+ * the state a child has already published.  The counts are not synchronized
+ * between processes, so a burst of simultaneous connections may briefly
+ * exceed a limit by a few or have some rejected that could have been
+ * allowed.  These limits protect the system from overload and are not exact
+ * quotas.  Users are recorded as a hash of the user identity, so in the
+ * unlikely event of a collision, two users will share a per-user limit.
+ *
+ * When remctld is not running in stand-alone mode, or no limits are
+ * configured, there is no scoreboard and all of these functions allow
+ * everything.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/messages.h>
+
+/* Some systems only provide the older name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* States of a scoreboard slot. */
+enum slot_state {
+    SLOT_FREE = 0,              /* Slot is not in use. */
+    SLOT_IDLE,                  /* Owned by a process with no connection. */
+    SLOT_ACTIVE                 /* Owned by a process with a connection. */
+};
+
+/* A slot in the scoreboard. */
+struct slot {
+    pid_t pid;                  /* Process that owns this slot. */
+    volatile sig_atomic_t state; /* The enum slot_state of the slot. */
+    volatile sig_atomic_t running; /* Whether a command is running. */
+    unsigned long user;         /* Hash of the authenticated user. */
+    time_t started;             /* When the connection was accepted. */
+};
+
+/* The configured limits, the scoreboard, and our slot in it. */
+static struct limits limits;
+static struct slot *scoreboard = NULL;
+static size_t nslots = 0;
+static struct slot *self = NULL;
+
+
+/*
+ * Hash a user identity.  This is the 32-bit FNV-1a hash, which is simple and
+ * good enough to tell users apart.
+ */
+static unsigned long
+hash_user(const char *user)
+{
+    const unsigned char *p;
+    unsigned long hash = 2166136261UL;
+
+    for (p = (const unsigned char *) user; *p != '\0'; p++) {
+        hash ^= *p;
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+
+/*
+ * Create the scoreboard with the given number of slots and store the limits.
+ * Must be called by the parent before forking any children.
+ */
+void
+server_limits_init(const struct limits *config, size_t slots)
+{
+    limits = *config;
+    nslots = slots;
+    scoreboard = mmap(NULL, nslots * sizeof(struct slot),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                      0);
+    if (scoreboard == MAP_FAILED)
+        sysdie("cannot allocate connection scoreboard");
+    memset(scoreboard, 0, nslots * sizeof(struct slot));
+}
+
+
+/*
+ * Free the scoreboard.  Only called by the parent on exit.
+ */
+void
+server_limits_free(void)
+{
+    if (scoreboard == NULL)
+        return;
+    munmap(scoreboard, nslots * sizeof(struct slot));
+    scoreboard = NULL;
+    nslots = 0;
+    self = NULL;
+}
+
+
+/*
+ * Reserve a free slot for a child that is about to be forked.  Returns the
+ * slot number, or -1 if there are no free slots (or no scoreboard, in which
+ * case the caller can just ignore it).
+ */
+long
+server_limits_reserve(void)
+{
+    size_t i;
+
+    for (i = 0; i < nslots; i++)
+        if (scoreboard[i].state == SLOT_FREE) {
+            scoreboard[i].pid = 0;
+            scoreboard[i].running = 0;
+            scoreboard[i].state = SLOT_IDLE;
+            return (long) i;
+        }
+    return -1;
+}
+
+
+/*
+ * Claim a slot that the caller manages itself, such as a worker pool slot,
+ * for a child that is about to be forked.  Like server_limits_reserve, this
+ * must be done before the fork, since once the child may be using the slot,
+ * the parent only records its PID.
+ */
+void
+server_limits_claim(long slot)
+{
+    if (scoreboard == NULL || slot < 0 || (size_t) slot >= nslots)
+        return;
+    scoreboard[slot].pid = 0;
+    scoreboard[slot].running = 0;
+    scoreboard[slot].state = SLOT_IDLE;
+}
+
+
+/*
+ * Record the process that owns a slot.  The slot must either have been
+ * returned by server_limits_reserve or claimed with server_limits_claim.  This is called by the parent after
+ * fork, by which time the child may already have started using the slot, so
+ * only the PID is recorded.  A PID of 0 frees the slot again, such as when
+ * the fork failed.
+ */
+void
+server_limits_assign(long slot, pid_t pid)
+{
+    if (scoreboard == NULL || slot < 0 || (size_t) slot >= nslots)
+        return;
+    scoreboard[slot].pid = pid;
+    if (pid == 0)
+        scoreboard[slot].state = SLOT_FREE;
+}
+
+
+/*
+ * Free the slot of a child that has exited, whatever state it was in.
+ */
+void
+server_limits_reap(pid_t pid)
+{
+    size_t i;
+
+    for (i = 0; i < nslots; i++)
+        if (scoreboard[i].state != SLOT_FREE && scoreboard[i].pid == pid) {
+            scoreboard[i].state = SLOT_FREE;
+            scoreboard[i].pid = 0;
+            return;
+        }
+}
+
+
+/*
+ * Called in a child to say which slot is its own.  Until this is called, the
+ * limits are not enforced in that process.
+ */
+void
+server_limits_enter(long slot)
+{
+    if (scoreboard == NULL || slot < 0 || (size_t) slot >= nslots)
+        return;
+    self = &scoreboard[slot];
+}
+
+
+/*
+ * Record a new authenticated connection from the given user and check it
+ * against the connection limits.  Returns true if the connection is allowed
+ * and false if it should be rejected.  A rejected connection is not counted
+ * against the limits.
+ */
+bool
+server_limits_connect(const char *user)
+{
+    size_t i;
+    unsigned long total = 0;
+    unsigned long count = 0;
+    time_t oldest;
+
+    if (self == NULL)
+        return true;
+    self->user = hash_user(user);
+    self->started = time(NULL);
+    self->running = 0;
+    self->state = SLOT_ACTIVE;
+    if (limits.connections == 0 && limits.user_connections == 0)
+        return true;
+
+    /* Count all connections and the connections from this user. */
+    oldest = self->started;
+    for (i = 0; i < nslots; i++) {
+        if (scoreboard[i].state != SLOT_ACTIVE)
+            continue;
+        total++;
+        if (scoreboard[i].user == self->user) {
+            count++;
+            if (scoreboard[i].started < oldest)
+                oldest = scoreboard[i].started;
+        }
+    }
+    if (limits.connections > 0 && total > limits.connections) {
+        notice("rejecting connection from %s: %lu connections open", user,
+               total - 1);
+        self->state = SLOT_IDLE;
+        return false;
+    }
+    if (limits.user_connections > 0 && count > limits.user_connections) {
+        notice("rejecting connection from %s: %lu connections open by user,"
+               " oldest for %lds", user, count - 1,
+               (long) (self->started - oldest));
+        self->state = SLOT_IDLE;
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Record that the current connection has closed.
+ */
+void
+server_limits_disconnect(void)
+{
+    if (self == NULL)
+        return;
+    self->running = 0;
+    self->state = SLOT_IDLE;
+}
+
+
+/*
+ * Record that the current connection is starting a command and check it
+ * against the command limits.  Returns true if the command is allowed and
+ * false if it should be rejected.  If this returns true, the caller must call
+ * server_limits_command_end when the command is done.
+ */
+bool
+server_limits_command_start(const char *user)
+{
+    size_t i;
+    unsigned long total = 0;
+    unsigned long count = 0;
+
+    if (self == NULL)
+        return true;
+    self->running = 1;
+    if (limits.commands == 0 && limits.user_commands == 0)
+        return true;
+
+    /* Count all running commands and the commands run by this user. */
+    for (i = 0; i < nslots; i++) {
+        if (scoreboard[i].state != SLOT_ACTIVE || !scoreboard[i].running)
+            continue;
+        total++;
+        if (scoreboard[i].user == self->user)
+            count++;
+    }
+    if (limits.commands > 0 && total > limits.commands) {
+        notice("rejecting command from %s: %lu commands running", user,
+               total - 1);
+        self->running = 0;
+        return false;
+    }
+    if (limits.user_commands > 0 && count > limits.user_commands) {
+        notice("rejecting command from %s: %lu commands running for user",
+               user, count - 1);
+        self->running = 0;
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Record that the current command has finished.
+ */
+void
+server_limits_command_end(void)
+{
+    if (self == NULL)
+        return;
+    self->running = 0;
+}
+
+
+/*
+ * Returns whether commands are counted against command limits in this
+ * process.  If so, the process must only run one command at a time, since
+ * its slot in the scoreboard only records whether a command is running.
+ */
+bool
+server_limits_commands(void)
+{
+    return self != NULL && (limits.commands > 0 || limits.user_commands > 0);
+}
@@ -0,0 +1,560 @@
+/*
+ * Parking idle connections in the stand-alone server.
+ *
+ * Without a worker pool, each connection is handled by its own child
+ * process, which normally stays around while the client keeps the connection
+ * open between commands.  If the park-idle tunable is set, a child whose
+ * protocol version two connection has been idle for that long exports its
+ * GSS-API context and passes it, along with the connection itself, to the
+ * parent over a Unix domain socket and then exits.  The parent watches the
+ * parked connections along with its listening sockets, and when the client
+ * sends its next message, forks a new child that imports the context and
+ * carries on as if nothing had happened.  An idle connection therefore costs
+ * only a file descriptor and a little memory in the parent rather than a
+ * whole process.
+ *
+ * Connections are only parked between messages and when nothing from the
+ * client is buffered, so no protocol state other than the GSS-API context
+ * and the details of the client has to be passed along.  The parent never
+ * looks inside the data it holds for a parked connection.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/tokens.h>
+#include <util/xmalloc.h>
+
+/*
+ * The largest amount of data sent for a parked connection.  Exported
+ * Kerberos contexts are well under this, and connections whose data would be
+ * larger just aren't parked.
+ */
+#define PARK_MAX (64 * 1024)
+
+/*
+ * The header of the data sent for a parked connection, followed by the user,
+ * IP address, hostname (if any), and exported GSS-API context.  The parent
+ * and child are always the same binary, so this is sent as is.
+ */
+struct park_header {
+    int protocol;               /* Protocol version number. */
+    OM_uint32 flags;            /* Connection flags. */
+    int options;                /* Output options from MESSAGE_OPTIONS. */
+    time_t expires;             /* Expiration time of GSS-API session. */
+    bool anonymous;             /* Whether the client is anonymous. */
+    bool has_hostname;          /* Whether the hostname is known. */
+    size_t user_length;         /* Length of the user. */
+    size_t ipaddress_length;    /* Length of the IP address. */
+    size_t hostname_length;     /* Length of the hostname. */
+    size_t context_length;      /* Length of the exported context. */
+};
+
+/* A parked connection held by the parent. */
+struct parked {
+    socket_type fd;             /* The connection to the client. */
+    char *data;                 /* Data sent by the child that parked it. */
+    size_t length;              /* Length of that data. */
+    time_t parked;              /* When the connection was parked. */
+};
+
+/*
+ * The socket pair used to pass connections to the parent, how long a
+ * connection must be idle before it's parked, and the parked connections.
+ * The wait set is the listening sockets, the parent's end of the socket
+ * pair, and the parked connections, rebuilt when the parked connections
+ * change.
+ */
+static socket_type channel[2] = { INVALID_SOCKET, INVALID_SOCKET };
+static time_t park_delay = 0;
+static struct parked **parked = NULL;
+static size_t nparked = 0;
+static size_t parked_size = 0;
+static socket_type *wait_set = NULL;
+static unsigned int wait_count = 0;
+static bool wait_stale = true;
+
+
+/*
+ * Free a parked connection without closing the connection itself.
+ */
+static void
+park_free(struct parked *connection)
+{
+    free(connection->data);
+    free(connection);
+}
+
+
+/*
+ * Set up parking of connections that have been idle for the given number of
+ * milliseconds.  Must be called by the parent before forking any children,
+ * which inherit the socket pair.
+ */
+void
+server_park_start(unsigned long delay)
+{
+#ifdef SCM_RIGHTS
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, channel) < 0)
+        sysdie("cannot create socket pair for parking connections");
+    fdflag_nonblocking(channel[0], true);
+    fdflag_close_exec(channel[0], true);
+    fdflag_close_exec(channel[1], true);
+    park_delay = (time_t) delay;
+#else
+    die("parking connections is not supported on this system");
+#endif
+}
+
+
+/*
+ * Close all parked connections and stop parking connections.  Called by the
+ * parent on exit.
+ */
+void
+server_park_stop(void)
+{
+    size_t i;
+
+    for (i = 0; i < nparked; i++) {
+        close(parked[i]->fd);
+        park_free(parked[i]);
+    }
+    free(parked);
+    parked = NULL;
+    nparked = 0;
+    parked_size = 0;
+    free(wait_set);
+    wait_set = NULL;
+    wait_stale = true;
+    if (channel[0] != INVALID_SOCKET)
+        close(channel[0]);
+    if (channel[1] != INVALID_SOCKET)
+        close(channel[1]);
+    channel[0] = INVALID_SOCKET;
+    channel[1] = INVALID_SOCKET;
+    park_delay = 0;
+}
+
+
+/*
+ * Called in each child after it's forked.  Close the parent's end of the
+ * socket pair and the parked connections, which belong to the parent, but
+ * keep our end so that we can park our own connection.
+ */
+void
+server_park_child(void)
+{
+    size_t i;
+
+    for (i = 0; i < nparked; i++) {
+        close(parked[i]->fd);
+        park_free(parked[i]);
+    }
+    free(parked);
+    parked = NULL;
+    nparked = 0;
+    parked_size = 0;
+    free(wait_set);
+    wait_set = NULL;
+    wait_stale = true;
+    if (channel[0] != INVALID_SOCKET)
+        close(channel[0]);
+    channel[0] = INVALID_SOCKET;
+}
+
+
+/*
+ * Send the exported context and the details of the client to the parent,
+ * along with the connection.  Returns true on success and false on failure.
+ */
+static bool
+park_send(struct client *client, gss_buffer_t context)
+{
+    struct park_header header;
+    struct iovec iov[5];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    size_t total;
+
+    memset(&header, 0, sizeof(header));
+    header.protocol = client->protocol;
+    header.flags = client->flags;
+    header.options = client->options;
+    header.expires = client->expires;
+    header.anonymous = client->anonymous;
+    header.has_hostname = (client->hostname != NULL);
+    header.user_length = strlen(client->user);
+    header.ipaddress_length = strlen(client->ipaddress);
+    if (client->hostname != NULL)
+        header.hostname_length = strlen(client->hostname);
+    header.context_length = context->length;
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = client->user;
+    iov[1].iov_len = header.user_length;
+    iov[2].iov_base = client->ipaddress;
+    iov[2].iov_len = header.ipaddress_length;
+    iov[3].iov_base = client->hostname;
+    iov[3].iov_len = header.hostname_length;
+    iov[4].iov_base = context->value;
+    iov[4].iov_len = context->length;
+    total = sizeof(header) + header.user_length + header.ipaddress_length
+            + header.hostname_length + header.context_length;
+    if (total > PARK_MAX) {
+        warn("cannot park connection: %lu bytes of data",
+             (unsigned long) total);
+        return false;
+    }
+
+    /* Pass the connection as ancillary data. */
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 5;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client->fd, sizeof(int));
+    if (sendmsg(channel[1], &msg, 0) < 0) {
+        syswarn("cannot pass parked connection to parent");
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Called by a child before waiting for the next message from the client,
+ * when nothing from the client is buffered.  If parking is enabled, wait up
+ * to the park delay for the client to send something.  If it doesn't, export
+ * the GSS-API context and pass the connection to the parent.  Returns true
+ * if the connection was handed off, in which case the child should stop
+ * handling it without sending anything more, and false if the child should
+ * carry on waiting for the next message.
+ */
+bool
+server_park_idle(struct client *client)
+{
+    gss_buffer_desc context;
+    OM_uint32 major, minor;
+    bool okay;
+
+    if (channel[1] == INVALID_SOCKET || park_delay == 0)
+        return false;
+    if (client->protocol < 2 || client->context == GSS_C_NO_CONTEXT)
+        return false;
+    if (server_event_wait(server_client_loop(client), client->fd, park_delay))
+        return false;
+
+    /* The hostname is passed along, so wait for it if it's being looked up. */
+    server_resolve_finish(client);
+
+    /*
+     * Exporting the context deletes it.  If we then can't pass it to the
+     * parent, import it again and keep the connection.
+     */
+    major = gss_export_sec_context(&minor, &client->context, &context);
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while exporting context", major, minor);
+        park_delay = 0;
+        return false;
+    }
+    okay = park_send(client, &context);
+    if (!okay) {
+        major = gss_import_sec_context(&minor, &context, &client->context);
+        if (major != GSS_S_COMPLETE) {
+            warn_gssapi("while importing context", major, minor);
+            okay = true;
+        }
+    }
+    gss_release_buffer(&minor, &context);
+    if (okay)
+        debug("parked idle connection from %s", client->user);
+    return okay;
+}
+
+
+/*
+ * Receive all connections waiting to be parked from the children.  Only
+ * called by the parent.
+ */
+static void
+park_receive(void)
+{
+    struct parked *connection;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    char *buffer;
+    ssize_t length;
+    int fd;
+
+    buffer = xmalloc(PARK_MAX);
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buffer;
+        iov.iov_len = PARK_MAX;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        length = recvmsg(channel[0], &msg, 0);
+        if (length < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                syswarn("cannot receive parked connection");
+            break;
+        }
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS) {
+            warn("parked connection received without a descriptor");
+            continue;
+        }
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        fdflag_close_exec(fd, true);
+        if ((size_t) length < sizeof(struct park_header)) {
+            warn("invalid data for parked connection");
+            close(fd);
+            continue;
+        }
+        connection = xmalloc(sizeof(struct parked));
+        connection->fd = fd;
+        connection->data = xmalloc(length);
+        memcpy(connection->data, buffer, length);
+        connection->length = length;
+        connection->parked = time(NULL);
+        if (nparked == parked_size) {
+            parked_size = (parked_size == 0) ? 16 : parked_size * 2;
+            parked = xreallocarray(parked, parked_size, sizeof(*parked));
+        }
+        parked[nparked++] = connection;
+        wait_stale = true;
+    }
+    free(buffer);
+}
+
+
+/*
+ * Remove a parked connection from the list, returning it.
+ */
+static struct parked *
+park_remove(size_t n)
+{
+    struct parked *connection = parked[n];
+
+    parked[n] = parked[--nparked];
+    wait_stale = true;
+    return connection;
+}
+
+
+/*
+ * Close parked connections that have been idle for longer than the timeout
+ * for waiting for a client.  Called by the parent whenever it wakes up.
+ */
+void
+server_park_expire(void)
+{
+    struct parked *connection;
+    time_t cutoff;
+    size_t i = 0;
+
+    cutoff = time(NULL) - TIMEOUT / 1000;
+    while (i < nparked)
+        if (parked[i]->parked < cutoff) {
+            connection = park_remove(i);
+            debug("closing parked connection after timeout");
+            close(connection->fd);
+            park_free(connection);
+        } else {
+            i++;
+        }
+}
+
+
+/*
+ * Return the set of file descriptors for the parent to wait on: the
+ * listening sockets it was given, its end of the socket pair, and all parked
+ * connections.  The array is owned by this file and only valid until the
+ * next call.
+ */
+socket_type *
+server_park_watch(socket_type *fds, unsigned int nfds, unsigned int *count)
+{
+    size_t i;
+
+    if (wait_stale) {
+        free(wait_set);
+        wait_count = nfds + 1 + nparked;
+        wait_set = xcalloc(wait_count, sizeof(socket_type));
+        memcpy(wait_set, fds, nfds * sizeof(socket_type));
+        wait_set[nfds] = channel[0];
+        for (i = 0; i < nparked; i++)
+            wait_set[nfds + 1 + i] = parked[i]->fd;
+        wait_stale = false;
+    }
+    *count = wait_count;
+    return wait_set;
+}
+
+
+/*
+ * Called by the parent when a file descriptor from server_park_watch is
+ * ready.  If it's the parent's end of the socket pair, receive the newly
+ * parked connections.  If it's a parked connection with data from the
+ * client, remove it from the parked connections and store the connection in
+ * fd; the caller should then fork a child that calls server_park_resume.  If
+ * the client instead closed the connection, close it.  Returns a parked
+ * connection to resume, or NULL if there's nothing more for the caller to
+ * do, including if fd wasn't one of ours.
+ */
+struct parked *
+server_park_ready(socket_type fd)
+{
+    struct parked *connection;
+    size_t i;
+    ssize_t status;
+    char c;
+
+    if (fd == channel[0]) {
+        park_receive();
+        return NULL;
+    }
+    for (i = 0; i < nparked; i++)
+        if (parked[i]->fd == fd)
+            break;
+    if (i == nparked)
+        return NULL;
+    connection = park_remove(i);
+    status = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (status > 0 || (status < 0 && errno == EINTR))
+        return connection;
+    debug("parked connection closed by client");
+    close(connection->fd);
+    park_free(connection);
+    return NULL;
+}
+
+
+/*
+ * Returns whether a file descriptor returned by server_park_watch belongs to
+ * the parking code rather than being a listening socket.
+ */
+bool
+server_park_owns(socket_type fd)
+{
+    size_t i;
+
+    if (fd == channel[0])
+        return true;
+    for (i = 0; i < nparked; i++)
+        if (parked[i]->fd == fd)
+            return true;
+    return false;
+}
+
+
+/*
+ * Return the file descriptor of a parked connection.
+ */
+socket_type
+server_park_fd(const struct parked *connection)
+{
+    return connection->fd;
+}
+
+
+/*
+ * Free a parked connection returned by server_park_ready without closing the
+ * connection.  The parent calls this once it has forked a child for the
+ * connection, and closes its copy of the connection itself.
+ */
+void
+server_park_free(struct parked *connection)
+{
+    park_free(connection);
+}
+
+
+/*
+ * Called in a child forked for a parked connection to pick up where the
+ * child that parked it left off.  Imports the GSS-API context and rebuilds
+ * the client struct.  Returns the client, or NULL on failure, in which case
+ * the connection is closed.
+ */
+struct client *
+server_park_resume(struct parked *connection)
+{
+    struct park_header header;
+    struct client *client;
+    gss_buffer_desc context;
+    OM_uint32 major, minor;
+    const char *p;
+    size_t total;
+
+    memcpy(&header, connection->data, sizeof(header));
+    total = sizeof(header) + header.user_length + header.ipaddress_length
+            + header.hostname_length + header.context_length;
+    if (total != connection->length) {
+        warn("invalid data for parked connection");
+        close(connection->fd);
+        park_free(connection);
+        return NULL;
+    }
+    client = xcalloc(1, sizeof(struct client));
+    client->fd = connection->fd;
+    client->context = GSS_C_NO_CONTEXT;
+    client->input = token_buffer_new();
+    if (client->input == NULL)
+        sysdie("cannot allocate memory");
+    client->protocol = header.protocol;
+    client->flags = header.flags;
+    client->options = header.options;
+    client->expires = header.expires;
+    client->anonymous = header.anonymous;
+    p = connection->data + sizeof(header);
+    client->user = xstrndup(p, header.user_length);
+    p += header.user_length;
+    client->ipaddress = xstrndup(p, header.ipaddress_length);
+    p += header.ipaddress_length;
+    if (header.has_hostname)
+        client->hostname = xstrndup(p, header.hostname_length);
+    p += header.hostname_length;
+    context.value = (void *) p;
+    context.length = header.context_length;
+    major = gss_import_sec_context(&minor, &context, &client->context);
+    park_free(connection);
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while importing context", major, minor);
+        server_free_client(client);
+        return NULL;
+    }
+    server_client_setup(client);
+    debug("resumed parked connection from %s", client->user);
+    return client;
+}
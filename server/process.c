@@ -22,31 +22,37 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
 
 #include <server/internal.h>
 #include <util/fdflag.h>
 #include <util/macros.h>
 #include <util/messages.h>
 #include <util/protocol.h>
+#include <util/vector.h>
 #include <util/xmalloc.h>
 
 /*
- * We would like to use event_base_loopbreak and event_base_got_break, but the
- * latter was introduced in libevent 2.x.  For right now, until we can rely on
- * libevent 2.x, set a flag in the process struct instead.  We still call
+ * We would like to use event_base_got_break to detect errors, but it was
+ * introduced in libevent 2.x, and several processes may share one event loop.
+ * Instead, errors set a flag in the process struct.  We still call
  * event_base_loopbreak where we can, to keep from processing more data than
  * we have to.
- *
- * This portability glue is specific to this file and assumes that the process
- * variable is in scope to replace the event_base_got_break functionality.
  */
 #ifndef HAVE_EVENT_BASE_LOOPBREAK
 # define event_base_loopbreak(base) /* empty */
 #endif
-#ifndef HAVE_EVENT_BASE_GOT_BREAK
-# define event_base_got_break(base) process->saw_error
+
+/* Needed to build the environment of commands started with posix_spawn. */
+#ifdef HAVE_POSIX_SPAWN
+extern char **environ;
 #endif
 
+/* Whether to start commands with posix_spawn when possible. */
+static bool use_spawn = true;
+
 
 /*
  * Callback for events in input or output handling while running a process.
@@ -109,9 +115,9 @@ server_handle_input_end(struct bufferevent *bev, void *data)
 
 
 /*
- * Called when the process has exited.  Here we reap the status and then tell
- * the event loop to complete.  Ignore SIGCHLD if our child process wasn't the
- * one that exited.
+ * Called when a process has exited.  Here we reap the status, which tells
+ * server_process_done that the process is done.  Ignore SIGCHLD if our
+ * child process wasn't the one that exited.
  */
 static void
 handle_exit(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
@@ -121,7 +127,122 @@ handle_exit(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
     if (waitpid(process->pid, &process->status, WNOHANG) > 0) {
         process->reaped = true;
         event_del(process->sigchld);
-        event_base_loopexit(process->loop, NULL);
+    }
+}
+
+
+/*
+ * Stop capturing the output of a process that has produced more output than
+ * should be captured, and send its output to the client as it arrives
+ * instead.  The output captured so far is sent first, followed by the new
+ * output waiting in the given bufferevent.
+ */
+static void
+capture_stop(struct process *process, struct bufferevent *bev)
+{
+    struct client *client = process->client;
+    int stream;
+
+    process->capture = false;
+    if (!server_process_send_output(process)) {
+        process->saw_error = true;
+        event_base_loopbreak(process->loop);
+        return;
+    }
+    client->setup(process);
+    stream = (bev == process->inout) ? 1 : 2;
+    if (!client->output(client, stream, bufferevent_get_input(bev))) {
+        process->saw_error = true;
+        event_base_loopbreak(process->loop);
+    }
+}
+
+
+/*
+ * Callback used to collect the output from a process whose output is being
+ * captured rather than sent to the client.  Each block of output is added to
+ * the output buffer of the process after its stream number and length, so
+ * that server_process_send_output can send the blocks in order later.  If
+ * the process has a limit on captured output, output past that limit is
+ * discarded, or sent to the client if the process says to stream it.
+ */
+static void
+handle_output_capture(struct bufferevent *bev, void *data)
+{
+    struct process *process = data;
+    struct evbuffer *buf;
+    char stream;
+    size_t length, used;
+
+    process->saw_output = true;
+    stream = (bev == process->inout) ? 1 : 2;
+    buf = bufferevent_get_input(bev);
+    length = evbuffer_get_length(buf);
+    if (process->capture_max > 0 && !process->truncated) {
+        used = evbuffer_get_length(process->output);
+        used += sizeof(stream) + sizeof(length);
+        if (used + length > process->capture_max) {
+            if (process->capture_stream) {
+                capture_stop(process, bev);
+                return;
+            }
+            notice("discarding output of %s beyond %lu bytes",
+                   process->command, (unsigned long) process->capture_max);
+            process->truncated = true;
+        }
+    }
+    if (process->truncated) {
+        if (evbuffer_drain(buf, length) < 0)
+            die("internal error: cannot discard process output");
+        return;
+    }
+    if (evbuffer_add(process->output, &stream, sizeof(stream)) < 0)
+        die("internal error: cannot capture process output");
+    if (evbuffer_add(process->output, &length, sizeof(length)) < 0)
+        die("internal error: cannot capture process output");
+    if (evbuffer_add_buffer(process->output, buf) < 0)
+        die("internal error: cannot capture process output");
+}
+
+
+/*
+ * Set up capturing the output of a process for protocol version two and
+ * later, instead of sending it to the client as it arrives.  Protocol version
+ * one always collects the output, so doesn't need this.
+ */
+static void
+capture_setup(struct process *process)
+{
+    bufferevent_data_cb writecb;
+
+    process->output = evbuffer_new();
+    if (process->output == NULL)
+        die("internal error: cannot create output buffer");
+    writecb = (process->input == NULL) ? NULL : server_handle_input_end;
+    bufferevent_setcb(process->inout, handle_output_capture, writecb,
+                      server_handle_io_event, process);
+    bufferevent_setwatermark(process->inout, EV_READ, 0, TOKEN_MAX_OUTPUT);
+    bufferevent_enable(process->err, EV_READ);
+    bufferevent_setcb(process->err, handle_output_capture, NULL,
+                      server_handle_io_event, process);
+    bufferevent_setwatermark(process->err, EV_READ, 0, TOKEN_MAX_OUTPUT);
+}
+
+
+/*
+ * Switch to the user the rule says to run its program as, if any.  Called in
+ * child processes before running a program.  Dies on failure.
+ */
+void
+server_process_drop_privileges(const struct rule *rule)
+{
+    if (rule->user != NULL && rule->uid > 0) {
+        if (initgroups(rule->user, rule->gid) != 0)
+            sysdie("cannot initgroups for %s\n", rule->user);
+        if (setgid(rule->gid) != 0)
+            sysdie("cannot setgid to %lu\n", (unsigned long) rule->gid);
+        if (setuid(rule->uid) != 0)
+            sysdie("cannot setuid to %lu\n", (unsigned long) rule->uid);
     }
 }
 
@@ -138,6 +259,189 @@ child_die_handler(void)
 }
 
 
+/*
+ * Set whether to start commands with posix_spawn where possible rather than
+ * always forking.  This is on by default and mostly exists so that the test
+ * suite can compare the two methods.
+ */
+void
+server_process_set_spawn(bool spawn)
+{
+    use_spawn = spawn;
+}
+
+
+#ifdef HAVE_POSIX_SPAWN
+
+/*
+ * Add an environment variable setting to a vector of NAME=value strings.
+ */
+static void
+add_env(struct vector *env, const char *name, const char *value)
+{
+    char *setting;
+
+    xasprintf(&setting, "%s=%s", name, value);
+    vector_add(env, setting);
+    free(setting);
+}
+
+
+/*
+ * Returns true if the given NAME=value setting sets one of the variables in
+ * a vector of settings.
+ */
+static bool
+env_overridden(const char *setting, const struct vector *env)
+{
+    size_t i, length;
+
+    length = strcspn(setting, "=");
+    for (i = 0; i < env->count; i++)
+        if (strncmp(setting, env->strings[i], length + 1) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Start a command with posix_spawn.  This avoids copying the page tables of
+ * a large server process, and everything the forked child would do is
+ * instead set up in the parent: the environment is built here and passed
+ * explicitly, and the file descriptor setup and SIGPIPE reset are done with
+ * spawn attributes.
+ *
+ * posix_spawn can't switch users or talk to persistent backends, so this is
+ * only used for commands that need neither.  It's also not used if any of
+ * the socket pair file descriptors are standard streams, since the dup2
+ * file actions then wouldn't work as expected.  Returns the PID of the new
+ * process, or -1 if the command should be started by forking instead,
+ * including if posix_spawn fails, so that errors are reported the same way
+ * as for forked commands.
+ */
+static pid_t
+spawn(struct process *process, const socket_type stdinout_fds[2],
+      const socket_type stderr_fds[2])
+{
+    struct client *client = process->client;
+    const struct rule *rule = process->rule;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    struct vector *env;
+    char **envp;
+    const char *argv0, *rcache;
+    char *expires;
+    bool drop_rcache = false;
+    size_t i, n;
+    pid_t pid;
+    int fd, status;
+
+    /* Check whether the command can be spawned. */
+    if (!use_spawn || rule->pool != NULL)
+        return -1;
+    if (rule->user != NULL && rule->uid > 0)
+        return -1;
+    if (stdinout_fds[0] < 3 || stdinout_fds[1] < 3)
+        return -1;
+    if (client->protocol > 1 && (stderr_fds[0] < 3 || stderr_fds[1] < 3))
+        return -1;
+
+    /*
+     * Build the environment, as in the forked child: our environment plus
+     * the connection and command information.
+     */
+    env = vector_new();
+    add_env(env, "REMUSER", client->user);
+    add_env(env, "REMOTE_USER", client->user);
+    add_env(env, "REMOTE_ADDR", client->ipaddress);
+    if (client->hostname != NULL && !rule->no_hostname)
+        add_env(env, "REMOTE_HOST", client->hostname);
+    add_env(env, "REMCTL_COMMAND", process->command);
+    xasprintf(&expires, "%lu", (unsigned long) client->expires);
+    add_env(env, "REMOTE_EXPIRES", expires);
+    free(expires);
+    if (server_replay_environment(&rcache)) {
+        if (rcache != NULL)
+            add_env(env, "KRB5RCACHETYPE", rcache);
+        else
+            drop_rcache = true;
+    }
+    for (n = 0; environ[n] != NULL; n++)
+        ;
+    envp = xcalloc(n + env->count + 1, sizeof(char *));
+    for (i = 0, n = 0; environ[i] != NULL; i++) {
+        if (drop_rcache && strncmp(environ[i], "KRB5RCACHETYPE=", 15) == 0)
+            continue;
+        if (!env_overridden(environ[i], env))
+            envp[n++] = environ[i];
+    }
+    for (i = 0; i < env->count; i++)
+        envp[n++] = env->strings[i];
+
+    /*
+     * Set up the standard streams as in the forked child, and then close the
+     * socket pairs and the low-numbered file descriptors that the forked
+     * child closes.
+     */
+    posix_spawn_file_actions_init(&actions);
+    if (process->input != NULL)
+        posix_spawn_file_actions_adddup2(&actions, stdinout_fds[1], 0);
+    else
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY,
+                                         0);
+    posix_spawn_file_actions_adddup2(&actions, stdinout_fds[1], 1);
+    if (client->protocol == 1)
+        posix_spawn_file_actions_adddup2(&actions, stdinout_fds[1], 2);
+    else
+        posix_spawn_file_actions_adddup2(&actions, stderr_fds[1], 2);
+    posix_spawn_file_actions_addclose(&actions, stdinout_fds[0]);
+    posix_spawn_file_actions_addclose(&actions, stdinout_fds[1]);
+    if (client->protocol > 1) {
+        posix_spawn_file_actions_addclose(&actions, stderr_fds[0]);
+        posix_spawn_file_actions_addclose(&actions, stderr_fds[1]);
+    }
+    for (fd = 3; fd < 16; fd++) {
+        if (fd == stdinout_fds[0] || fd == stdinout_fds[1])
+            continue;
+        if (fd == stderr_fds[0] || fd == stderr_fds[1])
+            continue;
+        status = fcntl(fd, F_GETFD);
+        if (status >= 0 && !(status & FD_CLOEXEC))
+            posix_spawn_file_actions_addclose(&actions, fd);
+    }
+
+    /* Restore the default SIGPIPE handler. */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    /* Start the command. */
+    argv0 = (rule->sudo_user == NULL) ? rule->program : PATH_SUDO;
+    status = posix_spawn(&pid, argv0, &actions, &attr,
+                         (char **) process->argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+    vector_free(env);
+    return (status == 0) ? pid : -1;
+}
+
+#else /* !HAVE_POSIX_SPAWN */
+
+static pid_t
+spawn(struct process *process UNUSED,
+      const socket_type stdinout_fds[2] UNUSED,
+      const socket_type stderr_fds[2] UNUSED)
+{
+    return -1;
+}
+
+#endif /* !HAVE_POSIX_SPAWN */
+
+
 /*
  * Start the child process.  This runs as a one-time event inside the event
  * loop, forks off the child process, and sets up the events that process
@@ -155,6 +459,7 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
     struct sigaction sa;
     const char *argv0;
     char *expires;
+    int status;
 
     /*
      * Socket pairs are used for communication with the child process that
@@ -181,9 +486,13 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
      * Flush output before forking, mostly in case -S was given and we've
      * therefore been writing log messages to standard output that may not
      * have been flushed yet.
+     *
+     * Use posix_spawn if we can, and otherwise fork.
      */
     fflush(stdout);
-    process->pid = fork();
+    process->pid = spawn(process, stdinout_fds, stderr_fds);
+    if (process->pid < 0)
+        process->pid = fork();
     switch (process->pid) {
     case -1:
         syswarn("cannot fork");
@@ -228,16 +537,6 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
         }
         close(stdinout_fds[1]);
 
-        /*
-         * Older versions of MIT Kerberos left the replay cache file open
-         * across exec.  Newer versions correctly set it close-on-exec, but
-         * close our low-numbered file descriptors anyway for older versions.
-         * We're just trying to get the replay cache, so we don't have to go
-         * very high.
-         */
-        for (fd = 3; fd < 16; fd++)
-            close(fd);
-
         /*
          * Restore the default SIGPIPE handler.  The server sets it to
          * SIG_IGN, which is inherited by children.  We want the child to have
@@ -259,7 +558,7 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
             sysdie("cannot set REMOTE_USER in environment");
         if (setenv("REMOTE_ADDR", client->ipaddress, 1) < 0)
             sysdie("cannot set REMOTE_ADDR in environment");
-        if (client->hostname != NULL)
+        if (client->hostname != NULL && !process->rule->no_hostname)
             if (setenv("REMOTE_HOST", client->hostname, 1) < 0)
                 sysdie("cannot set REMOTE_HOST in environment");
         if (setenv("REMCTL_COMMAND", process->command, 1) < 0)
@@ -268,19 +567,34 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
         if (setenv("REMOTE_EXPIRES", expires, 1) < 0)
             sysdie("cannot set REMOTE_EXPIRES in environment");
         free(expires);
+        server_replay_restore();
 
-        /* Drop privileges if requested. */
-        if (process->rule->user != NULL && process->rule->uid > 0) {
-            if (initgroups(process->rule->user, process->rule->gid) != 0)
-                sysdie("cannot initgroups for %s\n", process->rule->user);
-            if (setgid(process->rule->gid) != 0)
-                sysdie("cannot setgid to %lu\n",
-                       (unsigned long) process->rule->gid);
-            if (setuid(process->rule->uid) != 0)
-                sysdie("cannot setuid to %lu\n",
-                       (unsigned long) process->rule->uid);
+        /*
+         * If the command is handled by persistent backend processes, pass it
+         * to one of them instead of running it.  If none can be reached,
+         * fall back on running the program.
+         */
+        if (process->rule->pool != NULL) {
+            status = server_backend_relay(process->rule, process->argv, 0, 1,
+                                          2);
+            if (status >= 0)
+                exit(status);
         }
 
+        /*
+         * Older versions of MIT Kerberos left the replay cache file open
+         * across exec.  Newer versions correctly set it close-on-exec, but
+         * close our low-numbered file descriptors anyway for older versions.
+         * We're just trying to get the replay cache, so we don't have to go
+         * very high.  This has to wait until after any relay to a backend,
+         * since the backend registry lock may be one of those descriptors.
+         */
+        for (fd = 3; fd < 16; fd++)
+            close(fd);
+
+        /* Drop privileges if requested. */
+        server_process_drop_privileges(process->rule);
+
         /*
          * Run the command.  On error, we intentionally don't reveal
          * information about the command we ran.  We have to cast away const
@@ -340,7 +654,10 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
     }
 
     /* Set up the event hooks for the different protocols. */
-    client->setup(process);
+    if (process->capture && client->protocol > 1)
+        capture_setup(process);
+    else
+        client->setup(process);
     return;
 
 fail:
@@ -359,24 +676,38 @@ fail:
 
 
 /*
- * Runs a process as a child to completion, capturing its output and
- * processing it according to the negotiated remctl client protocol.
+ * Called by the event loop once the lookup of the client hostname has
+ * finished or waiting for it has timed out.  Collect the hostname and then
+ * create the child process.
+ */
+static void
+resolved(evutil_socket_t fd, short what, void *data)
+{
+    struct process *process = data;
+
+    server_resolve_collect(process->client, (what & EV_READ) != 0);
+    start(fd, what, process);
+}
+
+
+/*
+ * Prepare to run a process in the given event loop.  The child process itself
+ * is created by a one-time event once the event loop runs.  If the command
+ * wants REMOTE_HOST and the lookup of the client hostname hasn't finished,
+ * that event instead waits for the lookup, so that the event loop keeps
+ * handling everything else in the meantime.
  *
- * Takes the client, the short name for the command, an argument list, the
- * configuration line for that command, and the process.  Returns true on
- * success and false on failure.
+ * The caller must run the event loop until server_process_done returns true
+ * and then call server_process_finish, outside of any event callback.
  */
-bool
-server_process_run(struct process *process)
+void
+server_process_start(struct process *process, struct event_base *loop)
 {
-    bool success;
-    struct event_base *loop;
-    struct client *client = process->client;
     const struct timeval immediate = { 0, 0 };
 
-    /* Create the event base that we use for the event loop. */
-    loop = event_base_new();
     process->loop = loop;
+    process->stdinout_fd = INVALID_SOCKET;
+    process->stderr_fd = INVALID_SOCKET;
 
     /*
      * Create the event to handle SIGCHLD when the child process exits.  We
@@ -393,38 +724,70 @@ server_process_run(struct process *process)
 
     /*
      * Prepare to spawn the process itself via a one-time event.  This event
-     * will run once, immediately, and create and add further bufferevents to
-     * handle the output from the process.  It will then self-destruct.
+     * will run once, immediately or when the hostname lookup is done, and
+     * create and add further bufferevents to handle the output from the
+     * process.  It will then self-destruct.
      */
+    if (!process->rule->no_hostname
+        && server_resolve_wait(process->client, loop, resolved, process))
+        return;
     if (event_base_once(loop, -1, EV_TIMEOUT, start, process, &immediate) < 0)
         die("internal error: cannot create event to spawn the process");
+}
 
-    /*
-     * Run the event loop.  This will continue until handle_exit is called or
-     * we encounter some fatal error, in which case we'll break out of the
-     * loop.
-     */
-    if (event_base_dispatch(loop) < 0)
-        die("internal error: process event loop failed");
+
+/*
+ * Returns whether a process started with server_process_start has exited or
+ * failed, so that server_process_finish can be called for it.
+ */
+bool
+server_process_done(const struct process *process)
+{
+    return process->reaped || process->saw_error;
+}
+
+
+/*
+ * Finish running a process once it has exited or we encountered an error.
+ * Collects any remaining output and frees the resources used by the process.
+ * This runs the event loop of the process, so it must not be called from an
+ * event callback.  Returns true on success and false on failure.
+ */
+bool
+server_process_finish(struct process *process)
+{
+    bool success;
+    struct client *client = process->client;
+    int flags;
 
     /*
      * We have some more work to do after client exit since there may still be
      * output from the child sitting in system buffers.  Therefore, we now
      * repeatedly run the event loop in EVLOOP_NONBLOCK mode, only continuing
-     * if process->saw_output remains true and we didn't break out of the loop
-     * (indicating an error).  The saw_output flag will be set by the event
-     * handlers if we see any output from the process.
+     * if process->saw_output remains true and we didn't see an error.  The
+     * saw_output flag will be set by the event handlers if we see any output
+     * from the process.  If reading output is paused until the client
+     * catches up, wait for that instead.  Output held back to send in larger
+     * blocks is sent on the first time through.
      */
     process->saw_output = true;
-    while (process->saw_output && !event_base_got_break(loop)) {
+    if (process->flush != NULL && !process->saw_error)
+        event_active(process->flush, EV_TIMEOUT, 1);
+    while ((process->saw_output || process->paused) && !process->saw_error) {
         process->saw_output = false;
-        if (event_base_loop(loop, EVLOOP_NONBLOCK) < 0)
+        flags = process->paused ? EVLOOP_ONCE : EVLOOP_NONBLOCK;
+        if (event_base_loop(process->loop, flags) < 0)
             die("internal error: process event loop failed");
     }
 
+    /* Any queued output for the client must no longer refer to us. */
+    if (client->queue != NULL)
+        bufferevent_setcb(client->queue, NULL, NULL, NULL, NULL);
+
     /* Close down the file descriptors now that we have all the data. */
-    close(process->stdinout_fd);
-    if (client->protocol > 1)
+    if (process->stdinout_fd != INVALID_SOCKET)
+        close(process->stdinout_fd);
+    if (process->stderr_fd != INVALID_SOCKET)
         close(process->stderr_fd);
 
     /*
@@ -438,33 +801,137 @@ server_process_run(struct process *process)
      * problems if the child is doing something that shouldn't be arbitrarily
      * interrupted.  This approach seems safer, although has the disadvantage
      * of keeping the remctld process around until the child completes.
-     */
-    if (event_base_got_break(loop)) {
-        if (!process->reaped)
-            waitpid(process->pid, &process->status, 0);
-        return false;
-    }
-
-    /*
+     *
      * For protocol version one, if the process sent more than the max output,
      * we already pulled out the output we care about into process->output.
      * Otherwise, we need to pull the output from the bufferevent before we
      * free it.
      */
-    if (client->protocol == 1 && process->output == NULL) {
-        process->output = evbuffer_new();
-        if (process->output == NULL)
-            die("internal error: cannot create output buffer");
-        if (bufferevent_read_buffer(process->inout, process->output) < 0)
-            die("internal error: cannot read data from output buffer");
+    if (process->saw_error) {
+        if (!process->reaped && process->pid > 0)
+            waitpid(process->pid, &process->status, 0);
+        success = false;
+    } else {
+        if (client->protocol == 1 && process->output == NULL) {
+            process->output = evbuffer_new();
+            if (process->output == NULL)
+                die("internal error: cannot create output buffer");
+            if (bufferevent_read_buffer(process->inout, process->output) < 0)
+                die("internal error: cannot read data from output buffer");
+        }
+        success = true;
     }
 
     /* Free resources and return. */
-    success = !event_base_got_break(loop);
-    bufferevent_free(process->inout);
+    if (process->inout != NULL)
+        bufferevent_free(process->inout);
     if (process->err != NULL)
         bufferevent_free(process->err);
     event_free(process->sigchld);
-    event_base_free(loop);
+    if (process->flush != NULL)
+        event_free(process->flush);
+    process->flush = NULL;
+    process->inout = NULL;
+    process->err = NULL;
+    process->sigchld = NULL;
+    return success;
+}
+
+
+/*
+ * Runs a set of processes as children to completion, capturing their output
+ * and processing it according to the negotiated remctl client protocol.  At
+ * most parallel processes, which must be at least one, run at the same time
+ * in the event loop of the client connection, which all of the processes
+ * must share.  Processes are started in order as earlier ones finish.
+ *
+ * Returns true if all processes ran successfully and false otherwise.  After
+ * return, saw_error is set in the struct of each process that failed.
+ */
+bool
+server_process_run_all(struct process *processes, size_t count,
+                       size_t parallel)
+{
+    struct event_base *loop;
+    struct process *process;
+    size_t i;
+    size_t next = 0;
+    size_t running = 0;
+    bool success = true;
+
+    /* Use the event loop of the client connection. */
+    if (count == 0)
+        return true;
+    loop = server_client_loop(processes[0].client);
+
+    /*
+     * Start as many processes as we can and run the event loop until one of
+     * them exits or fails, and then finish those that are done and repeat.
+     * Finished processes have a NULL sigchld event.
+     */
+    while (next < count || running > 0) {
+        for (; next < count && running < parallel; next++, running++)
+            server_process_start(&processes[next], loop);
+        if (event_base_loop(loop, EVLOOP_ONCE) < 0)
+            die("internal error: process event loop failed");
+        for (i = 0; i < next; i++) {
+            process = &processes[i];
+            if (process->sigchld == NULL)
+                continue;
+            if (server_process_done(process)) {
+                if (!server_process_finish(process))
+                    success = false;
+                running--;
+            }
+        }
+    }
+    return success;
+}
+
+
+/*
+ * Runs a process as a child to completion, capturing its output and
+ * processing it according to the negotiated remctl client protocol.  Returns
+ * true on success and false on failure.
+ */
+bool
+server_process_run(struct process *process)
+{
+    return server_process_run_all(process, 1, 1);
+}
+
+
+/*
+ * Send the output captured from a process to the client, in the order in
+ * which the process produced it, using the output callback of the client.
+ * Returns true on success and false on failure.
+ */
+bool
+server_process_send_output(struct process *process)
+{
+    struct client *client = process->client;
+    struct evbuffer *block;
+    char stream;
+    size_t length;
+    char *data;
+    bool success = true;
+
+    block = evbuffer_new();
+    if (block == NULL)
+        die("internal error: cannot create output buffer");
+    while (success && evbuffer_get_length(process->output) > 0) {
+        if (evbuffer_remove(process->output, &stream, sizeof(stream)) < 0)
+            die("internal error: cannot read captured output");
+        if (evbuffer_remove(process->output, &length, sizeof(length)) < 0)
+            die("internal error: cannot read captured output");
+        data = xmalloc(length);
+        if (evbuffer_remove(process->output, data, length) < 0)
+            die("internal error: cannot read captured output");
+        if (evbuffer_add(block, data, length) < 0)
+            die("internal error: cannot copy captured output");
+        free(data);
+        success = client->output(client, stream, block);
+    }
+    evbuffer_free(block);
     return success;
 }
@@ -20,8 +20,15 @@
 #include <portable/socket.h>
 #include <portable/system.h>
 
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_SACKED
+# include <netinet/tcp.h>
+#endif
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif
 #include <signal.h>
 #include <syslog.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <time.h>
 
@@ -51,6 +58,12 @@ static volatile sig_atomic_t config_signaled = 0;
  */
 static volatile sig_atomic_t exit_signaled = 0;
 
+/*
+ * Flag indicating whether it's time to check the health of the persistent
+ * backend processes (only used in standalone mode).
+ */
+static volatile sig_atomic_t check_signaled = 0;
+
 /* Usage message. */
 static const char usage_message[] = "\
 Usage: remctld <options>\n\
@@ -62,6 +75,8 @@ Options:\n\
     -f <file>     Config file (default: " CONFIG_FILE ")\n\
     -h            Display this help\n\
     -m            Stand-alone daemon mode, meant mostly for testing\n\
+    -N <addr>     Don't look up hostnames of clients connecting to addr\n\
+    -o <opt=val>  Set a stand-alone daemon tunable (see remctld(8))\n\
     -P <file>     Write PID to file, only useful with -m\n\
     -p <port>     Port to use, only for standalone mode (default: 4373)\n\
     -S            Log to standard output/error rather than syslog\n\
@@ -83,8 +98,116 @@ struct options {
     const char *config_path;    /* -f: path to the configuration file */
     const char *pid_path;       /* -P: path to the PID file to write */
     struct vector *bindaddrs;   /* -b: bind to a specific address */
+
+    /* Tunables set with -o. */
+    unsigned long max_workers;  /* Size of worker pool, 0 to fork per conn */
+    unsigned long min_workers;  /* Minimum number of pool workers */
+    unsigned long spare_workers; /* Idle pool workers to keep around */
+    unsigned long max_requests; /* Connections per pool worker, 0 for any */
+    unsigned long listen_backlog; /* Listen queue size, 0 for system max */
+    unsigned long reuseport;    /* Whether pool workers have own sockets */
+    struct limits limits;       /* Concurrency limits, 0 for none */
+    unsigned long localgroup_ttl; /* Seconds to cache localgroup lookups */
+    unsigned long localgroup_negative_ttl; /* Same for failed lookups */
+    unsigned long cache_entries; /* Entries in output cache, 0 for none */
+    unsigned long cache_entry_size; /* Maximum size of a cached output */
+    unsigned long coalesce_wait; /* Milliseconds to wait for same command */
+    unsigned long compress_min; /* Smallest output token to compress */
+    unsigned long backend_check; /* Seconds between backend health checks */
+    unsigned long output_batch; /* Bytes of output to batch into a token */
+    unsigned long output_delay; /* Milliseconds to hold back output */
+    unsigned long worker_connections; /* Connections each worker multiplexes */
+    unsigned long auth_threads; /* Threads per worker accepting contexts */
+    unsigned long park_idle;    /* Milliseconds before parking idle conns */
+    unsigned long hostname_cache_entries; /* Cached hostnames, 0 for none */
+    unsigned long hostname_ttl; /* Seconds to cache hostnames */
+    unsigned long hostname_negative_ttl; /* Same for failed lookups */
+    unsigned long replay_cache_entries; /* Shared replay cache, 0 for none */
+    unsigned long replay_cache_ttl; /* Seconds to remember authenticators */
 };
 
+/* Holds information about a tunable that can be set with -o. */
+struct tunable {
+    const char *name;           /* Name of the tunable. */
+    size_t offset;              /* Offset of the value in struct options. */
+};
+
+/* The table of tunables, mapping names to struct options members. */
+#define OFFSET(member) offsetof(struct options, member)
+static const struct tunable tunables[] = {
+    { "auth-threads",            OFFSET(auth_threads) },
+    { "backend-check",           OFFSET(backend_check) },
+    { "cache-entries",           OFFSET(cache_entries) },
+    { "cache-entry-size",        OFFSET(cache_entry_size) },
+    { "coalesce-wait",           OFFSET(coalesce_wait) },
+    { "compress-min",            OFFSET(compress_min) },
+    { "hostname-cache-entries",  OFFSET(hostname_cache_entries) },
+    { "hostname-negative-ttl",   OFFSET(hostname_negative_ttl) },
+    { "hostname-ttl",            OFFSET(hostname_ttl) },
+    { "localgroup-negative-ttl", OFFSET(localgroup_negative_ttl) },
+    { "listen-backlog",          OFFSET(listen_backlog) },
+    { "localgroup-ttl",          OFFSET(localgroup_ttl) },
+    { "max-commands",            OFFSET(limits.commands) },
+    { "max-connections",         OFFSET(limits.connections) },
+    { "max-requests",            OFFSET(max_requests) },
+    { "max-user-commands",       OFFSET(limits.user_commands) },
+    { "max-user-connections",    OFFSET(limits.user_connections) },
+    { "max-workers",             OFFSET(max_workers) },
+    { "min-workers",             OFFSET(min_workers) },
+    { "output-batch",            OFFSET(output_batch) },
+    { "output-delay",            OFFSET(output_delay) },
+    { "park-idle",               OFFSET(park_idle) },
+    { "replay-cache-entries",    OFFSET(replay_cache_entries) },
+    { "replay-cache-ttl",        OFFSET(replay_cache_ttl) },
+    { "reuseport",               OFFSET(reuseport) },
+    { "spare-workers",           OFFSET(spare_workers) },
+    { "worker-connections",      OFFSET(worker_connections) },
+    { NULL,                      0 }
+};
+
+/*
+ * The number of connection scoreboard slots to use when enforcing per-user
+ * limits without a limit on the total number of connections.
+ */
+#define LIMITS_SLOTS 1024
+
+/*
+ * The most connections to accept from a listening socket in one go before
+ * going back to check for signals and reap children.
+ */
+#define ACCEPT_BATCH 64
+
+/* How often, in seconds, to warn about a full listen queue. */
+#define BACKLOG_WARN_INTERVAL 60
+
+/*
+ * States of a worker in the pre-forked worker pool.  Each worker updates only
+ * the state in its own slot of the scoreboard, and the parent only sets pid
+ * and stopping, so no locking is needed.
+ */
+enum worker_state {
+    WORKER_EMPTY = 0,           /* Slot is not in use. */
+    WORKER_STARTING,            /* Forked but not yet waiting for clients. */
+    WORKER_IDLE,                /* Waiting for a connection. */
+    WORKER_BUSY                 /* Handling a connection. */
+};
+
+/*
+ * A slot in the worker pool scoreboard.  The scoreboard lives in anonymous
+ * shared memory so that the parent can see the state of each worker.
+ */
+struct worker {
+    pid_t pid;                  /* Process ID of the worker. */
+    volatile sig_atomic_t state; /* The enum worker_state of the worker. */
+    volatile sig_atomic_t stopping; /* Set when the worker was told to exit. */
+    unsigned long served;       /* Connections handled by the worker. */
+};
+
+/* Some systems only provide the older name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
 
 /*
  * Display the usage message for remctld.
@@ -115,6 +238,39 @@ usage(int status)
 }
 
 
+/*
+ * Parse a tunable setting given with -o, which must be of the form
+ * <name>=<value> where <value> is a non-negative number, and store it in the
+ * options struct.  Dies on any error.
+ */
+static void
+parse_tunable(struct options *options, const char *setting)
+{
+    const struct tunable *tunable;
+    const char *value;
+    char *end;
+    size_t length;
+    unsigned long number;
+
+    value = strchr(setting, '=');
+    if (value == NULL || value == setting)
+        die("invalid tunable setting %s", setting);
+    length = value - setting;
+    value++;
+    for (tunable = tunables; tunable->name != NULL; tunable++)
+        if (strlen(tunable->name) == length)
+            if (strncmp(tunable->name, setting, length) == 0)
+                break;
+    if (tunable->name == NULL)
+        die("unknown tunable %.*s", (int) length, setting);
+    errno = 0;
+    number = strtoul(value, &end, 10);
+    if (errno != 0 || *value == '\0' || *value == '-' || *end != '\0')
+        die("invalid value %s for tunable %s", value, tunable->name);
+    *(unsigned long *) ((char *) options + tunable->offset) = number;
+}
+
+
 /*
  * Signal handler for child processes forked when running in standalone mode.
  * Just set the child_signaled global so that we know to reap the processes
@@ -151,6 +307,18 @@ exit_handler(int sig UNUSED)
 }
 
 
+/*
+ * Signal handler for the alarm used to schedule health checks of persistent
+ * backend processes when running in standalone mode.  Set the check_signaled
+ * global so that we do this the next time through the processing loop.
+ */
+static void
+check_handler(int sig UNUSED)
+{
+    check_signaled = 1;
+}
+
+
 /*
  * Given a service name, imports it and acquires credentials for it, storing
  * them in the second argument.  Returns true on success and false on failure,
@@ -185,6 +353,85 @@ acquire_creds(char *service, gss_cred_id_t *creds)
 }
 
 
+/*
+ * Close a connection that we've rejected after sending it an error.  The
+ * client will normally have sent its first command already, and closing a
+ * socket with unread data may reset the connection and discard our error
+ * before the client reads it.  So stop sending, and then read and discard
+ * whatever the client sends until it closes the connection or a second
+ * passes.  Frees the client.
+ */
+static void
+reject_client(struct client *client)
+{
+    char buffer[BUFSIZ];
+    struct pollfd pfd;
+    time_t end;
+    ssize_t status;
+
+    if (shutdown(client->fd, SHUT_WR) == 0) {
+        end = time(NULL) + 1;
+        while (time(NULL) <= end) {
+            pfd.fd = client->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            status = poll(&pfd, 1, 1000);
+            if (status < 0 && errno == EINTR)
+                continue;
+            if (status <= 0)
+                break;
+            if (read(client->fd, buffer, sizeof(buffer)) <= 0)
+                break;
+        }
+    }
+    server_limits_disconnect();
+    server_free_client(client);
+}
+
+
+/*
+ * Process requests from a client with an established security context,
+ * checking the ACL file as appropriate and spawning commands, and then free
+ * the client.  This function only returns when the client connection has
+ * completed or the connection was parked.
+ */
+static void
+serve_client(struct client *client, struct config *config)
+{
+    /*
+     * If the connection is over the concurrency limits, tell a protocol v2
+     * client why right away and close the connection so that it doesn't
+     * hold a process while it decides what to send.  Protocol v1 has no way
+     * to send an error except in reply to a command, so for those clients we
+     * have to read the first command, and server_run_command will send the
+     * error.
+     */
+    if (!server_limits_connect(client->user)) {
+        if (client->protocol == 1)
+            client->busy = true;
+        else {
+            client->error(client, ERROR_BUSY, "Too many connections");
+            reject_client(client);
+            return;
+        }
+    }
+
+    /*
+     * Now, we process incoming commands.  This is handled differently
+     * depending on the protocol version.  These functions won't exit until
+     * the client is done sending commands and we're done replying.
+     */
+    if (client->protocol == 1)
+        server_v1_handle_messages(client, config);
+    else
+        server_v2_handle_messages(client, config);
+
+    /* We're done; shut down the client connection. */
+    server_limits_disconnect();
+    server_free_client(client);
+}
+
+
 /*
  * Handle the interaction with the client.  Takes the client file descriptor,
  * the server configuration, and the server credentials.  Establishes a
@@ -206,19 +453,7 @@ handle_connection(int fd, struct config *config, gss_cred_id_t creds)
     }
     debug("accepted connection from %s (protocol %d)", client->user,
           client->protocol);
-
-    /*
-     * Now, we process incoming commands.  This is handled differently
-     * depending on the protocol version.  These functions won't exit until
-     * the client is done sending commands and we're done replying.
-     */
-    if (client->protocol == 1)
-        server_v1_handle_messages(client, config);
-    else
-        server_v2_handle_messages(client, config);
-
-    /* We're done; shut down the client connection. */
-    server_free_client(client);
+    serve_client(client, config);
 }
 
 
@@ -265,6 +500,24 @@ is_ipv6(const char *string UNUSED)
 #endif
 
 
+/*
+ * Start listening on a bound socket, using the listen queue size set with the
+ * listen-backlog tunable.  Dies on failure.
+ */
+static void
+listen_socket(struct options *options, socket_type fd)
+{
+    int backlog = SOMAXCONN;
+
+    if (options->listen_backlog > INT_MAX)
+        backlog = INT_MAX;
+    else if (options->listen_backlog > 0)
+        backlog = (int) options->listen_backlog;
+    if (listen(fd, backlog) < 0)
+        sysdie("error listening on socket");
+}
+
+
 /*
  * Bind the listening socket or sockets on which we accept requests and return
  * a list of sockets in the fds parameter.  Return a count of sockets in the
@@ -273,6 +526,12 @@ is_ipv6(const char *string UNUSED)
  * Handle the socket activation case where the socket has already been set up
  * for us by systemd and, in that case, just return the already-configured
  * socket.
+ *
+ * If the reuseport tunable is set with a worker pool, bind the sockets with
+ * SO_REUSEPORT but don't listen on them.  They then only reserve the
+ * addresses, and each worker listens on its own sockets for the same
+ * addresses (see worker_sockets).  This isn't possible with sockets from
+ * systemd, so in that case reuseport is turned off with a warning.
  */
 static void
 bind_sockets(struct options *options, socket_type **fds,
@@ -282,6 +541,7 @@ bind_sockets(struct options *options, socket_type **fds,
     size_t i;
     const char *addr;
     socket_type fd;
+    bool shared;
 
     /* Check whether systemd has already bound the sockets. */
     status = sd_listen_fds(true);
@@ -292,8 +552,13 @@ bind_sockets(struct options *options, socket_type **fds,
         for (i = 0; i < (size_t) status; i++)
             (*fds)[i] = SD_LISTEN_FDS_START + i;
         *count = status;
+        if (options->reuseport && options->max_workers > 0)
+            warn("reuseport cannot be used with sockets from systemd");
+        options->reuseport = 0;
         return;
     }
+    shared = (options->reuseport && options->max_workers > 0);
+    network_bind_reuseport(shared);
 
     /*
      * We have to do the work ourselves.  If there is no bind address, bind to
@@ -303,9 +568,9 @@ bind_sockets(struct options *options, socket_type **fds,
     if (options->bindaddrs->count == 0) {
         if (!network_bind_all(SOCK_STREAM, options->port, fds, count))
             sysdie("cannot bind any sockets");
-        for (i = 0; i < *count; i++)
-            if (listen((*fds)[i], 5) < 0)
-                sysdie("error listening on socket");
+        if (!shared)
+            for (i = 0; i < *count; i++)
+                listen_socket(options, (*fds)[i]);
         return;
     }
 
@@ -323,8 +588,8 @@ bind_sockets(struct options *options, socket_type **fds,
             fd = network_bind_ipv4(SOCK_STREAM, addr, options->port);
         if (fd == INVALID_SOCKET)
             sysdie("cannot bind to address %s, port %hu", addr, options->port);
-        if (listen(fd, 5) < 0)
-            sysdie("error listening on socket");
+        if (!shared)
+            listen_socket(options, fd);
         (*fds)[i] = fd;
     }
 }
@@ -358,26 +623,591 @@ write_pidfile(pid_t pid, const char *path)
 }
 
 
+/*
+ * Clean up and exit in a child process forked by the stand-alone server once
+ * it is done handling connections.  This releases everything inherited from
+ * the parent, which is not strictly necessary but helps valgrind testing.
+ */
+static void
+child_exit(struct options *options, struct config *config,
+           gss_cred_id_t creds)
+{
+    OM_uint32 minor;
+
+    if (creds != GSS_C_NO_CREDENTIAL)
+        gss_release_cred(&minor, &creds);
+    if (options->log_stdout)
+        fflush(stdout);
+    server_config_free(config);
+    vector_free(options->bindaddrs);
+    libevent_global_shutdown();
+    message_handlers_reset();
+    exit(0);
+}
+
+
+/*
+ * Re-read the configuration file in response to a signal, replacing the
+ * current configuration.  Returns the new configuration.
+ */
+static struct config *
+reload_config(struct options *options, struct config *config)
+{
+    notice("re-reading configuration");
+    server_cache_clear();
+    server_backend_stop();
+    server_config_free(config);
+    config = server_config_load(options->config_path);
+    if (config == NULL)
+        die("cannot load configuration file %s", options->config_path);
+    server_resolve_configure(config);
+    server_backend_start(config);
+    return config;
+}
+
+
+/*
+ * Check whether the listen queue of a socket that is ready for accept is
+ * full, and if so, warn that new connections may be dropped.  The warning is
+ * repeated at most once every BACKLOG_WARN_INTERVAL seconds.  For a listening
+ * socket, Linux reports the number of connections waiting to be accepted in
+ * tcpi_unacked and the size of the listen queue in tcpi_sacked.  Other
+ * systems don't provide this information, so this does nothing there.
+ */
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_SACKED
+static void
+check_backlog(socket_type fd)
+{
+    static time_t last = 0;
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    time_t now;
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0)
+        return;
+    if (info.tcpi_sacked == 0 || info.tcpi_unacked < info.tcpi_sacked)
+        return;
+    now = time(NULL);
+    if (last != 0 && now - last < BACKLOG_WARN_INTERVAL)
+        return;
+    last = now;
+    warn("listen queue full (%lu connections), new connections may be"
+         " dropped", (unsigned long) info.tcpi_sacked);
+}
+#else
+static void
+check_backlog(socket_type fd UNUSED)
+{
+}
+#endif
+
+
+/*
+ * Create the listening sockets for a worker when the reuseport tunable is
+ * set.  For each of the sockets bound by the parent, create a new socket
+ * bound to the same address, listen on it, and close our copy of the parent's
+ * socket.  The kernel then spreads incoming connections across the workers
+ * rather than waking all of them for each connection.  Returns the new array
+ * of sockets, or NULL on failure.
+ */
+static socket_type *
+worker_sockets(struct options *options, socket_type *fds, unsigned int nfds)
+{
+    socket_type *own;
+    unsigned int i;
+
+    own = xcalloc(nfds, sizeof(socket_type));
+    for (i = 0; i < nfds; i++) {
+        own[i] = network_bind_shared(fds[i]);
+        if (own[i] == INVALID_SOCKET) {
+            while (i-- > 0)
+                close(own[i]);
+            free(own);
+            return NULL;
+        }
+        listen_socket(options, own[i]);
+        fdflag_nonblocking(own[i], true);
+        fdflag_close_exec(own[i], true);
+    }
+    for (i = 0; i < nfds; i++)
+        close(fds[i]);
+    return own;
+}
+
+
+/*
+ * The main loop of a worker in the pre-forked worker pool if the
+ * worker-connections tunable is set.  Rather than handling one connection at
+ * a time, the worker hands each connection it accepts to the event engine,
+ * which handles up to worker-connections of them at once.  The worker is
+ * idle as long as it has room for another connection and isn't handling a
+ * message, which may run a command.  Once told to exit or after accepting
+ * its maximum number of connections, it stops accepting connections and
+ * exits once the ones it has are finished.
+ */
+static void
+pool_worker_engine(struct options *options, struct config *config,
+                   gss_cred_id_t creds, socket_type *fds, unsigned int nfds,
+                   struct worker *self, int notify)
+{
+    struct engine *engine;
+    socket_type fd, s;
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    ssize_t status;
+    size_t max = options->worker_connections;
+    bool accepting = true;
+    const char byte = 0;
+
+    engine = server_engine_new(config, creds, max, options->auth_threads);
+    server_engine_listen(engine, fds, nfds);
+    while (accepting || server_engine_count(engine) > 0) {
+        if (exit_signaled || self->stopping)
+            accepting = false;
+        if (options->max_requests > 0 && self->served >= options->max_requests)
+            accepting = false;
+        if (server_engine_pending(engine)) {
+            if (self->state != WORKER_BUSY) {
+                self->state = WORKER_BUSY;
+                status = write(notify, &byte, 1);
+                if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    syswarn("cannot notify parent of busy worker");
+            }
+            server_engine_run(engine);
+            continue;
+        }
+        if (accepting && server_engine_count(engine) < max)
+            self->state = WORKER_IDLE;
+        else
+            self->state = WORKER_BUSY;
+        fd = server_engine_wait(engine, accepting);
+        if (fd == INVALID_SOCKET)
+            continue;
+        check_backlog(fd);
+        sslen = sizeof(ss);
+        s = network_accept(fd, (struct sockaddr *) &ss, &sslen);
+        if (s == INVALID_SOCKET) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            if (errno == ECONNABORTED)
+                continue;
+            syswarn("error accepting incoming connection");
+            accepting = false;
+            continue;
+        }
+        self->served++;
+        fdflag_nonblocking(s, false);
+        server_engine_add(engine, s);
+        if (server_engine_count(engine) >= max)
+            self->state = WORKER_BUSY;
+        status = write(notify, &byte, 1);
+        if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            syswarn("cannot notify parent of busy worker");
+    }
+    server_engine_free(engine);
+}
+
+
+/*
+ * The main loop of a worker in the pre-forked worker pool.  Accept
+ * connections directly from the listening sockets and handle them one after
+ * another until told to exit or until the worker has handled its maximum
+ * number of connections.  Each time we start handling a connection, write a
+ * byte to the notify pipe so that the parent wakes up and can start more
+ * workers if we're running low on idle ones.
+ *
+ * If the reuseport tunable is set, the worker first creates its own
+ * listening sockets for the same addresses.  If the worker-connections
+ * tunable is set, the worker uses pool_worker_engine instead to handle
+ * several connections at once.
+ */
+static void
+pool_worker(struct options *options, struct config *config,
+            gss_cred_id_t creds, socket_type *fds, unsigned int nfds,
+            struct worker *self, int notify)
+{
+    socket_type fd, s;
+    socket_type *own = NULL;
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    ssize_t status;
+    unsigned int i;
+    const char byte = 0;
+
+    if (options->reuseport) {
+        own = worker_sockets(options, fds, nfds);
+        if (own == NULL)
+            return;
+        fds = own;
+    }
+    if (options->worker_connections > 1) {
+        pool_worker_engine(options, config, creds, fds, nfds, self, notify);
+        goto done;
+    }
+    while (!exit_signaled && !self->stopping) {
+        if (options->max_requests > 0 && self->served >= options->max_requests)
+            break;
+        self->state = WORKER_IDLE;
+        fd = network_wait_any(fds, nfds);
+        if (fd == INVALID_SOCKET) {
+            if (errno == EINTR)
+                continue;
+            syswarn("error waiting for incoming connection");
+            break;
+        }
+        check_backlog(fd);
+        sslen = sizeof(ss);
+        s = network_accept(fd, (struct sockaddr *) &ss, &sslen);
+        if (s == INVALID_SOCKET) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            if (errno == ECONNABORTED)
+                continue;
+            syswarn("error accepting incoming connection");
+            break;
+        }
+        self->state = WORKER_BUSY;
+        self->served++;
+        status = write(notify, &byte, 1);
+        if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            syswarn("cannot notify parent of busy worker");
+
+        /*
+         * Some systems have accepted sockets inherit the non-blocking flag
+         * of the listening socket, so make sure it's cleared.
+         */
+        fdflag_nonblocking(s, false);
+        handle_connection(s, config, creds);
+    }
+
+done:
+    if (own != NULL) {
+        for (i = 0; i < nfds; i++)
+            close(own[i]);
+        network_bind_all_free(own);
+    }
+}
+
+
+/*
+ * Start a new pool worker in the given scoreboard slot.  The parent just
+ * records the PID of the child; the child runs the worker loop and then
+ * exits.  The worker uses the slot of the same number in the connection
+ * scoreboard used for concurrency limits.  Returns false if we were unable to
+ * fork.
+ */
+static bool
+pool_spawn(struct options *options, struct config *config,
+           gss_cred_id_t creds, socket_type *fds, unsigned int nfds,
+           struct worker *workers, size_t n, int notify[2],
+           const struct sigaction *oldsa)
+{
+    struct worker *slot = &workers[n];
+    pid_t child;
+
+    slot->pid = 0;
+    slot->state = WORKER_STARTING;
+    slot->stopping = 0;
+    slot->served = 0;
+    server_limits_claim((long) n);
+    fflush(stdout);
+    child = fork();
+    if (child < 0) {
+        syswarn("forking a new worker failed");
+        server_limits_assign((long) n, 0);
+        slot->state = WORKER_EMPTY;
+        return false;
+    } else if (child == 0) {
+        close(notify[0]);
+        if (sigaction(SIGCHLD, oldsa, NULL) < 0)
+            syswarn("cannot reset SIGCHLD handler");
+        server_limits_enter((long) n);
+        pool_worker(options, config, creds, fds, nfds, slot, notify[1]);
+        close(notify[1]);
+        child_exit(options, config, creds);
+    }
+    slot->pid = child;
+    server_limits_assign((long) n, child);
+    debug("worker %lu started", (unsigned long) child);
+    return true;
+}
+
+
+/*
+ * Tell a worker to exit.  Idle workers are interrupted and exit immediately;
+ * busy workers finish their current connection first.
+ */
+static void
+pool_stop(struct worker *slot)
+{
+    slot->stopping = 1;
+    if (slot->pid > 0 && kill(slot->pid, SIGTERM) < 0 && errno != ESRCH)
+        syswarn("cannot signal worker %lu", (unsigned long) slot->pid);
+}
+
+
+/*
+ * Adjust the size of the worker pool.  Start enough workers to satisfy the
+ * minimum pool size and the desired number of spare idle workers without
+ * exceeding the maximum, or, if we have more idle workers than we want, stop
+ * one of them.  Only one worker is stopped per call so that the pool shrinks
+ * gradually after a burst.  Workers that are still starting are counted as
+ * idle so that we don't start too many.
+ */
+static void
+pool_adjust(struct options *options, struct config *config,
+            gss_cred_id_t creds, socket_type *fds, unsigned int nfds,
+            struct worker *workers, size_t nslots, int notify[2],
+            const struct sigaction *oldsa)
+{
+    size_t i;
+    unsigned long total = 0;
+    unsigned long idle = 0;
+    unsigned long wanted = 0;
+    struct worker *victim = NULL;
+
+    for (i = 0; i < nslots; i++) {
+        if (workers[i].state == WORKER_EMPTY || workers[i].stopping)
+            continue;
+        total++;
+        if (workers[i].state != WORKER_BUSY) {
+            idle++;
+            if (workers[i].state == WORKER_IDLE)
+                victim = &workers[i];
+        }
+    }
+    if (total < options->min_workers)
+        wanted = options->min_workers - total;
+    if (idle < options->spare_workers)
+        if (options->spare_workers - idle > wanted)
+            wanted = options->spare_workers - idle;
+    if (total + wanted > options->max_workers)
+        wanted = options->max_workers - total;
+
+    /* Start new workers in any free slots. */
+    for (i = 0; i < nslots && wanted > 0; i++) {
+        if (workers[i].state != WORKER_EMPTY)
+            continue;
+        if (!pool_spawn(options, config, creds, fds, nfds, workers, i, notify,
+                        oldsa))
+            break;
+        wanted--;
+    }
+
+    /* Otherwise, stop an idle worker if we have too many. */
+    if (idle > options->spare_workers && total > options->min_workers)
+        if (victim != NULL)
+            pool_stop(victim);
+}
+
+
+/*
+ * Run the pre-forked worker pool.  The parent never accepts connections
+ * itself.  It only supervises the workers, reaping them when they exit and
+ * starting new ones to keep the pool at the desired size.  On a request to
+ * re-read the configuration, all existing workers are told to exit after
+ * their current connection and are replaced with workers that inherit the
+ * new configuration.
+ *
+ * The scoreboard has twice as many slots as the maximum number of workers so
+ * that workers that are finishing a connection after being told to stop
+ * don't keep us from starting their replacements.
+ *
+ * Returns the current configuration, which may have been reloaded.
+ */
+static struct config *
+server_pool(struct options *options, struct config *config,
+            gss_cred_id_t creds, socket_type *fds, unsigned int nfds,
+            const struct sigaction *oldsa)
+{
+    struct worker *workers;
+    size_t nslots, i;
+    int notify[2];
+    pid_t child;
+    int status;
+    struct pollfd pfd;
+    char buffer[BUFSIZ];
+
+    /* Allocate the scoreboard in shared memory. */
+    nslots = options->max_workers * 2;
+    workers = mmap(NULL, nslots * sizeof(struct worker),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED)
+        sysdie("cannot allocate worker scoreboard");
+    memset(workers, 0, nslots * sizeof(struct worker));
+
+    /*
+     * The workers wake us up by writing to this pipe.  Make both ends
+     * non-blocking so that neither side can ever stall the other.
+     */
+    if (pipe(notify) < 0)
+        sysdie("cannot create worker notification pipe");
+    fdflag_nonblocking(notify[0], true);
+    fdflag_nonblocking(notify[1], true);
+    fdflag_close_exec(notify[0], true);
+    fdflag_close_exec(notify[1], true);
+
+    /* The supervision loop. */
+    while (1) {
+        if (child_signaled) {
+            child_signaled = 0;
+            while ((child = waitpid(0, &status, WNOHANG)) > 0) {
+                if (!server_backend_reap(child, status))
+                    log_child(child, status);
+                server_limits_reap(child);
+                for (i = 0; i < nslots; i++)
+                    if (workers[i].pid == child) {
+                        workers[i].pid = 0;
+                        workers[i].state = WORKER_EMPTY;
+                        break;
+                    }
+            }
+            if (child < 0 && errno != ECHILD)
+                sysdie("waitpid failed");
+            server_backend_check(false);
+        }
+        if (check_signaled) {
+            check_signaled = 0;
+            server_backend_check(true);
+            alarm(options->backend_check);
+        }
+        if (config_signaled) {
+            config_signaled = 0;
+            config = reload_config(options, config);
+            for (i = 0; i < nslots; i++)
+                if (workers[i].state != WORKER_EMPTY && !workers[i].stopping)
+                    pool_stop(&workers[i]);
+        }
+        if (exit_signaled) {
+            notice("signal received, exiting");
+            break;
+        }
+        pool_adjust(options, config, creds, fds, nfds, workers, nslots,
+                    notify, oldsa);
+
+        /*
+         * Wait for a worker to tell us it's busy, for a signal, or for a
+         * second to pass, whichever comes first, and then drain the pipe.
+         */
+        pfd.fd = notify[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        status = poll(&pfd, 1, 1000);
+        if (status < 0 && errno != EINTR)
+            sysdie("error waiting for workers");
+        if (status > 0)
+            while (read(notify[0], buffer, sizeof(buffer)) > 0)
+                ;
+    }
+
+    /* Tell all the workers to exit and clean up. */
+    for (i = 0; i < nslots; i++)
+        if (workers[i].state != WORKER_EMPTY)
+            pool_stop(&workers[i]);
+    close(notify[0]);
+    close(notify[1]);
+    munmap(workers, nslots * sizeof(struct worker));
+    return config;
+}
+
+
+/*
+ * Fork a child to handle a newly accepted connection, or a parked connection
+ * if resume is not NULL.  If concurrency limits are set and the scoreboard is
+ * full, close the connection immediately instead.  The child closes the
+ * listening sockets, handles the connection, and exits.
+ */
+static void
+fork_child(struct options *options, struct config *config,
+           gss_cred_id_t creds, socket_type *fds, unsigned int nfds,
+           socket_type s, const struct sockaddr *addr, bool limited,
+           struct parked *resume, const struct sigaction *oldsa)
+{
+    struct client *client;
+    pid_t child;
+    long slot = -1;
+    unsigned int i;
+    char ip[INET6_ADDRSTRLEN];
+
+    if (limited) {
+        slot = server_limits_reserve();
+        if (slot < 0) {
+            network_sockaddr_sprint(ip, sizeof(ip), addr);
+            warn("too many children, closing connection from %s", ip);
+            if (resume != NULL)
+                server_park_free(resume);
+            close(s);
+            return;
+        }
+    }
+    child = fork();
+    if (child < 0) {
+        syswarn("forking a new child failed");
+        server_limits_assign(slot, 0);
+        if (resume != NULL)
+            server_park_free(resume);
+        close(s);
+        warn("sleeping ten seconds in the hope we recover...");
+        sleep(10);
+    } else if (child == 0) {
+        for (i = 0; i < nfds; i++)
+            close(fds[i]);
+        network_bind_all_free(fds);
+        if (sigaction(SIGCHLD, oldsa, NULL) < 0)
+            syswarn("cannot reset SIGCHLD handler");
+        server_park_child();
+        server_limits_enter(slot);
+        if (resume == NULL) {
+            handle_connection(s, config, creds);
+        } else {
+            client = server_park_resume(resume);
+            if (client != NULL)
+                serve_client(client, config);
+        }
+        child_exit(options, config, creds);
+    } else {
+        server_limits_assign(slot, child);
+        if (resume != NULL)
+            server_park_free(resume);
+        close(s);
+        network_sockaddr_sprint(ip, sizeof(ip), addr);
+        debug("child %lu for %s", (unsigned long) child, ip);
+    }
+}
+
+
 /*
  * Run as a daemon.  This is the main dispatch loop, which listens for network
  * connections, forks a child to process each connection, and reaps the
  * children when they're done.  This is only used in standalone mode; when run
  * from inetd or tcpserver, remctld processes one connection and then exits.
+ *
+ * Each time a listening socket is ready, accept all of the connections
+ * waiting on it (up to ACCEPT_BATCH) before going back to wait again, so that
+ * a burst of connections doesn't overflow the listen queue while we handle
+ * them one at a time.
+ *
+ * If a worker pool was requested, hand off to server_pool instead, which
+ * pre-forks workers that accept connections themselves.  If parking of idle
+ * connections was requested, also watch the parked connections and fork a
+ * child to resume each one when the client sends something.
+ *
+ * Returns the current configuration, which may have been reloaded.
  */
-static void
+static struct config *
 server_daemon(struct options *options, struct config *config,
               gss_cred_id_t creds)
 {
-    socket_type s;
-    unsigned int nfds, i;
-    socket_type *fds;
+    socket_type fd, s;
+    unsigned int nfds, nwatch, i, n;
+    socket_type *fds, *watch;
+    struct parked *resume;
     pid_t child;
     int status;
+    bool limited;
     struct sigaction sa, oldsa;
     struct sockaddr_storage ss;
     socklen_t sslen;
-    char ip[INET6_ADDRSTRLEN];
-    OM_uint32 minor;
 
     /* Set up a SIGCHLD handler so that we know when to reap children. */
     memset(&sa, 0, sizeof(sa));
@@ -397,8 +1227,22 @@ server_daemon(struct options *options, struct config *config,
     if (sigaction(SIGHUP, &sa, NULL) < 0)
         sysdie("cannot set SIGHUP handler");
 
-    /* Bind to the network sockets and configure listening addresses. */
+    /* Set up a SIGALRM handler to schedule backend health checks. */
+    sa.sa_handler = check_handler;
+    if (sigaction(SIGALRM, &sa, NULL) < 0)
+        sysdie("cannot set SIGALRM handler");
+
+    /*
+     * Bind to the network sockets and configure listening addresses.  The
+     * listening sockets are made non-blocking so that we can accept until
+     * there are no more waiting connections, and so that pool workers that
+     * lose the race for a connection don't block.
+     */
     bind_sockets(options, &fds, &nfds);
+    for (i = 0; i < nfds; i++) {
+        fdflag_nonblocking(fds[i], true);
+        fdflag_close_exec(fds[i], true);
+    }
 
     /*
      * Set up our PID file now that we're ready to accept connections, so that
@@ -420,69 +1264,124 @@ server_daemon(struct options *options, struct config *config,
         if (raise(SIGSTOP) < 0)
             syswarn("cannot notify upstart of startup");
 
+    /*
+     * If there are any concurrency limits, set up the scoreboard used to
+     * enforce them.  With a worker pool, each worker has a slot.  Otherwise,
+     * we allow for twice as many children as the connection limit, since
+     * children rejecting connections still need a slot until they exit.
+     */
+    limited = (options->limits.connections > 0
+               || options->limits.user_connections > 0
+               || options->limits.commands > 0
+               || options->limits.user_commands > 0);
+    if (limited) {
+        if (options->max_workers > 0)
+            server_limits_init(&options->limits, options->max_workers * 2);
+        else if (options->limits.connections > 0)
+            server_limits_init(&options->limits,
+                               options->limits.connections * 2);
+        else
+            server_limits_init(&options->limits, LIMITS_SLOTS);
+    }
+
+    /* Set up the cache of command output shared by all children. */
+    if (options->cache_entries > 0 && options->cache_entry_size > 0)
+        server_cache_init(options->cache_entries, options->cache_entry_size);
+
+    /* Set up the cache of client hostnames shared by all children. */
+    server_resolve_init(options->hostname_cache_entries,
+                        options->hostname_ttl, options->hostname_negative_ttl);
+
+    /* Start any persistent backend processes and schedule health checks. */
+    server_backend_start(config);
+    if (options->backend_check > 0)
+        alarm(options->backend_check);
+
+    /* If running a worker pool, the workers do all of the accepting. */
+    if (options->max_workers > 0) {
+        config = server_pool(options, config, creds, fds, nfds, &oldsa);
+        goto done;
+    }
+
+    /* Set up parking of idle connections if requested. */
+    watch = fds;
+    nwatch = nfds;
+    if (options->park_idle > 0)
+        server_park_start(options->park_idle);
+
     /*
      * The main processing loop.  Each time through the loop, check to see if
      * we need to reap children, check to see if we should re-read our
      * configuration, and check to see if we're exiting.  Then see if we have
      * a new connection, and if so, fork a child to handle it.
      *
-     * Note that there are no limits here on the number of simultaneous
-     * processes, so you may want to set system resource limits to prevent an
-     * attacker from consuming all available processes.
+     * Unless concurrency limits are set, there are no limits here on the
+     * number of simultaneous processes, so you may want to set system
+     * resource limits to prevent an attacker from consuming all available
+     * processes.  If limits are set and the scoreboard is full, close new
+     * connections immediately without forking.
      */
     while (1) {
         if (child_signaled) {
             child_signaled = 0;
-            while ((child = waitpid(0, &status, WNOHANG)) > 0)
-                log_child(child, status);
+            while ((child = waitpid(0, &status, WNOHANG)) > 0) {
+                if (!server_backend_reap(child, status))
+                    log_child(child, status);
+                server_limits_reap(child);
+            }
             if (child < 0 && errno != ECHILD)
                 sysdie("waitpid failed");
+            server_backend_check(false);
+        }
+        if (check_signaled) {
+            check_signaled = 0;
+            server_backend_check(true);
+            alarm(options->backend_check);
         }
         if (config_signaled) {
             config_signaled = 0;
-            notice("re-reading configuration");
-            server_config_free(config);
-            config = server_config_load(options->config_path);
-            if (config == NULL)
-                die("cannot load configuration file %s", options->config_path);
+            config = reload_config(options, config);
         }
         if (exit_signaled) {
             notice("signal received, exiting");
             break;
         }
-        sslen = sizeof(ss);
-        s = network_accept_any(fds, nfds, (struct sockaddr *) &ss, &sslen);
-        if (s == INVALID_SOCKET) {
+        if (options->park_idle > 0) {
+            server_park_expire();
+            watch = server_park_watch(fds, nfds, &nwatch);
+        }
+        fd = network_wait_any(watch, nwatch);
+        if (fd == INVALID_SOCKET) {
             if (errno != EINTR)
-                sysdie("error accepting incoming connection");
+                sysdie("error waiting for incoming connection");
             continue;
         }
-        fdflag_close_exec(s, true);
-        child = fork();
-        if (child < 0) {
-            syswarn("forking a new child failed");
-            warn("sleeping ten seconds in the hope we recover...");
-            sleep(10);
-        } else if (child == 0) {
-            for (i = 0; i < nfds; i++)
-                close(fds[i]);
-            network_bind_all_free(fds);
-            if (sigaction(SIGCHLD, &oldsa, NULL) < 0)
-                syswarn("cannot reset SIGCHLD handler");
-            handle_connection(s, config, creds);
-            if (creds != GSS_C_NO_CREDENTIAL)
-                gss_release_cred(&minor, &creds);
-            if (options->log_stdout)
-                fflush(stdout);
-            server_config_free(config);
-            vector_free(options->bindaddrs);
-            libevent_global_shutdown();
-            message_handlers_reset();
-            exit(0);
-        } else {
-            close(s);
-            network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
-            debug("child %lu for %s", (unsigned long) child, ip);
+        if (options->park_idle > 0 && server_park_owns(fd)) {
+            resume = server_park_ready(fd);
+            if (resume == NULL)
+                continue;
+            s = server_park_fd(resume);
+            sslen = sizeof(ss);
+            if (getpeername(s, (struct sockaddr *) &ss, &sslen) < 0)
+                memset(&ss, 0, sizeof(ss));
+            fork_child(options, config, creds, fds, nfds, s,
+                       (struct sockaddr *) &ss, limited, resume, &oldsa);
+            continue;
+        }
+        check_backlog(fd);
+        for (n = 0; n < ACCEPT_BATCH && !exit_signaled; n++) {
+            sslen = sizeof(ss);
+            s = network_accept(fd, (struct sockaddr *) &ss, &sslen);
+            if (s == INVALID_SOCKET) {
+                if (errno == ECONNABORTED)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    break;
+                sysdie("error accepting incoming connection");
+            }
+            fdflag_nonblocking(s, false);
+            fork_child(options, config, creds, fds, nfds, s,
+                       (struct sockaddr *) &ss, limited, NULL, &oldsa);
         }
     }
 
@@ -490,11 +1389,19 @@ server_daemon(struct options *options, struct config *config,
      * Clean up resources at the end of the loop.  This is not strictly
      * necessary, but it helps valgrind testing.
      */
+done:
+    alarm(0);
+    server_park_stop();
+    server_backend_stop();
+    server_limits_free();
+    server_cache_free();
+    server_resolve_free();
     if (options->pid_path != NULL)
         unlink(options->pid_path);
     for (i = 0; i < nfds; i++)
         close(fds[i]);
     network_bind_all_free(fds);
+    return config;
 }
 
 
@@ -513,6 +1420,7 @@ main(int argc, char *argv[])
     gss_cred_id_t creds = GSS_C_NO_CREDENTIAL;
     OM_uint32 minor;
     struct config *config;
+    time_t min_ttl;
 
     /* Ignore SIGPIPE errors from our children. */
     memset(&sa, 0, sizeof(sa));
@@ -532,9 +1440,22 @@ main(int argc, char *argv[])
     options.port = 4373;
     options.config_path = CONFIG_FILE;
     options.bindaddrs = vector_new();
+    options.min_workers = 1;
+    options.spare_workers = 1;
+    options.cache_entries = 128;
+    options.cache_entry_size = 65536;
+    options.coalesce_wait = 10 * 1000;
+    options.backend_check = 60;
+    options.compress_min = 1024;
+    options.output_batch = 0;
+    options.output_delay = 10;
+    options.hostname_cache_entries = 1024;
+    options.hostname_ttl = 300;
+    options.hostname_negative_ttl = 60;
+    options.replay_cache_ttl = 600;
 
     /* Parse options. */
-    while ((option = getopt(argc, argv, "b:dFf:hk:mP:p:Ss:vZ")) != EOF) {
+    while ((option = getopt(argc, argv, "b:dFf:hk:mN:o:P:p:Ss:vZ")) != EOF) {
         switch (option) {
         case 'b':
             vector_add(options.bindaddrs, optarg);
@@ -558,6 +1479,12 @@ main(int argc, char *argv[])
         case 'm':
             options.standalone = true;
             break;
+        case 'N':
+            server_resolve_skip(optarg);
+            break;
+        case 'o':
+            parse_tunable(&options, optarg);
+            break;
         case 'P':
             options.pid_path = optarg;
             break;
@@ -588,6 +1515,38 @@ main(int argc, char *argv[])
         die("-b only makes sense in combination with -m");
     if (options.suspend && !options.standalone)
         die("-Z only makes sense in combination with -m");
+    if (options.max_workers > 0) {
+        if (!options.standalone)
+            die("a worker pool only makes sense in combination with -m");
+        if (options.min_workers > options.max_workers)
+            die("min-workers may not be larger than max-workers");
+        if (options.spare_workers > options.max_workers)
+            die("spare-workers may not be larger than max-workers");
+    }
+    if (options.park_idle > 0) {
+        if (!options.standalone)
+            die("park-idle only makes sense in combination with -m");
+        if (options.max_workers > 0)
+            die("park-idle cannot be used with max-workers");
+        if (options.limits.connections > 0
+            || options.limits.user_connections > 0)
+            die("connection limits cannot be used with park-idle");
+    }
+    if (options.auth_threads > 0 && options.worker_connections <= 1)
+        die("auth-threads only makes sense with worker-connections");
+    if (options.worker_connections > 1) {
+        if (options.max_workers == 0)
+            die("worker-connections only makes sense with max-workers");
+        if (options.limits.connections > 0
+            || options.limits.user_connections > 0)
+            die("connection limits cannot be used with worker-connections");
+    }
+    if (!options.standalone)
+        if (options.limits.connections > 0
+            || options.limits.user_connections > 0
+            || options.limits.commands > 0
+            || options.limits.user_commands > 0)
+            die("concurrency limits only make sense in combination with -m");
 
     /* Daemonize if told to do so. */
     if (options.standalone && !options.foreground)
@@ -611,9 +1570,34 @@ main(int argc, char *argv[])
     }
 
     /* Read the configuration file. */
+    server_config_set_localgroup_ttl(options.localgroup_ttl,
+                                     options.localgroup_negative_ttl);
+    server_v2_set_output_batch(options.output_batch, options.output_delay);
+    server_v2_set_compress_min(options.compress_min);
+    server_cache_set_wait(options.coalesce_wait);
     config = server_config_load(options.config_path);
     if (config == NULL)
         die("cannot read configuration file %s", options.config_path);
+    server_resolve_configure(config);
+
+    /*
+     * Set up the replay cache shared by all children, if wanted.  This turns
+     * off the Kerberos replay cache, which has to happen before acquiring
+     * credentials since the replay cache is chosen at that point.  Entries
+     * have to be kept for twice the Kerberos clock skew or an authenticator
+     * could be replayed after its entry expires, so raise a shorter lifetime.
+     */
+    if (options.standalone && options.replay_cache_entries > 0) {
+        min_ttl = server_replay_min_ttl();
+        if (options.replay_cache_ttl < (unsigned long) min_ttl) {
+            warn("replay-cache-ttl of %lu is less than twice the Kerberos"
+                 " clock skew, using %lu", options.replay_cache_ttl,
+                 (unsigned long) min_ttl);
+            options.replay_cache_ttl = min_ttl;
+        }
+        server_replay_init(options.replay_cache_entries,
+                           options.replay_cache_ttl);
+    }
 
     /*
      * If a service was specified, we should load only those credentials since
@@ -633,13 +1617,15 @@ main(int argc, char *argv[])
     if (!options.standalone)
         handle_connection(STDIN_FILENO, config, creds);
     else
-        server_daemon(&options, config, creds);
+        config = server_daemon(&options, config, creds);
 
     /* Clean up and exit. */
     server_config_free(config);
     if (creds != GSS_C_NO_CREDENTIAL)
         gss_release_cred(&minor, &creds);
     vector_free(options.bindaddrs);
+    server_resolve_free();
+    server_replay_free();
     libevent_global_shutdown();
     message_handlers_reset();
     return 0;
@@ -0,0 +1,522 @@
+/*
+ * Shared replay cache for the stand-alone server.
+ *
+ * By default, every GSS-API context accepted by the server records its
+ * Kerberos authenticator in the Kerberos replay cache, a file shared by all
+ * processes, which serializes every connection on a lock and an fsync of that
+ * file.  With a high connection rate, this is the limit on how fast the
+ * server can accept connections.
+ *
+ * This is an alternative replay cache in anonymous shared memory, created by
+ * the parent before it starts forking, like the output cache.  When it is
+ * enabled, the Kerberos replay cache is turned off by setting
+ * KRB5RCACHETYPE=none in the environment, and the first context token from
+ * each client is instead checked here before being passed to
+ * gss_accept_sec_context.  The token is parsed just far enough to find the
+ * encrypted authenticator of the Kerberos AP-REQ, and the ciphertext is
+ * hashed into a tag.  Any change to the ciphertext makes the authenticator
+ * fail to decrypt, so a replay of the same authenticator always has the
+ * same tag.  This is the same approach as the file2 replay cache of newer
+ * versions of MIT Kerberos.  Tokens that can't be parsed are rejected, since
+ * nothing else would catch a replay of them.
+ *
+ * The cache is split into shards of a fixed number of slots.  Each tag can
+ * only be stored in the shard selected by its hash, and access to each shard
+ * is serialized with an fcntl lock on the byte of an unlinked temporary file
+ * with the same offset as the shard number, and additionally with a mutex
+ * for the threads of a single process, since fcntl locks belong to
+ * processes.  Each slot records when its tag was stored, and any slot older
+ * than the lifetime of the cache is free to be reused, so expired entries
+ * never need to be cleaned up.  A Kerberos authenticator is only accepted
+ * within the clock skew of its timestamp, so the lifetime needs to be at
+ * least twice the maximum clock skew, and remctld raises any shorter
+ * lifetime to that.  If every slot in a shard is in use, the token is
+ * rejected rather than risk accepting a replay.
+ *
+ * A tag is recorded when its token is checked, so that two connections
+ * replaying the same authenticator at the same time can't both pass, and
+ * removed again if the context isn't established, so that invalid tokens
+ * can't fill the cache.
+ *
+ * When remctld is not running in stand-alone mode, or this cache is
+ * disabled, there is no cache, every token passes, and the Kerberos replay
+ * cache is used as usual.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#ifdef HAVE_KRB5
+# include <portable/krb5.h>
+#endif
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_PROFILE_H
+# include <profile.h>
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <sys/mman.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#ifdef HAVE_KRB5
+# include <util/messages-krb5.h>
+#endif
+#include <util/xmalloc.h>
+
+/* Some systems only provide the older name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* The number of slots in each shard of the cache. */
+#define SHARD_SIZE 64
+
+/* The Kerberos default maximum clock skew, if it can't be found. */
+#define DEFAULT_CLOCK_SKEW 300
+
+/* Whether we can ask Kerberos for its maximum clock skew. */
+#if defined(HAVE_KRB5)                                  \
+    && (defined(HAVE_KRB5_GET_MAX_TIME_SKEW)            \
+        || (defined(HAVE_KRB5_GET_PROFILE) && defined(HAVE_PROFILE_H)))
+# define HAVE_CLOCK_SKEW 1
+#endif
+
+/* The DER encoding of the OID of the Kerberos GSS-API mechanism. */
+static const unsigned char krb5_oid[] = {
+    0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02
+};
+
+/* A slot in the cache.  A slot with a stored time of 0 is unused. */
+struct slot {
+    struct replay_tag tag;      /* Tag of the authenticator. */
+    time_t stored;              /* When the tag was stored. */
+};
+
+/* The cache, the number of shards, the lifetime of entries, and the lock. */
+static struct slot *cache = NULL;
+static size_t nshards = 0;
+static time_t lifetime = 0;
+static FILE *lockfile = NULL;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The original setting of KRB5RCACHETYPE, restored for commands. */
+static bool environment_changed = false;
+static char *saved_rcache_type = NULL;
+
+
+/*
+ * Read the identifier and length of a DER element starting at *p, which must
+ * not go past end.  On success, advances *p to the start of the contents of
+ * the element, sets length to the length of the contents, and returns the
+ * identifier octet.  Returns -1 if the element isn't valid or doesn't fit.
+ * Only the definite-length encodings used by DER are supported.
+ */
+static int
+der_element(const unsigned char **p, const unsigned char *end,
+            size_t *length)
+{
+    const unsigned char *q = *p;
+    size_t n, bytes;
+    int id;
+
+    if (end - q < 2)
+        return -1;
+    id = *q++;
+    n = *q++;
+    if (n & 0x80) {
+        bytes = n & 0x7f;
+        if (bytes == 0 || bytes > sizeof(size_t))
+            return -1;
+        if ((size_t) (end - q) < bytes)
+            return -1;
+        for (n = 0; bytes > 0; bytes--)
+            n = (n << 8) | *q++;
+    }
+    if ((size_t) (end - q) < n)
+        return -1;
+    *p = q;
+    *length = n;
+    return id;
+}
+
+
+/*
+ * Find the contents of the element with the given context-specific tag in a
+ * SEQUENCE whose contents run from p to end.  Returns true and sets start and
+ * length on success, and false if there is no such element or the SEQUENCE
+ * isn't valid.
+ */
+static bool
+der_field(const unsigned char *p, const unsigned char *end, int tag,
+          const unsigned char **start, size_t *length)
+{
+    size_t n;
+    int id;
+
+    while (p < end) {
+        id = der_element(&p, end, &n);
+        if (id < 0)
+            return false;
+        if (id == (0xa0 | tag)) {
+            *start = p;
+            *length = n;
+            return true;
+        }
+        p += n;
+    }
+    return false;
+}
+
+
+/*
+ * Find the ciphertext of the authenticator in an initial Kerberos GSS-API
+ * context token.  The token is the mechanism OID, the token ID for an
+ * AP-REQ, and the AP-REQ, all wrapped in an [APPLICATION 0] element.  The
+ * authenticator is field 4 of the AP-REQ, and its ciphertext is field 2 of
+ * that EncryptedData.  Returns true and sets start and length on success,
+ * and false if the token isn't a Kerberos AP-REQ.
+ */
+static bool
+find_authenticator(const gss_buffer_t token, const unsigned char **start,
+                   size_t *length)
+{
+    const unsigned char *p = token->value;
+    const unsigned char *end = p + token->length;
+    size_t n;
+
+    /* The GSS-API framing and the mechanism OID. */
+    if (der_element(&p, end, &n) != 0x60)
+        return false;
+    end = p + n;
+    if ((size_t) (end - p) < sizeof(krb5_oid) + 2)
+        return false;
+    if (memcmp(p, krb5_oid, sizeof(krb5_oid)) != 0)
+        return false;
+    p += sizeof(krb5_oid);
+
+    /* The token ID of an AP-REQ. */
+    if (p[0] != 0x01 || p[1] != 0x00)
+        return false;
+    p += 2;
+
+    /* The AP-REQ, which is [APPLICATION 14] SEQUENCE. */
+    if (der_element(&p, end, &n) != 0x6e)
+        return false;
+    end = p + n;
+    if (der_element(&p, end, &n) != 0x30)
+        return false;
+    end = p + n;
+
+    /* The authenticator, an EncryptedData SEQUENCE. */
+    if (!der_field(p, end, 4, &p, &n))
+        return false;
+    end = p + n;
+    if (der_element(&p, end, &n) != 0x30)
+        return false;
+    end = p + n;
+
+    /* The ciphertext, an OCTET STRING. */
+    if (!der_field(p, end, 2, &p, &n))
+        return false;
+    end = p + n;
+    if (der_element(&p, end, &n) != 0x04 || n == 0)
+        return false;
+    *start = p;
+    *length = n;
+    return true;
+}
+
+
+/*
+ * Compute the tag of an authenticator ciphertext.  This is two 64-bit FNV-1a
+ * hashes with different starting values.  The ciphertext can't be chosen by
+ * an attacker without breaking the authenticator, so the hash only needs to
+ * keep accidental collisions between authenticators rare.
+ */
+static void
+make_tag(const unsigned char *data, size_t length, struct replay_tag *tag)
+{
+    uint64_t first = 14695981039346656037ULL;
+    uint64_t second = first ^ (uint64_t) length;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        first = (first ^ data[i]) * 1099511628211ULL;
+        second = (second ^ data[length - i - 1]) * 1099511628211ULL;
+    }
+    tag->hash[0] = first;
+    tag->hash[1] = second;
+}
+
+
+/*
+ * Lock or unlock a shard of the cache.  type is F_WRLCK or F_UNLCK.  Returns
+ * true on success and false on failure, after reporting an error.
+ */
+static bool
+lock_shard(size_t n, short type)
+{
+    struct flock lock;
+
+#ifdef HAVE_PTHREAD
+    if (type != F_UNLCK)
+        pthread_mutex_lock(&mutex);
+#endif
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = (off_t) n;
+    lock.l_len = 1;
+    while (fcntl(fileno(lockfile), F_SETLKW, &lock) < 0)
+        if (errno != EINTR) {
+            syswarn("cannot lock replay cache shard");
+#ifdef HAVE_PTHREAD
+            if (type != F_UNLCK)
+                pthread_mutex_unlock(&mutex);
+#endif
+            return false;
+        }
+#ifdef HAVE_PTHREAD
+    if (type == F_UNLCK)
+        pthread_mutex_unlock(&mutex);
+#endif
+    return true;
+}
+
+
+/*
+ * Return the maximum clock skew allowed by Kerberos in seconds.  MIT
+ * Kerberos doesn't provide a function to get it, so read the setting from
+ * the Kerberos configuration the same way that it does.  Falls back on the
+ * Kerberos default if the setting can't be found.
+ */
+static time_t
+clock_skew(void)
+{
+#ifdef HAVE_CLOCK_SKEW
+    krb5_context ctx;
+    krb5_error_code code;
+    time_t skew = DEFAULT_CLOCK_SKEW;
+# ifndef HAVE_KRB5_GET_MAX_TIME_SKEW
+    profile_t profile;
+    int value;
+# endif
+
+    code = krb5_init_context(&ctx);
+    if (code != 0) {
+        warn_krb5(ctx, code, "cannot create Kerberos context");
+        return DEFAULT_CLOCK_SKEW;
+    }
+# ifdef HAVE_KRB5_GET_MAX_TIME_SKEW
+    skew = krb5_get_max_time_skew(ctx);
+# else
+    if (krb5_get_profile(ctx, &profile) == 0) {
+        if (profile_get_integer(profile, "libdefaults", "clockskew", NULL,
+                                DEFAULT_CLOCK_SKEW, &value) == 0)
+            skew = value;
+        profile_release(profile);
+    }
+# endif
+    krb5_free_context(ctx);
+    return (skew > 0) ? skew : DEFAULT_CLOCK_SKEW;
+#else
+    return DEFAULT_CLOCK_SKEW;
+#endif
+}
+
+
+/*
+ * Return the shortest lifetime that entries in the cache can safely have.
+ * An authenticator is accepted within the clock skew of its timestamp in
+ * either direction, so it has to be remembered for twice the clock skew.
+ */
+time_t
+server_replay_min_ttl(void)
+{
+    return 2 * clock_skew();
+}
+
+
+/*
+ * Create the cache with room for at least the given number of entries,
+ * keeping each of them for ttl seconds, and turn off the Kerberos replay
+ * cache.  Must be called by the parent before forking any children,
+ * acquiring any credentials, or accepting any contexts.  Anonymous mappings
+ * start out zeroed, so every slot starts out unused.
+ */
+void
+server_replay_init(size_t entries, time_t ttl)
+{
+    const char *type;
+
+    if (entries == 0 || ttl == 0)
+        return;
+    lockfile = tmpfile();
+    if (lockfile == NULL)
+        sysdie("cannot create replay cache lock file");
+    fdflag_close_exec(fileno(lockfile), true);
+    nshards = (entries + SHARD_SIZE - 1) / SHARD_SIZE;
+    lifetime = ttl;
+    cache = mmap(NULL, nshards * SHARD_SIZE * sizeof(struct slot),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED)
+        sysdie("cannot allocate replay cache");
+
+    /* Turn off the Kerberos replay cache, remembering the old setting. */
+    type = getenv("KRB5RCACHETYPE");
+    if (type != NULL)
+        saved_rcache_type = xstrdup(type);
+    if (setenv("KRB5RCACHETYPE", "none", 1) < 0)
+        sysdie("cannot set KRB5RCACHETYPE in environment");
+    environment_changed = true;
+}
+
+
+/*
+ * Free the cache and restore the Kerberos replay cache.  Only called by the
+ * parent on exit.
+ */
+void
+server_replay_free(void)
+{
+    if (cache == NULL)
+        return;
+    munmap(cache, nshards * SHARD_SIZE * sizeof(struct slot));
+    fclose(lockfile);
+    cache = NULL;
+    lockfile = NULL;
+    nshards = 0;
+    server_replay_restore();
+    free(saved_rcache_type);
+    saved_rcache_type = NULL;
+    environment_changed = false;
+}
+
+
+/*
+ * Returns whether the environment was changed to turn off the Kerberos
+ * replay cache, and if so, sets value to the original setting of
+ * KRB5RCACHETYPE, or NULL if it wasn't set.  Used to build the environment
+ * of commands started without forking.
+ */
+bool
+server_replay_environment(const char **value)
+{
+    if (!environment_changed)
+        return false;
+    *value = saved_rcache_type;
+    return true;
+}
+
+
+/*
+ * Restore the original setting of KRB5RCACHETYPE in a child that is about to
+ * run a command, so that the command doesn't inherit the setting that turns
+ * off the Kerberos replay cache.
+ */
+void
+server_replay_restore(void)
+{
+    if (!environment_changed)
+        return;
+    if (saved_rcache_type == NULL)
+        unsetenv("KRB5RCACHETYPE");
+    else if (setenv("KRB5RCACHETYPE", saved_rcache_type, 1) < 0)
+        sysdie("cannot set KRB5RCACHETYPE in environment");
+}
+
+
+/*
+ * Check the first context token from a client for a replayed authenticator
+ * and record its tag in the cache.  Returns true and sets tag if the token
+ * may be accepted, and false if it is a replay, can't be checked, or can't
+ * be recorded, after logging a warning.  If there is no cache, always
+ * returns true and clears the tag.
+ */
+bool
+server_replay_check(const gss_buffer_t token, struct replay_tag *tag)
+{
+    const unsigned char *data;
+    struct slot *shard, *free_slot = NULL;
+    size_t length, n, i;
+    bool okay = false;
+    time_t now;
+
+    memset(tag, 0, sizeof(*tag));
+    if (cache == NULL)
+        return true;
+    if (!find_authenticator(token, &data, &length)) {
+        warn("context token is not a Kerberos AP-REQ, rejecting");
+        return false;
+    }
+    make_tag(data, length, tag);
+    n = tag->hash[0] % nshards;
+    shard = &cache[n * SHARD_SIZE];
+    now = time(NULL);
+    if (!lock_shard(n, F_WRLCK))
+        return false;
+    for (i = 0; i < SHARD_SIZE; i++) {
+        if (shard[i].stored == 0 || shard[i].stored + lifetime <= now) {
+            if (free_slot == NULL)
+                free_slot = &shard[i];
+            continue;
+        }
+        if (memcmp(&shard[i].tag, tag, sizeof(*tag)) == 0) {
+            warn("replayed Kerberos authenticator, rejecting");
+            goto done;
+        }
+    }
+    if (free_slot == NULL) {
+        warn("replay cache full, rejecting context token");
+        goto done;
+    }
+    free_slot->tag = *tag;
+    free_slot->stored = now;
+    okay = true;
+
+done:
+    lock_shard(n, F_UNLCK);
+    if (!okay)
+        memset(tag, 0, sizeof(*tag));
+    return okay;
+}
+
+
+/*
+ * Remove a tag recorded by server_replay_check from the cache because the
+ * context wasn't established with that token.  Does nothing for a cleared
+ * tag.
+ */
+void
+server_replay_forget(const struct replay_tag *tag)
+{
+    struct slot *shard;
+    size_t n, i;
+
+    if (cache == NULL || (tag->hash[0] == 0 && tag->hash[1] == 0))
+        return;
+    n = tag->hash[0] % nshards;
+    shard = &cache[n * SHARD_SIZE];
+    if (!lock_shard(n, F_WRLCK))
+        return;
+    for (i = 0; i < SHARD_SIZE; i++)
+        if (shard[i].stored != 0
+            && memcmp(&shard[i].tag, tag, sizeof(*tag)) == 0) {
+            shard[i].stored = 0;
+            break;
+        }
+    lock_shard(n, F_UNLCK);
+}
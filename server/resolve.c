@@ -0,0 +1,707 @@
+/*
+ * Asynchronous lookup of client hostnames.
+ *
+ * The hostname of a client is only used to set REMOTE_HOST for commands, but
+ * a reverse DNS lookup can take seconds when resolvers are unhealthy.  So
+ * rather than looking it up before reading anything from the client, start
+ * the lookup as soon as the connection is accepted and only collect its
+ * answer when a command that wants REMOTE_HOST is about to run.  By then the
+ * lookup has normally finished while the GSS-API context was being
+ * established.  Lookups use getnameinfo, so they honor /etc/hosts and the
+ * rest of the system name service configuration exactly as before.
+ *
+ * In stand-alone mode, the parent starts a resolver process before it starts
+ * forking, and closes all other descriptors in it so that it doesn't hold
+ * the listening sockets or any client connections open.  To start a lookup,
+ * the process handling a connection creates a pipe and passes the write end
+ * and the client address to the resolver over a socket pair.  The resolver
+ * forks a short-lived helper for each lookup, so that a slow lookup doesn't
+ * hold up any other, and the helper writes the hostname to the pipe.  This
+ * means that workers, which may be running threads, never fork for lookups.
+ * Without a resolver process, as when running under inetd, the process
+ * handling the connection forks the helper itself.
+ *
+ * In stand-alone mode, the results are also kept in a cache in anonymous
+ * shared memory, created by the parent before it starts forking, so that
+ * repeated connections from the same client skip the lookup entirely no
+ * matter which process handles them.  Failed lookups are cached for a
+ * separate, normally shorter, time.  Like the output cache, each address can
+ * only be stored in the entry selected by its hash, and access to each entry
+ * is serialized with fcntl locks on the byte of an unlinked temporary file
+ * with the same offset as the entry number.
+ *
+ * No lookup is done at all if no configuration rule wants REMOTE_HOST or if
+ * the connection is to a local address for which lookups were disabled.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* Some systems only provide the older name for anonymous mappings. */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * How long, in milliseconds, to wait for a lookup when its answer is needed.
+ * This is long enough for the system resolver to go through all of its
+ * retries with the default settings.
+ */
+#define RESOLVE_TIMEOUT (30 * 1000)
+
+/*
+ * How often, in seconds, the resolver process checks whether its parent is
+ * still running, so that it doesn't outlive a parent that died.
+ */
+#define RESOLVER_CHECK 10
+
+/* An entry in the cache.  An entry with an empty address is unused. */
+struct entry {
+    char address[INET6_ADDRSTRLEN]; /* IP address of the client. */
+    char hostname[NI_MAXHOST];  /* Hostname, empty if the lookup failed. */
+    time_t expires;             /* When the entry expires. */
+};
+
+/* The cache, its size, the lifetimes of entries, and the lock file. */
+static struct entry *cache = NULL;
+static size_t nentries = 0;
+static time_t positive_ttl = 0;
+static time_t negative_ttl = 0;
+static FILE *lockfile = NULL;
+
+/*
+ * Whether any rule wants REMOTE_HOST, and the local addresses for which no
+ * lookups should be done.
+ */
+static bool needed = true;
+static struct vector *skip = NULL;
+
+/* A request for a lookup sent to the resolver process. */
+struct request {
+    struct sockaddr_storage addr; /* Address to look up. */
+    socklen_t length;           /* Length of that address. */
+    char address[INET6_ADDRSTRLEN]; /* The address in text form. */
+};
+
+/*
+ * The resolver process and the socket pair used to send it requests.  The
+ * resolver reads from the first socket and clients write to the second.
+ */
+static pid_t resolver = 0;
+static socket_type channel[2] = { INVALID_SOCKET, INVALID_SOCKET };
+
+
+/*
+ * Hash an address to find its cache entry.  This is the 32-bit FNV-1a hash.
+ */
+static size_t
+hash_address(const char *address)
+{
+    const unsigned char *p;
+    unsigned long hash = 2166136261UL;
+
+    for (p = (const unsigned char *) address; *p != '\0'; p++) {
+        hash ^= *p;
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash % nentries;
+}
+
+
+/*
+ * Lock or unlock an entry of the cache.  type is F_RDLCK, F_WRLCK, or
+ * F_UNLCK.  Returns true on success and false on failure, after reporting an
+ * error.
+ */
+static bool
+lock_entry(size_t n, short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = (off_t) n;
+    lock.l_len = 1;
+    while (fcntl(fileno(lockfile), F_SETLKW, &lock) < 0)
+        if (errno != EINTR) {
+            syswarn("cannot lock hostname cache entry");
+            return false;
+        }
+    return true;
+}
+
+
+/*
+ * Check whether any rule of a newly loaded configuration wants REMOTE_HOST.
+ * If none does, lookups aren't started at all.
+ */
+void
+server_resolve_configure(const struct config *config)
+{
+    size_t i;
+
+    needed = false;
+    for (i = 0; i < config->count; i++)
+        if (!config->rules[i]->no_hostname)
+            needed = true;
+}
+
+
+/*
+ * Disable lookups for connections to the given local address, which must be
+ * a numeric IP address.
+ */
+void
+server_resolve_skip(const char *address)
+{
+    if (skip == NULL)
+        skip = vector_new();
+    vector_add(skip, address);
+}
+
+
+/*
+ * Returns true if lookups have been disabled for the local address of a
+ * client connection.
+ */
+static bool
+skip_connection(socket_type fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t length = sizeof(ss);
+    char address[INET6_ADDRSTRLEN];
+    size_t i;
+
+    if (skip == NULL)
+        return false;
+    if (getsockname(fd, (struct sockaddr *) &ss, &length) < 0)
+        return false;
+    if (getnameinfo((struct sockaddr *) &ss, length, address, sizeof(address),
+                    NULL, 0, NI_NUMERICHOST)
+        != 0)
+        return false;
+    for (i = 0; i < skip->count; i++)
+        if (strcmp(skip->strings[i], address) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Look up an address in the cache.  If there is an unexpired entry for it,
+ * store a copy of the hostname in hostname, or NULL if the lookup failed,
+ * and return true.  Otherwise, return false.
+ */
+static bool
+cache_get(const char *address, char **hostname)
+{
+    const struct entry *entry;
+    size_t n;
+    bool found = false;
+
+    if (cache == NULL)
+        return false;
+    n = hash_address(address);
+    if (!lock_entry(n, F_RDLCK))
+        return false;
+    entry = &cache[n];
+    if (strcmp(entry->address, address) == 0 && entry->expires > time(NULL)) {
+        found = true;
+        if (entry->hostname[0] == '\0')
+            *hostname = NULL;
+        else
+            *hostname = xstrdup(entry->hostname);
+    }
+    lock_entry(n, F_UNLCK);
+    return found;
+}
+
+
+/*
+ * Store the result of a lookup in the cache, replacing whatever was in its
+ * entry.  hostname is NULL if the lookup failed.
+ */
+static void
+cache_put(const char *address, const char *hostname)
+{
+    struct entry *entry;
+    time_t ttl;
+    size_t n;
+
+    if (cache == NULL || strlen(address) >= sizeof(entry->address))
+        return;
+    if (hostname != NULL && strlen(hostname) >= sizeof(entry->hostname))
+        return;
+    ttl = (hostname == NULL) ? negative_ttl : positive_ttl;
+    if (ttl == 0)
+        return;
+    n = hash_address(address);
+    if (!lock_entry(n, F_WRLCK))
+        return;
+    entry = &cache[n];
+    memcpy(entry->address, address, strlen(address) + 1);
+    if (hostname == NULL)
+        entry->hostname[0] = '\0';
+    else
+        memcpy(entry->hostname, hostname, strlen(hostname) + 1);
+    entry->expires = time(NULL) + ttl;
+    lock_entry(n, F_UNLCK);
+}
+
+
+/*
+ * Close all descriptors other than standard input, output, and error, the
+ * given descriptor, and the cache lock file.  Called in processes forked to
+ * do lookups so that they don't hold the listening sockets or connections to
+ * other clients open.
+ */
+static void
+close_descriptors(int keep)
+{
+    long max, fd;
+
+    max = sysconf(_SC_OPEN_MAX);
+    if (max < 0)
+        max = 1024;
+    for (fd = 3; fd < max; fd++)
+        if (fd != keep && (lockfile == NULL || fd != fileno(lockfile)))
+            close((int) fd);
+}
+
+
+/*
+ * Look up the hostname of an address, given in both binary and text form,
+ * store the result in the cache, and write the hostname to fd.  Called in
+ * the helper process.  Returns the exit status for the helper.
+ */
+static int
+lookup(const struct sockaddr *addr, socklen_t length, const char *address,
+       int fd)
+{
+    char hostname[NI_MAXHOST];
+    ssize_t status;
+
+    if (getnameinfo(addr, length, hostname, sizeof(hostname), NULL, 0,
+                    NI_NAMEREQD)
+        != 0) {
+        cache_put(address, NULL);
+        return 1;
+    }
+    cache_put(address, hostname);
+    do {
+        status = write(fd, hostname, strlen(hostname));
+    } while (status < 0 && errno == EINTR);
+    return 0;
+}
+
+
+#ifdef SCM_RIGHTS
+
+/*
+ * The main loop of the resolver process.  Receive lookup requests and fork a
+ * helper for each, which writes the answer to the descriptor passed with the
+ * request.  Helpers are reaped automatically since SIGCHLD is ignored.
+ * Returns when the parent has exited.
+ */
+static void
+resolver_loop(pid_t parent)
+{
+    struct request request;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t length;
+    pid_t pid;
+    int fd;
+
+    while (getppid() == parent) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &request;
+        iov.iov_len = sizeof(request);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        length = recvmsg(channel[0], &msg, 0);
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            syswarn("cannot receive hostname lookup request");
+            return;
+        }
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS) {
+            warn("hostname lookup request received without a descriptor");
+            continue;
+        }
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if ((size_t) length != sizeof(request)
+            || (size_t) request.length > sizeof(request.addr)) {
+            warn("invalid hostname lookup request");
+            close(fd);
+            continue;
+        }
+        request.address[sizeof(request.address) - 1] = '\0';
+        pid = fork();
+        if (pid < 0)
+            syswarn("cannot fork process for hostname lookup");
+        else if (pid == 0) {
+            close(channel[0]);
+            _exit(lookup((struct sockaddr *) &request.addr, request.length,
+                         request.address, fd));
+        }
+        close(fd);
+    }
+}
+
+
+/*
+ * Start the resolver process.  It closes every descriptor it inherits other
+ * than its end of the socket pair and the cache lock file, and it checks
+ * periodically whether the parent is still running.  If it can't be started,
+ * each process handling a connection forks its own helpers instead.
+ */
+static void
+resolver_start(void)
+{
+    struct sigaction sa;
+    struct timeval timeout = { RESOLVER_CHECK, 0 };
+    pid_t parent;
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, channel) < 0) {
+        syswarn("cannot create socket pair for hostname lookups");
+        return;
+    }
+    fdflag_nonblocking(channel[1], true);
+    fdflag_close_exec(channel[0], true);
+    fdflag_close_exec(channel[1], true);
+    parent = getpid();
+    fflush(stdout);
+    resolver = fork();
+    if (resolver < 0) {
+        syswarn("cannot fork hostname resolver");
+        resolver = 0;
+        close(channel[1]);
+        channel[1] = INVALID_SOCKET;
+    } else if (resolver == 0) {
+        close(channel[1]);
+        close_descriptors(channel[0]);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+        sigaction(SIGALRM, &sa, NULL);
+        sa.sa_handler = SIG_IGN;
+        sigaction(SIGCHLD, &sa, NULL);
+        if (setsockopt(channel[0], SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                       sizeof(timeout))
+            < 0)
+            syswarn("cannot set timeout for hostname lookup requests");
+        resolver_loop(parent);
+        _exit(0);
+    }
+    close(channel[0]);
+    channel[0] = INVALID_SOCKET;
+}
+
+
+/*
+ * Pass a lookup to the resolver process along with the descriptor to which
+ * the hostname should be written.  Returns true on success and false on
+ * failure.
+ */
+static bool
+resolver_send(const struct client *client, const struct sockaddr *addr,
+              socklen_t length, int fd)
+{
+    struct request request;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    if ((size_t) length > sizeof(request.addr)
+        || strlen(client->ipaddress) >= sizeof(request.address))
+        return false;
+    memset(&request, 0, sizeof(request));
+    memcpy(&request.addr, addr, length);
+    request.length = length;
+    memcpy(request.address, client->ipaddress,
+           strlen(client->ipaddress) + 1);
+    iov.iov_base = &request;
+    iov.iov_len = sizeof(request);
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(channel[1], &msg, 0) < 0) {
+        syswarn("cannot pass hostname lookup to resolver");
+        return false;
+    }
+    return true;
+}
+
+#else /* !SCM_RIGHTS */
+
+static void
+resolver_start(void)
+{
+}
+
+static bool
+resolver_send(const struct client *client UNUSED,
+              const struct sockaddr *addr UNUSED, socklen_t length UNUSED,
+              int fd UNUSED)
+{
+    return false;
+}
+
+#endif /* !SCM_RIGHTS */
+
+
+/*
+ * Create the cache with the given number of entries, keeping the results of
+ * successful lookups for ttl seconds and of failed lookups for failed_ttl
+ * seconds, and start the resolver process.  Must be called by the parent
+ * before forking any children.  Anonymous mappings start out zeroed, so
+ * every entry starts out unused.
+ */
+void
+server_resolve_init(size_t entries, time_t ttl, time_t failed_ttl)
+{
+    if (entries > 0 && (ttl > 0 || failed_ttl > 0)) {
+        lockfile = tmpfile();
+        if (lockfile == NULL)
+            sysdie("cannot create hostname cache lock file");
+        fdflag_close_exec(fileno(lockfile), true);
+        nentries = entries;
+        positive_ttl = ttl;
+        negative_ttl = failed_ttl;
+        cache = mmap(NULL, nentries * sizeof(struct entry),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                     0);
+        if (cache == MAP_FAILED)
+            sysdie("cannot allocate hostname cache");
+    }
+    resolver_start();
+}
+
+
+/*
+ * Stop the resolver process and free the cache and the list of local
+ * addresses without lookups.  Only called by the parent on exit.
+ */
+void
+server_resolve_free(void)
+{
+    if (skip != NULL)
+        vector_free(skip);
+    skip = NULL;
+    if (resolver > 0) {
+        kill(resolver, SIGTERM);
+        while (waitpid(resolver, NULL, 0) < 0 && errno == EINTR)
+            ;
+        resolver = 0;
+    }
+    if (channel[1] != INVALID_SOCKET)
+        close(channel[1]);
+    channel[1] = INVALID_SOCKET;
+    if (cache == NULL)
+        return;
+    munmap(cache, nentries * sizeof(struct entry));
+    fclose(lockfile);
+    cache = NULL;
+    lockfile = NULL;
+    nentries = 0;
+}
+
+
+/*
+ * Start looking up the hostname of a new client, given its address and the
+ * client with its IP address already filled in.  If the answer is cached,
+ * set the hostname immediately.  Otherwise, create a pipe, have the resolver
+ * process or, without one, a helper process forked here look up the
+ * hostname and write it to the pipe, and remember the pipe in the client so
+ * that the answer can be collected later.  If the lookup can't be started,
+ * the client just doesn't get a hostname.
+ */
+void
+server_resolve_start(struct client *client, const struct sockaddr *addr,
+                     socklen_t length)
+{
+    int fds[2];
+    pid_t pid;
+    bool okay;
+
+    if (!needed || skip_connection(client->fd))
+        return;
+    if (cache_get(client->ipaddress, &client->hostname))
+        return;
+    if (pipe(fds) < 0) {
+        syswarn("cannot create pipe for hostname lookup");
+        return;
+    }
+    if (channel[1] != INVALID_SOCKET) {
+        okay = resolver_send(client, addr, length, fds[1]);
+        close(fds[1]);
+        if (!okay) {
+            close(fds[0]);
+            return;
+        }
+    } else {
+        pid = fork();
+        if (pid < 0) {
+            syswarn("cannot fork process for hostname lookup");
+            close(fds[0]);
+            close(fds[1]);
+            return;
+        } else if (pid == 0) {
+            close(fds[0]);
+            close(client->fd);
+            close_descriptors(fds[1]);
+            _exit(lookup(addr, length, client->ipaddress, fds[1]));
+        }
+        close(fds[1]);
+        client->resolver = pid;
+    }
+    fdflag_close_exec(fds[0], true);
+    client->resolver_fd = fds[0];
+    client->resolving = true;
+}
+
+
+/*
+ * Stop a lookup for a client, killing the helper if we started it and it's
+ * still running, and clean up after it.
+ */
+void
+server_resolve_cancel(struct client *client)
+{
+    if (!client->resolving)
+        return;
+    if (client->resolver != 0) {
+        kill(client->resolver, SIGKILL);
+        while (waitpid(client->resolver, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    close(client->resolver_fd);
+    client->resolver = 0;
+    client->resolver_fd = -1;
+    client->resolving = false;
+}
+
+
+/*
+ * Collect the answer of the lookup for a client once its pipe is readable,
+ * or give up on it if ready is false because waiting for it timed out.  The
+ * helper exits right after writing the hostname, so this reads until the end
+ * of the pipe without waiting more than briefly.  Sets the hostname of the
+ * client if the lookup succeeded.
+ */
+void
+server_resolve_collect(struct client *client, bool ready)
+{
+    char hostname[NI_MAXHOST];
+    size_t used = 0;
+    ssize_t status;
+
+    if (!client->resolving)
+        return;
+    if (!ready)
+        warn("timed out looking up hostname of %s", client->ipaddress);
+    while (ready && used < sizeof(hostname) - 1) {
+        status = read(client->resolver_fd, hostname + used,
+                      sizeof(hostname) - 1 - used);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            break;
+        used += status;
+    }
+    server_resolve_cancel(client);
+    if (used > 0) {
+        hostname[used] = '\0';
+        client->hostname = xstrdup(hostname);
+    }
+}
+
+
+/*
+ * Arrange for the given event loop to call callback with data once the
+ * answer of the lookup for a client is available or waiting for it has
+ * timed out, so that the process waiting for it can keep handling other
+ * events.  The callback should pass whether EV_READ was set to
+ * server_resolve_collect.  Returns false without scheduling anything if no
+ * lookup is running.
+ */
+bool
+server_resolve_wait(struct client *client, struct event_base *loop,
+                    void (*callback)(socket_type, short, void *), void *data)
+{
+    struct timeval timeout;
+
+    if (!client->resolving)
+        return false;
+    timeout.tv_sec = RESOLVE_TIMEOUT / 1000;
+    timeout.tv_usec = (RESOLVE_TIMEOUT % 1000) * 1000;
+    if (event_base_once(loop, client->resolver_fd, EV_READ, callback, data,
+                        &timeout)
+        < 0)
+        die("internal error: cannot create event to wait for hostname");
+    return true;
+}
+
+
+/*
+ * Collect the answer of the lookup for a client, if one is running, waiting
+ * for it if it hasn't finished yet.  Used where nothing else needs to happen
+ * while waiting.
+ */
+void
+server_resolve_finish(struct client *client)
+{
+    bool ready;
+
+    if (!client->resolving)
+        return;
+    ready = server_event_wait(server_client_loop(client), client->resolver_fd,
+                              RESOLVE_TIMEOUT);
+    server_resolve_collect(client, ready);
+}
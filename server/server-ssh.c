@@ -145,23 +145,39 @@ fail:
 }
 
 
+/*
+ * Send a block of output to our standard output or standard error, depending
+ * on the stream.  Returns true on success and false on failure.
+ */
+static bool
+send_output(struct client *client, int stream, struct evbuffer *output)
+{
+    int fd;
+
+    fd = (stream == 1) ? client->fd : client->stderr_fd;
+    if (evbuffer_write(output, fd) < 0) {
+        syswarn("error sending output");
+        client->fatal = true;
+        return false;
+    }
+    return true;
+}
+
+
 /*
  * Handle one block of output from the running command.
  */
 static void
 handle_output(struct bufferevent *bev, void *data)
 {
-    int fd;
+    int stream;
     struct evbuffer *buf;
     struct process *process = data;
-    struct client *client = process->client;
 
     process->saw_output = true;
-    fd = (bev == process->inout) ? client->fd : client->stderr_fd;
+    stream = (bev == process->inout) ? 1 : 2;
     buf = bufferevent_get_input(bev);
-    if (evbuffer_write(buf, fd) < 0) {
-        syswarn("error sending output");
-        client->fatal = true;
+    if (!send_output(process->client, stream, buf)) {
         process->saw_error = true;
         event_base_loopbreak(process->loop);
     }
@@ -280,6 +296,7 @@ server_ssh_new_client(const char *user)
     client->setup = command_setup;
     client->finish = command_finish;
     client->error = send_error;
+    client->output = send_output;
 
     /* Free allocated data and return. */
     vector_free(client_info);
@@ -296,6 +313,7 @@ server_ssh_free_client(struct client *client)
 {
     if (client == NULL)
         return;
+    server_client_loop_free(client);
     if (client->fd >= 0)
         close(client->fd);
     if (client->stderr_fd >= 0)
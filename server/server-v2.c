@@ -20,101 +20,466 @@
 #include <portable/uio.h>
 
 #include <server/internal.h>
+#include <util/compress.h>
+#include <util/fdflag.h>
 #include <util/gss-tokens.h>
 #include <util/macros.h>
 #include <util/messages.h>
 #include <util/xmalloc.h>
 
+/*
+ * While a command is running, its output tokens are queued to send to the
+ * client as it's ready for them.  Once this much is queued, stop reading
+ * output from the command until the queue drains to OUTPUT_QUEUE_LOW, so
+ * that a slow client can't make us use unbounded memory.
+ */
+#define OUTPUT_QUEUE_HIGH (4 * TOKEN_MAX_DATA)
+#define OUTPUT_QUEUE_LOW  TOKEN_MAX_DATA
+
+/*
+ * Output from a command is held back until there are at least batch_size
+ * bytes of it or until batch_delay milliseconds have passed since the first
+ * byte held back, so that commands that write a little at a time don't
+ * produce a token for every write.  These are the server-wide defaults,
+ * which rules can override.  Holding back output adds latency, so by
+ * default output is not batched unless a rule asks for it.
+ */
+static size_t batch_size = 0;
+static unsigned long batch_delay = 10;
+
+/*
+ * Output tokens smaller than this aren't worth compressing, even if the
+ * client and the rule for the command allow it.
+ */
+static size_t compress_min = 1024;
+
+/* The states of flushing the queue of output for the client. */
+enum flush_state {
+    FLUSH_PENDING,
+    FLUSH_DONE,
+    FLUSH_TIMEOUT,
+    FLUSH_ERROR
+};
+
+
+/*
+ * Set the server-wide defaults for holding back command output to send in
+ * larger tokens.  A size of at most one byte or a delay of zero sends output
+ * as soon as it is seen.
+ */
+void
+server_v2_set_output_batch(size_t size, unsigned long delay)
+{
+    batch_size = (size > TOKEN_MAX_OUTPUT) ? TOKEN_MAX_OUTPUT : size;
+    batch_delay = delay;
+}
+
+
+/*
+ * Set the smallest output token that will be compressed.
+ */
+void
+server_v2_set_compress_min(size_t size)
+{
+    compress_min = size;
+}
+
+
+/*
+ * Return the batch size and delay in milliseconds for output from commands
+ * for a rule.
+ */
+static size_t
+rule_batch_size(const struct rule *rule)
+{
+    if (rule->output_batch > 0)
+        return (size_t) rule->output_batch;
+    return batch_size;
+}
+
+static unsigned long
+rule_batch_delay(const struct rule *rule)
+{
+    if (rule->output_delay > 0)
+        return (unsigned long) rule->output_delay;
+    return batch_delay;
+}
+
+
+/*
+ * Add a token whose data is stored in an array of iovecs to the queue of
+ * tokens for the client, wrapping it first.  The data is encrypted in place
+ * unless conf is false, in which case it only gets integrity protection.
+ * Returns a token status and sets the GSS-API major and minor status on
+ * failure.
+ */
+static enum token_status
+queue_token(struct client *client, struct iovec *iov, int iovcnt, bool conf,
+            OM_uint32 *major, OM_uint32 *minor)
+{
+    struct iovec *wrapped;
+    struct evbuffer *queue;
+    enum token_status status;
+    int count, i;
+
+    status = token_wrap_priv_iov(client->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                                 conf, iov, iovcnt, &wrapped, &count, major,
+                                 minor);
+    if (status != TOKEN_OK)
+        return status;
+    queue = bufferevent_get_output(client->queue);
+    for (i = 0; i < count; i++)
+        if (evbuffer_add(queue, wrapped[i].iov_base, wrapped[i].iov_len) < 0)
+            die("internal error: cannot queue output token");
+    free(wrapped[0].iov_base);
+    free(wrapped);
+    return TOKEN_OK;
+}
+
+
+/*
+ * Callback for the queue of output for the client once all of it has been
+ * sent while flushing it.
+ */
+static void
+handle_flush_written(struct bufferevent *bev UNUSED, void *data)
+{
+    enum flush_state *state = data;
+
+    *state = FLUSH_DONE;
+}
+
+
+/*
+ * Callback for errors or a timeout while flushing the queue of output for
+ * the client, which records what happened.
+ */
+static void
+handle_flush_error(struct bufferevent *bev UNUSED, short what, void *data)
+{
+    enum flush_state *state = data;
+
+    *state = (what & BEV_EVENT_TIMEOUT) ? FLUSH_TIMEOUT : FLUSH_ERROR;
+}
+
+
+/*
+ * Send any output still queued for the client, waiting for the client to
+ * accept it, and then stop queuing output.  This has to be done before
+ * sending any other token so that tokens arrive in order.  The wait is done
+ * in the event loop of the connection, so that other events in that loop,
+ * such as the other connections of a pool worker, are handled while a slow
+ * client catches up.  Returns true on success, false on failure (and logs a
+ * message on failure).
+ */
+static bool
+flush_queue(struct client *client)
+{
+    struct evbuffer *queue;
+    struct timeval tv;
+    enum flush_state state = FLUSH_PENDING;
+    bool okay = true;
+
+    if (client->queue == NULL)
+        return true;
+    queue = bufferevent_get_output(client->queue);
+    if (evbuffer_get_length(queue) > 0) {
+        tv.tv_sec = TIMEOUT / 1000;
+        tv.tv_usec = (TIMEOUT % 1000) * 1000;
+        bufferevent_setwatermark(client->queue, EV_WRITE, 0, 0);
+        bufferevent_setcb(client->queue, NULL, handle_flush_written,
+                          handle_flush_error, &state);
+        bufferevent_set_timeouts(client->queue, NULL, &tv);
+        bufferevent_enable(client->queue, EV_WRITE);
+        while (state == FLUSH_PENDING)
+            if (event_base_loop(bufferevent_get_base(client->queue),
+                                EVLOOP_ONCE)
+                < 0)
+                die("internal error: output flush event loop failed");
+        if (state != FLUSH_DONE) {
+            if (state == FLUSH_TIMEOUT)
+                warn("timeout sending queued output to client");
+            else
+                syswarn("cannot send queued output to client");
+            client->fatal = true;
+            okay = false;
+        }
+    }
+    bufferevent_free(client->queue);
+    client->queue = NULL;
+    fdflag_nonblocking(client->fd, false);
+    return okay;
+}
+
+
+/*
+ * Compress the data of an output token with the given method and, if that
+ * makes it smaller, change the header and the iovecs to send a
+ * MESSAGE_OUTPUT_COMPRESSED token instead.  The header must have room for
+ * the extra octet for the compression method.  Returns the newly allocated
+ * compressed data, which the caller must free, or NULL if the output should
+ * be sent as is.
+ */
+static void *
+compress_output(enum compress_method method, char *header, struct iovec *iov)
+{
+    void *data;
+    size_t size;
+
+    size = compress_bound(method, iov[1].iov_len);
+    data = xmalloc(size);
+    if (!compress_data(method, iov[1].iov_base, iov[1].iov_len, data, &size)
+        || size >= iov[1].iov_len) {
+        free(data);
+        return NULL;
+    }
+    header[0] = 3;
+    header[1] = MESSAGE_OUTPUT_COMPRESSED;
+    memmove(header + 4, header + 3, 4);
+    header[3] = method;
+    iov[0].iov_len = 1 + 1 + 1 + 1 + 4;
+    iov[1].iov_base = data;
+    iov[1].iov_len = size;
+    return data;
+}
+
 
 /*
  * Given the client struct and the stream number the data is from, send a
  * protocol v2 output token to the client containing the data stored in the
- * buffer in the client struct.  Returns true on success, false on failure
- * (and logs a message on failure).
+ * buffer.  Returns true on success, false on failure (and logs a message on
+ * failure).
  */
-static bool
+bool
 server_v2_send_output(struct client *client, int stream,
                       struct evbuffer *output)
 {
-    gss_buffer_desc token;
+    struct iovec iov[2];
+    char header[1 + 1 + 1 + 1 + 4];
     size_t outlen;
-    char *p;
     OM_uint32 tmp, major, minor;
+    void *compressed = NULL;
     int status;
 
-    /* Allocate room for the total message. */
-    outlen = evbuffer_get_length(output);
-    if (outlen >= SIZE_MAX - 1 - 1 - 1 - 4)
-        die("internal error: memory allocation too large");
-    token.length = 1 + 1 + 1 + 4 + outlen;
-    token.value = xmalloc(token.length);
-
     /*
-     * Fill in the header (version, type, stream, length, and data) and then
-     * the data.
+     * Fill in the header (version, type, stream, and length).  The data is
+     * sent directly from the output buffer, where it's encrypted in place, so
+     * that it isn't copied into a separate token.  If the rule for the
+     * command and the client both allow it, it's not encrypted at all.
      */
-    p = token.value;
-    *p = 2;
-    p++;
-    *p = MESSAGE_OUTPUT;
-    p++;
-    *p = stream;
-    p++;
+    outlen = evbuffer_get_length(output);
+    header[0] = 2;
+    header[1] = MESSAGE_OUTPUT;
+    header[2] = stream;
     tmp = htonl(outlen);
-    memcpy(p, &tmp, 4);
-    p += 4;
-    if (evbuffer_remove(output, p, outlen) < 0)
+    memcpy(header + 3, &tmp, 4);
+    iov[0].iov_base = header;
+    iov[0].iov_len = 1 + 1 + 1 + 4;
+    iov[1].iov_base = evbuffer_pullup(output, outlen);
+    iov[1].iov_len = outlen;
+    if (outlen > 0 && iov[1].iov_base == NULL)
         die("internal error: cannot move data from output buffer");
 
-    /* Send the token. */
-    status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+    /*
+     * If the rule for the command and the client both allow it, send the
+     * output compressed if it's large enough to be worth trying and
+     * compressing it helps.
+     */
+    if (client->compress != COMPRESS_NONE && outlen >= compress_min
+        && outlen <= TOKEN_MAX_OUTPUT)
+        compressed = compress_output(client->compress, header, iov);
+
+    /*
+     * Send the token, or add it to the queue if a command is running.  The
+     * event loop sends queued tokens as the client is ready for them.
+     */
+    if (client->queue == NULL)
+        status = token_send_priv_iov(client->fd, client->context,
+                                     TOKEN_DATA | TOKEN_PROTOCOL,
+                                     !client->integrity_only, iov, 2,
+                                     TIMEOUT, &major, &minor);
+    else
+        status = queue_token(client, iov, 2, !client->integrity_only, &major,
+                             &minor);
+    evbuffer_drain(output, outlen);
+    free(compressed);
     if (status != TOKEN_OK) {
         warn_token("sending output token", status, major, minor);
-        free(token.value);
         client->fatal = true;
         return false;
     }
-    free(token.value);
     return true;
 }
 
 
+/*
+ * Stop or resume reading output from a process, used when the queue of
+ * output for the client is full and once it has drained.  If a stream has
+ * already reached end of file, enabling it again just reports end of file
+ * again, which disables it.
+ */
+static void
+pause_output(struct process *process, bool pause)
+{
+    process->paused = pause;
+    if (pause) {
+        bufferevent_disable(process->inout, EV_READ);
+        bufferevent_disable(process->err, EV_READ);
+    } else {
+        bufferevent_enable(process->inout, EV_READ);
+        bufferevent_enable(process->err, EV_READ);
+    }
+}
+
+
+/*
+ * Called when the queue of output for the client has drained below the low
+ * water mark.  Resume reading output from the process if we paused it.
+ */
+static void
+handle_queue_drained(struct bufferevent *bev UNUSED, void *data)
+{
+    struct process *process = data;
+
+    if (process->paused)
+        pause_output(process, false);
+}
+
+
+/*
+ * Called on errors sending queued output to the client.  The client is gone
+ * or broken, so give up on the command.
+ */
+static void
+handle_queue_event(struct bufferevent *bev UNUSED, short events UNUSED,
+                   void *data)
+{
+    struct process *process = data;
+
+    syswarn("cannot send queued output to client");
+    process->client->fatal = true;
+    process->saw_error = true;
+    process->paused = false;
+    event_base_loopbreak(process->loop);
+}
+
+
+/*
+ * Send the output from one stream of a process that's waiting in its
+ * bufferevent, if any, and then stop reading output from the process if the
+ * queue of output for the client is full.  Returns false if sending failed.
+ */
+static bool
+send_stream(struct process *process, struct bufferevent *bev)
+{
+    struct evbuffer *buf, *queue;
+    int stream;
+
+    buf = bufferevent_get_input(bev);
+    if (evbuffer_get_length(buf) == 0)
+        return true;
+    if (process->flush != NULL)
+        event_del(process->flush);
+    stream = (bev == process->inout) ? 1 : 2;
+    if (!server_v2_send_output(process->client, stream, buf)) {
+        process->saw_error = true;
+        event_base_loopbreak(process->loop);
+        return false;
+    }
+    queue = bufferevent_get_output(process->client->queue);
+    if (evbuffer_get_length(queue) >= OUTPUT_QUEUE_HIGH)
+        pause_output(process, true);
+    return true;
+}
+
+
+/*
+ * Called when output from a process has been held back for long enough.
+ * Since output held back on one stream is sent before any output from the
+ * other, at most one of the streams has any.
+ */
+static void
+handle_flush(evutil_socket_t fd UNUSED, short what UNUSED, void *data)
+{
+    struct process *process = data;
+
+    if (send_stream(process, process->inout))
+        send_stream(process, process->err);
+}
+
+
 /*
  * Callback used to handle output from a process (protocol version two or
  * later).  We use the same handler for both standard output and standard
  * error and check the bufferevent to determine which stream we're seeing.
  *
  * When called, note that we saw some output, which is a flag to continue
- * processing when running the event loop after the child has exited.
+ * processing when running the event loop after the child has exited.  If
+ * output is being batched and the process is still running, only send the
+ * output once there's enough of it, and otherwise make sure the flush timer
+ * will send it soon.  Any output held back on the other stream is sent
+ * first to keep the streams in order.
  */
 static void
 handle_output(struct bufferevent *bev, void *data)
 {
-    int stream;
-    struct evbuffer *buf;
     struct process *process = data;
+    struct bufferevent *other;
+    struct timeval tv;
+    size_t size;
+    unsigned long delay;
 
     process->saw_output = true;
-    stream = (bev == process->inout) ? 1 : 2;
-    buf = bufferevent_get_input(bev);
-    if (!server_v2_send_output(process->client, stream, buf)) {
-        process->saw_error = true;
-        event_base_loopbreak(process->loop);
+    other = (bev == process->inout) ? process->err : process->inout;
+    if (!send_stream(process, other))
+        return;
+    if (process->flush != NULL && !process->reaped) {
+        size = rule_batch_size(process->rule);
+        if (evbuffer_get_length(bufferevent_get_input(bev)) < size) {
+            if (!event_pending(process->flush, EV_TIMEOUT, NULL)) {
+                delay = rule_batch_delay(process->rule);
+                tv.tv_sec = (time_t) (delay / 1000);
+                tv.tv_usec = (long) (delay % 1000) * 1000;
+                if (event_add(process->flush, &tv) < 0)
+                    die("internal error: cannot add output flush event");
+            }
+            return;
+        }
     }
+    send_stream(process, bev);
 }
 
 
 /*
  * Set up handling of a child process with the v2 protocol.  Takes the process
- * struct and sets up the necessary event loop hooks.
+ * struct and sets up the necessary event loop hooks, including the queue of
+ * output for the client, which is sent from the same event loop.
  */
 void
 server_v2_command_setup(struct process *process)
 {
+    struct client *client = process->client;
     bufferevent_data_cb writecb;
 
+    flush_queue(client);
+    fdflag_nonblocking(client->fd, true);
+    client->queue = bufferevent_socket_new(process->loop, client->fd, 0);
+    if (client->queue == NULL)
+        die("internal error: cannot create client output bufferevent");
+    bufferevent_setcb(client->queue, NULL, handle_queue_drained,
+                      handle_queue_event, process);
+    bufferevent_setwatermark(client->queue, EV_WRITE, OUTPUT_QUEUE_LOW, 0);
+    bufferevent_enable(client->queue, EV_WRITE);
+
+    /* If output is batched, create the timer to send held-back output. */
+    if (rule_batch_size(process->rule) > 1
+        && rule_batch_delay(process->rule) > 0) {
+        process->flush = event_new(process->loop, -1, 0, handle_flush,
+                                   process);
+        if (process->flush == NULL)
+            die("internal error: cannot create output flush event");
+    }
+
     writecb = (process->input == NULL) ? NULL : server_handle_input_end;
     bufferevent_setcb(process->inout, handle_output, writecb,
                       server_handle_io_event, process);
@@ -137,6 +502,7 @@ server_v2_command_finish(struct client *client, struct evbuffer *output UNUSED,
                          int exit_status)
 {
     gss_buffer_desc token;
+    struct iovec iov;
     char buffer[1 + 1 + 1];
     OM_uint32 major, minor;
     int status;
@@ -148,10 +514,21 @@ server_v2_command_finish(struct client *client, struct evbuffer *output UNUSED,
     buffer[1] = MESSAGE_STATUS;
     buffer[2] = exit_status;
 
-    /* Send the token. */
-    status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+    /*
+     * If output was queued, add the token to the queue and send it all at
+     * once, so that the last of the output and the status usually go out in
+     * a single write.
+     */
+    if (client->queue != NULL) {
+        iov.iov_base = token.value;
+        iov.iov_len = token.length;
+        status = queue_token(client, &iov, 1, true, &major, &minor);
+        if (status == TOKEN_OK)
+            return flush_queue(client);
+    } else
+        status = token_send_priv(client->fd, client->context,
+                                 TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
+                                 &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending status token", status, major, minor);
         client->fatal = true;
@@ -193,7 +570,11 @@ server_v2_send_error(struct client *client, enum error_codes code,
     p += 4;
     memcpy(p, message, strlen(message));
 
-    /* Send the token. */
+    /* Send the token after any queued output. */
+    if (!flush_queue(client)) {
+        free(token.value);
+        return false;
+    }
     status = token_send_priv(client->fd, client->context,
                              TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
                              &major, &minor);
@@ -273,20 +654,82 @@ server_v3_send_noop(struct client *client)
 }
 
 
+/*
+ * Given the client struct and a MESSAGE_OPTIONS token, record the output
+ * options that the client asked for and that the server supports, and send
+ * them back to the client in a protocol v3 options token.  The options last
+ * for the rest of the connection.  Returns true on success, false on failure
+ * (and logs a message on failure).
+ */
+static bool
+server_v3_handle_options(struct client *client, gss_buffer_t token)
+{
+    gss_buffer_desc reply;
+    char buffer[1 + 1 + 1];
+    OM_uint32 major, minor;
+    int status;
+
+    /* Parse the token and choose the options. */
+    if (token->length != 1 + 1 + 1) {
+        warn("malformed options message from client");
+        return client->error(client, ERROR_BAD_TOKEN, "Invalid token");
+    }
+    client->options = ((unsigned char *) token->value)[2];
+    client->options &= OPTION_INTEGRITY | compress_methods();
+    debug("output options %d for connection", client->options);
+
+    /* Build the options token. */
+    reply.length = 1 + 1 + 1;
+    reply.value = &buffer;
+    buffer[0] = 3;
+    buffer[1] = MESSAGE_OPTIONS;
+    buffer[2] = client->options;
+
+    /* Send the token. */
+    status = token_send_priv(client->fd, client->context,
+                             TOKEN_DATA | TOKEN_PROTOCOL, &reply, TIMEOUT,
+                             &major, &minor);
+    if (status != TOKEN_OK) {
+        warn_token("sending options token", status, major, minor);
+        client->fatal = true;
+        return false;
+    }
+    return true;
+}
+
+
 /*
  * Receive a new token from the client, handling reporting of errors.  Takes
  * the client struct and a pointer to storage for the token.  Returns TOKEN_OK
  * on success, TOKEN_FAIL_EOF if the other end has gone away, and a different
  * error code on a recoverable error.
+ *
+ * Waiting for the client to send something is done in the event loop of the
+ * connection, reading whatever arrives until a complete token is buffered,
+ * so that other events in that loop, such as the other connections of a
+ * pool worker, are handled while the client is slow or idle.
  */
 static int
 server_v2_read_token(struct client *client, gss_buffer_t token)
 {
-    OM_uint32 major, minor;
-    int status, flags;
-    
-    status = token_recv_priv(client->fd, client->context, &flags, token,
-                             TOKEN_MAX_LENGTH, TIMEOUT, &major, &minor);
+    OM_uint32 major = 0;
+    OM_uint32 minor = 0;
+    int status = TOKEN_OK;
+    int flags;
+
+    while (status == TOKEN_OK
+           && !token_buffer_complete(client->input, TOKEN_MAX_LENGTH)) {
+        if (!server_event_wait(server_client_loop(client), client->fd,
+                               TIMEOUT))
+            status = TOKEN_FAIL_TIMEOUT;
+        else
+            status = token_buffer_read(client->fd, client->input);
+    }
+    if (status == TOKEN_OK)
+        status = token_recv_priv_buffer(client->fd, client->input,
+                                        client->context, &flags, token,
+                                        TOKEN_MAX_LENGTH, TIMEOUT, &major,
+                                        &minor);
     if (status != TOKEN_OK) {
         warn_token("receiving token", status, major, minor);
         if (status != TOKEN_FAIL_EOF && status != TOKEN_FAIL_SOCKET)
@@ -467,6 +910,9 @@ server_v2_handle_token(struct client *client, struct config *config,
         debug("replying to no-op message");
         result = server_v3_send_noop(client);
         break;
+    case MESSAGE_OPTIONS:
+        result = server_v3_handle_options(client, token);
+        break;
     case MESSAGE_QUIT:
         debug("quit received, closing connection");
         client->keepalive = false;
@@ -482,6 +928,33 @@ server_v2_handle_token(struct client *client, struct config *config,
 }
 
 
+/*
+ * Reads and handles a single message from the client, checking a command
+ * against the ACLs and executing it when appropriate.  This waits for the
+ * message if it hasn't been read yet, but callers that wait for data
+ * themselves can call it once token_buffer_complete is true for the input
+ * buffer of the client and it won't block on reading (other than for the
+ * rest of a continued command).  client->keepalive must be set to true
+ * before the first call.  Returns true if the connection should stay open
+ * for further messages, and false if it should be closed or was parked.
+ */
+bool
+server_v2_handle_message(struct client *client, struct config *config)
+{
+    gss_buffer_desc token;
+    OM_uint32 minor;
+    bool result;
+
+    if (!token_buffer_pending(client->input) && server_park_idle(client))
+        return false;
+    if (server_v2_read_token(client, &token) != TOKEN_OK)
+        return false;
+    result = server_v2_handle_token(client, config, &token);
+    gss_release_buffer(&minor, &token);
+    return result && client->keepalive;
+}
+
+
 /*
  * Takes the client struct and the server configuration and handles client
  * requests.  Reads messages from the client, checking commands against the
@@ -491,20 +964,7 @@ server_v2_handle_token(struct client *client, struct config *config,
 void
 server_v2_handle_messages(struct client *client, struct config *config)
 {
-    gss_buffer_desc token;
-    OM_uint32 minor;
-    int status;
-
-    /* Loop receiving messages until we're finished. */
     client->keepalive = true;
-    do {
-        status = server_v2_read_token(client, &token);
-        if (status != TOKEN_OK)
-            break;
-        if (!server_v2_handle_token(client, config, &token)) {
-            gss_release_buffer(&minor, &token);
-            break;
-        }
-        gss_release_buffer(&minor, &token);
-    } while (client->keepalive);
+    while (server_v2_handle_message(client, config))
+        ;
 }
@@ -0,0 +1,374 @@
+/*
+ * Test suite for falling back with servers that don't support output options.
+ *
+ * Runs a fake server that doesn't understand MESSAGE_OPTIONS, either because
+ * it predates that message or because it only supports protocol version two,
+ * and checks that a client that asks for output options gets the error or
+ * version reply, stops asking, and runs its commands as usual.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+
+#include <fcntl.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <util/gss-tokens.h>
+#include <util/messages.h>
+#include <util/protocol.h>
+#include <util/tokens.h>
+#include <util/xmalloc.h>
+
+
+/*
+ * Send a token to the client, dying on failure.
+ */
+static void
+send_token(socket_type conn, gss_ctx_id_t context, const void *data,
+           size_t length)
+{
+    gss_buffer_desc token;
+    OM_uint32 major, minor;
+
+    token.value = (void *) data;
+    token.length = length;
+    if (token_send_priv(conn, context, TOKEN_DATA | TOKEN_PROTOCOL, &token, 0,
+                        &major, &minor)
+        != TOKEN_OK)
+        die("cannot send token");
+}
+
+
+/*
+ * Parse a complete protocol version two command and reply with output
+ * giving the number of rejected messages seen so far, the number of arguments,
+ * and the total length of the arguments, followed by an exit status of 0.
+ */
+static void
+send_result(socket_type conn, gss_ctx_id_t context, const char *command,
+            size_t length, unsigned long rejected)
+{
+    char *output, *token;
+    size_t count, i, size, total;
+    uint32_t data;
+
+    if (length < 4)
+        die("command too short");
+    memcpy(&data, command, 4);
+    count = ntohl(data);
+    command += 4;
+    length -= 4;
+    total = 0;
+    for (i = 0; i < count; i++) {
+        if (length < 4)
+            die("command too short");
+        memcpy(&data, command, 4);
+        size = ntohl(data);
+        if (length - 4 < size)
+            die("command too short");
+        command += 4 + size;
+        length -= 4 + size;
+        total += size;
+    }
+    xasprintf(&output, "%lu rejected, %lu arguments, %lu bytes", rejected,
+              (unsigned long) count, (unsigned long) total);
+    token = xmalloc(1 + 1 + 1 + 4 + strlen(output));
+    token[0] = 2;
+    token[1] = MESSAGE_OUTPUT;
+    token[2] = 1;
+    data = htonl(strlen(output));
+    memcpy(token + 3, &data, 4);
+    memcpy(token + 7, output, strlen(output));
+    send_token(conn, context, token, 7 + strlen(output));
+    token[1] = MESSAGE_STATUS;
+    token[2] = 0;
+    send_token(conn, context, token, 3);
+    free(token);
+    free(output);
+}
+
+
+/*
+ * Create a socket, accept a single connection, establish a context, and then
+ * answer commands like a server that supports the given protocol version but
+ * not MESSAGE_OPTIONS until the client quits.  We run this in a subprocess
+ * to provide the foil against which to test the client.
+ */
+static void
+accept_connection(const char *pidfile, int protocol)
+{
+    struct sockaddr_in saddr;
+    socket_type s, conn;
+    int fd;
+    int on = 1;
+    const void *onaddr = &on;
+    int flags;
+    gss_buffer_desc send_tok, recv_tok;
+    OM_uint32 major, minor, ret_flags;
+    gss_ctx_id_t context;
+    gss_name_t client;
+    gss_OID doid;
+    char *p;
+    char *command = NULL;
+    size_t length = 0;
+    unsigned long rejected = 0;
+    const char version[] = { 2, MESSAGE_VERSION, (char) protocol };
+    const char error[] = { 2, MESSAGE_ERROR, 0, 0, 0, ERROR_UNKNOWN_MESSAGE,
+                           0, 0, 0, 0 };
+
+    /* Create the socket and accept the connection. */
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(14373);
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+        sysdie("error creating socket");
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, onaddr, sizeof(on));
+    if (bind(s, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+        sysdie("error binding socket");
+    if (listen(s, 1) < 0)
+        sysdie("error listening to socket");
+    fd = open(pidfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        sysdie("cannot create sentinal");
+    close(fd);
+    conn = accept(s, NULL, 0);
+    if (conn == INVALID_SOCKET)
+        sysdie("error accepting connection");
+
+    /* Now do the context negotiation. */
+    if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+        die("cannot recv initial token");
+    if (flags != (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
+        die("bad flags on initial token");
+    context = GSS_C_NO_CONTEXT;
+    do {
+        if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+            die("cannot recv subsequent token");
+        if (flags != (TOKEN_CONTEXT | TOKEN_PROTOCOL))
+            die("bad flags on subsequent token");
+        major = gss_accept_sec_context(&minor, &context, GSS_C_NO_CREDENTIAL,
+                       &recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &client, &doid,
+                       &send_tok, &ret_flags, NULL, NULL);
+        if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED)
+            die("GSS-API failure: %ld %ld\n", (long) major, (long) minor);
+        gss_release_buffer(&minor, &recv_tok);
+        if (send_tok.length != 0) {
+            flags = TOKEN_CONTEXT | TOKEN_PROTOCOL;
+            if (token_send(conn, flags, &send_tok, 0) != TOKEN_OK)
+                die("cannot send subsequent token");
+            gss_release_buffer(&minor, &send_tok);
+        }
+    } while (major == GSS_S_CONTINUE_NEEDED);
+
+    /*
+     * Answer messages with a protocol version we don't support with
+     * MESSAGE_VERSION and MESSAGE_OPTIONS with an unknown message error, and
+     * gather the tokens of a command until it's complete.  Stop when the
+     * client quits or closes the connection.
+     */
+    while (1) {
+        if (token_recv_priv(conn, context, &flags, &recv_tok,
+                            TOKEN_MAX_LENGTH, 0, &major, &minor)
+            != TOKEN_OK)
+            break;
+        p = recv_tok.value;
+        if (recv_tok.length < 2 || p[1] == MESSAGE_QUIT) {
+            gss_release_buffer(&minor, &recv_tok);
+            break;
+        }
+        if (p[0] > protocol) {
+            rejected++;
+            send_token(conn, context, version, sizeof(version));
+        } else if (p[1] == MESSAGE_OPTIONS) {
+            rejected++;
+            send_token(conn, context, error, sizeof(error));
+        } else if (p[1] == MESSAGE_COMMAND && recv_tok.length >= 4) {
+            command = xrealloc(command, length + recv_tok.length - 4);
+            memcpy(command + length, p + 4, recv_tok.length - 4);
+            length += recv_tok.length - 4;
+            if (p[3] == 0 || p[3] == 3) {
+                send_result(conn, context, command, length, rejected);
+                length = 0;
+            }
+        } else {
+            die("unexpected token from client");
+        }
+        gss_release_buffer(&minor, &recv_tok);
+    }
+
+    /* All done.  Clean up memory. */
+    free(command);
+    gss_release_name(&minor, &client);
+    gss_delete_sec_context(&minor, &context, GSS_C_NO_BUFFER);
+    socket_close(conn);
+    socket_close(s);
+}
+
+
+/*
+ * Start the fake server in a child process, supporting the given protocol
+ * version, and wait for it to be ready.  Returns the PID of the child.
+ */
+static pid_t
+start_server(char *path, const char *pidfile, int protocol)
+{
+    struct timeval tv;
+    pid_t child;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        test_tmpdir_free(path);
+        accept_connection(pidfile, protocol);
+        exit(0);
+    }
+    alarm(1);
+    while (access(pidfile, F_OK) < 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 50000;
+        select(0, NULL, NULL, NULL, &tv);
+    }
+    alarm(0);
+    return child;
+}
+
+
+/*
+ * Run a command and check its output, which is the expected string, and
+ * that its status is 0.
+ */
+static void
+check_command(struct remctl *r, const struct iovec *command, size_t count,
+              const char *expected, const char *message)
+{
+    struct remctl_output *output;
+
+    ok(remctl_commandv(r, command, count), "%s: command", message);
+    output = remctl_output(r);
+    if (output == NULL) {
+        diag("output error: %s", remctl_error(r));
+        ok_block(3, false, "%s: output", message);
+        return;
+    }
+    is_int(REMCTL_OUT_OUTPUT, output->type, "%s: output", message);
+    if (output->type == REMCTL_OUT_OUTPUT)
+        ok(output->length == strlen(expected)
+               && memcmp(output->data, expected, output->length) == 0,
+           "%s: output is correct", message);
+    else
+        ok(false, "%s: output is correct", message);
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+           && output->status == 0,
+       "%s: status 0", message);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    char *path, *pidfile;
+    struct remctl *r;
+    pid_t child;
+    struct iovec command[2];
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    plan(6 * 4 + 4);
+
+    path = test_tmpdir();
+    basprintf(&pidfile, "%s/pid", path);
+    command[0].iov_base = (void *) "test";
+    command[0].iov_len = strlen("test");
+    command[1].iov_base = (void *) "fallback";
+    command[1].iov_len = strlen("fallback");
+
+    /* Without any output options, no options message is sent. */
+    child = start_server(path, pidfile, 3);
+    r = remctl_new();
+    if (!remctl_open(r, "127.0.0.1", 14373, config->principal))
+        bail("cannot connect to fake server: %s", remctl_error(r));
+    check_command(r, command, 2, "0 rejected, 2 arguments, 12 bytes",
+                  "no options");
+    remctl_close(r);
+    waitpid(child, NULL, 0);
+    unlink(pidfile);
+
+    /*
+     * Asking for integrity-only output gets an error, after which the
+     * command runs as usual and the options aren't sent again, even if they
+     * change.
+     */
+    child = start_server(path, pidfile, 3);
+    r = remctl_new();
+    remctl_set_integrity_only(r, 1);
+    if (!remctl_open(r, "127.0.0.1", 14373, config->principal))
+        bail("cannot connect to fake server: %s", remctl_error(r));
+    check_command(r, command, 2, "1 rejected, 2 arguments, 12 bytes",
+                  "integrity-only");
+    ok(r->old_server, "...and the server is remembered as old");
+    is_int(0, r->options, "...and no options are in effect");
+    remctl_set_integrity_only(r, 0);
+    check_command(r, command, 2, "1 rejected, 2 arguments, 12 bytes",
+                  "second command");
+    remctl_close(r);
+    waitpid(child, NULL, 0);
+    unlink(pidfile);
+
+    /* The same happens when asking for compression, if supported. */
+    r = remctl_new();
+    if (!remctl_set_compression(r, 1)) {
+        skip_block(5, "compression not supported");
+        remctl_close(r);
+    } else {
+        child = start_server(path, pidfile, 3);
+        if (!remctl_open(r, "127.0.0.1", 14373, config->principal))
+            bail("cannot connect to fake server: %s", remctl_error(r));
+        check_command(r, command, 2, "1 rejected, 2 arguments, 12 bytes",
+                      "compression");
+        ok(r->old_server, "...and the server is remembered as old");
+        remctl_close(r);
+        waitpid(child, NULL, 0);
+        unlink(pidfile);
+    }
+
+    /* A server that only supports protocol version two rejects the version. */
+    child = start_server(path, pidfile, 2);
+    r = remctl_new();
+    remctl_set_integrity_only(r, 1);
+    if (!remctl_open(r, "127.0.0.1", 14373, config->principal))
+        bail("cannot connect to fake server: %s", remctl_error(r));
+    check_command(r, command, 2, "1 rejected, 2 arguments, 12 bytes",
+                  "protocol two");
+    ok(r->old_server, "...and the server is remembered as old");
+    check_command(r, command, 2, "1 rejected, 2 arguments, 12 bytes",
+                  "protocol two second command");
+    remctl_close(r);
+    waitpid(child, NULL, 0);
+    unlink(pidfile);
+
+    /* Clean up. */
+    free(pidfile);
+    test_tmpdir_free(path);
+    return 0;
+}
@@ -2,6 +2,7 @@
  * Test suite for setting a timeout for the client.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
  * Copyright 2012
  *     The Board of Trustees of the Leland Stanford Junior University
  *
@@ -29,7 +30,7 @@ main(void)
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
     remctld_start(config, "data/conf-simple", (char *) 0);
 
-    plan(11);
+    plan(16);
 
     /*
      * Send the command with no arguments, which means we'll time out right
@@ -67,5 +68,17 @@ main(void)
               "correct error");
     remctl_close(r);
 
+    /* The same with a timeout of less than a second. */
+    command[2] = NULL;
+    r = remctl_new();
+    ok(!remctl_set_timeout_ms(r, -1), "negative timeout rejected");
+    ok(remctl_set_timeout_ms(r, 500), "set sub-second timeout");
+    ok(remctl_open(r, "127.0.0.1", 14373, config->principal), "open");
+    ok(remctl_command(r, command), "sent test sleep command");
+    is_string("error receiving token: timed out",
+              remctl_output(r) == NULL ? remctl_error(r) : "got output",
+              "timed out");
+    remctl_close(r);
+
     return 0;
 }
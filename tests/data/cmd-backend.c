@@ -0,0 +1,195 @@
+/*
+ * Small C program to test persistent backends.
+ *
+ * If REMCTL_BACKEND is set in the environment, this program serves requests
+ * on the listening socket passed as standard input, using the protocol that
+ * remctld uses to talk to persistent backends.  Otherwise, it runs a single
+ * command given on the command line like any other command.  Either way, it
+ * supports the following commands, selected with the first argument:
+ *
+ * echo         Print the remaining arguments separated by spaces.
+ * env          Print the value of the environment variable given as argument.
+ * mode         Print "backend" or "direct" and the PID of this process.
+ * status       Print "output" and "error" to the two streams and exit 2.
+ * stdin        Print the data read from standard input.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <util/buffer.h>
+#include <util/messages.h>
+#include <util/network.h>
+#include <util/protocol.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+
+/*
+ * Run a command, given its arguments (without the program name) and its
+ * standard input, and store its output and error output in the given
+ * buffers.  Returns the exit status.
+ */
+static int
+run(struct vector *args, struct buffer *input, bool backend,
+    struct buffer *output, struct buffer *error)
+{
+    const char *command, *value;
+    size_t i;
+
+    if (args->count == 0) {
+        buffer_append_sprintf(error, "no command given\n");
+        return 1;
+    }
+    command = args->strings[0];
+    if (strcmp(command, "echo") == 0) {
+        for (i = 1; i < args->count; i++)
+            buffer_append_sprintf(output, "%s%s", (i > 1) ? " " : "",
+                                  args->strings[i]);
+        buffer_append_sprintf(output, "\n");
+    } else if (strcmp(command, "env") == 0 && args->count == 2) {
+        value = getenv(args->strings[1]);
+        if (value == NULL)
+            return 1;
+        buffer_append_sprintf(output, "%s\n", value);
+    } else if (strcmp(command, "mode") == 0) {
+        buffer_append_sprintf(output, "%s %lu\n",
+                              backend ? "backend" : "direct",
+                              (unsigned long) getpid());
+    } else if (strcmp(command, "status") == 0) {
+        buffer_append_sprintf(output, "output\n");
+        buffer_append_sprintf(error, "error\n");
+        return 2;
+    } else if (strcmp(command, "stdin") == 0) {
+        buffer_append(output, input->data + input->used, input->left);
+    } else {
+        buffer_append_sprintf(error, "unknown command %s\n", command);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Send a record to remctld.
+ */
+static void
+send_record(int fd, enum backend_records type, const char *data,
+            size_t length)
+{
+    char header[5];
+    uint32_t size;
+
+    header[0] = (char) type;
+    size = htonl((uint32_t) length);
+    memcpy(header + 1, &size, sizeof(size));
+    if (xwrite(fd, header, sizeof(header)) < 0)
+        sysdie("cannot send record");
+    if (length > 0 && xwrite(fd, data, length) < 0)
+        sysdie("cannot send record");
+}
+
+
+/*
+ * Read a request from remctld on the given connection, run it, and send back
+ * the reply.  Returns false if the connection closed early.
+ */
+static bool
+serve(int fd)
+{
+    struct vector *args;
+    struct buffer *input, *output, *error;
+    unsigned char header[5];
+    uint32_t size, status;
+    char *data;
+    bool done = false;
+
+    args = vector_new();
+    input = buffer_new();
+    output = buffer_new();
+    error = buffer_new();
+    while (!done) {
+        if (!network_read(fd, header, sizeof(header), 0))
+            return false;
+        memcpy(&size, header + 1, sizeof(size));
+        size = ntohl(size);
+        data = xmalloc(size + 1);
+        if (size > 0 && !network_read(fd, data, size, 0))
+            return false;
+        data[size] = '\0';
+        switch (header[0]) {
+        case BACKEND_ARGUMENT:
+            vector_add(args, data);
+            break;
+        case BACKEND_ENV:
+            putenv(xstrdup(data));
+            break;
+        case BACKEND_STDIN:
+            buffer_append(input, data, size);
+            break;
+        case BACKEND_END:
+            status = htonl((uint32_t) run(args, input, true, output, error));
+            done = true;
+            break;
+        case BACKEND_PING:
+            status = htonl(0);
+            done = true;
+            break;
+        default:
+            die("unknown record type %d", header[0]);
+        }
+        free(data);
+    }
+    if (output->left > 0)
+        send_record(fd, BACKEND_STDOUT, output->data, output->left);
+    if (error->left > 0)
+        send_record(fd, BACKEND_STDERR, error->data, error->left);
+    send_record(fd, BACKEND_STATUS, (char *) &status, sizeof(status));
+    vector_free(args);
+    buffer_free(input);
+    buffer_free(output);
+    buffer_free(error);
+    return true;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct vector *args;
+    struct buffer *input, *output, *error;
+    int fd, status;
+
+    /* Serve requests forever in backend mode. */
+    if (getenv("REMCTL_BACKEND") != NULL) {
+        while ((fd = accept(0, NULL, NULL)) >= 0) {
+            serve(fd);
+            close(fd);
+        }
+        sysdie("cannot accept connection");
+    }
+
+    /* Otherwise, run the command line. */
+    args = vector_new();
+    for (fd = 1; fd < argc; fd++)
+        vector_add(args, argv[fd]);
+    input = buffer_new();
+    output = buffer_new();
+    error = buffer_new();
+    if (argc > 1 && strcmp(argv[1], "stdin") == 0)
+        if (!buffer_read_all(input, 0))
+            sysdie("cannot read standard input");
+    status = run(args, input, false, output, error);
+    if (xwrite(1, output->data, output->left) < 0)
+        sysdie("cannot write output");
+    if (xwrite(2, error->data, error->left) < 0)
+        sysdie("cannot write error");
+    return status;
+}
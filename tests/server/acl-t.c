@@ -21,6 +21,9 @@
 #endif
 #include <portable/system.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include <server/internal.h>
 #include <tests/tap/basic.h>
 #include <tests/tap/messages.h>
@@ -68,16 +71,39 @@ acl_permit_anonymous(const struct rule *rule)
 }
 
 
+/*
+ * Write the given contents to an ACL file, replacing any existing file.
+ */
+static void
+write_acl(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF)
+        sysbail("cannot write to %s", path);
+    if (fclose(file) == EOF)
+        sysbail("cannot flush %s", path);
+}
+
+
 int
 main(void)
 {
+    char *tmpdir, *path;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    struct stat st;
+    struct timespec times[2];
+#endif
     struct rule rule = {
         NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, 0, NULL,
         NULL, NULL
     };
     const char *acls[5];
 
-    plan(78);
+    plan(88);
     if (chdir(getenv("C_TAP_SOURCE")) < 0)
         sysbail("can't chdir to C_TAP_SOURCE");
 
@@ -284,6 +310,10 @@ main(void)
     ok(strncmp(errors, "TEST:0: compilation of regex '*host/.*' failed:",
                strlen("TEST:0: compilation of regex '*host/.*' failed:")) == 0,
        "...with invalid regex error");
+    free(errors);
+    errors = NULL;
+    acl_permit(&rule, "host/bar.org@EXAMPLE.ORG");
+    ok(errors != NULL, "...reported again on the next check");
     errors_uncapture();
     free(errors);
     errors = NULL;
@@ -293,7 +323,7 @@ main(void)
     is_string("TEST:0: ACL scheme 'regex' is not supported\n", errors,
               "...with not supported error");
     errors_uncapture();
-    skip_block(5, "regex support not available");
+    skip_block(6, "regex support not available");
     free(errors);
     errors = NULL;
 #endif
@@ -340,5 +370,52 @@ main(void)
     free(errors);
     errors = NULL;
 
+    /*
+     * ACL files are cached after they're read.  Make sure that changes are
+     * noticed and that the order of entries is still honored.  Each version
+     * of the file has a different size so that the change is seen even if
+     * it happens within the same second.
+     */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/acl-cache", tmpdir);
+    write_acl(path, "first@EXAMPLE.ORG\n");
+    acls[0] = path;
+    acls[1] = NULL;
+    ok(acl_permit(&rule, "first@EXAMPLE.ORG"), "cached ACL 1");
+    write_acl(path, "second@EXAMPLE.ORG\nthird@EXAMPLE.ORG\n");
+    ok(!acl_permit(&rule, "first@EXAMPLE.ORG"), "...removed principal");
+    ok(acl_permit(&rule, "third@EXAMPLE.ORG"), "...added principal");
+    write_acl(path, "deny:third@EXAMPLE.ORG\nthird@EXAMPLE.ORG\n");
+    ok(!acl_permit(&rule, "third@EXAMPLE.ORG"), "...deny before principal");
+    write_acl(path, "# Comment\nthird@EXAMPLE.ORG\ndeny:third@EXAMPLE.ORG\n");
+    ok(acl_permit(&rule, "third@EXAMPLE.ORG"), "...deny after principal");
+    ok(acl_permit(&rule, "third@EXAMPLE.ORG"), "...and still from cache");
+
+    /*
+     * A change that doesn't alter the size of the file is noticed even
+     * within the same second if the system has nanosecond timestamps.  Set
+     * the modification time so that only its nanoseconds change, since the
+     * file system may not record times that precisely.
+     */
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    write_acl(path, "fourth@EXAMPLE.ORG\n");
+    ok(acl_permit(&rule, "fourth@EXAMPLE.ORG"), "...new principal");
+    if (stat(path, &st) < 0)
+        sysbail("cannot stat %s", path);
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000L;
+    write_acl(path, "fifth1@EXAMPLE.ORG\n");
+    if (utimensat(AT_FDCWD, path, times, 0) < 0)
+        sysbail("cannot set times of %s", path);
+    ok(!acl_permit(&rule, "fourth@EXAMPLE.ORG"), "...same-size change");
+    ok(acl_permit(&rule, "fifth1@EXAMPLE.ORG"), "...new principal");
+#else
+    skip_block(3, "no nanosecond file timestamps");
+#endif
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+
     return 0;
 }
@@ -132,11 +132,31 @@ main(void)
         NULL, NULL, (char **) acls
     };
 
-    plan(16);
+    plan(21);
 
     /* Use a krb5.conf with a default realm of EXAMPLE.ORG. */
     kerberos_generate_conf("EXAMPLE.ORG");
 
+    /* With caching, the group and user are only looked up once. */
+    server_config_set_localgroup_ttl(60, 60);
+    fake_queue_group(&goodguys, 0);
+    set_passwd("remi", 0);
+    acls[0] = "localgroup:goodguys";
+    acls[1] = NULL;
+    ok(acl_permit(&rule, "remi@EXAMPLE.ORG"), "User in group with caching");
+    set_passwd("eagle", 0);
+    ok(acl_permit(&rule, "remi@EXAMPLE.ORG"), "...and from the cache");
+
+    /* Failed lookups are cached too. */
+    ok(!acl_permit(&rule, "nobody@EXAMPLE.ORG"), "Unknown user with caching");
+    set_passwd("nobody", 42);
+    ok(!acl_permit(&rule, "nobody@EXAMPLE.ORG"), "...and from the cache");
+
+    /* Changing the cache times discards the cached results. */
+    server_config_set_localgroup_ttl(0, 0);
+    fake_queue_group(&goodguys, 0);
+    ok(acl_permit(&rule, "nobody@EXAMPLE.ORG"), "...but not once cleared");
+
     /* Check behavior with empty groups. */
     fake_queue_group(&empty, 0);
     set_passwd("someone", 0);
@@ -0,0 +1,142 @@
+/*
+ * Test suite for the threads that accept GSS-API contexts.
+ *
+ * The context tokens sent here are never valid, so every handshake fails,
+ * but that's enough to check that each one is handled by the threads and
+ * comes back exactly once, and that the process can fork while the threads
+ * are running.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <util/messages.h>
+#include <util/tokens.h>
+#include <util/xmalloc.h>
+
+/* The number of connections to authenticate at once. */
+#define COUNT 8
+
+
+/*
+ * Run a batch of connections through a pool with the given number of
+ * threads.  Half get a context token with the wrong flags and half get a
+ * token with the right flags but invalid contents.
+ */
+static void
+test_pool(size_t threads)
+{
+    struct auth_pool *pool;
+    struct client clients[COUNT];
+    socket_type peers[COUNT];
+    socket_type fds[2];
+    gss_buffer_desc token;
+    struct pollfd pfd;
+    enum accept_status status;
+    bool seen[COUNT];
+    bool failed = true;
+    void *data;
+    size_t i, n;
+    int flags, result;
+    pid_t child;
+
+    pool = server_auth_new(GSS_C_NO_CREDENTIAL, threads);
+    ok(pool != NULL, "%lu threads: pool created", (unsigned long) threads);
+    token.value = (void *) "not a context token";
+    token.length = strlen(token.value);
+    for (i = 0; i < COUNT; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+            sysbail("cannot create socket pair");
+        memset(&clients[i], 0, sizeof(clients[i]));
+        clients[i].fd = fds[0];
+        clients[i].protocol = 2;
+        clients[i].context = GSS_C_NO_CONTEXT;
+        clients[i].input = token_buffer_new();
+        if (clients[i].input == NULL)
+            sysbail("cannot create token buffer");
+        peers[i] = fds[1];
+        flags = (i % 2 == 0) ? TOKEN_DATA : TOKEN_CONTEXT | TOKEN_PROTOCOL;
+        if (token_send(peers[i], flags, &token, 0) != TOKEN_OK)
+            sysbail("cannot send token");
+        seen[i] = false;
+    }
+
+    /*
+     * Submit them all, fork a child that allocates memory while the threads
+     * are handling them, and collect the results.
+     */
+    for (i = 0; i < COUNT; i++)
+        server_auth_submit(pool, &clients[i], &seen[i]);
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        free(xmalloc(1024));
+        _exit(0);
+    }
+    result = -1;
+    if (waitpid(child, &result, 0) < 0)
+        sysbail("cannot wait for child");
+    is_int(0, result, "%lu threads: fork while accepting",
+           (unsigned long) threads);
+    pfd.fd = server_auth_fd(pool);
+    pfd.events = POLLIN;
+    for (n = 0; n < COUNT;) {
+        if (poll(&pfd, 1, 10 * 1000) <= 0)
+            break;
+        while (server_auth_result(pool, &data, &status)) {
+            if (*(bool *) data || status != ACCEPT_FAIL)
+                failed = false;
+            *(bool *) data = true;
+            n++;
+        }
+    }
+    is_int(COUNT, n, "%lu threads: all results returned",
+           (unsigned long) threads);
+    for (i = 0; i < COUNT; i++)
+        if (!seen[i])
+            failed = false;
+    ok(failed, "%lu threads: each failed once", (unsigned long) threads);
+    ok(!server_auth_result(pool, &data, &status),
+       "%lu threads: no more results", (unsigned long) threads);
+
+    /* Clean up. */
+    server_auth_free(pool);
+    for (i = 0; i < COUNT; i++) {
+        close(clients[i].fd);
+        close(peers[i]);
+        token_buffer_free(clients[i].input);
+    }
+}
+
+
+int
+main(void)
+{
+    /* Suppress the warnings about the invalid tokens. */
+    message_handlers_warn(0);
+    message_handlers_notice(0);
+
+    plan(2 * 5);
+
+    /* Without threads, each token is accepted as it's submitted. */
+    test_pool(0);
+
+    /* With threads, they're accepted in parallel. */
+    test_pool(4);
+
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*
+ * Test suite for persistent backend processes.
+ *
+ * The test acts as the stand-alone parent, starting the backend pools, and
+ * also as the child that relays commands to them.  It also runs commands the
+ * way the server does, using a fake protocol version two client.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+/* The output sent to the fake client. */
+static struct evbuffer *sent = NULL;
+
+
+/*
+ * Fake client callback for output from a running command, which collects
+ * standard output and discards standard error.
+ */
+static void
+client_read(struct bufferevent *bev, void *data)
+{
+    struct process *process = data;
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    process->saw_output = true;
+    if (bev == process->err)
+        evbuffer_drain(input, evbuffer_get_length(input));
+    else if (evbuffer_add_buffer(sent, input) < 0)
+        bail("cannot collect output");
+}
+
+
+/*
+ * Fake client callback to set up sending output from a running command.
+ */
+static void
+client_setup(struct process *process)
+{
+    bufferevent_setcb(process->inout, client_read, NULL,
+                      server_handle_io_event, process);
+    bufferevent_enable(process->err, EV_READ);
+    bufferevent_setcb(process->err, client_read, NULL,
+                      server_handle_io_event, process);
+}
+
+
+/*
+ * Fake client callback for the end of a command, which ignores it.
+ */
+static bool
+client_finish(struct client *client UNUSED, struct evbuffer *data UNUSED,
+              int exit_status UNUSED)
+{
+    return true;
+}
+
+
+/*
+ * Fake client callback for errors, which ignores them.
+ */
+static bool
+client_error(struct client *client UNUSED, enum error_codes code UNUSED,
+             const char *message UNUSED)
+{
+    return true;
+}
+
+
+/*
+ * Read the contents of a temporary file into newly allocated memory and then
+ * close it.
+ */
+static char *
+slurp(FILE *file)
+{
+    char buffer[BUFSIZ];
+    size_t length;
+
+    rewind(file);
+    length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    buffer[length] = '\0';
+    fclose(file);
+    return bstrdup(buffer);
+}
+
+
+/*
+ * Run a command with server_backend_relay, passing it the given input, and
+ * return its exit status.  The output and error output are stored in
+ * newly-allocated strings in output and error.
+ */
+static int
+relay(struct rule *rule, const char *command, const char *arg,
+      const char *input, char **output, char **error)
+{
+    const char *argv[4];
+    FILE *out, *err;
+    int fds[2];
+    int status;
+
+    argv[0] = "cmd-backend";
+    argv[1] = command;
+    argv[2] = arg;
+    argv[3] = NULL;
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    if (input != NULL)
+        if (write(fds[1], input, strlen(input)) < (ssize_t) strlen(input))
+            sysbail("cannot write input");
+    close(fds[1]);
+    out = tmpfile();
+    err = tmpfile();
+    if (out == NULL || err == NULL)
+        sysbail("cannot create temporary files");
+    status = server_backend_relay(rule, argv, fds[0], fileno(out),
+                                  fileno(err));
+    close(fds[0]);
+    *output = slurp(out);
+    *error = slurp(err);
+    return status;
+}
+
+
+/*
+ * Run the mode command and return the PID of the backend that handled it, or
+ * 0 if it wasn't handled by a backend.
+ */
+static unsigned long
+backend_pid(struct rule *rule)
+{
+    char *output, *error;
+    unsigned long pid = 0;
+
+    if (relay(rule, "mode", NULL, NULL, &output, &error) == 0)
+        if (strncmp(output, "backend ", strlen("backend ")) == 0)
+            pid = strtoul(output + strlen("backend "), NULL, 10);
+    free(output);
+    free(error);
+    return pid;
+}
+
+
+/*
+ * Run the test mode command through server_run_command, the way the server
+ * runs it for a client, and return the newly-allocated output.
+ */
+static char *
+run_mode(struct client *client, struct config *config)
+{
+    struct iovec name = { (void *) "test", 4 };
+    struct iovec mode = { (void *) "mode", 4 };
+    struct iovec *command[3] = { &name, &mode, NULL };
+    char *result;
+    size_t length;
+
+    sent = evbuffer_new();
+    if (sent == NULL)
+        bail("cannot allocate buffer");
+    server_run_command(client, config, command);
+    length = evbuffer_get_length(sent);
+    result = bcalloc(length + 1, 1);
+    if (evbuffer_remove(sent, result, length) < 0)
+        bail("cannot read output");
+    evbuffer_free(sent);
+    sent = NULL;
+    return result;
+}
+
+
+int
+main(void)
+{
+    struct client client;
+    struct config *config;
+    struct rule *rule;
+    char *tmpdir, *path, *program, *output, *error;
+    unsigned long pid, pid2;
+    pid_t child;
+    int status;
+    FILE *file;
+
+    plan(28);
+
+    /* Write a configuration with a backend pool of two processes. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/conf-backend", tmpdir);
+    program = test_file_path("data/cmd-backend");
+    if (program == NULL)
+        bail("cannot find data/cmd-backend");
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "test ALL %s backend=2 backend-requests=3 ANYUSER\n",
+            program);
+    fprintf(file, "other ALL %s ANYUSER\n", program);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+    config = server_config_load(path);
+    if (config == NULL)
+        bail("cannot load %s", path);
+    rule = config->rules[0];
+    is_int(2, rule->backend, "backend parsed");
+    is_int(3, rule->backend_requests, "backend-requests parsed");
+
+    /* Without pools, commands aren't relayed. */
+    status = relay(rule, "echo", "foo", NULL, &output, &error);
+    is_int(-1, status, "No relay without a pool");
+    free(output);
+    free(error);
+
+    /* Start the pools. */
+    server_backend_start(config);
+    ok(rule->pool != NULL, "Pool started for backend rule");
+    ok(config->rules[1]->pool == NULL, "...and not for other rule");
+
+    /* Run some commands. */
+    status = relay(rule, "echo", "foo", NULL, &output, &error);
+    is_int(0, status, "echo status");
+    is_string("foo\n", output, "...and output");
+    is_string("", error, "...and no error output");
+    free(output);
+    free(error);
+    status = relay(rule, "status", NULL, NULL, &output, &error);
+    is_int(2, status, "status status");
+    is_string("output\n", output, "...and output");
+    is_string("error\n", error, "...and error output");
+    free(output);
+    free(error);
+
+    /*
+     * The same backend process handled both and the next command is its
+     * last, after which the other backend process is used.
+     */
+    pid = backend_pid(rule);
+    ok(pid > 0, "Command handled by a backend");
+    pid2 = backend_pid(rule);
+    ok(pid2 > 0 && pid2 != pid, "Backend retired after three requests");
+
+    /* Once the retired backend is reaped, it is replaced. */
+    child = waitpid((pid_t) pid, &status, 0);
+    is_int(pid, child, "Retired backend exited");
+    ok(server_backend_reap(child, status), "...and was reaped as a backend");
+    ok(!server_backend_reap(child, status), "...only once");
+    server_backend_check(false);
+
+    /*
+     * Healthy backends survive a health check, which is done by a separate
+     * process that is reaped like a backend.
+     */
+    pid = backend_pid(rule);
+    server_backend_check(true);
+    child = waitpid(-1, &status, 0);
+    ok(child > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+       "Health checker exited successfully");
+    ok(server_backend_reap(child, status), "...and was reaped");
+    is_int(pid, backend_pid(rule), "Backend still running after check");
+
+    /* Commands run the way the server runs them are relayed to backends. */
+    memset(&client, 0, sizeof(client));
+    client.fd = -1;
+    client.stderr_fd = -1;
+    client.protocol = 2;
+    client.user = (char *) "test@EXAMPLE.COM";
+    client.ipaddress = (char *) "127.0.0.1";
+    client.setup = client_setup;
+    client.finish = client_finish;
+    client.error = client_error;
+    output = run_mode(&client, config);
+    is_int(0, strncmp(output, "backend ", strlen("backend ")),
+           "Server command handled by a backend");
+    free(output);
+
+    /* Input and environment are passed to the backend. */
+    status = relay(rule, "stdin", NULL, "some data", &output, &error);
+    is_int(0, status, "stdin status");
+    is_string("some data", output, "...and output");
+    free(output);
+    free(error);
+    if (setenv("REMOTE_USER", "test@EXAMPLE.COM", 1) < 0)
+        sysbail("cannot set REMOTE_USER");
+    status = relay(rule, "env", "REMOTE_USER", NULL, &output, &error);
+    is_int(0, status, "env status");
+    is_string("test@EXAMPLE.COM\n", output, "...and output");
+    free(output);
+    free(error);
+
+    /* Stopping the pools stops the backends. */
+    server_backend_stop();
+    ok(rule->pool == NULL, "Pool removed");
+    status = relay(rule, "echo", "foo", NULL, &output, &error);
+    is_int(-1, status, "No relay after stop");
+    free(output);
+    free(error);
+    output = run_mode(&client, config);
+    is_int(0, strncmp(output, "direct ", strlen("direct ")),
+           "...and server command run directly");
+    free(output);
+    status = 0;
+    while (waitpid(-1, &status, 0) > 0)
+        if (WIFSIGNALED(status) && WTERMSIG(status) != SIGTERM)
+            break;
+    ok(!WIFSIGNALED(status) || WTERMSIG(status) == SIGTERM,
+       "Backends terminated");
+
+    /* Clean up. */
+    server_client_loop_free(&client);
+    server_config_free(config);
+    test_file_path_free(program);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    libevent_global_shutdown();
+    return 0;
+}
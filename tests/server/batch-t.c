@@ -0,0 +1,91 @@
+/*
+ * Test suite for batching output from the server.
+ *
+ * Runs a command that prints a line a second under rules that batch its
+ * output, and checks that held-back output is sent once there is enough of
+ * it and once it has been held back long enough.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+
+/* The line printed by the command. */
+#define LINE "output line\n"
+
+
+/*
+ * Run the given test command and check the length of each output message,
+ * given as a zero-terminated list, and that the command succeeded.
+ */
+static void
+check_batch(struct remctl *r, const char *name, const size_t lengths[])
+{
+    const char *command[] = { "test", NULL, NULL };
+    struct remctl_output *output;
+    size_t i;
+
+    command[1] = name;
+    ok(remctl_command(r, command), "remctl_command %s", name);
+    for (i = 0; lengths[i] != 0; i++) {
+        output = remctl_output(r);
+        if (output == NULL || output->type != REMCTL_OUT_OUTPUT) {
+            ok(false, "...output %lu", (unsigned long) i + 1);
+            continue;
+        }
+        is_int(lengths[i], output->length, "...output %lu length",
+               (unsigned long) i + 1);
+    }
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS,
+       "...followed by status");
+    if (output != NULL && output->type == REMCTL_OUT_STATUS)
+        is_int(0, output->status, "...of 0");
+    else
+        ok(false, "...of 0");
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+    const size_t by_size[] = { 2 * strlen(LINE), strlen(LINE), 0 };
+    const size_t by_delay[] = { strlen(LINE), strlen(LINE), strlen(LINE), 0 };
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", NULL);
+
+    plan(13);
+
+    r = remctl_new();
+    ok(r != NULL, "remctl_new");
+    ok(remctl_open(r, "localhost", 14373, config->principal), "remctl_open");
+
+    /*
+     * With a batch size of 20 bytes and a long delay, the first two lines are
+     * sent together once there are enough of them, and the last is sent when
+     * the command exits.
+     */
+    check_batch(r, "batch-size", by_size);
+
+    /*
+     * With a large batch size and a short delay, each line is sent once it
+     * has been held back for the delay.
+     */
+    check_batch(r, "batch-delay", by_delay);
+
+    remctl_close(r);
+    return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * Test suite for the shared cache of command output.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/system.h>
+
+#include <sys/wait.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+/* Output sent to the fake client, whether it was streamed, and the status. */
+static struct evbuffer *sent;
+static bool streamed;
+static int sent_status;
+
+
+/*
+ * Look up a key in the cache and check the result.  If expected is NULL, the
+ * lookup should fail.  Otherwise, it should return that data and the given
+ * status.
+ */
+static void
+check_get(const char *key, const char *expected, int expected_status,
+          const char *message)
+{
+    struct evbuffer *output;
+    size_t length;
+    int status = -1;
+    char *data;
+    bool found;
+
+    output = evbuffer_new();
+    if (output == NULL)
+        bail("cannot create output buffer");
+    found = server_cache_get(key, strlen(key), output, &status);
+    if (expected == NULL) {
+        ok(!found, "%s", message);
+        is_int(0, (long) evbuffer_get_length(output), "...with no output");
+    } else {
+        ok(found, "%s", message);
+        length = evbuffer_get_length(output);
+        data = bcalloc(length + 1, 1);
+        evbuffer_remove(output, data, length);
+        is_string(expected, data, "...with the right output");
+        is_int(expected_status, status, "...and the right status");
+        free(data);
+    }
+    evbuffer_free(output);
+}
+
+
+/*
+ * Check joining a command running in another process.  Fork a child that
+ * joins the command first and so runs it, and then have the parent join the
+ * same command while the child is still running it.  The parent should wait
+ * for the child and get its result.
+ */
+static void
+check_join(void)
+{
+    struct evbuffer *output;
+    int fds[2];
+    pid_t child;
+    int status = -1;
+    bool leader;
+    char c;
+    char *data;
+    size_t length;
+
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        close(fds[0]);
+        output = evbuffer_new();
+        if (output == NULL)
+            _exit(1);
+        server_cache_join("run", 3, output, &status, &leader);
+        if (!leader)
+            _exit(1);
+        if (write(fds[1], "x", 1) < 1)
+            _exit(1);
+        sleep(1);
+        server_cache_put("run", 3, "result", 6, 3, 0);
+        server_cache_leave("run", 3);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (read(fds[0], &c, 1) < 1)
+        bail("child failed to start the command");
+    close(fds[0]);
+    output = evbuffer_new();
+    if (output == NULL)
+        bail("cannot create output buffer");
+    ok(server_cache_join("run", 3, output, &status, &leader),
+       "Joined command run by another process");
+    ok(!leader, "...and did not run it");
+    length = evbuffer_get_length(output);
+    data = bcalloc(length + 1, 1);
+    evbuffer_remove(output, data, length);
+    is_string("result", data, "...with the right output");
+    is_int(3, status, "...and the right status");
+    free(data);
+    evbuffer_free(output);
+    if (waitpid(child, &status, 0) != child)
+        sysbail("cannot wait for child");
+    is_int(0, status, "Child ran the command");
+
+    /* Results stored only for joined commands are not cached. */
+    check_get("run", NULL, 0, "Result of joined command not cached");
+
+    /* With nothing running, the next process runs the command. */
+    output = evbuffer_new();
+    if (output == NULL)
+        bail("cannot create output buffer");
+    ok(!server_cache_join("run", 3, output, &status, &leader),
+       "Nothing to join without a running command");
+    ok(leader, "...so runs the command");
+    server_cache_leave("run", 3);
+    evbuffer_free(output);
+}
+
+
+/*
+ * Fork a child that runs the command with the given key, as far as the cache
+ * is concerned, for the given number of seconds, and then stores "result" as
+ * its output.  Returns the PID of the child once it is running the command.
+ */
+static pid_t
+start_leader(const char *key, unsigned int seconds)
+{
+    struct evbuffer *output;
+    int fds[2];
+    pid_t child;
+    int status;
+    bool leader;
+    char c;
+
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        close(fds[0]);
+        output = evbuffer_new();
+        if (output == NULL)
+            _exit(1);
+        server_cache_join(key, strlen(key), output, &status, &leader);
+        if (!leader)
+            _exit(1);
+        if (write(fds[1], "x", 1) < 1)
+            _exit(1);
+        sleep(seconds);
+        server_cache_put(key, strlen(key), "result", 6, 0, 0);
+        server_cache_leave(key, strlen(key));
+        _exit(0);
+    }
+    close(fds[1]);
+    if (read(fds[0], &c, 1) < 1)
+        bail("child failed to start the command");
+    close(fds[0]);
+    return child;
+}
+
+
+/*
+ * Check that processes don't wait for a different command that uses the same
+ * cache entry, and only wait for an identical command for a limited time.
+ * Expects a cache with only one entry, so that all keys share it.
+ */
+static void
+check_wait(void)
+{
+    struct evbuffer *output;
+    pid_t child;
+    time_t start;
+    int status;
+    bool leader;
+
+    output = evbuffer_new();
+    if (output == NULL)
+        bail("cannot create output buffer");
+    child = start_leader("one", 2);
+    start = time(NULL);
+    ok(!server_cache_join("two", 3, output, &status, &leader),
+       "Different command using the same entry not joined");
+    ok(!leader, "...and not run as the leader");
+    server_cache_set_wait(200);
+    ok(!server_cache_join("one", 3, output, &status, &leader),
+       "Gave up waiting for identical command");
+    ok(!leader, "...and not run as the leader");
+    ok(time(NULL) - start < 2, "...before it finished");
+    server_cache_set_wait(10 * 1000);
+    ok(server_cache_join("one", 3, output, &status, &leader),
+       "Joined identical command with a longer wait");
+    is_int(6, (long) evbuffer_get_length(output), "...with its output");
+    evbuffer_free(output);
+    if (waitpid(child, &status, 0) != child)
+        sysbail("cannot wait for child");
+    is_int(0, status, "Child ran the command");
+}
+
+
+/*
+ * Fake client callback for captured output, which collects it.
+ */
+static bool
+client_output(struct client *client UNUSED, int stream UNUSED,
+              struct evbuffer *data)
+{
+    if (evbuffer_add_buffer(sent, data) < 0)
+        bail("cannot collect output");
+    return true;
+}
+
+
+/*
+ * Fake client callback for output from a running command, which collects it.
+ */
+static void
+client_read(struct bufferevent *bev, void *data)
+{
+    struct process *process = data;
+
+    process->saw_output = true;
+    if (evbuffer_add_buffer(sent, bufferevent_get_input(bev)) < 0)
+        bail("cannot collect output");
+}
+
+
+/*
+ * Fake client callback to set up sending output from a running command,
+ * which notes that output was streamed and then collects it.
+ */
+static void
+client_setup(struct process *process)
+{
+    streamed = true;
+    bufferevent_setcb(process->inout, client_read, NULL,
+                      server_handle_io_event, process);
+    bufferevent_enable(process->err, EV_READ);
+    bufferevent_setcb(process->err, client_read, NULL,
+                      server_handle_io_event, process);
+}
+
+
+/*
+ * Fake client callback for the end of a command, which records the status.
+ */
+static bool
+client_finish(struct client *client UNUSED, struct evbuffer *data UNUSED,
+              int status)
+{
+    sent_status = status;
+    return true;
+}
+
+
+/*
+ * Fake client callback for errors, which ignores them.
+ */
+static bool
+client_error(struct client *client UNUSED, enum error_codes code UNUSED,
+             const char *message UNUSED)
+{
+    return true;
+}
+
+
+/*
+ * Run the echo command of cmd-backend through a rule that caches its output
+ * with a fake client, and check that the argument is echoed back and whether
+ * the output was streamed.
+ */
+static void
+check_run(struct client *client, struct config *config, const char *arg,
+          bool expect_streamed, const char *message)
+{
+    struct iovec argv[3];
+    struct iovec *command[4];
+    char *expected, *data;
+    size_t length;
+
+    argv[0].iov_base = (void *) "test";
+    argv[0].iov_len = 4;
+    argv[1].iov_base = (void *) "echo";
+    argv[1].iov_len = 4;
+    argv[2].iov_base = (void *) arg;
+    argv[2].iov_len = strlen(arg);
+    command[0] = &argv[0];
+    command[1] = &argv[1];
+    command[2] = &argv[2];
+    command[3] = NULL;
+    sent = evbuffer_new();
+    if (sent == NULL)
+        bail("cannot create output buffer");
+    streamed = false;
+    sent_status = -1;
+    server_run_command(client, config, command);
+    is_int(0, sent_status, "%s", message);
+    basprintf(&expected, "%s\n", arg);
+    length = evbuffer_get_length(sent);
+    data = bcalloc(length + 1, 1);
+    evbuffer_remove(sent, data, length);
+    is_string(expected, data, "...with the right output");
+    is_int(expect_streamed, streamed, "...and %s", expect_streamed
+           ? "output streamed" : "output captured");
+    free(data);
+    free(expected);
+    evbuffer_free(sent);
+}
+
+
+/*
+ * Check that output of a cached command is captured while it fits in a cache
+ * entry, and is sent as it arrives once it no longer fits.
+ */
+static void
+check_stream(void)
+{
+    struct config *config;
+    struct client client;
+    char *tmpdir, *path, *program;
+    char big[1024];
+    FILE *file;
+
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/conf-cache", tmpdir);
+    program = test_file_path("data/cmd-backend");
+    if (program == NULL)
+        bail("cannot find data/cmd-backend");
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "test echo %s cache=60 ANYUSER\n", program);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+    config = server_config_load(path);
+    if (config == NULL)
+        bail("cannot load %s", path);
+    memset(&client, 0, sizeof(client));
+    client.fd = -1;
+    client.stderr_fd = -1;
+    client.protocol = 2;
+    client.user = (char *) "test@EXAMPLE.COM";
+    client.ipaddress = (char *) "127.0.0.1";
+    client.setup = client_setup;
+    client.finish = client_finish;
+    client.error = client_error;
+    client.output = client_output;
+
+    /* Run commands with small and large output. */
+    server_cache_init(4, 256);
+    check_run(&client, config, "small", false, "Small output");
+    memset(big, 'a', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    check_run(&client, config, big, true, "Large output");
+    server_cache_free();
+
+    /* Clean up. */
+    server_client_loop_free(&client);
+    server_config_free(config);
+    test_file_path_free(program);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+}
+
+
+int
+main(void)
+{
+    char big[64];
+
+    plan(49);
+
+    /* Without a cache, nothing is stored. */
+    ok(!server_cache_enabled(), "No cache before initialization");
+    server_cache_put("key", 3, "data", 4, 0, 60);
+    check_get("key", NULL, 0, "Nothing found without a cache");
+
+    /* Basic storage and retrieval. */
+    server_cache_init(16, 32);
+    ok(server_cache_enabled(), "Cache enabled after initialization");
+    check_get("key", NULL, 0, "Nothing found in a new cache");
+    server_cache_put("key", 3, "data", 4, 0, 60);
+    check_get("key", "data", 0, "Stored data found");
+    check_get("other", NULL, 0, "Other key not found");
+    server_cache_put("key", 3, "new data", 8, 2, 60);
+    check_get("key", "new data", 2, "Stored data replaced");
+
+    /* Empty output is cached like any other. */
+    server_cache_put("empty", 5, NULL, 0, 0, 60);
+    check_get("empty", "", 0, "Empty output found");
+
+    /* Expired entries and data that doesn't fit are not returned. */
+    server_cache_put("expired", 7, "data", 4, 0, 0);
+    check_get("expired", NULL, 0, "Expired data not found");
+    memset(big, 'a', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    server_cache_put("big", 3, big, strlen(big), 0, 60);
+    check_get("big", NULL, 0, "Data too large for an entry not stored");
+
+    /* Coalescing identical running commands. */
+    check_join();
+
+    /* Clearing the cache removes everything. */
+    server_cache_clear();
+    check_get("key", NULL, 0, "Nothing found after clearing the cache");
+
+    /* After freeing the cache, nothing is stored again. */
+    server_cache_put("key", 3, "data", 4, 0, 60);
+    server_cache_free();
+    ok(!server_cache_enabled(), "No cache after free");
+    check_get("key", NULL, 0, "Nothing found after free");
+
+    /* Waiting for running commands in a cache with one entry. */
+    server_cache_init(1, 32);
+    check_wait();
+    server_cache_free();
+
+    /* Output too large to cache is sent as it arrives. */
+    message_handlers_notice(0);
+    check_stream();
+
+    return 0;
+}
@@ -48,7 +48,7 @@ main(void)
 {
     struct config *config;
 
-    plan(49);
+    plan(61);
     if (chdir(getenv("C_TAP_SOURCE")) < 0)
         sysbail("can't chdir to C_TAP_SOURCE");
 
@@ -114,6 +114,20 @@ main(void)
                " found\n");
     test_error("data/configs/bad-user-1",
                "data/configs/bad-user-1:1: invalid user value nonexistent\n");
+    test_error("data/configs/bad-cache-1",
+               "data/configs/bad-cache-1:1: invalid cache value 1m\n");
+    test_error("data/configs/bad-cache-2",
+               "data/configs/bad-cache-2:1: invalid cache-key value group\n");
+    test_error("data/configs/bad-coalesce-1",
+               "data/configs/bad-coalesce-1:1: invalid coalesce value 1\n");
+    test_error("data/configs/bad-compress-1",
+               "data/configs/bad-compress-1:1: invalid compress value 1\n");
+    test_error("data/configs/bad-integrity-1",
+               "data/configs/bad-integrity-1:1: invalid integrity-only value"
+               " maybe\n");
+    test_error("data/configs/bad-output-1",
+               "data/configs/bad-output-1:1: invalid output-batch value"
+               " 100000\n");
 
     return 0;
 }
@@ -0,0 +1,167 @@
+/*
+ * Test suite for finding the configuration rule for a command.
+ *
+ * The server uses an index to find the rule for a command.  Check it against
+ * a straightforward linear scan of the rules over a series of randomly
+ * generated configurations.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+
+/* The number of random configurations to try. */
+#define CONFIGS 50
+
+/* The commands and subcommands to use in rules and lookups. */
+static const char *const commands[] = {
+    "a", "b", "c", "help", "ALL", "EMPTY", NULL
+};
+static const char *const subcommands[] = {
+    "x", "y", "z", "ALL", "EMPTY", NULL
+};
+
+
+/*
+ * The reference implementation.  Given a configuration rule, a command, and
+ * a subcommand, return true if that command and subcommand match that rule.
+ */
+static bool
+line_matches(const struct rule *rule, const char *command,
+             const char *subcommand)
+{
+    bool okay = false;
+
+    if (strcmp(rule->command, "ALL") == 0)
+        okay = true;
+    if (command != NULL && strcmp(rule->command, command) == 0)
+        okay = true;
+    if (command == NULL && strcmp(rule->command, "EMPTY") == 0)
+        okay = true;
+    if (okay) {
+        if (strcmp(rule->subcommand, "ALL") == 0)
+            return true;
+        if (subcommand != NULL && strcmp(rule->subcommand, subcommand) == 0)
+            return true;
+        if (subcommand == NULL && strcmp(rule->subcommand, "EMPTY") == 0)
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Find the first rule matching a command and subcommand by checking every
+ * rule in order.
+ */
+static struct rule *
+find_linear(const struct config *config, const char *command,
+            const char *subcommand)
+{
+    size_t i;
+
+    for (i = 0; i < config->count; i++)
+        if (line_matches(config->rules[i], command, subcommand))
+            return config->rules[i];
+    return NULL;
+}
+
+
+/*
+ * Write a random configuration to the given path.  Rules are drawn from the
+ * non-NULL commands and subcommands, so that there are plenty of duplicate
+ * keys and wildcards.
+ */
+static void
+write_config(const char *path)
+{
+    FILE *file;
+    size_t count, i, command, subcommand;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    count = 1 + (size_t) rand() % 40;
+    for (i = 0; i < count; i++) {
+        command = (size_t) rand() % (ARRAY_SIZE(commands) - 1);
+        subcommand = (size_t) rand() % (ARRAY_SIZE(subcommands) - 1);
+        fprintf(file, "%s %s /bin/true ANYUSER\n", commands[command],
+                subcommands[subcommand]);
+    }
+    if (fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+}
+
+
+int
+main(void)
+{
+    struct config *config;
+    struct rule *rule;
+    char *tmpdir, *path, *simple;
+    size_t i, j;
+    int n;
+    bool okay;
+
+    plan(CONFIGS + 4);
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/conf-random", tmpdir);
+
+    /* A few fixed checks of precedence. */
+    simple = test_file_path("data/conf-simple");
+    if (simple == NULL)
+        bail("cannot find data/conf-simple");
+    config = server_config_load(simple);
+    if (config == NULL)
+        bail("cannot load %s", simple);
+    test_file_path_free(simple);
+    rule = server_config_find_rule(config, "test", "test");
+    ok(rule != NULL && rule == config->rules[0], "test test is first rule");
+    rule = server_config_find_rule(config, "empty", NULL);
+    is_string("EMPTY", rule == NULL ? NULL : rule->subcommand,
+              "empty with no subcommand matches EMPTY");
+    rule = server_config_find_rule(config, "foo", "bar");
+    is_string("ALL", rule == NULL ? NULL : rule->command,
+              "foo bar matches ALL bar");
+    ok(server_config_find_rule(config, "foo", "baz") == NULL,
+       "foo baz matches nothing");
+    server_config_free(config);
+
+    /* Compare against a linear scan for random configurations. */
+    for (n = 1; n <= CONFIGS; n++) {
+        srand((unsigned int) n);
+        write_config(path);
+        config = server_config_load(path);
+        if (config == NULL)
+            bail("cannot load random configuration %d", n);
+        okay = true;
+        for (i = 0; i < ARRAY_SIZE(commands); i++)
+            for (j = 0; j < ARRAY_SIZE(subcommands); j++) {
+                rule = server_config_find_rule(config, commands[i],
+                                               subcommands[j]);
+                if (rule != find_linear(config, commands[i], subcommands[j])) {
+                    diag("mismatch for %s %s",
+                         commands[i] == NULL ? "(null)" : commands[i],
+                         subcommands[j] == NULL ? "(null)" : subcommands[j]);
+                    okay = false;
+                }
+            }
+        ok(okay, "random configuration %d", n);
+        server_config_free(config);
+    }
+
+    /* Clean up. */
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Test suite for the server concurrency limits.
+ *
+ * The scoreboard is shared memory normally used by separate processes, but
+ * since each process only touches its own slot, we can simulate several
+ * processes in a single test program by switching which slot is ours.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <util/messages.h>
+
+
+int
+main(void)
+{
+    struct limits limits = { 2, 1, 1, 0 };
+    long slot;
+
+    plan(28);
+
+    /* Suppress the notices about rejected connections. */
+    message_handlers_notice(0);
+
+    /* Without a scoreboard, everything is allowed. */
+    is_int(-1, server_limits_reserve(), "No slots without a scoreboard");
+    server_limits_enter(0);
+    ok(server_limits_connect("user"), "Connection allowed without limits");
+    ok(server_limits_command_start("user"), "Command allowed without limits");
+    server_limits_command_end();
+    server_limits_disconnect();
+
+    /* Set up a scoreboard and reserve slots for three processes. */
+    server_limits_init(&limits, 4);
+    is_int(0, server_limits_reserve(), "First slot reserved");
+    server_limits_assign(0, 1000);
+    is_int(1, server_limits_reserve(), "Second slot reserved");
+    server_limits_assign(1, 1001);
+    is_int(2, server_limits_reserve(), "Third slot reserved");
+    server_limits_assign(2, 1002);
+
+    /* Check the connection limits. */
+    server_limits_enter(0);
+    ok(server_limits_connect("a"), "First connection from a allowed");
+    server_limits_enter(1);
+    ok(!server_limits_connect("a"), "Second connection from a rejected");
+    ok(server_limits_connect("b"), "First connection from b allowed");
+    server_limits_enter(2);
+    ok(!server_limits_connect("c"), "Third connection rejected");
+
+    /* Check the command limits. */
+    server_limits_enter(1);
+    ok(server_limits_command_start("b"), "First command allowed");
+    server_limits_enter(0);
+    ok(!server_limits_command_start("a"), "Second command rejected");
+    server_limits_enter(1);
+    server_limits_command_end();
+    server_limits_enter(0);
+    ok(server_limits_command_start("a"), "Command allowed after first ends");
+    server_limits_command_end();
+
+    /* Once a connection closes, another one is allowed. */
+    server_limits_enter(1);
+    server_limits_disconnect();
+    server_limits_enter(2);
+    ok(server_limits_connect("c"), "Connection allowed after one closes");
+    server_limits_disconnect();
+
+    /* Reaping a process frees its slot, even if it was connected. */
+    is_int(3, server_limits_reserve(), "Fourth slot reserved");
+    is_int(-1, server_limits_reserve(), "Scoreboard is full");
+    server_limits_reap(1000);
+    is_int(0, server_limits_reserve(), "Reaped slot can be reserved");
+    server_limits_assign(0, 1003);
+    server_limits_enter(2);
+    ok(server_limits_connect("a"), "Connection from a allowed after reap");
+    server_limits_disconnect();
+
+    /* Assigning PID 0 frees a slot, such as after a failed fork. */
+    server_limits_assign(0, 0);
+    slot = server_limits_reserve();
+    is_int(0, slot, "Slot freed by assigning PID 0");
+
+    /*
+     * The child may start using its slot before the parent records its PID,
+     * and recording the PID must not discard what the child published.
+     */
+    server_limits_enter(slot);
+    ok(server_limits_connect("a"), "Connection before PID is recorded");
+    server_limits_assign(slot, 1004);
+    server_limits_enter(3);
+    ok(!server_limits_connect("a"), "...and still counted afterwards");
+
+    /*
+     * Slots managed by the caller, such as worker pool slots, are claimed
+     * before the fork, after which the same applies.
+     */
+    server_limits_reap(1002);
+    server_limits_claim(2);
+    is_int(-1, server_limits_reserve(), "Claimed slot is not reserved");
+    server_limits_enter(2);
+    ok(server_limits_connect("b"), "Connection in claimed slot allowed");
+    server_limits_assign(2, 1005);
+    server_limits_disconnect();
+    server_limits_reap(1005);
+    is_int(2, server_limits_reserve(), "Claimed slot freed when reaped");
+
+    /* Per-user command limits. */
+    server_limits_free();
+    limits.connections = 0;
+    limits.user_connections = 0;
+    limits.commands = 0;
+    limits.user_commands = 1;
+    server_limits_init(&limits, 3);
+    server_limits_enter(0);
+    server_limits_connect("a");
+    ok(server_limits_command_start("a"), "Command from a allowed");
+    server_limits_enter(1);
+    server_limits_connect("b");
+    ok(server_limits_command_start("b"), "Command from b allowed");
+    server_limits_enter(2);
+    server_limits_connect("a");
+    ok(!server_limits_command_start("a"), "Second command from a rejected");
+    server_limits_free();
+    ok(server_limits_connect("a"), "Everything allowed after free");
+
+    return 0;
+}
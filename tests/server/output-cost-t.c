@@ -0,0 +1,153 @@
+/*
+ * Benchmark for the CPU cost of sending large command output.
+ *
+ * Runs a command with several megabytes of output against remctld, first
+ * with the output encrypted as usual, then with integrity-only output, and
+ * then with compressed output if the library supports it.  Checks that all
+ * of the output arrives each time and reports the CPU time used by remctld
+ * and by the client for each.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+/* The size of the output of each command and the number of commands. */
+#define OUTPUT   "8388608"
+#define COMMANDS 4
+
+
+/*
+ * Return the user and system CPU time in a struct rusage in milliseconds.
+ */
+static unsigned long
+cpu_ms(const struct rusage *usage)
+{
+    unsigned long ms;
+
+    ms = (unsigned long) usage->ru_utime.tv_sec * 1000;
+    ms += (unsigned long) usage->ru_utime.tv_usec / 1000;
+    ms += (unsigned long) usage->ru_stime.tv_sec * 1000;
+    ms += (unsigned long) usage->ru_stime.tv_usec / 1000;
+    return ms;
+}
+
+
+/*
+ * Run the command with the given subcommand COMMANDS times over a single
+ * connection, with integrity-only or compressed output allowed if asked.
+ * Returns true if all of the output arrived and every command succeeded.
+ */
+static bool
+run_commands(struct kerberos_config *config, const char *subcommand,
+             bool integrity, bool compress)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    const char *command[] = { "test", NULL, OUTPUT, NULL };
+    unsigned long total;
+    int i;
+    bool success = false;
+
+    command[1] = subcommand;
+    r = remctl_new();
+    if (r == NULL)
+        return false;
+    remctl_set_integrity_only(r, integrity);
+    if (compress && !remctl_set_compression(r, 1))
+        goto done;
+    if (!remctl_open(r, "127.0.0.1", 14373, config->principal))
+        goto done;
+    for (i = 0; i < COMMANDS; i++) {
+        if (!remctl_command(r, command))
+            goto done;
+        total = 0;
+        do {
+            output = remctl_output(r);
+            if (output == NULL)
+                goto done;
+            if (output->type == REMCTL_OUT_OUTPUT)
+                total += output->length;
+        } while (output->type == REMCTL_OUT_OUTPUT);
+        if (output->type != REMCTL_OUT_STATUS || output->status != 0)
+            goto done;
+        if (total != strtoul(OUTPUT, NULL, 10))
+            goto done;
+    }
+    success = true;
+
+done:
+    if (!success)
+        diag("%s failed: %s", subcommand, remctl_error(r));
+    remctl_close(r);
+    return success;
+}
+
+
+/*
+ * Start remctld, run the commands, stop remctld so that its CPU time is
+ * added to that of our children, and report the CPU time used by remctld
+ * and the commands it ran and by the client.
+ */
+static void
+benchmark(struct kerberos_config *config, const char *subcommand,
+          bool integrity, bool compress, const char *name)
+{
+    struct process *remctld;
+    struct rusage self_start, self_end, child_start, child_end;
+    bool success;
+
+    remctld = remctld_start(config, "data/conf-simple", NULL);
+    getrusage(RUSAGE_SELF, &self_start);
+    getrusage(RUSAGE_CHILDREN, &child_start);
+    success = run_commands(config, subcommand, integrity, compress);
+    process_stop(remctld);
+    getrusage(RUSAGE_SELF, &self_end);
+    getrusage(RUSAGE_CHILDREN, &child_end);
+    ok(success, "%s: all output received", name);
+    diag("%s: %d commands of %s bytes, server %lu ms CPU, client %lu ms CPU",
+         name, COMMANDS, OUTPUT, cpu_ms(&child_end) - cpu_ms(&child_start),
+         cpu_ms(&self_end) - cpu_ms(&self_start));
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+    bool compress;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    plan(3);
+
+    /* Compression is only tested if the library supports it. */
+    r = remctl_new();
+    if (r == NULL)
+        sysbail("cannot allocate remctl object");
+    compress = remctl_set_compression(r, 1);
+    remctl_close(r);
+
+    /* Each way of sending the output. */
+    benchmark(config, "large-output", false, false, "Encrypted");
+    benchmark(config, "large-integrity", true, false, "Integrity-only");
+    if (compress)
+        benchmark(config, "large-compress", false, true, "Compressed");
+    else
+        skip("compression not supported");
+    return 0;
+}
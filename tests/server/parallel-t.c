@@ -0,0 +1,180 @@
+/*
+ * Test suite for running summary programs in parallel.
+ *
+ * Runs help commands with no arguments against configurations of summary
+ * programs using a fake protocol version two client, and checks that output
+ * is returned in the order of the configuration and that the exit status is
+ * unchanged from when summary programs were run one at a time.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+/* The output and exit status sent to the fake client. */
+static char *output[2];
+static size_t output_length[2];
+static int status;
+static bool finished;
+
+
+/*
+ * Fake client callback for output, which adds it to the output for that
+ * stream.
+ */
+static bool
+client_output(struct client *client UNUSED, int stream, struct evbuffer *data)
+{
+    size_t length;
+    char **buffer;
+
+    if (stream < 1 || stream > 2)
+        bail("unknown stream %d in output", stream);
+    buffer = &output[stream - 1];
+    length = evbuffer_get_length(data);
+    *buffer = brealloc(*buffer, output_length[stream - 1] + length + 1);
+    if (evbuffer_remove(data, *buffer + output_length[stream - 1], length) < 0)
+        bail("cannot read output");
+    output_length[stream - 1] += length;
+    (*buffer)[output_length[stream - 1]] = '\0';
+    return true;
+}
+
+
+/*
+ * Fake client callback for the end of a command, which records the status.
+ */
+static bool
+client_finish(struct client *client UNUSED, struct evbuffer *data UNUSED,
+              int exit_status)
+{
+    finished = true;
+    status = exit_status;
+    return true;
+}
+
+
+/*
+ * Fake client callback for errors, which ignores them.  Errors show up as the
+ * command not finishing.
+ */
+static bool
+client_error(struct client *client UNUSED, enum error_codes code UNUSED,
+             const char *message UNUSED)
+{
+    return true;
+}
+
+
+/*
+ * Write a configuration to the given path with one line per summary, each of
+ * which runs the given program with that summary, and then run a help
+ * command with no arguments against that configuration.
+ */
+static void
+run_summary(struct client *client, const char *path, const char *program,
+            const char *summaries[])
+{
+    struct config *config;
+    struct iovec help = { (void *) "help", 4 };
+    struct iovec *command[2] = { &help, NULL };
+    FILE *file;
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        free(output[i]);
+        output[i] = bstrdup("");
+        output_length[i] = 0;
+    }
+    finished = false;
+    status = -1;
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    for (i = 0; summaries[i] != NULL; i++)
+        fprintf(file, "%s ALL %s summary=%s ANYUSER\n", summaries[i],
+                program, summaries[i]);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+    config = server_config_load(path);
+    if (config == NULL)
+        bail("cannot load %s", path);
+    server_run_command(client, config, command);
+    server_config_free(config);
+}
+
+
+int
+main(void)
+{
+    struct client client;
+    char *tmpdir, *path, *program;
+    const char *ordered[] = { "slow", "fast", "error", "last", NULL };
+    const char *fail_first[] = { "fail", "last", NULL };
+    const char *fail_last[] = { "last", "fail", NULL };
+    const char *large[] = { "large", "last", NULL };
+
+    /* Suppress normal logging. */
+    message_handlers_notice(0);
+
+    plan(8);
+
+    /* Set up a fake client and a configuration file. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/conf-parallel", tmpdir);
+    program = test_file_path("data/cmd-summary");
+    if (program == NULL)
+        bail("cannot find data/cmd-summary");
+    memset(&client, 0, sizeof(client));
+    client.fd = -1;
+    client.stderr_fd = -1;
+    client.protocol = 2;
+    client.user = (char *) "test@EXAMPLE.COM";
+    client.ipaddress = (char *) "127.0.0.1";
+    client.finish = client_finish;
+    client.error = client_error;
+    client.output = client_output;
+
+    /* Output is in configuration order even though the first is slowest. */
+    run_summary(&client, path, program, ordered);
+    ok(finished, "Summary finished");
+    is_string("slow summary\nfast summary\nerror summary\nlast summary\n",
+              output[0], "...with output in configuration order");
+    is_string("error output\n", output[1], "...and error output");
+    is_int(0, status, "...and status 0");
+
+    /* The exit status is the status of the summary of the last line. */
+    run_summary(&client, path, program, fail_first);
+    is_int(0, status, "Status is 0 if the last summary succeeds");
+    run_summary(&client, path, program, fail_last);
+    is_int(3, status, "Status is that of the last summary if it fails");
+
+    /* Output of each summary is limited, but later summaries are sent. */
+    run_summary(&client, path, program, large);
+    ok(output_length[0] > 0 && output_length[0] <= 1024 * 1024,
+       "Large summary output is limited");
+    ok(strstr(output[0], "last summary\n") != NULL,
+       "...and later output is still sent");
+
+    /* Clean up. */
+    free(output[0]);
+    free(output[1]);
+    server_client_loop_free(&client);
+    test_file_path_free(program);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    libevent_global_shutdown();
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Test suite for parking idle connections in the server.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+
+/*
+ * Run the remote test command on an open connection and confirm the output
+ * is correct.
+ */
+static void
+test_command(struct remctl *r)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        ok_block(0, 3, "... command failed");
+        return;
+    }
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT,
+       "... got output");
+    if (output != NULL && output->type == REMCTL_OUT_OUTPUT) {
+        ok(output->length == 12
+               && memcmp(output->data, "hello world\n", 12) == 0,
+           "... output correct");
+        output = remctl_output(r);
+    } else {
+        ok(0, "... output correct");
+    }
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+           && output->status == 0,
+       "... status ok");
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r, *r2;
+    struct process *remctld;
+    int i;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    plan(2 + 4 * 3);
+
+    /* Start a server that parks connections after 100ms. */
+    remctld = remctld_start(config, "data/conf-simple", "-o",
+                            "park-idle=100", NULL);
+
+    /*
+     * Run commands on the same connection, sleeping long enough between them
+     * for the connection to be parked and resumed each time.
+     */
+    r = remctl_new();
+    ok(remctl_open(r, "127.0.0.1", 14373, config->principal),
+       "Connection");
+    for (i = 0; i < 3; i++) {
+        test_command(r);
+        usleep(300 * 1000);
+    }
+
+    /* A second connection works while the first is parked. */
+    r2 = remctl_new();
+    ok(remctl_open(r2, "127.0.0.1", 14373, config->principal),
+       "Second connection");
+    test_command(r2);
+    remctl_close(r2);
+    remctl_close(r);
+    process_stop(remctld);
+
+    return 0;
+}
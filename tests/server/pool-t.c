@@ -0,0 +1,149 @@
+/*
+ * Test suite for the pre-forked worker pool in the server.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+
+/*
+ * Run the remote test command on an open connection and confirm the output
+ * is correct.
+ */
+static void
+test_command(struct remctl *r)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        ok_block(0, 3, "... command failed");
+        return;
+    }
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT,
+       "... got output");
+    if (output != NULL && output->type == REMCTL_OUT_OUTPUT) {
+        ok(output->length == 12
+               && memcmp(output->data, "hello world\n", 12) == 0,
+           "... output correct");
+        output = remctl_output(r);
+    } else {
+        ok(0, "... output correct");
+    }
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+           && output->status == 0,
+       "... status ok");
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r, *r2;
+    struct remctl *rs[3];
+    struct process *remctld;
+    struct remctl_output *output;
+    const char *sleep_command[] = { "test", "sleep", NULL };
+    time_t start;
+    int i;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    plan(6 * 4 + 2 * 4 + 3 * 7 + 6);
+
+    /*
+     * Start a pool with two workers that each exit after two connections,
+     * and make enough sequential connections that workers have to be
+     * replaced.
+     */
+    remctld = remctld_start(config, "data/conf-simple", "-o",
+                            "max-workers=2", "-o", "min-workers=2", "-o",
+                            "max-requests=2", NULL);
+    for (i = 0; i < 6; i++) {
+        r = remctl_new();
+        ok(remctl_open(r, "127.0.0.1", 14373, config->principal),
+           "Connection %d", i + 1);
+        test_command(r);
+        remctl_close(r);
+    }
+
+    /* Two simultaneous connections must each be handled by a worker. */
+    r = remctl_new();
+    r2 = remctl_new();
+    ok(remctl_open(r, "127.0.0.1", 14373, config->principal),
+       "First simultaneous connection");
+    ok(remctl_open(r2, "127.0.0.1", 14373, config->principal),
+       "Second simultaneous connection");
+    test_command(r2);
+    test_command(r);
+    remctl_close(r2);
+    remctl_close(r);
+    process_stop(remctld);
+
+    /*
+     * With worker-connections, a single worker handles several simultaneous
+     * connections, running commands on each of them in turn.
+     */
+    remctld = remctld_start(config, "data/conf-simple", "-o",
+                            "max-workers=1", "-o", "min-workers=1", "-o",
+                            "spare-workers=0", "-o", "worker-connections=3",
+                            NULL);
+    for (i = 0; i < 3; i++) {
+        rs[i] = remctl_new();
+        ok(remctl_open(rs[i], "127.0.0.1", 14373, config->principal),
+           "Multiplexed connection %d", i + 1);
+    }
+    for (i = 2; i >= 0; i--)
+        test_command(rs[i]);
+    for (i = 0; i < 3; i++)
+        test_command(rs[i]);
+    for (i = 0; i < 3; i++)
+        remctl_close(rs[i]);
+    process_stop(remctld);
+
+    /*
+     * A worker runs the commands of all of its connections at the same time,
+     * so a command on a new connection finishes while a slow command on
+     * another connection to the same worker is still running.
+     */
+    remctld = remctld_start(config, "data/conf-simple", "-o",
+                            "max-workers=1", "-o", "min-workers=1", "-o",
+                            "spare-workers=0", "-o", "worker-connections=2",
+                            NULL);
+    r = remctl_new();
+    r2 = remctl_new();
+    if (!remctl_open(r, "127.0.0.1", 14373, config->principal))
+        bail("cannot connect: %s", remctl_error(r));
+    if (!remctl_command(r, sleep_command))
+        bail("cannot send command: %s", remctl_error(r));
+    start = time(NULL);
+    ok(remctl_open(r2, "127.0.0.1", 14373, config->principal),
+       "Connection while a command is running");
+    test_command(r2);
+    ok(time(NULL) - start < 3, "...handled before the command finished");
+    output = remctl_output(r);
+    while (output != NULL && output->type == REMCTL_OUT_OUTPUT)
+        output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+           && output->status == 0,
+       "Running command finished");
+    remctl_close(r2);
+    remctl_close(r);
+    process_stop(remctld);
+
+    return 0;
+}
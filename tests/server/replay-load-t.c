@@ -0,0 +1,131 @@
+/*
+ * Load test and benchmark for the shared replay cache in remctld.
+ *
+ * Runs several clients in parallel against remctld, each opening many
+ * connections to the test realm and running a command over each, first
+ * with the Kerberos replay cache and then with the shared replay cache, and
+ * reports how long the connections took with each.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+/* The number of clients to run in parallel and connections for each. */
+#define CLIENTS     8
+#define CONNECTIONS 50
+
+
+/*
+ * Open a connection, run the test command, and check its status.  Returns
+ * true on success and false on any failure.
+ */
+static bool
+run_command(struct kerberos_config *config)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+    bool success = false;
+
+    r = remctl_new();
+    if (r == NULL)
+        return false;
+    if (!remctl_open(r, "127.0.0.1", 14373, config->principal))
+        goto done;
+    if (!remctl_command(r, command))
+        goto done;
+    do {
+        output = remctl_output(r);
+        if (output == NULL)
+            goto done;
+    } while (output->type != REMCTL_OUT_STATUS);
+    success = (output->status == 0);
+
+done:
+    remctl_close(r);
+    return success;
+}
+
+
+/*
+ * Run CLIENTS processes in parallel that each make CONNECTIONS connections,
+ * wait for them all to finish, and report how long it took.  Returns true
+ * if every connection succeeded.
+ */
+static bool
+benchmark(struct kerberos_config *config, const char *cache)
+{
+    struct timeval start, end;
+    pid_t children[CLIENTS];
+    unsigned long elapsed;
+    int i, j, status;
+    bool success = true;
+
+    fflush(stdout);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < CLIENTS; i++) {
+        children[i] = fork();
+        if (children[i] < 0)
+            sysbail("cannot fork");
+        else if (children[i] == 0) {
+            for (j = 0; j < CONNECTIONS; j++)
+                if (!run_command(config))
+                    _exit(1);
+            _exit(0);
+        }
+    }
+    for (i = 0; i < CLIENTS; i++) {
+        if (waitpid(children[i], &status, 0) < 0)
+            sysbail("cannot wait for child");
+        if (status != 0)
+            success = false;
+    }
+    gettimeofday(&end, NULL);
+    elapsed = (unsigned long) (end.tv_sec - start.tv_sec) * 1000000UL;
+    elapsed += (unsigned long) end.tv_usec;
+    elapsed -= (unsigned long) start.tv_usec;
+    diag("%s: %d connections in %lu ms, %lu connections per second", cache,
+         CLIENTS * CONNECTIONS, elapsed / 1000,
+         CLIENTS * CONNECTIONS * 1000000UL / (elapsed > 0 ? elapsed : 1));
+    return success;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    plan(2);
+
+    /* First, with the Kerberos replay cache. */
+    remctld = remctld_start(config, "data/conf-simple", NULL);
+    ok(benchmark(config, "Kerberos replay cache"),
+       "All connections succeed with the Kerberos replay cache");
+    process_stop(remctld);
+
+    /* Then with the shared replay cache. */
+    remctld = remctld_start(config, "data/conf-simple", "-o",
+                            "replay-cache-entries=4096", NULL);
+    ok(benchmark(config, "Shared replay cache"),
+       "All connections succeed with the shared replay cache");
+    process_stop(remctld);
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Test suite for the shared replay cache for Kerberos authenticators.
+ *
+ * The context tokens used here are built by hand with only the structure
+ * that the replay cache looks at, since they're never passed to GSS-API.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#include <portable/system.h>
+
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+
+/* Large enough for any token built here. */
+#define TOKEN_SIZE 1024
+
+/* The DER encoding of the OID of the Kerberos GSS-API mechanism. */
+static const unsigned char krb5_oid[] = {
+    0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02
+};
+
+
+/*
+ * Wrap the length bytes at the start of buf in a DER element with the given
+ * identifier, moving them to make room for the header.  Returns the new
+ * length.
+ */
+static size_t
+der_wrap(unsigned char *buf, size_t length, int id)
+{
+    size_t header = (length < 128) ? 2 : (length < 256) ? 3 : 4;
+
+    memmove(buf + header, buf, length);
+    buf[0] = (unsigned char) id;
+    if (length < 128)
+        buf[1] = (unsigned char) length;
+    else if (length < 256) {
+        buf[1] = 0x81;
+        buf[2] = (unsigned char) length;
+    } else {
+        buf[1] = 0x82;
+        buf[2] = (unsigned char) (length >> 8);
+        buf[3] = (unsigned char) (length & 0xff);
+    }
+    return length + header;
+}
+
+
+/*
+ * Append an element with the given identifier and contents to buf, which
+ * currently holds length bytes.  Returns the new length.
+ */
+static size_t
+der_append(unsigned char *buf, size_t length, int id, const void *data,
+           size_t size)
+{
+    memcpy(buf + length, data, size);
+    return length + der_wrap(buf + length, size, id);
+}
+
+
+/*
+ * Build a Kerberos initial context token whose authenticator ciphertext is
+ * size bytes all set to fill, except for the first two bytes, which hold
+ * seed.  options is used as the first byte of the AP options, which are not
+ * encrypted.  Stores the token in buf and sets token to point to it.
+ */
+static void
+make_token(unsigned char *buf, gss_buffer_t token, size_t size, int fill,
+           unsigned long seed, int options)
+{
+    unsigned char cipher[512], field[TOKEN_SIZE];
+    const unsigned char pvno[] = { 0x02, 0x01, 0x05 };
+    const unsigned char type[] = { 0x02, 0x01, 0x0e };
+    const unsigned char etype[] = { 0x02, 0x01, 0x12 };
+    unsigned char apopts[] = { 0x03, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    const unsigned char ticket[] = { 0x61, 0x00 };
+    size_t length, n;
+
+    /* The encrypted authenticator. */
+    memset(cipher, fill, size);
+    cipher[0] = (unsigned char) (seed & 0xff);
+    cipher[1] = (unsigned char) ((seed >> 8) & 0xff);
+    n = der_append(field, 0, 0x04, cipher, size);
+    memmove(field + 5, field, n);
+    memcpy(field, "\xa0\x03", 2);
+    memcpy(field + 2, etype, sizeof(etype));
+    n = 5 + der_wrap(field + 5, n, 0xa2);
+    n = der_wrap(field, n, 0x30);
+
+    /* The AP-REQ. */
+    apopts[2] = (unsigned char) options;
+    length = der_append(buf, 0, 0xa0, pvno, sizeof(pvno));
+    length = der_append(buf, length, 0xa1, type, sizeof(type));
+    length = der_append(buf, length, 0xa2, apopts, sizeof(apopts));
+    length = der_append(buf, length, 0xa3, ticket, sizeof(ticket));
+    length = der_append(buf, length, 0xa4, field, n);
+    length = der_wrap(buf, length, 0x30);
+    length = der_wrap(buf, length, 0x6e);
+
+    /* The GSS-API framing. */
+    memmove(buf + sizeof(krb5_oid) + 2, buf, length);
+    memcpy(buf, krb5_oid, sizeof(krb5_oid));
+    buf[sizeof(krb5_oid)] = 0x01;
+    buf[sizeof(krb5_oid) + 1] = 0x00;
+    length = der_wrap(buf, length + sizeof(krb5_oid) + 2, 0x60);
+    token->value = buf;
+    token->length = length;
+}
+
+
+/*
+ * Check a token against the replay cache, capturing any warning.  Returns
+ * the result of the check.
+ */
+static bool
+check(gss_buffer_t token, struct replay_tag *tag)
+{
+    bool result;
+
+    errors_capture();
+    result = server_replay_check(token, tag);
+    errors_uncapture();
+    return result;
+}
+
+
+int
+main(void)
+{
+    unsigned char buf[TOKEN_SIZE], other[TOKEN_SIZE];
+    gss_buffer_desc token, token2;
+    struct replay_tag tag, tag2;
+    const char *value;
+    char *tmpdir, *krb5conf;
+    FILE *file;
+    unsigned long i;
+    pid_t child;
+    int status;
+
+    plan(32);
+
+    /* Without a cache, everything passes and the environment is unchanged. */
+    if (unsetenv("KRB5RCACHETYPE") < 0)
+        sysbail("cannot clear KRB5RCACHETYPE");
+    make_token(buf, &token, 64, 'a', 1, 0);
+    ok(check(&token, &tag), "No cache: token passes");
+    ok(check(&token, &tag), "...and passes again");
+    ok(tag.hash[0] == 0 && tag.hash[1] == 0, "...with a cleared tag");
+    ok(!server_replay_environment(&value), "...and environment unchanged");
+
+    /* Creating the cache turns off the Kerberos replay cache. */
+    server_replay_init(100, 600);
+    is_string("none", getenv("KRB5RCACHETYPE"), "Kerberos cache turned off");
+    ok(server_replay_environment(&value), "...and environment changed");
+    is_string(NULL, value, "...with no original setting");
+
+    /* A token passes once and is then a replay. */
+    ok(check(&token, &tag), "First use of token passes");
+    ok(tag.hash[0] != 0 || tag.hash[1] != 0, "...and records a tag");
+    ok(!check(&token, &tag), "Replay is rejected");
+    is_string("replayed Kerberos authenticator, rejecting\n", errors,
+              "...with the right warning");
+    ok(tag.hash[0] == 0 && tag.hash[1] == 0, "...and a cleared tag");
+
+    /* Changing the unencrypted parts of the token doesn't help. */
+    make_token(other, &token2, 64, 'a', 1, 0x20);
+    ok(!check(&token2, &tag), "Replay with different options is rejected");
+
+    /* A different authenticator, which needs a long length encoding. */
+    make_token(other, &token2, 300, 'b', 1, 0);
+    ok(check(&token2, &tag2), "Long authenticator passes");
+    ok(!check(&token2, &tag), "...and is then a replay");
+
+    /* A forgotten tag can be used again. */
+    server_replay_forget(&tag2);
+    ok(check(&token2, &tag2), "Forgotten authenticator passes again");
+
+    /* Tokens that can't be parsed are rejected. */
+    token2.length = 20;
+    ok(!check(&token2, &tag), "Truncated token is rejected");
+    is_string("context token is not a Kerberos AP-REQ, rejecting\n", errors,
+              "...with the right warning");
+    make_token(other, &token2, 64, 'c', 1, 0);
+    other[6] = 0x03;
+    ok(!check(&token2, &tag), "Token for another mechanism is rejected");
+    token2.length = 0;
+    ok(!check(&token2, &tag), "Empty token is rejected");
+
+    /* The cache is shared with child processes. */
+    make_token(other, &token2, 64, 'd', 1, 0);
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0)
+        _exit(check(&token2, &tag) ? 0 : 1);
+    if (waitpid(child, &status, 0) < 0)
+        sysbail("cannot wait for child");
+    is_int(0, status, "Token passes in child");
+    ok(!check(&token2, &tag), "...and is then a replay in parent");
+    server_replay_free();
+
+    /* The environment is restored to its original value. */
+    ok(getenv("KRB5RCACHETYPE") == NULL, "Environment restored on free");
+    if (setenv("KRB5RCACHETYPE", "dfl", 1) < 0)
+        sysbail("cannot set KRB5RCACHETYPE");
+    server_replay_init(1, 600);
+    server_replay_restore();
+    is_string("dfl", getenv("KRB5RCACHETYPE"), "Original setting restored");
+
+    /* A full shard rejects tokens rather than forgetting old ones. */
+    for (i = 0; i < 64; i++) {
+        make_token(other, &token2, 64, 'e', i, 0);
+        if (!check(&token2, &tag))
+            break;
+    }
+    is_int(64, i, "Sixty-four tokens fit in a shard");
+    make_token(other, &token2, 64, 'e', 64, 0);
+    ok(!check(&token2, &tag), "...and the next is rejected");
+    is_string("replay cache full, rejecting context token\n", errors,
+              "...with the right warning");
+    server_replay_free();
+    is_string("dfl", getenv("KRB5RCACHETYPE"), "...and setting kept on free");
+
+    /* Entries expire after their lifetime. */
+    server_replay_init(1, 1);
+    ok(check(&token, &tag), "Token passes with a short lifetime");
+    ok(!check(&token, &tag), "...and is then a replay");
+    sleep(2);
+    ok(check(&token, &tag), "...but passes again once expired");
+    server_replay_free();
+
+    /*
+     * The shortest safe lifetime is twice the Kerberos clock skew, taken from
+     * the Kerberos configuration if we can read it.
+     */
+    tmpdir = test_tmpdir();
+    basprintf(&krb5conf, "%s/krb5.conf", tmpdir);
+    file = fopen(krb5conf, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", krb5conf);
+    fprintf(file, "[libdefaults]\n    clockskew = 120\n");
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", krb5conf);
+    if (setenv("KRB5_CONFIG", krb5conf, 1) < 0)
+        sysbail("cannot set KRB5_CONFIG");
+#if defined(HAVE_KRB5)                                  \
+    && (defined(HAVE_KRB5_GET_MAX_TIME_SKEW)            \
+        || (defined(HAVE_KRB5_GET_PROFILE) && defined(HAVE_PROFILE_H)))
+    is_int(240, server_replay_min_ttl(), "Minimum lifetime from clock skew");
+#else
+    is_int(600, server_replay_min_ttl(), "Minimum lifetime from clock skew");
+#endif
+    unlink(krb5conf);
+    free(krb5conf);
+    test_tmpdir_free(tmpdir);
+    free(errors);
+    return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Test suite for the asynchronous lookup of client hostnames.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+/* How a lookup is expected to be done. */
+enum lookup {
+    LOOKUP_NONE,                /* No lookup, from the cache or skipped. */
+    LOOKUP_HELPER,              /* A helper forked by the client. */
+    LOOKUP_RESOLVER             /* The resolver process. */
+};
+
+
+/*
+ * Set up a fake client for the given file descriptor from 127.0.0.1.
+ */
+static void
+client_init(struct client *client, int fd)
+{
+    memset(client, 0, sizeof(struct client));
+    client->fd = fd;
+    client->ipaddress = (char *) "127.0.0.1";
+}
+
+
+/*
+ * Free the parts of a fake client allocated by the lookup.
+ */
+static void
+client_free(struct client *client)
+{
+    server_resolve_cancel(client);
+    server_client_loop_free(client);
+    free(client->hostname);
+    client->hostname = NULL;
+}
+
+
+/*
+ * Start a lookup of 127.0.0.1 for a fake client with the given file
+ * descriptor, check whether a lookup was started and how, finish the lookup,
+ * and check the resulting hostname.
+ */
+static void
+check_lookup(int fd, const struct sockaddr_in *sin, enum lookup how,
+             const char *expected, const char *message)
+{
+    struct client client;
+
+    client_init(&client, fd);
+    server_resolve_start(&client, (const struct sockaddr *) sin,
+                         sizeof(*sin));
+    is_int(how != LOOKUP_NONE, client.resolving, "%s: %s", message,
+           how != LOOKUP_NONE ? "lookup started" : "no lookup");
+    if (how != LOOKUP_NONE)
+        is_int(how == LOOKUP_HELPER, client.resolver != 0, "%s: %s", message,
+               how == LOOKUP_HELPER ? "by a helper" : "by the resolver");
+    server_resolve_finish(&client);
+    is_int(0, client.resolving, "%s: lookup finished", message);
+    is_string(expected, client.hostname, "%s: hostname", message);
+    client_free(&client);
+}
+
+
+/*
+ * Event loop callback for the answer of a lookup, which collects it.
+ */
+static void
+resolved(evutil_socket_t fd UNUSED, short what, void *data)
+{
+    server_resolve_collect(data, (what & EV_READ) != 0);
+}
+
+
+int
+main(void)
+{
+    struct sockaddr_in sin, other;
+    struct sockaddr_storage ss;
+    struct client lookup;
+    socklen_t length;
+    struct config *config;
+    char hostname[NI_MAXHOST], other_hostname[NI_MAXHOST];
+    const char *expected = NULL;
+    const char *other_expected = NULL;
+    char buffer;
+    int fds[2];
+    char *tmpdir, *path;
+    socket_type server, client, connection;
+    FILE *file;
+
+    /* Suppress normal logging. */
+    message_handlers_notice(0);
+
+    plan(32);
+
+    /* Find what the lookup should return. */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (getnameinfo((struct sockaddr *) &sin, sizeof(sin), hostname,
+                    sizeof(hostname), NULL, 0, NI_NAMEREQD)
+        == 0)
+        expected = hostname;
+    memset(&other, 0, sizeof(other));
+    other.sin_family = AF_INET;
+    other.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1);
+    if (getnameinfo((struct sockaddr *) &other, sizeof(other), other_hostname,
+                    sizeof(other_hostname), NULL, 0, NI_NAMEREQD)
+        == 0)
+        other_expected = other_hostname;
+
+    /* Without a resolver or a cache, each lookup runs a helper. */
+    check_lookup(-1, &sin, LOOKUP_HELPER, expected, "no cache");
+    check_lookup(-1, &sin, LOOKUP_HELPER, expected, "no cache again");
+
+    /*
+     * Start the resolver and check that it doesn't keep open a descriptor
+     * that was open when it was started.
+     */
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    server_resolve_init(16, 60, 60);
+    close(fds[1]);
+    alarm(30);
+    ok(read(fds[0], &buffer, 1) == 0, "Resolver closes inherited descriptors");
+    alarm(0);
+    close(fds[0]);
+
+    /* With a cache, only the first lookup is done by the resolver. */
+    check_lookup(-1, &sin, LOOKUP_RESOLVER, expected, "first cached");
+    check_lookup(-1, &sin, LOOKUP_NONE, expected, "second cached");
+
+    /* The answer can be collected by the event loop. */
+    client_init(&lookup, -1);
+    lookup.ipaddress = (char *) "127.0.0.2";
+    server_resolve_start(&lookup, (const struct sockaddr *) &other,
+                         sizeof(other));
+    ok(server_resolve_wait(&lookup, server_client_loop(&lookup), resolved,
+                           &lookup),
+       "Waiting for the lookup in the event loop");
+    event_base_dispatch(server_client_loop(&lookup));
+    is_int(0, lookup.resolving, "...and the lookup finished");
+    is_string(other_expected, lookup.hostname, "...with the right hostname");
+    ok(!server_resolve_wait(&lookup, server_client_loop(&lookup), resolved,
+                            &lookup),
+       "...and there is nothing more to wait for");
+    client_free(&lookup);
+
+    /* Load a configuration with a rule that doesn't want REMOTE_HOST. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/conf-resolve", tmpdir);
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "test ALL /bin/true remote-host=no ANYUSER\n");
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+    config = server_config_load(path);
+    ok(config != NULL, "Configuration with remote-host loaded");
+    if (config == NULL)
+        bail("cannot load %s", path);
+    ok(config->rules[0]->no_hostname, "...and remote-host parsed");
+
+    /* If no rule wants REMOTE_HOST, no lookup is done. */
+    server_resolve_configure(config);
+    check_lookup(-1, &sin, LOOKUP_NONE, NULL, "not needed");
+    config->rules[0]->no_hostname = false;
+    server_resolve_configure(config);
+    server_config_free(config);
+
+    /* An invalid value is rejected. */
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "test ALL /bin/true remote-host=maybe ANYUSER\n");
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+    errors_capture();
+    config = server_config_load(path);
+    errors_uncapture();
+    ok(config == NULL, "Invalid remote-host rejected");
+    free(errors);
+    errors = NULL;
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+
+    /* Set up a real connection to 127.0.0.1 to check disabling lookups. */
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server == INVALID_SOCKET)
+        sysbail("cannot create socket");
+    if (bind(server, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        sysbail("cannot bind socket");
+    if (listen(server, 1) < 0)
+        sysbail("cannot listen on socket");
+    length = sizeof(ss);
+    if (getsockname(server, (struct sockaddr *) &ss, &length) < 0)
+        sysbail("cannot get socket address");
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (client == INVALID_SOCKET)
+        sysbail("cannot create socket");
+    if (connect(client, (struct sockaddr *) &ss, length) < 0)
+        sysbail("cannot connect to socket");
+    connection = accept(server, NULL, NULL);
+    if (connection == INVALID_SOCKET)
+        sysbail("cannot accept connection");
+
+    /* Lookups disabled for another address still happen. */
+    server_resolve_skip("192.0.2.1");
+    check_lookup(connection, &sin, LOOKUP_NONE, expected, "other address");
+
+    /* Lookups disabled for our local address don't. */
+    server_resolve_skip("127.0.0.1");
+    check_lookup(connection, &sin, LOOKUP_NONE, NULL, "disabled");
+
+    /* Clean up. */
+    close(connection);
+    close(client);
+    close(server);
+    server_resolve_free();
+    libevent_global_shutdown();
+    return 0;
+}
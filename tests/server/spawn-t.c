@@ -0,0 +1,251 @@
+/*
+ * Test suite for starting commands with posix_spawn and with fork.
+ *
+ * Runs the same commands with both methods of starting them and checks that
+ * the results are the same, and then times running a simple command many
+ * times with each method to compare their speed.  The timings are reported
+ * as diagnostics.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+/* The number of commands to run with each method for the timing. */
+#define BENCHMARK_COUNT 200
+
+
+/*
+ * Stub client callback for errors, which ignores them.  Errors show up as a
+ * failure to run the process.
+ */
+static bool
+client_error(struct client *client UNUSED, enum error_codes code UNUSED,
+             const char *message UNUSED)
+{
+    return true;
+}
+
+
+/*
+ * Run a command for the given rule with the given arguments after the
+ * program name and optional input, using the fake client.  Returns the exit
+ * status, or -1 if the process could not be run, and stores the output and
+ * error output in newly-allocated strings.
+ */
+static int
+run(struct client *client, struct rule *rule, const char *command,
+    const char *arg, const char *input, char **output, char **error)
+{
+    struct process process;
+    const char *argv[4];
+    struct stream_output {
+        char *data;
+        size_t length;
+    } streams[2];
+    char stream;
+    size_t length;
+    int status;
+
+    argv[0] = "cmd-backend";
+    argv[1] = command;
+    argv[2] = arg;
+    argv[3] = NULL;
+    memset(&process, 0, sizeof(process));
+    process.client = client;
+    process.command = "test";
+    process.argv = argv;
+    process.rule = rule;
+    process.capture = true;
+    if (input != NULL) {
+        process.input = evbuffer_new();
+        if (process.input == NULL)
+            bail("cannot create input buffer");
+        evbuffer_add(process.input, input, strlen(input));
+    }
+    if (!server_process_run(&process))
+        status = -1;
+    else if (WIFEXITED(process.status))
+        status = WEXITSTATUS(process.status);
+    else
+        status = -1;
+
+    /* Split the captured output into its streams. */
+    memset(streams, 0, sizeof(streams));
+    streams[0].data = bstrdup("");
+    streams[1].data = bstrdup("");
+    while (process.output != NULL
+           && evbuffer_get_length(process.output) > 0) {
+        evbuffer_remove(process.output, &stream, sizeof(stream));
+        evbuffer_remove(process.output, &length, sizeof(length));
+        if (stream < 1 || stream > 2)
+            bail("unknown stream %d in output", stream);
+        streams[stream - 1].data =
+            brealloc(streams[stream - 1].data,
+                     streams[stream - 1].length + length + 1);
+        evbuffer_remove(process.output,
+                        streams[stream - 1].data + streams[stream - 1].length,
+                        length);
+        streams[stream - 1].length += length;
+        streams[stream - 1].data[streams[stream - 1].length] = '\0';
+    }
+    *output = streams[0].data;
+    *error = streams[1].data;
+    if (process.input != NULL)
+        evbuffer_free(process.input);
+    if (process.output != NULL)
+        evbuffer_free(process.output);
+    return status;
+}
+
+
+/*
+ * Run the tests of a command method, given the rules for the test program
+ * and for a missing program.
+ */
+static void
+test_commands(struct client *client, struct rule *rule, struct rule *missing,
+              const char *method)
+{
+    char *output, *error;
+    int status;
+
+    status = run(client, rule, "echo", "foo", NULL, &output, &error);
+    is_int(0, status, "%s: echo status", method);
+    is_string("foo\n", output, "%s: ...and output", method);
+    free(output);
+    free(error);
+    status = run(client, rule, "status", NULL, NULL, &output, &error);
+    is_int(2, status, "%s: status status", method);
+    is_string("error\n", error, "%s: ...and error output", method);
+    free(output);
+    free(error);
+
+    /* The environment is inherited, but connection information overrides. */
+    run(client, rule, "env", "REMOTE_USER", NULL, &output, &error);
+    is_string("test@EXAMPLE.COM\n", output, "%s: REMOTE_USER", method);
+    free(output);
+    free(error);
+    run(client, rule, "env", "SPAWN_TEST", NULL, &output, &error);
+    is_string("inherited\n", output, "%s: inherited environment", method);
+    free(output);
+    free(error);
+
+    /* Input is passed on standard input. */
+    run(client, rule, "stdin", NULL, "some data", &output, &error);
+    is_string("some data", output, "%s: standard input", method);
+    free(output);
+    free(error);
+
+    /* A missing program fails the same way. */
+    status = run(client, missing, "echo", "foo", NULL, &output, &error);
+    is_int(255, status, "%s: missing program", method);
+    free(output);
+    free(error);
+}
+
+
+/*
+ * Run a simple command many times with a method of starting commands and
+ * report how long it took.
+ */
+static void
+benchmark(struct client *client, struct rule *rule, const char *method)
+{
+    struct timeval start, end;
+    char *output, *error;
+    unsigned long elapsed;
+    int i;
+    bool success = true;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < BENCHMARK_COUNT; i++) {
+        if (run(client, rule, "echo", "foo", NULL, &output, &error) != 0)
+            success = false;
+        free(output);
+        free(error);
+    }
+    gettimeofday(&end, NULL);
+    elapsed = (unsigned long) (end.tv_sec - start.tv_sec) * 1000000UL;
+    elapsed += (unsigned long) end.tv_usec;
+    elapsed -= (unsigned long) start.tv_usec;
+    ok(success, "%s: ran %d commands", method, BENCHMARK_COUNT);
+    diag("%s: %lu microseconds per command", method,
+         elapsed / BENCHMARK_COUNT);
+}
+
+
+int
+main(void)
+{
+    struct config *config;
+    struct client client;
+    char *tmpdir, *path, *program;
+    FILE *file;
+
+    /* Suppress normal logging. */
+    message_handlers_notice(0);
+
+    plan(2 * 9);
+
+    /* Write a configuration with the test program and a missing program. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/conf-spawn", tmpdir);
+    program = test_file_path("data/cmd-backend");
+    if (program == NULL)
+        bail("cannot find data/cmd-backend");
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "test ALL %s ANYUSER\n", program);
+    fprintf(file, "missing ALL %s/nonexistent ANYUSER\n", tmpdir);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+    config = server_config_load(path);
+    if (config == NULL)
+        bail("cannot load %s", path);
+
+    /* Set up the environment and a fake client. */
+    if (setenv("SPAWN_TEST", "inherited", 1) < 0)
+        sysbail("cannot set SPAWN_TEST");
+    if (setenv("REMOTE_USER", "wrong", 1) < 0)
+        sysbail("cannot set REMOTE_USER");
+    memset(&client, 0, sizeof(client));
+    client.fd = -1;
+    client.stderr_fd = -1;
+    client.protocol = 2;
+    client.user = (char *) "test@EXAMPLE.COM";
+    client.ipaddress = (char *) "127.0.0.1";
+    client.error = client_error;
+
+    /* Run the tests and the timings with each method. */
+    server_process_set_spawn(true);
+    test_commands(&client, config->rules[0], config->rules[1], "spawn");
+    benchmark(&client, config->rules[0], "spawn");
+    server_process_set_spawn(false);
+    test_commands(&client, config->rules[0], config->rules[1], "fork");
+    benchmark(&client, config->rules[0], "fork");
+
+    /* Clean up. */
+    server_client_loop_free(&client);
+    server_config_free(config);
+    test_file_path_free(program);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    libevent_global_shutdown();
+    return 0;
+}
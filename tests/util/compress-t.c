@@ -0,0 +1,95 @@
+/*
+ * Test suite for compression of command output.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <tests/tap/basic.h>
+#include <util/compress.h>
+#include <util/protocol.h>
+
+/* The size of the test data, which is the size of a full output token. */
+#define SIZE TOKEN_MAX_OUTPUT
+
+
+/*
+ * Check compressing and decompressing data with one method, given the name
+ * of the method for test descriptions and the output option for it.
+ */
+static void
+test_method(enum compress_method method, int option, const char *name,
+            const char *data)
+{
+    char *out, *back;
+    size_t size, length;
+
+    if (!(compress_methods() & option)) {
+        skip_block(8, "%s not available", name);
+        return;
+    }
+    is_int(method, compress_choose(option), "%s: chosen", name);
+    size = compress_bound(method, SIZE);
+    ok(size >= SIZE, "%s: bound is large enough", name);
+    out = bcalloc(1, size);
+    back = bcalloc(1, SIZE);
+
+    /* Compress and decompress the data. */
+    length = size;
+    ok(compress_data(method, data, SIZE, out, &length), "%s: compress", name);
+    ok(length < SIZE / 10, "%s: ...and the result is much smaller", name);
+    ok(compress_expand(method, out, length, back, SIZE), "%s: expand", name);
+    ok(memcmp(data, back, SIZE) == 0, "%s: ...and the result matches", name);
+
+    /* The wrong size or corrupt data is rejected. */
+    ok(!compress_expand(method, out, length, back, SIZE - 1),
+       "%s: wrong size rejected", name);
+    memset(out + length / 2, 0xff, length / 2);
+    ok(!compress_expand(method, out, length, back, SIZE),
+       "%s: corrupt data rejected", name);
+    free(out);
+    free(back);
+}
+
+
+int
+main(void)
+{
+    char *data;
+    char out[64];
+    size_t i, length;
+
+    plan(4 + 2 * 8);
+
+    /* Something compressible, like the output of most commands. */
+    data = bmalloc(SIZE);
+    for (i = 0; i < SIZE; i++)
+        data[i] = "remctl output line\n"[i % 19];
+
+    /* Without any compression options, nothing is chosen. */
+    is_int(COMPRESS_NONE, compress_choose(OPTION_INTEGRITY), "No method");
+    if (compress_methods() & OPTION_ZSTD)
+        is_int(COMPRESS_ZSTD, compress_choose(OPTION_ZLIB | OPTION_ZSTD),
+               "zstd preferred");
+    else
+        is_int(compress_methods() ? COMPRESS_ZLIB : COMPRESS_NONE,
+               compress_choose(OPTION_ZLIB | OPTION_ZSTD),
+               "zlib used without zstd");
+
+    /* An unknown method fails. */
+    length = sizeof(out);
+    ok(!compress_data(99, data, 16, out, &length), "Unknown method fails");
+    ok(!compress_expand(99, out, 16, data, 16), "...and can't expand");
+
+    /* Each method. */
+    test_method(COMPRESS_ZLIB, OPTION_ZLIB, "zlib", data);
+    test_method(COMPRESS_ZSTD, OPTION_ZSTD, "zstd", data);
+
+    free(data);
+    return 0;
+}
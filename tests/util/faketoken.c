@@ -1,5 +1,5 @@
 /*
- * Fake token_send and token_recv functions for testing.
+ * Fake token sending and receiving functions for testing.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2006, 2009, 2010, 2012
@@ -12,6 +12,7 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
 #include <time.h>
 
@@ -19,8 +20,12 @@
 #include <util/tokens.h>
 
 enum token_status fake_token_send(socket_type, int, gss_buffer_t, time_t);
+enum token_status fake_token_sendv(socket_type, int, const struct iovec *, int,
+                                   time_t);
 enum token_status fake_token_recv(socket_type, int *, gss_buffer_t, size_t,
                                   time_t);
+enum token_status fake_token_recv_buffer(socket_type, struct token_buffer *,
+                                         int *, gss_buffer_t, size_t, time_t);
 
 /*
  * The token and flags are actually read from or written to these variables.
@@ -54,6 +59,34 @@ fake_token_send(socket_type fd UNUSED, int flags, gss_buffer_t tok,
 }
 
 
+/*
+ * Accept a token write request with the data in iovecs and store the
+ * concatenation of the data into the buffer.
+ */
+enum token_status
+fake_token_sendv(socket_type fd UNUSED, int flags, const struct iovec *iov,
+                 int iovcnt, time_t timeout)
+{
+    size_t length = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > sizeof(send_buffer) - length)
+            return TOKEN_FAIL_SYSTEM;
+        length += iov[i].iov_len;
+    }
+    if (fail_timeout && timeout > 0)
+        return TOKEN_FAIL_TIMEOUT;
+    send_flags = flags;
+    send_length = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(send_buffer + send_length, iov[i].iov_base, iov[i].iov_len);
+        send_length += iov[i].iov_len;
+    }
+    return TOKEN_OK;
+}
+
+
 /*
  * Receive a token from the stored buffer and return it.
  */
@@ -73,3 +106,23 @@ fake_token_recv(socket_type fd UNUSED, int *flags, gss_buffer_t tok,
     *flags = recv_flags;
     return TOKEN_OK;
 }
+
+
+/*
+ * Receive a token from the stored buffer without copying it, ignoring the
+ * token buffer.
+ */
+enum token_status
+fake_token_recv_buffer(socket_type fd UNUSED,
+                       struct token_buffer *buffer UNUSED, int *flags,
+                       gss_buffer_t tok, size_t max, time_t timeout)
+{
+    if (recv_length > max)
+        return TOKEN_FAIL_LARGE;
+    if (fail_timeout && timeout > 0)
+        return TOKEN_FAIL_TIMEOUT;
+    tok->value = recv_buffer;
+    tok->length = recv_length;
+    *flags = recv_flags;
+    return TOKEN_OK;
+}
@@ -11,6 +11,8 @@
 #include <config.h>
 #include <portable/system.h>
 #include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
@@ -35,11 +37,18 @@ main(void)
     gss_ctx_id_t server_ctx, client_ctx;
     OM_uint32 c_stat, c_min_stat, s_stat, s_min_stat, ret_flags;
     gss_OID doid;
-    int status, flags;
+    struct iovec iov[2], *out;
+    struct token_buffer *input;
+    char data[12];
+    char wrapped[2048];
+    size_t length;
+    OM_uint32 len;
+    int status, flags, count, i;
+    bool conf;
 
     /* Unless we have Kerberos available, we can't really do anything. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
-    plan(28);
+    plan(49);
 
     /*
      * We have to set up a context first in order to do this test, which is
@@ -113,6 +122,110 @@ main(void)
     is_int(3, flags, "...and the right flags");
     gss_release_buffer(&c_min_stat, &client_tok);
 
+    /* Send a token from iovecs, which encrypts the data in place. */
+    memcpy(data, "hello world", 11);
+    iov[0].iov_base = data;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = data + 5;
+    iov[1].iov_len = 6;
+    status = token_send_priv_iov(0, server_ctx, 3, true, iov, 2, 0, &s_stat,
+                                 &s_min_stat);
+    is_int(TOKEN_OK, status, "sent a token from iovecs");
+    memcpy(recv_buffer, send_buffer, send_length);
+    recv_length = send_length;
+    recv_flags = send_flags;
+    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 1024, 0,
+                             &s_stat, &c_min_stat);
+    is_int(TOKEN_OK, status, "...and received it");
+    is_int(11, client_tok.length, "...with the right length");
+    ok(memcmp(client_tok.value, "hello world", 11) == 0,
+       "...and the right data");
+    gss_release_buffer(&c_min_stat, &client_tok);
+
+    /* Wrap a token from iovecs to send later. */
+    memcpy(data, "hello world", 11);
+    status = token_wrap_priv_iov(server_ctx, 3, true, iov, 2, &out, &count,
+                                 &s_stat, &s_min_stat);
+    is_int(TOKEN_OK, status, "wrapped a token from iovecs");
+    for (length = 0, i = 0; i < count; i++) {
+        memcpy(wrapped + length, out[i].iov_base, out[i].iov_len);
+        length += out[i].iov_len;
+    }
+    free(out[0].iov_base);
+    free(out);
+    is_int(3, wrapped[0], "...with the right flags");
+    memcpy(&len, wrapped + 1, sizeof(len));
+    is_int(length - 5, ntohl(len), "...and the right length");
+    memcpy(recv_buffer, wrapped + 5, length - 5);
+    recv_length = length - 5;
+    recv_flags = wrapped[0];
+    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 1024, 0,
+                             &s_stat, &c_min_stat);
+    is_int(TOKEN_OK, status, "...and it can be received");
+    ok(client_tok.length == 11
+       && memcmp(client_tok.value, "hello world", 11) == 0,
+       "...with the right data");
+    gss_release_buffer(&c_min_stat, &client_tok);
+
+    /* Receive a token through a token buffer. */
+    server_tok.value = (char *) "hello";
+    server_tok.length = 5;
+    status = token_send_priv(0, server_ctx, 3, &server_tok, 0, &s_stat,
+                             &s_min_stat);
+    memcpy(recv_buffer, send_buffer, send_length);
+    recv_length = send_length;
+    recv_flags = send_flags;
+    input = token_buffer_new();
+    status = token_recv_priv_buffer(0, input, client_ctx, &flags,
+                                    &client_tok, 1024, 0, &c_stat,
+                                    &c_min_stat);
+    is_int(TOKEN_OK, status, "received a token through a buffer");
+    is_int(3, flags, "...with the right flags");
+    is_int(5, client_tok.length, "...and the right length");
+    ok(memcmp(client_tok.value, "hello", 5) == 0, "...and the right data");
+    gss_release_buffer(&c_min_stat, &client_tok);
+    token_buffer_free(input);
+
+    /* Tokens with integrity protection only are only accepted if asked. */
+    memcpy(data, "hello world", 11);
+    status = token_send_priv_iov(0, server_ctx, 3, false, iov, 2, 0, &s_stat,
+                                 &s_min_stat);
+    is_int(TOKEN_OK, status, "sent a token with integrity protection only");
+    ok(memcmp(data, "hello world", 11) == 0, "...without encrypting it");
+    memcpy(recv_buffer, send_buffer, send_length);
+    recv_length = send_length;
+    recv_flags = send_flags;
+    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 1024, 0,
+                             &c_stat, &c_min_stat);
+    is_int(TOKEN_FAIL_INVALID, status, "...and token_recv_priv rejects it");
+    status = token_send_priv_iov(0, server_ctx, 3, false, iov, 2, 0, &s_stat,
+                                 &s_min_stat);
+    memcpy(recv_buffer, send_buffer, send_length);
+    recv_length = send_length;
+    recv_flags = send_flags;
+    input = token_buffer_new();
+    status = token_recv_integ_buffer(0, input, client_ctx, &flags,
+                                     &client_tok, &conf, 1024, 0, &c_stat,
+                                     &c_min_stat);
+    is_int(TOKEN_OK, status, "...but token_recv_integ_buffer accepts it");
+    ok(!conf, "...and reports it wasn't encrypted");
+    ok(client_tok.length == 11
+       && memcmp(client_tok.value, "hello world", 11) == 0,
+       "...with the right data");
+    gss_release_buffer(&c_min_stat, &client_tok);
+    status = token_send_priv_iov(0, server_ctx, 3, true, iov, 2, 0, &s_stat,
+                                 &s_min_stat);
+    memcpy(recv_buffer, send_buffer, send_length);
+    recv_length = send_length;
+    recv_flags = send_flags;
+    status = token_recv_integ_buffer(0, input, client_ctx, &flags,
+                                     &client_tok, &conf, 1024, 0, &c_stat,
+                                     &c_min_stat);
+    is_int(TOKEN_OK, status, "received an encrypted token the same way");
+    ok(conf, "...and it was reported as encrypted");
+    gss_release_buffer(&c_min_stat, &client_tok);
+    token_buffer_free(input);
+
     /*
      * Now, fake up a token to make sure that token_recv_priv is doing the
      * right thing.
@@ -248,7 +248,7 @@ test_timeout_ipv4(void)
 
     /* In the parent.  Open that first connection. */
     socket_close(fd);
-    c = network_connect_host("127.0.0.1", 11119, NULL, 1);
+    c = network_connect_host("127.0.0.1", 11119, NULL, 1000);
     ok(c != INVALID_SOCKET, "Timeout: first connection worked");
 
     /*
@@ -257,7 +257,7 @@ test_timeout_ipv4(void)
      */
     alarm(20);
     for (i = 0; i < (int) ARRAY_SIZE(block); i++) {
-        block[i] = network_connect_host("127.0.0.1", 11119, NULL, 1);
+        block[i] = network_connect_host("127.0.0.1", 11119, NULL, 1000);
         if (block[i] == INVALID_SOCKET)
             break;
     }
@@ -335,7 +335,7 @@ test_network_read(void)
     socket_set_errno(0);
     ok(network_read(c, buffer, sizeof(buffer), 0), "network_read");
     ok(memcmp("one\n", buffer, sizeof(buffer)) == 0, "...with good data");
-    ok(network_read(c, buffer, sizeof(buffer), 1),
+    ok(network_read(c, buffer, sizeof(buffer), 1000),
        "network_read with timeout");
     ok(memcmp("two\n", buffer, sizeof(buffer)) == 0, "...with good data");
 
@@ -343,10 +343,13 @@ test_network_read(void)
      * The third read should abort with a timeout, since the writer is writing
      * with a ten second delay.
      */
-    ok(!network_read(c, buffer, sizeof(buffer), 1),
+    ok(!network_read(c, buffer, sizeof(buffer), 500),
        "network_read aborted with timeout");
     is_int(ETIMEDOUT, socket_errno, "...with correct error");
     ok(memcmp("two\n", buffer, sizeof(buffer)) == 0, "...and data unchanged");
+    is_int(-1, network_read_some(c, buffer, sizeof(buffer), 250),
+           "network_read_some aborted with timeout");
+    is_int(ETIMEDOUT, socket_errno, "...with correct error");
     alarm(0);
 
     /* Clean up. */
@@ -360,8 +363,8 @@ test_network_read(void)
 /*
  * Test the network write function with a timeout.  We fork off a child
  * process that runs delay_reader, and then we write 64KB to the network in
- * two chunks, once with a timeout and once without, and then try a third time
- * when we should time out.
+ * two chunks and 32KB in two more with network_writev, once each with a
+ * timeout and once without, and then try again when we should time out.
  */
 static void
 test_network_write(void)
@@ -369,6 +372,7 @@ test_network_write(void)
     socket_type fd, c;
     pid_t child;
     char *buffer;
+    struct iovec iov[2];
 
     /*
      * 15MB chosen because it's larger than the default TCP buffer size of
@@ -410,16 +414,24 @@ test_network_write(void)
      */
     socket_set_errno(0);
     ok(network_write(c, buffer, 32 * 1024, 0), "network_write");
-    ok(network_write(c, buffer, 32 * 1024, 1),
+    ok(network_write(c, buffer, 32 * 1024, 1000),
        "network_write with timeout");
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = 4 * 1024;
+    iov[1].iov_base = buffer + 4 * 1024;
+    iov[1].iov_len = 12 * 1024;
+    ok(network_writev(c, iov, 2, 0), "network_writev");
+    ok(network_writev(c, iov, 2, 1000), "network_writev with timeout");
 
     /*
      * A longer write cannot be completely absorbed before the client sleep,
      * so should fail with a timeout.
      */
-    ok(!network_write(c, buffer, bufsize, 1),
+    ok(!network_write(c, buffer, bufsize, 1000),
        "network_write aborted with timeout");
     is_int(ETIMEDOUT, socket_errno, "...with correct error");
+    iov[1].iov_len = bufsize - 4 * 1024;
+    ok(!network_writev(c, iov, 2, 1000), "network_writev aborted with timeout");
     alarm(0);
 
     /* Clean up. */
@@ -435,7 +447,7 @@ int
 main(void)
 {
     /* Set up the plan. */
-    plan(22);
+    plan(27);
 
     /* Test network_client_create. */
     test_create_ipv4(NULL);
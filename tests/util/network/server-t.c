@@ -33,6 +33,7 @@
 #include <portable/socket.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <signal.h>
 
@@ -64,7 +65,7 @@ ipv6_works(void)
     fd = network_bind_ipv6(SOCK_STREAM, "::1", 11119);
     if (fd != INVALID_SOCKET) {
         fdflag_nonblocking(fd, true);
-        client = network_connect_host("::1", 11119, NULL, 1);
+        client = network_connect_host("::1", 11119, NULL, 1000);
         if (client == INVALID_SOCKET) {
             close(fd);
             if (socket_errno == ETIMEDOUT || socket_errno == ENETUNREACH)
@@ -541,11 +542,74 @@ test_any_udp(void)
 }
 
 
+/*
+ * Bind a socket on port 11119 on the IPv4 loopback address with SO_REUSEPORT,
+ * bind a second socket to the same address with network_bind_shared, and
+ * accept a connection on the second one with network_accept.  For skipping
+ * purposes, this runs six tests.
+ */
+static void
+test_shared(void)
+{
+#ifndef SO_REUSEPORT
+    skip_block(6, "SO_REUSEPORT not supported");
+#else
+    socket_type fd, shared, client;
+    pid_t child;
+    int status;
+
+    network_bind_reuseport(true);
+    fd = network_bind_ipv4(SOCK_STREAM, "127.0.0.1", 11119);
+    network_bind_reuseport(false);
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot create or bind socket");
+    shared = network_bind_shared(fd);
+    ok(shared != INVALID_SOCKET, "network_bind_shared");
+    if (shared == INVALID_SOCKET) {
+        skip_block(5, "cannot bind shared socket");
+        socket_close(fd);
+        return;
+    }
+    if (listen(shared, 1) < 0)
+        sysbail("cannot listen to socket %d", shared);
+    fdflag_nonblocking(shared, true);
+
+    /* With no pending connections, network_accept fails immediately. */
+    client = network_accept(shared, NULL, NULL);
+    ok(client == INVALID_SOCKET
+           && (socket_errno == EAGAIN || socket_errno == EWOULDBLOCK),
+       "network_accept with no connection");
+
+    /* Accept a connection and check that it's close-on-exec. */
+    alarm(5);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0)
+        client_writer("127.0.0.1", NULL, true);
+    else {
+        network_wait_any(&shared, 1);
+        client = network_accept(shared, NULL, NULL);
+        ok(client != INVALID_SOCKET
+               && (fcntl(client, F_GETFD) & FD_CLOEXEC) != 0,
+           "network_accept sets close-on-exec");
+        fdflag_nonblocking(client, false);
+        test_server_connection(client);
+        waitpid(child, &status, 0);
+        is_int(0, status, "client made correct connections");
+    }
+    alarm(0);
+    socket_close(shared);
+    socket_close(fd);
+#endif
+}
+
+
 int
 main(void)
 {
     /* Set up the plan. */
-    plan(43);
+    plan(49);
 
     /* Test network_bind functions. */
     test_ipv4(NULL);
@@ -570,5 +634,8 @@ main(void)
 
     /* Test UDP socket handling and network_wait_any. */
     test_any_udp();
+
+    /* Test SO_REUSEPORT and network_accept. */
+    test_shared();
     return 0;
 }
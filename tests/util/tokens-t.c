@@ -12,6 +12,7 @@
 #include <portable/system.h>
 #include <portable/gssapi.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <fcntl.h>
 #ifdef HAVE_SYS_SELECT_H
@@ -131,6 +132,25 @@ send_regular_token(socket_type fd)
 }
 
 
+/*
+ * Send a token via token_sendv to a file descriptor, splitting the data
+ * across several iovecs.
+ */
+static void
+send_iov_token(socket_type fd)
+{
+    struct iovec iov[3];
+
+    iov[0].iov_base = (char *) "he";
+    iov[0].iov_len = 2;
+    iov[1].iov_base = (char *) "";
+    iov[1].iov_len = 0;
+    iov[2].iov_base = (char *) "llo";
+    iov[2].iov_len = 3;
+    token_sendv(fd, 3, iov, 3, 1000);
+}
+
+
 int
 main(void)
 {
@@ -140,10 +160,11 @@ main(void)
     char buffer[20];
     ssize_t length;
     gss_buffer_desc result;
+    struct token_buffer *input;
 
     alarm(20);
 
-    plan(12);
+    plan(32);
     if (chdir(getenv("C_TAP_BUILD")) < 0)
         sysbail("can't chdir to C_TAP_BUILD");
 
@@ -165,6 +186,24 @@ main(void)
         socket_close(client);
     }
 
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        send_iov_token(server);
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        length = read(client, buffer, 12);
+        is_int(10, length, "received token from iovecs has correct length");
+        ok(memcmp(buffer, token, 10) == 0, "...and correct data");
+        waitpid(child, NULL, 0);
+        socket_close(client);
+    }
+
     unlink("server-ready");
     child = fork();
     if (child < 0)
@@ -186,6 +225,91 @@ main(void)
         socket_close(client);
     }
 
+    /*
+     * Send two tokens at once and read them through a token buffer, which
+     * should return them one at a time.
+     */
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        memcpy(buffer, token, sizeof(token));
+        memcpy(buffer + sizeof(token), token, sizeof(token));
+        buffer[sizeof(token)] = 5;
+        socket_xwrite(server, buffer, 2 * sizeof(token));
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        input = token_buffer_new();
+        if (input == NULL)
+            sysbail("cannot create token buffer");
+        status = token_recv_buffer(client, input, &flags, &result, 5, 5000);
+        is_int(TOKEN_OK, status, "received buffered token");
+        is_int(3, flags, "...with right flags");
+        is_int(5, result.length, "...and right length");
+        ok(memcmp(result.value, "hello", 5) == 0, "...and right data");
+        waitpid(child, NULL, 0);
+        ok(token_buffer_pending(input), "...and more data is buffered");
+        status = token_recv_buffer(client, input, &flags, &result, 5, 0);
+        is_int(TOKEN_OK, status, "received second buffered token");
+        ok(flags == 5 && result.length == 5
+           && memcmp(result.value, "hello", 5) == 0, "...with right data");
+        ok(!token_buffer_pending(input), "...and nothing more is buffered");
+        status = token_recv_buffer(client, input, &flags, &result, 5, 1000);
+        is_int(TOKEN_FAIL_EOF, status, "...and then end of file");
+        token_buffer_free(input);
+        socket_close(client);
+    }
+
+    /*
+     * Send part of a token, wait for the client to check that it's not yet
+     * complete, and then send the rest followed by the header of a token that
+     * is too large.  Read them with token_buffer_read as a caller with its
+     * own event loop would.
+     */
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        socket_xwrite(server, token, 7);
+        if (socket_read(server, buffer, 1) < 1)
+            _exit(1);
+        memcpy(buffer, token + 7, sizeof(token) - 7);
+        memcpy(buffer + sizeof(token) - 7, "\3\0\0\0\144", 5);
+        socket_xwrite(server, buffer, sizeof(token) - 7 + 5);
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        input = token_buffer_new();
+        if (input == NULL)
+            sysbail("cannot create token buffer");
+        ok(!token_buffer_complete(input, 5), "empty buffer is not complete");
+        status = token_buffer_read(client, input);
+        is_int(TOKEN_OK, status, "read part of a token");
+        ok(!token_buffer_complete(input, 5), "...which is not complete");
+        socket_xwrite(client, "x", 1);
+        status = token_buffer_read(client, input);
+        is_int(TOKEN_OK, status, "read the rest of the token");
+        ok(token_buffer_complete(input, 5), "...which is complete");
+        status = token_recv_buffer(client, input, &flags, &result, 5, 0);
+        ok(status == TOKEN_OK && flags == 3 && result.length == 5
+           && memcmp(result.value, "hello", 5) == 0, "...with right data");
+        ok(token_buffer_complete(input, 5), "Too-large token is complete");
+        status = token_recv_buffer(client, input, &flags, &result, 5, 0);
+        is_int(TOKEN_FAIL_LARGE, status, "...and is rejected");
+        waitpid(child, NULL, 0);
+        status = token_buffer_read(client, input);
+        is_int(TOKEN_FAIL_EOF, status, "...and then end of file");
+        token_buffer_free(input);
+        socket_close(client);
+    }
+
     /* Send a token with a length of one, but no following data. */
     unlink("server-ready");
     child = fork();
@@ -257,7 +381,7 @@ main(void)
         memset(result.value, 'a', 8192 * 1024);
         result.length = 8192 * 1024;
         client = create_client();
-        status = token_send(client, 3, &result, 1);
+        status = token_send(client, 3, &result, 1000);
         free(result.value);
         is_int(TOKEN_FAIL_TIMEOUT, status, "can't send due to timeout");
         socket_close(client);
@@ -276,7 +400,7 @@ main(void)
         exit(0);
     } else {
         client = create_client();
-        status = token_recv(client, &flags, &result, 200, 1);
+        status = token_recv(client, &flags, &result, 200, 1000);
         is_int(TOKEN_FAIL_TIMEOUT, status, "can't receive due to timeout");
         socket_close(client);
         waitpid(child, NULL, 0);
@@ -0,0 +1,157 @@
+/*
+ * Compression of command output.
+ *
+ * The output of a command can be compressed before it's sent if the client
+ * and the server support the same compression method.  These functions hide
+ * which of the compression libraries were found at build time from the rest
+ * of remctl.  Output is compressed as it is sent, so the fastest levels are
+ * used.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#include <util/compress.h>
+
+
+/*
+ * Return the output options for the compression methods that are available.
+ */
+int
+compress_methods(void)
+{
+    int options = 0;
+
+#ifdef HAVE_ZLIB
+    options |= OPTION_ZLIB;
+#endif
+#ifdef HAVE_ZSTD
+    options |= OPTION_ZSTD;
+#endif
+    return options;
+}
+
+
+/*
+ * Choose the compression method to use for a client that sent the given
+ * output options.  zstd is preferred, since it's both faster and better.
+ */
+enum compress_method
+compress_choose(int options)
+{
+    options &= compress_methods();
+    if (options & OPTION_ZSTD)
+        return COMPRESS_ZSTD;
+    else if (options & OPTION_ZLIB)
+        return COMPRESS_ZLIB;
+    else
+        return COMPRESS_NONE;
+}
+
+
+/*
+ * Return the worst-case compressed size of length bytes of data.
+ */
+size_t
+compress_bound(enum compress_method method, size_t length)
+{
+    switch (method) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB:
+        return compressBound(length);
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        return ZSTD_compressBound(length);
+#endif
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Compress data into a buffer that the caller provides.
+ */
+bool
+compress_data(enum compress_method method, const void *data, size_t length,
+              void *out, size_t *outlen)
+{
+#ifdef HAVE_ZLIB
+    uLongf size;
+#endif
+#ifdef HAVE_ZSTD
+    size_t result;
+#endif
+
+    switch (method) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB:
+        size = *outlen;
+        if (compress2(out, &size, data, length, Z_BEST_SPEED) != Z_OK)
+            return false;
+        *outlen = size;
+        return true;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        result = ZSTD_compress(out, *outlen, data, length, 1);
+        if (ZSTD_isError(result))
+            return false;
+        *outlen = result;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * Decompress data into a buffer that the caller provides, which must be
+ * exactly the size of the uncompressed data.  Since the output can't be
+ * larger than the buffer, corrupt or malicious data can't make us use more
+ * memory than the caller expected.
+ */
+bool
+compress_expand(enum compress_method method, const void *data, size_t length,
+                void *out, size_t outlen)
+{
+#ifdef HAVE_ZLIB
+    uLongf size;
+#endif
+#ifdef HAVE_ZSTD
+    size_t result;
+#endif
+
+    switch (method) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB:
+        size = outlen;
+        if (uncompress(out, &size, data, length) != Z_OK)
+            return false;
+        return size == outlen;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        result = ZSTD_decompress(out, outlen, data, length);
+        if (ZSTD_isError(result))
+            return false;
+        return result == outlen;
+#endif
+    default:
+        return false;
+    }
+}
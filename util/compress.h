@@ -0,0 +1,68 @@
+/*
+ * Prototypes for compression of command output.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef UTIL_COMPRESS_H
+#define UTIL_COMPRESS_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+#include <sys/types.h>
+
+#include <util/protocol.h>
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all util functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Return the output options (OPTION_ZLIB and so forth) for the compression
+ * methods that are available, or 0 if remctl was built without any.
+ */
+int compress_methods(void);
+
+/*
+ * Given the output options sent by a client, return the best compression
+ * method that both sides support, or COMPRESS_NONE if there isn't one.
+ */
+enum compress_method compress_choose(int options);
+
+/*
+ * Return the size of the buffer needed to hold length bytes of data once
+ * compressed with the given method, or 0 if that method isn't available.
+ */
+size_t compress_bound(enum compress_method, size_t length);
+
+/*
+ * Compress the data of the given length into out, which is *outlen bytes
+ * long, and set *outlen to the length of the compressed data.  Returns false
+ * if the method isn't available or compression fails.
+ */
+bool compress_data(enum compress_method, const void *data, size_t length,
+                   void *out, size_t *outlen)
+    __attribute__((__nonnull__));
+
+/*
+ * Decompress the data of the given length into out, which must be exactly
+ * the length of the uncompressed data.  Returns false if the method isn't
+ * available, the data is corrupt, or it doesn't decompress to exactly
+ * outlen bytes.
+ */
+bool compress_expand(enum compress_method, const void *data, size_t length,
+                     void *out, size_t outlen)
+    __attribute__((__nonnull__));
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* UTIL_COMPRESS_H */
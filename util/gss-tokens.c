@@ -5,7 +5,11 @@
  * apply integrity and privacy protection to the token data before sending.
  * token_send_priv and token_recv_priv are similar to token_send and
  * token_recv except that they also take a GSS-API context and a GSS-API major
- * and minor status to report errors.
+ * and minor status to report errors.  token_send_priv_iov is similar to
+ * token_send_priv but takes the data as an array of iovecs and encrypts it
+ * in place, avoiding copies of large data, and can also send data with
+ * integrity protection only.  token_recv_integ_buffer is the corresponding
+ * way to receive tokens that may not be encrypted.
  *
  * Originally written by Anton Ushakov
  * Extensive modifications by Russ Allbery <eagle@eyrie.org>
@@ -19,7 +23,9 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
+#include <errno.h>
 #include <time.h>
 
 #include <util/gss-tokens.h>
@@ -31,10 +37,15 @@
  * functions.
  */
 #if TESTING
-# define token_send fake_token_send
-# define token_recv fake_token_recv
+# define token_send        fake_token_send
+# define token_sendv       fake_token_sendv
+# define token_recv        fake_token_recv
+# define token_recv_buffer fake_token_recv_buffer
 enum token_status token_send(int, int, gss_buffer_t, time_t);
+enum token_status token_sendv(int, int, const struct iovec *, int, time_t);
 enum token_status token_recv(int, int *, gss_buffer_t, size_t, time_t);
+enum token_status token_recv_buffer(int, struct token_buffer *, int *,
+                                    gss_buffer_t, size_t, time_t);
 #endif
 
 
@@ -87,34 +98,38 @@ token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
 
 
 /*
- * Receives and unwraps a data payload token.  Takes the file descriptor,
- * GSS-API context, a pointer into which to storge the flags, a buffer for the
- * message, and a place to put GSS-API major and minor status.  Returns
- * TOKEN_OK on success or one of the TOKEN_FAIL_* statuses on failure.  On
- * success, tok will contain newly allocated memory and should be freed when
- * no longer needed using gss_release_buffer.  On failure, any allocated
- * memory will be freed.
- *
- * As a hack to support remctl v1, look to see if the flags includes
- * TOKEN_SEND_MIC and do not include TOKEN_PROTOCOL.  If so, calculate a MIC
- * and send it back.
+ * Receives and unwraps a data payload token, reading it through a token
+ * buffer if one is given.  This is the implementation of token_recv_priv,
+ * token_recv_priv_buffer, and token_recv_integ_buffer.  If conf is NULL,
+ * tokens that weren't encrypted are rejected.  Otherwise, they're accepted
+ * and conf is set to whether the token was encrypted.
  */
-enum token_status
-token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
-                gss_buffer_t tok, size_t max, time_t timeout,
-                OM_uint32 *major, OM_uint32 *minor)
+static enum token_status
+recv_priv(socket_type fd, struct token_buffer *buffer, gss_ctx_id_t ctx,
+          int *flags, gss_buffer_t tok, bool *conf, size_t max,
+          time_t timeout, OM_uint32 *major, OM_uint32 *minor)
 {
     gss_buffer_desc in, mic;
     int state;
     enum token_status status;
 
-    status = token_recv(fd, flags, &in, max, timeout);
+    if (buffer == NULL)
+        status = token_recv(fd, flags, &in, max, timeout);
+    else
+        status = token_recv_buffer(fd, buffer, flags, &in, max, timeout);
     if (status != TOKEN_OK)
         return status;
     *major = gss_unwrap(minor, ctx, &in, tok, &state, NULL);
-    free(in.value);
+    if (buffer == NULL)
+        free(in.value);
     if (*major != GSS_S_COMPLETE)
         return TOKEN_FAIL_GSSAPI;
+    if (conf != NULL)
+        *conf = (state != 0);
+    else if (state == 0) {
+        gss_release_buffer(minor, tok);
+        return TOKEN_FAIL_INVALID;
+    }
     if ((*flags & TOKEN_SEND_MIC) && !(*flags & TOKEN_PROTOCOL)) {
         *major = gss_get_mic(minor, ctx, GSS_C_QOP_DEFAULT, tok, &mic);
         if (*major != GSS_S_COMPLETE) {
@@ -132,3 +147,299 @@ token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
     }
     return TOKEN_OK;
 }
+
+
+/*
+ * Receives and unwraps a data payload token.  Takes the file descriptor,
+ * GSS-API context, a pointer into which to storge the flags, a buffer for the
+ * message, and a place to put GSS-API major and minor status.  Returns
+ * TOKEN_OK on success or one of the TOKEN_FAIL_* statuses on failure.  On
+ * success, tok will contain newly allocated memory and should be freed when
+ * no longer needed using gss_release_buffer.  On failure, any allocated
+ * memory will be freed.
+ *
+ * As a hack to support remctl v1, look to see if the flags includes
+ * TOKEN_SEND_MIC and do not include TOKEN_PROTOCOL.  If so, calculate a MIC
+ * and send it back.
+ */
+enum token_status
+token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
+                gss_buffer_t tok, size_t max, time_t timeout,
+                OM_uint32 *major, OM_uint32 *minor)
+{
+    return recv_priv(fd, NULL, ctx, flags, tok, NULL, max, timeout, major,
+                     minor);
+}
+
+
+/*
+ * The same as token_recv_priv, except that the token is read through the
+ * token buffer for the connection.  The unwrapped token is still newly
+ * allocated, so it remains valid after further tokens are read.
+ */
+enum token_status
+token_recv_priv_buffer(socket_type fd, struct token_buffer *buffer,
+                       gss_ctx_id_t ctx, int *flags, gss_buffer_t tok,
+                       size_t max, time_t timeout, OM_uint32 *major,
+                       OM_uint32 *minor)
+{
+    return recv_priv(fd, buffer, ctx, flags, tok, NULL, max, timeout, major,
+                     minor);
+}
+
+
+/*
+ * The same as token_recv_priv_buffer, except that tokens with only integrity
+ * protection are also accepted, and conf is set to whether the token was
+ * encrypted.  Used by clients that have told the server that they accept
+ * output without encryption.
+ */
+enum token_status
+token_recv_integ_buffer(socket_type fd, struct token_buffer *buffer,
+                        gss_ctx_id_t ctx, int *flags, gss_buffer_t tok,
+                        bool *conf, size_t max, time_t timeout,
+                        OM_uint32 *major, OM_uint32 *minor)
+{
+    return recv_priv(fd, buffer, ctx, flags, tok, conf, max, timeout, major,
+                     minor);
+}
+
+
+/*
+ * Wraps and encrypts a data payload token stored in an array of iovecs,
+ * encrypting the data in place where possible.  Takes the GSS-API context,
+ * the flags, whether to encrypt the data or only protect its integrity, the
+ * iovecs, whether to include the token flags and length in the result, where
+ * to store the resulting array of iovecs and its length, and the status
+ * variables.  Returns TOKEN_OK on success and
+ * TOKEN_FAIL_SYSTEM or TOKEN_FAIL_GSSAPI on failure.
+ *
+ * The concatenation of the resulting iovecs is the wrapped token, preceded by
+ * the flags and length if requested.  The iovecs point either to the data in
+ * the original iovecs or into a single newly allocated block of memory, which
+ * is pointed to by the first iovec.  Free that and then the array with free.
+ *
+ * With gss_wrap_iov, the GSS-API header, padding, and trailer are put in
+ * their own iovecs around the encrypted data, and the result is the same as
+ * the token generated by gss_wrap.  Without it, the data is copied into one
+ * buffer and wrapped with gss_wrap.
+ */
+#ifdef HAVE_GSS_WRAP_IOV
+
+static enum token_status
+wrap_iov(gss_ctx_id_t ctx, int flags, bool conf, struct iovec *iov,
+         int iovcnt, bool prefix, struct iovec **out, int *outcnt,
+         OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_iov_buffer_desc *giov;
+    struct iovec *result;
+    unsigned char char_flags = (unsigned char) flags;
+    size_t offset, extra, length = 0;
+    char *buffer;
+    OM_uint32 len;
+    int i, n, state;
+
+    /*
+     * Ask for the sizes of the header, padding, and trailer so that they can
+     * be allocated together with the token flags and length.
+     */
+    n = iovcnt + 3;
+    giov = calloc(n, sizeof(gss_iov_buffer_desc));
+    if (giov == NULL)
+        return TOKEN_FAIL_SYSTEM;
+    giov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    for (i = 0; i < iovcnt; i++) {
+        giov[i + 1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        giov[i + 1].buffer.value = iov[i].iov_base;
+        giov[i + 1].buffer.length = iov[i].iov_len;
+        length += iov[i].iov_len;
+    }
+    giov[n - 2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+    giov[n - 1].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+    *major = gss_wrap_iov_length(minor, ctx, conf, GSS_C_QOP_DEFAULT, &state,
+                                 giov, n);
+    if (*major != GSS_S_COMPLETE) {
+        free(giov);
+        return TOKEN_FAIL_GSSAPI;
+    }
+    offset = prefix ? 1 + sizeof(OM_uint32) : 0;
+    extra = offset + giov[0].buffer.length + giov[n - 2].buffer.length
+        + giov[n - 1].buffer.length;
+    buffer = malloc(extra + 1);
+    result = calloc(n + 1, sizeof(struct iovec));
+    if (buffer == NULL || result == NULL) {
+        free(buffer);
+        free(result);
+        free(giov);
+        return TOKEN_FAIL_SYSTEM;
+    }
+    giov[0].buffer.value = buffer + offset;
+    giov[n - 2].buffer.value = buffer + offset + giov[0].buffer.length;
+    giov[n - 1].buffer.value = (char *) giov[n - 2].buffer.value
+        + giov[n - 2].buffer.length;
+
+    /* Encrypt the data in place, or just compute the checksum. */
+    *major = gss_wrap_iov(minor, ctx, conf, GSS_C_QOP_DEFAULT, &state, giov,
+                          n);
+    if (*major != GSS_S_COMPLETE) {
+        free(buffer);
+        free(result);
+        free(giov);
+        return TOKEN_FAIL_GSSAPI;
+    }
+
+    /* Build the result, starting with the token flags and length. */
+    *outcnt = 0;
+    if (prefix) {
+        length += extra - offset;
+        len = htonl(length);
+        memcpy(buffer, &char_flags, 1);
+        memcpy(buffer + 1, &len, sizeof(OM_uint32));
+        result[0].iov_base = buffer;
+        result[0].iov_len = offset;
+        *outcnt = 1;
+    }
+    for (i = 0; i < n; i++) {
+        result[*outcnt].iov_base = giov[i].buffer.value;
+        result[*outcnt].iov_len = giov[i].buffer.length;
+        (*outcnt)++;
+    }
+    free(giov);
+    *out = result;
+    return TOKEN_OK;
+}
+
+#else /* !HAVE_GSS_WRAP_IOV */
+
+static enum token_status
+wrap_iov(gss_ctx_id_t ctx, int flags, bool conf, struct iovec *iov,
+         int iovcnt, bool prefix, struct iovec **out, int *outcnt,
+         OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_buffer_desc tok, wrapped;
+    unsigned char char_flags = (unsigned char) flags;
+    size_t offset, length = 0;
+    char *buffer;
+    OM_uint32 len;
+    int i, state;
+
+    /* Gather the data into a single buffer and wrap that. */
+    for (i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+    tok.length = length;
+    tok.value = malloc(length + 1);
+    if (tok.value == NULL)
+        return TOKEN_FAIL_SYSTEM;
+    for (offset = 0, i = 0; i < iovcnt; i++) {
+        memcpy((char *) tok.value + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    *major = gss_wrap(minor, ctx, conf, GSS_C_QOP_DEFAULT, &tok, &state,
+                      &wrapped);
+    free(tok.value);
+    if (*major != GSS_S_COMPLETE)
+        return TOKEN_FAIL_GSSAPI;
+
+    /* Copy the result into memory we can free with free. */
+    offset = prefix ? 1 + sizeof(OM_uint32) : 0;
+    buffer = malloc(offset + wrapped.length + 1);
+    *out = calloc(1, sizeof(struct iovec));
+    if (buffer == NULL || *out == NULL) {
+        free(buffer);
+        free(*out);
+        gss_release_buffer(minor, &wrapped);
+        return TOKEN_FAIL_SYSTEM;
+    }
+    if (prefix) {
+        len = htonl(wrapped.length);
+        memcpy(buffer, &char_flags, 1);
+        memcpy(buffer + 1, &len, sizeof(OM_uint32));
+    }
+    memcpy(buffer + offset, wrapped.value, wrapped.length);
+    gss_release_buffer(minor, &wrapped);
+    (*out)[0].iov_base = buffer;
+    (*out)[0].iov_len = offset + wrapped.length;
+    *outcnt = 1;
+    return TOKEN_OK;
+}
+
+#endif /* !HAVE_GSS_WRAP_IOV */
+
+
+/*
+ * Return the total length of the data in an array of iovecs, or SIZE_MAX if
+ * it is larger than the largest data payload we can send.
+ */
+static size_t
+iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t length = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > TOKEN_MAX_DATA - length)
+            return SIZE_MAX;
+        length += iov[i].iov_len;
+    }
+    return length;
+}
+
+
+/*
+ * Wraps, encrypts, and sends a data payload token stored in an array of
+ * iovecs, without copying the data into a separate buffer where possible.
+ * Takes the same arguments as token_send_priv except for the iovecs in
+ * place of the token and whether to encrypt the data, and returns the same
+ * values.  If conf is false, the data only gets integrity protection.
+ *
+ * The data is encrypted in place, so the contents of the iovecs are
+ * undefined afterwards.  The remctl v1 MIC protocol is not supported, since
+ * it needs the original data to verify the MIC.
+ */
+enum token_status
+token_send_priv_iov(socket_type fd, gss_ctx_id_t ctx, int flags, bool conf,
+                    struct iovec *iov, int iovcnt, time_t timeout,
+                    OM_uint32 *major, OM_uint32 *minor)
+{
+    struct iovec *out;
+    int outcnt;
+    enum token_status status;
+
+    if (iov_length(iov, iovcnt) == SIZE_MAX)
+        return TOKEN_FAIL_LARGE;
+    status = wrap_iov(ctx, flags, conf, iov, iovcnt, false, &out, &outcnt,
+                      major, minor);
+    if (status != TOKEN_OK)
+        return status;
+    status = token_sendv(fd, flags, out, outcnt, timeout);
+    free(out[0].iov_base);
+    free(out);
+    return status;
+}
+
+
+/*
+ * Wraps and encrypts a data payload token stored in an array of iovecs and
+ * builds the complete token, with flags and length, without sending it.
+ * Takes the GSS-API context, the flags, whether to encrypt, the iovecs,
+ * where to store the resulting iovecs and their count, and the status
+ * variables.  Returns TOKEN_OK on success and TOKEN_FAIL_SYSTEM,
+ * TOKEN_FAIL_LARGE, or TOKEN_FAIL_GSSAPI on failure.
+ *
+ * As with token_send_priv_iov, the data is encrypted in place and the
+ * resulting iovecs may point into the original data.  On success, free the
+ * iov_base member of the first resulting iovec and then the array with free.
+ *
+ * This is used by the server to queue output tokens to send when the client
+ * is ready for them.  It does not support the remctl v1 MIC protocol.
+ */
+enum token_status
+token_wrap_priv_iov(gss_ctx_id_t ctx, int flags, bool conf, struct iovec *iov,
+                    int iovcnt, struct iovec **out, int *outcnt,
+                    OM_uint32 *major, OM_uint32 *minor)
+{
+    if (iov_length(iov, iovcnt) == SIZE_MAX)
+        return TOKEN_FAIL_LARGE;
+    return wrap_iov(ctx, flags, conf, iov, iovcnt, true, out, outcnt, major,
+                    minor);
+}
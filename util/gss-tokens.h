@@ -16,6 +16,7 @@
 #include <portable/gssapi.h>
 #include <portable/macros.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 #include <util/tokens.h>
 
 BEGIN_DECLS
@@ -28,7 +29,8 @@ BEGIN_DECLS
  * not use gss_release_buffer to free the token returned by token_recv; this
  * will cause crashes on Windows.  Call free on the value member instead.  On
  * a GSS-API failure, the major and minor status are returned in the final two
- * arguments.
+ * arguments.  Received tokens that were not encrypted are rejected with
+ * TOKEN_FAIL_INVALID.
  */
 enum token_status token_send_priv(socket_type, gss_ctx_id_t, int flags,
                                   gss_buffer_t, time_t, OM_uint32 *,
@@ -37,6 +39,50 @@ enum token_status token_recv_priv(socket_type, gss_ctx_id_t, int *flags,
                                   gss_buffer_t, size_t max, time_t,
                                   OM_uint32 *, OM_uint32 *);
 
+/*
+ * Like token_recv_priv, but reads the token through a token buffer for the
+ * connection (see util/tokens.h).  The unwrapped token is newly allocated as
+ * with token_recv_priv.
+ */
+enum token_status token_recv_priv_buffer(socket_type, struct token_buffer *,
+                                         gss_ctx_id_t, int *flags,
+                                         gss_buffer_t, size_t max, time_t,
+                                         OM_uint32 *, OM_uint32 *);
+
+/*
+ * Like token_recv_priv_buffer, but also accepts tokens that have integrity
+ * protection only, setting conf to whether the token was encrypted.
+ */
+enum token_status token_recv_integ_buffer(socket_type, struct token_buffer *,
+                                          gss_ctx_id_t, int *flags,
+                                          gss_buffer_t, bool *conf,
+                                          size_t max, time_t, OM_uint32 *,
+                                          OM_uint32 *);
+
+/*
+ * Send a token whose data is the concatenation of an array of iovecs.  The
+ * data is encrypted in place where the GSS-API implementation supports it,
+ * so the contents of the iovecs are undefined afterwards.  If conf is false,
+ * the data only gets integrity protection and is not encrypted.  Does not
+ * support the remctl v1 MIC protocol.
+ */
+enum token_status token_send_priv_iov(socket_type, gss_ctx_id_t, int flags,
+                                      bool conf, struct iovec *, int iovcnt,
+                                      time_t, OM_uint32 *, OM_uint32 *);
+
+/*
+ * Wrap and encrypt a data payload token stored in an array of iovecs, in
+ * place where possible, and store an array of iovecs whose concatenation is
+ * the complete token as it would be sent, including flags and length, in the
+ * final iovec arguments, to be sent later.  The iov_base member of the first
+ * resulting iovec is newly allocated memory.  Free it and then the array
+ * with free.  conf is as for token_send_priv_iov.
+ */
+enum token_status token_wrap_priv_iov(gss_ctx_id_t, int flags, bool conf,
+                                      struct iovec *, int iovcnt,
+                                      struct iovec **, int *, OM_uint32 *,
+                                      OM_uint32 *);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
@@ -47,10 +47,14 @@
 #include <config.h>
 #include <portable/system.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <errno.h>
-#ifdef HAVE_SYS_SELECT_H
-# include <sys/select.h>
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
 #endif
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
@@ -83,6 +87,85 @@
 # define socket_xwrite(fd, b, s)        xwrite((fd), (b), (s))
 #endif
 
+/* Windows calls poll WSAPoll. */
+#ifdef _WIN32
+# define poll(fds, n, timeout)          WSAPoll((fds), (n), (timeout))
+#endif
+
+/*
+ * Whether the network_bind functions should set SO_REUSEPORT on the sockets
+ * they create, changed with network_bind_reuseport.
+ */
+static bool bind_reuseport = false;
+
+/*
+ * The epoll instance used by network_wait_any, along with the file
+ * descriptors it was built for and the process that built it, so that it can
+ * be reused by later calls with the same file descriptors.
+ */
+#ifdef HAVE_EPOLL_CREATE1
+static int wait_epoll = -1;
+static pid_t wait_epoll_pid = 0;
+static socket_type *wait_epoll_fds = NULL;
+static unsigned int wait_epoll_count = 0;
+#endif
+
+
+/*
+ * Return the current time in milliseconds, for computing deadlines.  Use a
+ * monotonic clock if available so that changes to the system time don't
+ * affect timeouts.
+ */
+static uint64_t
+network_now(void)
+{
+    struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+#endif
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + (uint64_t) tv.tv_usec / 1000;
+}
+
+
+/*
+ * Wait until a file descriptor is ready for the given poll events or the
+ * deadline (in the milliseconds returned by network_now) passes.  Restarts
+ * the wait if interrupted by a signal.  Returns true if the file descriptor
+ * is ready, which includes errors and end of file that the next read or
+ * write will report, and false on timeout or failure, setting the socket
+ * errno (to ETIMEDOUT on timeout).
+ */
+static bool
+network_poll(socket_type fd, short events, uint64_t deadline)
+{
+    struct pollfd pfd;
+    uint64_t now, wait;
+    int status;
+
+    for (;;) {
+        now = network_now();
+        if (now >= deadline) {
+            socket_set_errno(ETIMEDOUT);
+            return false;
+        }
+        wait = deadline - now;
+        if (wait > INT_MAX)
+            wait = INT_MAX;
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        status = poll(&pfd, 1, (int) wait);
+        if (status > 0)
+            return true;
+        else if (status < 0 && socket_errno != EINTR)
+            return false;
+    }
+}
+
 
 /*
  * Set SO_REUSEADDR on a socket if possible (so that something new can listen
@@ -100,6 +183,34 @@ network_set_reuseaddr(socket_type fd UNUSED)
 }
 
 
+/*
+ * Set SO_REUSEPORT on a socket if possible, which allows several sockets,
+ * normally in separate processes, to bind to the same address and port and
+ * have the kernel spread incoming connections between them.
+ */
+void
+network_set_reuseport(socket_type fd UNUSED)
+{
+#ifdef SO_REUSEPORT
+    int flag = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0)
+        syswarn("cannot mark bind port shareable");
+#endif
+}
+
+
+/*
+ * Set whether the network_bind functions set SO_REUSEPORT on the sockets
+ * they create.
+ */
+void
+network_bind_reuseport(bool enable)
+{
+    bind_reuseport = enable;
+}
+
+
 /*
  * Set IPV6_V6ONLY on a socket if possible, since the IPv6 behavior is more
  * consistent and easier to understand.
@@ -150,6 +261,8 @@ network_bind_ipv4(int type, const char *address, unsigned short port)
         return INVALID_SOCKET;
     }
     network_set_reuseaddr(fd);
+    if (bind_reuseport)
+        network_set_reuseport(fd);
 
     /* Accept "any" or "all" in the bind address to mean 0.0.0.0. */
     if (!strcmp(address, "any") || !strcmp(address, "all"))
@@ -204,6 +317,8 @@ network_bind_ipv6(int type, const char *address, unsigned short port)
         return INVALID_SOCKET;
     }
     network_set_reuseaddr(fd);
+    if (bind_reuseport)
+        network_set_reuseport(fd);
 
     /*
      * Restrict the socket to IPv6 only if possible.  The default behavior is
@@ -265,6 +380,51 @@ network_bind_ipv6(int type UNUSED, const char *address, unsigned short port)
 #endif /* HAVE_INET6 */
 
 
+/*
+ * Create a new socket bound to the same local address and port as an
+ * existing bound socket, with SO_REUSEPORT set so that both can be bound at
+ * once.  The existing socket must also have been created with SO_REUSEPORT
+ * (see network_bind_reuseport).  This lets each of several processes listen
+ * on its own socket for the same address so that the kernel can spread
+ * connections between them.  Returns the new socket or INVALID_SOCKET on
+ * failure, after reporting the error with syswarn.
+ */
+socket_type
+network_bind_shared(socket_type old)
+{
+    struct sockaddr_storage addr;
+    socklen_t length, typelen;
+    socket_type fd;
+    int type;
+
+    length = sizeof(addr);
+    if (getsockname(old, (struct sockaddr *) &addr, &length) < 0) {
+        syswarn("cannot get address of listening socket");
+        return INVALID_SOCKET;
+    }
+    typelen = sizeof(type);
+    if (getsockopt(old, SOL_SOCKET, SO_TYPE, (void *) &type, &typelen) < 0) {
+        syswarn("cannot get type of listening socket");
+        return INVALID_SOCKET;
+    }
+    fd = socket(addr.ss_family, type, IPPROTO_IP);
+    if (fd == INVALID_SOCKET) {
+        syswarn("cannot create socket");
+        return INVALID_SOCKET;
+    }
+    network_set_reuseaddr(fd);
+    network_set_reuseport(fd);
+    if (addr.ss_family == AF_INET6)
+        network_set_v6only(fd);
+    if (bind(fd, (struct sockaddr *) &addr, length) < 0) {
+        syswarn("cannot bind shared socket");
+        socket_close(fd);
+        return INVALID_SOCKET;
+    }
+    return fd;
+}
+
+
 /*
  * Create and bind sockets for every local address, as determined by
  * getaddrinfo if IPv6 is available (otherwise, just use the IPv4 loopback
@@ -354,23 +514,106 @@ network_bind_all(int type, unsigned short port, socket_type **fds,
 #endif /* HAVE_INET6 */
 
 
+#ifdef HAVE_EPOLL_CREATE1
+
+/*
+ * Discard the epoll instance used by network_wait_any, if any.  This is
+ * needed whenever the file descriptors it was built for may have been closed,
+ * since new file descriptors with the same numbers would otherwise look like
+ * the same set.
+ */
+static void
+network_wait_reset(void)
+{
+    if (wait_epoll >= 0)
+        close(wait_epoll);
+    wait_epoll = -1;
+    free(wait_epoll_fds);
+    wait_epoll_fds = NULL;
+    wait_epoll_count = 0;
+}
+
+#endif /* HAVE_EPOLL_CREATE1 */
+
+
 /*
  * Free the array of file descriptors allocated by network_bind_all.  This is
  * a simple wrapper around free, needed on platforms where libraries allocate
  * memory from a different memory domain than programs (such as Windows).
+ * The caller has normally closed the file descriptors by now, so also discard
+ * the cached epoll instance for network_wait_any.
  */
 void
 network_bind_all_free(socket_type *fds)
 {
+#ifdef HAVE_EPOLL_CREATE1
+    network_wait_reset();
+#endif
     free(fds);
 }
 
 
+#ifdef HAVE_EPOLL_CREATE1
+
+/*
+ * Wait for any of the file descriptors to be ready for read using epoll.
+ * The epoll instance is built the first time and then reused as long as the
+ * same process calls this function with the same file descriptors, so each
+ * wait is a single system call no matter how many file descriptors there
+ * are.  Returns the ready file descriptor, or INVALID_SOCKET on failure with
+ * errno set.  If epoll can't be set up, sets errno to ENOSYS so that the
+ * caller can fall back to poll.
+ */
+static socket_type
+network_wait_epoll(socket_type fds[], unsigned int count)
+{
+    struct epoll_event event;
+    unsigned int i;
+    int status;
+
+    /* Build a new epoll instance if the last one doesn't match. */
+    if (wait_epoll < 0 || wait_epoll_pid != getpid()
+        || wait_epoll_count != count
+        || memcmp(wait_epoll_fds, fds, count * sizeof(socket_type)) != 0) {
+        network_wait_reset();
+        wait_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (wait_epoll < 0)
+            goto fail;
+        for (i = 0; i < count; i++) {
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.fd = fds[i];
+            if (epoll_ctl(wait_epoll, EPOLL_CTL_ADD, fds[i], &event) < 0)
+                goto fail;
+        }
+        wait_epoll_fds = calloc(count, sizeof(socket_type));
+        if (wait_epoll_fds == NULL)
+            goto fail;
+        memcpy(wait_epoll_fds, fds, count * sizeof(socket_type));
+        wait_epoll_count = count;
+        wait_epoll_pid = getpid();
+    }
+
+    /* Wait for one of them to be ready. */
+    status = epoll_wait(wait_epoll, &event, 1, -1);
+    if (status <= 0)
+        return INVALID_SOCKET;
+    return event.data.fd;
+
+fail:
+    network_wait_reset();
+    errno = ENOSYS;
+    return INVALID_SOCKET;
+}
+
+#endif /* HAVE_EPOLL_CREATE1 */
+
+
 /*
  * Given an array of file descriptors and the length of that array (the same
  * data that's returned by network_bind_all), wait for an incoming connection
- * on any of those sockets and return the file descriptor that selects ready
- * for read.
+ * on any of those sockets and return the file descriptor that is ready for
+ * read.
  *
  * This is primarily intended for UDP services listening on multiple file
  * descriptors, and also provides part of the code for network_accept_any.
@@ -381,37 +624,67 @@ network_bind_all_free(socket_type *fds)
  * which is not, precisely speaking, an error condition.  In this case, errno
  * will be set to EINTR.
  *
- * This is not intended to be a replacement for a full event loop, just some
- * simple shared code for UDP services.
+ * Uses epoll where available and otherwise poll, so there is no limit on the
+ * file descriptor numbers.  This is not intended to be a replacement for a
+ * full event loop, just some simple shared code for UDP services.
  */
 socket_type
 network_wait_any(socket_type fds[], unsigned int count)
 {
-    fd_set readfds;
-    socket_type maxfd, fd;
+    struct pollfd *pfds;
+    socket_type fd;
     unsigned int i;
     int status;
 
-    FD_ZERO(&readfds);
-    maxfd = -1;
+#ifdef HAVE_EPOLL_CREATE1
+    fd = network_wait_epoll(fds, count);
+    if (fd != INVALID_SOCKET || errno != ENOSYS)
+        return fd;
+#endif
+    pfds = calloc(count, sizeof(struct pollfd));
+    if (pfds == NULL)
+        return INVALID_SOCKET;
     for (i = 0; i < count; i++) {
-        FD_SET(fds[i], &readfds);
-        if (fds[i] > maxfd)
-            maxfd = fds[i];
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
     }
-    status = select(maxfd + 1, &readfds, NULL, NULL, NULL);
-    if (status < 0)
-        return INVALID_SOCKET;
+    status = poll(pfds, count, -1);
     fd = INVALID_SOCKET;
-    for (i = 0; i < count; i++)
-        if (FD_ISSET(fds[i], &readfds)) {
-            fd = fds[i];
-            break;
-        }
+    if (status > 0)
+        for (i = 0; i < count; i++)
+            if (pfds[i].revents != 0) {
+                fd = fds[i];
+                break;
+            }
+    free(pfds);
     return fd;
 }
 
 
+/*
+ * Accept a connection on a listening socket, marking the new socket
+ * close-on-exec.  Where accept4 is available, this is done in the same
+ * system call, so there's no window in which another thread could run a
+ * program that inherits it.  Returns the new socket or INVALID_SOCKET, with
+ * the socket errno set, and fills in the address of the client.
+ */
+socket_type
+network_accept(socket_type fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    socket_type client;
+
+#if defined(HAVE_ACCEPT4) && defined(SOCK_CLOEXEC)
+    client = accept4(fd, addr, addrlen, SOCK_CLOEXEC);
+    if (client != INVALID_SOCKET || socket_errno != ENOSYS)
+        return client;
+#endif
+    client = accept(fd, addr, addrlen);
+    if (client != INVALID_SOCKET)
+        fdflag_close_exec(client, true);
+    return client;
+}
+
+
 /*
  * Given an array of file descriptors and the length of that array (the same
  * data that's returned by network_bind_all), wait for an incoming connection
@@ -489,46 +762,26 @@ network_source(socket_type fd, int family, const char *source)
 
 /*
  * Internal helper function that waits for a non-blocking connect to complete
- * on a socket.  Takes the file descriptor and the timeout.  Returns 0 on a
- * successful completion of the connect within the timeout and -1 on failure.
- * On failure, sets the socket errno.
+ * on a socket.  Takes the file descriptor and the timeout in milliseconds.
+ * Returns 0 on a successful completion of the connect within the timeout and
+ * -1 on failure.  On failure, sets the socket errno.
  */
 static int
 connect_wait(socket_type fd, time_t timeout)
 {
     int status, err;
     socklen_t length;
-    struct timeval tv;
-    fd_set set;
 
-    /*
-     * Use select to poll the file descriptor.  Loop if interrupted by a
-     * caught signal.  This means we could wait for longer than the timeout
-     * when interrupted, but there's no good way of recovering the elapsed
-     * time that's worth the hassle.
-     */
-    do {
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        status = select(fd + 1, NULL, &set, NULL, &tv);
-    } while (status < 0 && socket_errno == EINTR);
+    /* Wait for the socket to be writable, which means the connect finished. */
+    if (!network_poll(fd, POLLOUT, network_now() + (uint64_t) timeout))
+        return -1;
 
-    /*
-     * If we timed out, set errno appropriately.  If the connection completes,
-     * retrieve the actual status from the socket.
-     */
-    if (status == 0 && !FD_ISSET(fd, &set)) {
-        status = -1;
-        socket_set_errno(ETIMEDOUT);
-    } else if (status > 0 && FD_ISSET(fd, &set)) {
-        length = sizeof(err);
-        status = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &length);
-        if (status == 0) {
-            status = (err == 0) ? 0 : -1;
-            socket_set_errno(err);
-        }
+    /* Retrieve the actual status from the socket. */
+    length = sizeof(err);
+    status = getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &err, &length);
+    if (status == 0) {
+        status = (err == 0) ? 0 : -1;
+        socket_set_errno(err);
     }
     return status;
 }
@@ -677,17 +930,15 @@ socket_xread(socket_type fd, void *buffer, size_t size)
 
 /*
  * Read the specified number of bytes from the network, enforcing a timeout
- * (in seconds).  We use select to wait for data to become available and then
- * keep reading until either we time out or we've gotten all the data we're
- * looking for.  timeout may be 0 to never time out.  Return true on success
- * and false (setting socket_errno) on failure.
+ * (in milliseconds).  We use poll to wait for data to become available and
+ * then keep reading until either we time out or we've gotten all the data
+ * we're looking for.  timeout may be 0 to never time out.  Return true on
+ * success and false (setting socket_errno) on failure.
  */
 bool
 network_read(socket_type fd, void *buffer, size_t total, time_t timeout)
 {
-    time_t start, now;
-    fd_set set;
-    struct timeval tv;
+    uint64_t deadline;
     size_t got = 0;
     ssize_t status;
 
@@ -697,28 +948,14 @@ network_read(socket_type fd, void *buffer, size_t total, time_t timeout)
 
     /*
      * The hard way.  We try to apply the timeout on the whole read.  If
-     * either select or read fails with EINTR, restart the loop, and rely on
-     * the overall timeout to limit how long we wait without forward
+     * either poll or read fails with EINTR, restart the loop, and rely on
+     * the overall deadline to limit how long we wait without forward
      * progress.
      */
-    start = time(NULL);
-    now = start;
-    do {
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        tv.tv_sec = timeout - (now - start);
-        if (tv.tv_sec < 1)
-            tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        status = select(fd + 1, &set, NULL, NULL, &tv);
-        if (status < 0) {
-            if (socket_errno == EINTR)
-                continue;
+    deadline = network_now() + (uint64_t) timeout;
+    while (got < total) {
+        if (!network_poll(fd, POLLIN, deadline))
             return false;
-        } else if (status == 0) {
-            socket_set_errno(ETIMEDOUT);
-            return false;
-        }
         status = socket_read(fd, (char *) buffer + got, total - got);
         if (status < 0) {
             if (socket_errno == EINTR)
@@ -729,28 +966,22 @@ network_read(socket_type fd, void *buffer, size_t total, time_t timeout)
             return false;
         }
         got += status;
-        if (got == total)
-            return true;
-        now = time(NULL);
-    } while (now - start < timeout);
-    socket_set_errno(ETIMEDOUT);
-    return false;
+    }
+    return true;
 }
 
 
 /*
  * Write the specified number of bytes from the network, enforcing a timeout
- * (in seconds).  We use select to wait for the socket to become available and
- * then keep reading until either we time out or we've sent all the data.
- * timeout may be 0 to never time out.  Return true on success and false
- * (setting socket_errno) on failure.
+ * (in milliseconds).  We use poll to wait for the socket to become writable
+ * and then keep writing until either we time out or we've written all the
+ * data.  timeout may be 0 to never time out.  Return true on success and
+ * false (setting socket_errno) on failure.
  */
 bool
 network_write(socket_type fd, const void *buffer, size_t total, time_t timeout)
 {
-    time_t start, now;
-    fd_set set;
-    struct timeval tv;
+    uint64_t deadline;
     size_t sent = 0;
     ssize_t status;
     int err;
@@ -759,51 +990,181 @@ network_write(socket_type fd, const void *buffer, size_t total, time_t timeout)
     if (timeout == 0)
         return (socket_xwrite(fd, buffer, total) >= 0);
 
-    /* The hard way.  We try to apply the timeout on the whole write.  If
-     * either select or read fails with EINTR, restart the loop, and rely on
-     * the overall timeout to limit how long we wait without forward progress.
+    /*
+     * The hard way.  We try to apply the timeout on the whole write.  If
+     * either poll or write fails with EINTR, restart the loop, and rely on
+     * the overall deadline to limit how long we wait without forward
+     * progress.
      */
     fdflag_nonblocking(fd, true);
-    start = time(NULL);
-    now = start;
-    do {
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        tv.tv_sec = timeout - (now - start);
-        if (tv.tv_sec < 1)
-            tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        status = select(fd + 1, NULL, &set, NULL, &tv);
+    deadline = network_now() + (uint64_t) timeout;
+    while (sent < total) {
+        if (!network_poll(fd, POLLOUT, deadline))
+            goto fail;
+        status = socket_write(fd, (const char *) buffer + sent, total - sent);
         if (status < 0) {
-            if (socket_errno == EINTR)
+            if (socket_errno == EINTR || socket_errno == EAGAIN)
                 continue;
             goto fail;
-        } else if (status == 0) {
-            socket_set_errno(ETIMEDOUT);
-            goto fail;
         }
-        status = socket_write(fd, (const char *) buffer + sent, total - sent);
-        if (status < 0) {
+        sent += status;
+    }
+    fdflag_nonblocking(fd, false);
+    return true;
+
+fail:
+    err = socket_errno;
+    fdflag_nonblocking(fd, false);
+    socket_set_errno(err);
+    return false;
+}
+
+
+/*
+ * Read at least one and up to the specified number of bytes from the
+ * network, enforcing a timeout in milliseconds.  Returns the number of bytes
+ * read, or -1 on failure with the socket errno set.  End of file is a failure
+ * with errno set to EPIPE, as with network_read.
+ *
+ * Where MSG_DONTWAIT is supported, first try to read without waiting, since
+ * usually the caller already knows data is available and the poll can be
+ * skipped.
+ */
+ssize_t
+network_read_some(socket_type fd, void *buffer, size_t size, time_t timeout)
+{
+    uint64_t deadline = 0;
+    ssize_t status;
+
+    if (timeout > 0)
+        deadline = network_now() + (uint64_t) timeout;
+    for (;;) {
+        if (timeout > 0) {
+#ifdef MSG_DONTWAIT
+            status = recv(fd, buffer, size, MSG_DONTWAIT);
+            if (status >= 0)
+                break;
             if (socket_errno == EINTR)
                 continue;
+            if (socket_errno != EAGAIN && socket_errno != EWOULDBLOCK)
+                return -1;
+#endif
+            if (!network_poll(fd, POLLIN, deadline))
+                return -1;
+#ifdef MSG_DONTWAIT
+            continue;
+#endif
+        }
+        status = socket_read(fd, buffer, size);
+        if (status >= 0)
+            break;
+        if (socket_errno != EINTR)
+            return -1;
+    }
+    if (status == 0) {
+        socket_set_errno(EPIPE);
+        return -1;
+    }
+    return status;
+}
+
+
+/*
+ * Like network_write, but write the data from an array of iovecs with
+ * writev, so that a header and data stored separately can be sent without
+ * first copying them into one buffer.  On Windows, which has no writev for
+ * sockets, the data is copied into a single buffer and sent with
+ * network_write.
+ */
+#ifdef _WIN32
+
+bool
+network_writev(socket_type fd, const struct iovec iov[], int iovcnt,
+               time_t timeout)
+{
+    size_t total = 0, offset = 0;
+    char *buffer;
+    bool okay;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    buffer = xmalloc(total);
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(buffer + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    okay = network_write(fd, buffer, total, timeout);
+    free(buffer);
+    return okay;
+}
+
+#else /* !_WIN32 */
+
+bool
+network_writev(socket_type fd, const struct iovec iov[], int iovcnt,
+               time_t timeout)
+{
+    uint64_t deadline;
+    struct iovec *copy, *left;
+    ssize_t status;
+    size_t sent;
+    int err;
+
+    /* If there's no timeout, do this the easy way. */
+    if (timeout == 0)
+        return (xwritev(fd, iov, iovcnt) >= 0);
+
+    /*
+     * The hard way, as with network_write.  We need a copy of the iovecs so
+     * that we can advance past the data that was already written after a
+     * partial write.
+     */
+    copy = xcalloc(iovcnt, sizeof(struct iovec));
+    memcpy(copy, iov, iovcnt * sizeof(struct iovec));
+    left = copy;
+    while (iovcnt > 0 && left[0].iov_len == 0) {
+        left++;
+        iovcnt--;
+    }
+    fdflag_nonblocking(fd, true);
+    deadline = network_now() + (uint64_t) timeout;
+    while (iovcnt > 0) {
+        if (!network_poll(fd, POLLOUT, deadline))
+            goto fail;
+        status = writev(fd, left, iovcnt);
+        if (status < 0) {
+            if (socket_errno == EINTR || socket_errno == EAGAIN)
+                continue;
             goto fail;
         }
-        sent += status;
-        if (sent == total) {
-            fdflag_nonblocking(fd, false);
-            return true;
+
+        /* Skip past the data that was written. */
+        sent = (size_t) status;
+        while (iovcnt > 0 && sent >= left[0].iov_len) {
+            sent -= left[0].iov_len;
+            left++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            left[0].iov_base = (char *) left[0].iov_base + sent;
+            left[0].iov_len -= sent;
         }
-        now = time(NULL);
-    } while (now - start < timeout);
-    socket_set_errno(ETIMEDOUT);
+    }
+    free(copy);
+    fdflag_nonblocking(fd, false);
+    return true;
 
 fail:
     err = socket_errno;
+    free(copy);
     fdflag_nonblocking(fd, false);
     socket_set_errno(err);
     return false;
 }
 
+#endif /* !_WIN32 */
+
 
 /*
  * Print an ASCII representation of the address of the given sockaddr into the
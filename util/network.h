@@ -36,6 +36,7 @@
 #include <portable/macros.h>
 #include <portable/socket.h>
 #include <portable/stdbool.h>
+#include <portable/uio.h>
 
 #include <sys/types.h>
 
@@ -55,6 +56,23 @@ socket_type network_bind_ipv4(int type, const char *addr, unsigned short port)
 socket_type network_bind_ipv6(int type, const char *addr, unsigned short port)
     __attribute__((__nonnull__));
 
+/*
+ * Set whether sockets created by the network_bind functions have
+ * SO_REUSEPORT set, so that other sockets can later be bound to the same
+ * address and port with network_bind_shared.  This is a global setting that
+ * affects all later binds.
+ */
+void network_bind_reuseport(bool);
+
+/*
+ * Create a new socket bound to the same address and port as the given socket,
+ * which must have been created with SO_REUSEPORT, so that the kernel spreads
+ * incoming connections between all of the sockets for that address that are
+ * listening.  Returns the new socket or INVALID_SOCKET on error, which is
+ * reported with syswarn.
+ */
+socket_type network_bind_shared(socket_type);
+
 /*
  * Create and bind sockets of the given type for every local address (normally
  * two, one for IPv4 and one for IPv6, if IPv6 support is enabled).  If IPv6
@@ -72,13 +90,18 @@ bool network_bind_all(int type, unsigned short port, socket_type **fds,
 void network_bind_all_free(socket_type *fds);
 
 /*
- * Wait on an array of file descriptor for one of them to select ready for
- * read, and return the first file descriptor that does so.  This is primarily
+ * Wait on an array of file descriptor for one of them to be ready for read,
+ * and return the first file descriptor that does so.  This is primarily
  * intended for UDP services listening on multiple file descriptors.  TCP
  * services will probably want to use network_accept_any instead.
  *
- * This is not intended to be a replacement for a full event loop, just some
- * simple shared code for UDP services.
+ * Where epoll is available, the epoll instance is kept between calls and
+ * reused as long as the same file descriptors are passed, so repeated calls
+ * from a listening loop don't rebuild the set each time.  It is discarded by
+ * network_bind_all_free, which must therefore be called after closing the
+ * file descriptors before binding new ones.  This is not intended to be a
+ * replacement for a full event loop, just some simple shared code for UDP
+ * services.
  */
 socket_type network_wait_any(socket_type fds[], unsigned int count)
     __attribute__((__nonnull__));
@@ -95,13 +118,23 @@ socket_type network_accept_any(socket_type fds[], unsigned int count,
                                struct sockaddr *addr, socklen_t *addrlen)
     __attribute__((__nonnull__(1)));
 
+/*
+ * Accept a connection on a single listening socket, like accept, but mark the
+ * new socket close-on-exec, atomically if possible.  If the listening socket
+ * is non-blocking, returns INVALID_SOCKET with errno set to EAGAIN or
+ * EWOULDBLOCK if there are no pending connections, so this can be called in a
+ * loop to accept every connection that is waiting.
+ */
+socket_type network_accept(socket_type, struct sockaddr *addr,
+                           socklen_t *addrlen);
+
 /*
  * Create a socket and connect it to the remote service given by the linked
  * list of addrinfo structs.  Returns the new file descriptor on success and
  * INVALID_SOCKET on failure, with the error left in errno.  Takes an optional
- * source address and a timeout in seconds, which may be 0 for no timeout.
- * (Source may also be "all" or "any", which mean the same thing as NULL: do
- * not use any particular source address.)
+ * source address and a timeout in milliseconds, which may be 0 for no
+ * timeout.  (Source may also be "all" or "any", which mean the same thing as
+ * NULL: do not use any particular source address.)
  */
 socket_type network_connect(const struct addrinfo *, const char *source,
                             time_t)
@@ -134,18 +167,22 @@ socket_type network_client_create(int domain, int type, const char *source);
  * network_set_freebind sets IP_FREEBIND, which allows binding IPv6 addresses
  * that may not have been set up yet.  network_set_reuseaddr sets SO_REUSEADDR
  * so that something new can listen on the same port immediately if the daemon
- * dies unexpectedly.  network_set_v6only sets IP_V6ONLY, which avoids binding
+ * dies unexpectedly.  network_set_reuseport sets SO_REUSEPORT so that several
+ * sockets can listen on the same address and port and share the incoming
+ * connections.  network_set_v6only sets IP_V6ONLY, which avoids binding
  * to the backward-compatibility IPv4 address when binding an IPv6 socket
  * (generally preferred since the behavior is more predictable).
  */
 void network_set_freebind(socket_type fd);
 void network_set_reuseaddr(socket_type fd);
+void network_set_reuseport(socket_type fd);
 void network_set_v6only(socket_type fd);
 
 /*
  * Read or write the specified number of bytes to the network, enforcing a
- * timeout.  Both return true on success and false on failure; on failure, the
- * socket errno is set.
+ * timeout in milliseconds, which may be 0 for no timeout.  Timeouts are
+ * measured with a monotonic clock where available.  Both return true on
+ * success and false on failure; on failure, the socket errno is set.
  *
  * network_write will set the file descriptor non-blocking and then set it
  * back to blocking at the conclusion of the write, so don't use this function
@@ -156,6 +193,22 @@ bool network_read(socket_type, void *, size_t, time_t)
 bool network_write(socket_type, const void *, size_t, time_t)
     __attribute__((__nonnull__));
 
+/*
+ * Read whatever data is available from the network, up to the given number
+ * of bytes, waiting at most the timeout for at least one byte.  Returns the
+ * number of bytes read, or -1 on failure (including end of file, which sets
+ * the socket errno to EPIPE).
+ */
+ssize_t network_read_some(socket_type, void *, size_t, time_t)
+    __attribute__((__nonnull__));
+
+/*
+ * Like network_write, but writes the data from an array of iovecs, normally
+ * with a single writev call.  The iovecs themselves are not modified.
+ */
+bool network_writev(socket_type, const struct iovec *, int, time_t)
+    __attribute__((__nonnull__));
+
 /*
  * Put an ASCII representation of the address in a sockaddr into the provided
  * buffer, which should hold at least INET6_ADDRSTRLEN characters.
@@ -35,7 +35,26 @@ enum message_types {
     MESSAGE_STATUS  = 4,
     MESSAGE_ERROR   = 5,
     MESSAGE_VERSION = 6,
-    MESSAGE_NOOP    = 7
+    MESSAGE_NOOP    = 7,
+    MESSAGE_OUTPUT_COMPRESSED = 8,
+    MESSAGE_OPTIONS = 9
+};
+
+/*
+ * Output options in MESSAGE_OPTIONS, which the client sends to ask for them
+ * and the server sends back with the ones it will use.
+ */
+enum output_options {
+    OPTION_INTEGRITY = 1,       /* Output may be sent without encryption. */
+    OPTION_ZLIB      = 2,       /* Output may be compressed with zlib. */
+    OPTION_ZSTD      = 4        /* Output may be compressed with zstd. */
+};
+
+/* Compression methods used in MESSAGE_OUTPUT_COMPRESSED. */
+enum compress_method {
+    COMPRESS_NONE = 0,
+    COMPRESS_ZLIB = 1,
+    COMPRESS_ZSTD = 2
 };
 
 /* Windows uses this for something else. */
@@ -54,7 +73,24 @@ enum error_codes {
     ERROR_TOOMANY_ARGS       = 7,  /* Argument count exceeds server limit. */
     ERROR_TOOMUCH_DATA       = 8,  /* Argument size exceeds server limit. */
     ERROR_UNEXPECTED_MESSAGE = 9,  /* Message type not valid now. */
-    ERROR_NO_HELP            = 10  /* No help defined for this command. */
+    ERROR_NO_HELP            = 10, /* No help defined for this command. */
+    ERROR_BUSY               = 11  /* Server too busy, try again later. */
+};
+
+/*
+ * Record types of the protocol between remctld and persistent backends.
+ * Each record is a one-octet type, a four-octet length in network byte
+ * order, and then that many octets of data.
+ */
+enum backend_records {
+    BACKEND_ARGUMENT = 1,       /* An argument to the command. */
+    BACKEND_ENV      = 2,       /* An environment variable, NAME=value. */
+    BACKEND_STDIN    = 3,       /* Data for standard input. */
+    BACKEND_END      = 4,       /* End of the request, with no data. */
+    BACKEND_PING     = 5,       /* Health check, answered with a status. */
+    BACKEND_STDOUT   = 6,       /* Data written to standard output. */
+    BACKEND_STDERR   = 7,       /* Data written to standard error. */
+    BACKEND_STATUS   = 8        /* Exit status, four octets, end of reply. */
 };
 
 #endif /* UTIL_PROTOCOL_H */
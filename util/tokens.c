@@ -1,9 +1,9 @@
 /*
  * Token handling routines.
  *
- * Low-level routines to send and receive remctl tokens.  token_send and
- * token_recv do not do anything to their provided input or output except
- * wrapping flags and a length around them.
+ * Low-level routines to send and receive remctl tokens.  token_send,
+ * token_sendv, and token_recv do not do anything to their provided input or
+ * output except wrapping flags and a length around them.
  *
  * Originally written by Anton Ushakov
  * Extensive modifications by Russ Allbery <eagle@eyrie.org>
@@ -17,8 +17,10 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 
 #include <util/messages.h>
@@ -26,6 +28,25 @@
 #include <util/tokens.h>
 #include <util/xwrite.h>
 
+/*
+ * The minimum amount of data to try to read from the network at a time into
+ * a token buffer.  Reading this much usually gets a complete token, and
+ * often several, with one system call.
+ */
+#define TOKEN_BUFFER_SIZE (16 * 1024)
+
+/*
+ * Data read from a connection but not yet returned as a token.  used is the
+ * amount of data at the start of the buffer that was already returned and
+ * left is the amount of data after that still to be parsed.
+ */
+struct token_buffer {
+    char *data;
+    size_t size;
+    size_t used;
+    size_t left;
+};
+
 
 /*
  * Given a socket errno, map it to one of our error codes.
@@ -54,26 +75,57 @@ map_socket_error(int err)
 enum token_status
 token_send(socket_type fd, int flags, gss_buffer_t tok, time_t timeout)
 {
-    size_t buflen;
-    char *buffer;
+    struct iovec iov;
+
+    iov.iov_base = tok->value;
+    iov.iov_len = tok->length;
+    return token_sendv(fd, flags, &iov, 1, timeout);
+}
+
+
+/*
+ * Send a token whose data is stored in an array of iovecs.  The token data
+ * is the concatenation of the iovecs.  The flags and length are sent along
+ * with the data in a single writev, without copying the data.  Returns the
+ * same values as token_send.
+ */
+enum token_status
+token_sendv(socket_type fd, int flags, const struct iovec *iov, int iovcnt,
+            time_t timeout)
+{
+    struct iovec *out;
+    unsigned char header[1 + sizeof(OM_uint32)];
+    size_t length = 0;
+    OM_uint32 len;
     bool okay;
-    unsigned char char_flags = (unsigned char) flags;
-    OM_uint32 len = htonl(tok->length);
+    int i;
 
-    /* Send out the whole message in a single write. */
-    if (tok->length > SIZE_MAX - 1 - sizeof(OM_uint32)) {
-        errno = ENOMEM;
+    /* Build the flags and length header. */
+    if (iovcnt < 0 || iovcnt >= INT_MAX) {
+        errno = EINVAL;
         return TOKEN_FAIL_SYSTEM;
     }
-    buflen = 1 + sizeof(OM_uint32) + tok->length;
-    buffer = malloc(buflen);
-    if (buffer == NULL)
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > UINT32_MAX - length) {
+            errno = ENOMEM;
+            return TOKEN_FAIL_SYSTEM;
+        }
+        length += iov[i].iov_len;
+    }
+    header[0] = (unsigned char) flags;
+    len = htonl(length);
+    memcpy(header + 1, &len, sizeof(OM_uint32));
+
+    /* Send out the whole message in a single write. */
+    out = calloc(iovcnt + 1, sizeof(struct iovec));
+    if (out == NULL)
         return TOKEN_FAIL_SYSTEM;
-    memcpy(buffer, &char_flags, 1);
-    memcpy(buffer + 1, &len, sizeof(OM_uint32));
-    memcpy(buffer + 1 + sizeof(OM_uint32), tok->value, tok->length);
-    okay = network_write(fd, buffer, buflen, timeout);
-    free(buffer);
+    out[0].iov_base = header;
+    out[0].iov_len = sizeof(header);
+    if (iovcnt > 0)
+        memcpy(out + 1, iov, iovcnt * sizeof(struct iovec));
+    okay = network_writev(fd, out, iovcnt + 1, timeout);
+    free(out);
     return okay ? TOKEN_OK : map_socket_error(socket_errno);
 }
 
@@ -133,3 +185,201 @@ token_recv(socket_type fd, int *flags, gss_buffer_t tok, size_t max,
     }
     return TOKEN_OK;
 }
+
+
+/*
+ * Create a new, empty token buffer for a connection.  Returns NULL if memory
+ * allocation fails.
+ */
+struct token_buffer *
+token_buffer_new(void)
+{
+    return calloc(1, sizeof(struct token_buffer));
+}
+
+
+/*
+ * Free a token buffer.  Any tokens returned from it are no longer valid.
+ */
+void
+token_buffer_free(struct token_buffer *buffer)
+{
+    if (buffer == NULL)
+        return;
+    free(buffer->data);
+    free(buffer);
+}
+
+
+/*
+ * Returns whether any data read from the connection is in the buffer and not
+ * yet returned as a token.  If so, the next token may be available without
+ * waiting for the connection to be readable.
+ */
+bool
+token_buffer_pending(const struct token_buffer *buffer)
+{
+    return buffer->left > 0;
+}
+
+
+/*
+ * Move the unparsed data in the buffer to the start and make sure that there
+ * is room for at least the given amount of unparsed data.  Invalidates any
+ * pointers into the buffer.  Returns false on memory allocation failure.
+ */
+static bool
+token_buffer_reserve(struct token_buffer *buffer, size_t needed)
+{
+    size_t size;
+    char *data;
+
+    if (buffer->used > 0 && buffer->left > 0)
+        memmove(buffer->data, buffer->data + buffer->used, buffer->left);
+    buffer->used = 0;
+    size = (needed > TOKEN_BUFFER_SIZE) ? needed : TOKEN_BUFFER_SIZE;
+    if (buffer->size < size) {
+        data = realloc(buffer->data, size);
+        if (data == NULL)
+            return false;
+        buffer->data = data;
+        buffer->size = size;
+    }
+    return true;
+}
+
+
+/*
+ * Make sure that at least the given amount of unparsed data is in the
+ * buffer, reading as much as is available from the file descriptor until
+ * there is.  Invalidates any pointers into the buffer.  Returns TOKEN_OK on
+ * success or one of the TOKEN_FAIL_* statuses on failure.
+ */
+static enum token_status
+token_buffer_fill(socket_type fd, struct token_buffer *buffer, size_t needed,
+                  time_t timeout)
+{
+    ssize_t status;
+
+    if (buffer->left >= needed)
+        return TOKEN_OK;
+    if (!token_buffer_reserve(buffer, needed))
+        return TOKEN_FAIL_SYSTEM;
+
+    /* Read whatever is available until we have enough. */
+    while (buffer->left < needed) {
+        status = network_read_some(fd, buffer->data + buffer->left,
+                                   buffer->size - buffer->left, timeout);
+        if (status < 0)
+            return map_socket_error(socket_errno);
+        buffer->left += status;
+    }
+    return TOKEN_OK;
+}
+
+
+/*
+ * Returns the length of the next token in the buffer including its flags and
+ * length, or 0 if not even that much has been read.
+ */
+static size_t
+token_buffer_next(const struct token_buffer *buffer)
+{
+    OM_uint32 len;
+
+    if (buffer->left < 1 + sizeof(OM_uint32))
+        return 0;
+    memcpy(&len, buffer->data + buffer->used + 1, sizeof(OM_uint32));
+    return 1 + sizeof(OM_uint32) + ntohl(len);
+}
+
+
+/*
+ * Returns whether token_recv_buffer can return the next token without
+ * reading from the connection: either the whole token is in the buffer, or
+ * enough of it is there to know that it is larger than max and will be
+ * rejected.  This is used by callers that wait for data themselves, such as
+ * an event loop handling many connections, together with token_buffer_read.
+ */
+bool
+token_buffer_complete(const struct token_buffer *buffer, size_t max)
+{
+    size_t length;
+
+    length = token_buffer_next(buffer);
+    if (length == 0)
+        return false;
+    if (length - 1 - sizeof(OM_uint32) > max)
+        return true;
+    return buffer->left >= length;
+}
+
+
+/*
+ * Read whatever data is available from the connection into the buffer with a
+ * single read, making room for the rest of a partially read token.  Only
+ * call this when the file descriptor is known to be readable, since it
+ * otherwise blocks.  Returns TOKEN_OK on success, TOKEN_FAIL_EOF if the other
+ * end closed the connection, and one of the other TOKEN_FAIL_* statuses on
+ * any other failure.
+ */
+enum token_status
+token_buffer_read(socket_type fd, struct token_buffer *buffer)
+{
+    ssize_t status;
+    size_t needed;
+
+    needed = token_buffer_next(buffer);
+    if (needed < buffer->left + 1)
+        needed = buffer->left + 1;
+    if (!token_buffer_reserve(buffer, needed))
+        return TOKEN_FAIL_SYSTEM;
+    status = network_read_some(fd, buffer->data + buffer->left,
+                               buffer->size - buffer->left, 0);
+    if (status < 0)
+        return map_socket_error(socket_errno);
+    buffer->left += status;
+    return TOKEN_OK;
+}
+
+
+/*
+ * Receive a token from a file descriptor using a token buffer for that
+ * connection.  This is like token_recv and returns the same values, but
+ * reads from the file descriptor in large chunks, keeping any data beyond
+ * the token in the buffer for the next call, which saves system calls when
+ * the other end sends several tokens at once.
+ *
+ * The value member of the token points into the buffer rather than to newly
+ * allocated memory, so must not be freed, and is only valid until the next
+ * call to token_recv_buffer or token_buffer_free with the same buffer.
+ */
+enum token_status
+token_recv_buffer(socket_type fd, struct token_buffer *buffer, int *flags,
+                  gss_buffer_t tok, size_t max, time_t timeout)
+{
+    OM_uint32 len;
+    enum token_status status;
+
+    status = token_buffer_fill(fd, buffer, 1 + sizeof(OM_uint32), timeout);
+    if (status != TOKEN_OK)
+        return status;
+    *flags = (unsigned char) buffer->data[buffer->used];
+    memcpy(&len, buffer->data + buffer->used + 1, sizeof(OM_uint32));
+    buffer->used += 1 + sizeof(OM_uint32);
+    buffer->left -= 1 + sizeof(OM_uint32);
+    tok->length = ntohl(len);
+    if (tok->length > max)
+        return TOKEN_FAIL_LARGE;
+    if (tok->length == 0) {
+        tok->value = NULL;
+        return TOKEN_OK;
+    }
+    status = token_buffer_fill(fd, buffer, tok->length, timeout);
+    if (status != TOKEN_OK)
+        return status;
+    tok->value = buffer->data + buffer->used;
+    buffer->used += tok->length;
+    buffer->left -= tok->length;
+    return TOKEN_OK;
+}
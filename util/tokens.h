@@ -16,6 +16,8 @@
 #include <portable/gssapi.h>
 #include <portable/macros.h>
 #include <portable/socket.h>
+#include <portable/stdbool.h>
+#include <portable/uio.h>
 #include <sys/types.h>
 
 /* Token types and flags. */
@@ -41,21 +43,57 @@ enum token_status {
     TOKEN_FAIL_TIMEOUT = -7     /* Timeout sending or receiving token */
 };
 
+/* Data read from a connection and not yet returned as a token. */
+struct token_buffer;
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
 #pragma GCC visibility push(hidden)
 
 /*
- * Sending and receiving tokens.  Do not use gss_release_buffer to free the
- * token returned by token_recv; this will cause crashes on Windows.  Call
- * free on the value member instead.
+ * Sending and receiving tokens.  The timeout is in milliseconds and may be 0
+ * for no timeout.  Do not use gss_release_buffer to free the token returned
+ * by token_recv; this will cause crashes on Windows.  Call free on the value
+ * member instead.
  */
 enum token_status token_send(socket_type, int flags, gss_buffer_t,
                              time_t timeout);
 enum token_status token_recv(socket_type, int *flags, gss_buffer_t,
                              size_t max, time_t timeout);
 
+/*
+ * Send a token whose data is the concatenation of an array of iovecs, using
+ * writev to avoid copying it into one buffer.
+ */
+enum token_status token_sendv(socket_type, int flags, const struct iovec *,
+                              int iovcnt, time_t timeout);
+
+/*
+ * Receiving tokens through a buffer kept for each connection, which reads
+ * data from the connection in large chunks and returns tokens parsed from
+ * it.  The token returned by token_recv_buffer points into the buffer, must
+ * not be freed, and is only valid until the next call with the same buffer.
+ * token_buffer_new returns NULL on memory allocation failure.  Once a buffer
+ * is used for a connection, all further tokens from that connection must be
+ * read through it.
+ *
+ * Callers that wait for data themselves can call token_buffer_read once the
+ * connection is readable and then token_recv_buffer, which won't block, for
+ * as long as token_buffer_complete returns true.
+ */
+struct token_buffer *token_buffer_new(void)
+    __attribute__((__malloc__));
+void token_buffer_free(struct token_buffer *);
+bool token_buffer_pending(const struct token_buffer *)
+    __attribute__((__nonnull__));
+enum token_status token_recv_buffer(socket_type, struct token_buffer *,
+                                    int *flags, gss_buffer_t, size_t max,
+                                    time_t timeout);
+bool token_buffer_complete(const struct token_buffer *, size_t max)
+    __attribute__((__nonnull__));
+enum token_status token_buffer_read(socket_type, struct token_buffer *);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 